@@ -0,0 +1,85 @@
+#!/usr/bin/env ruby
+#  Copyright 2014 Noel Cower
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+#  -----------------------------------------------------------------------------
+#
+#  batch_bench.rb
+#    Times Driver#batch_stages and reports the stages it saves, for rows of
+#    interleaved icon and label quads and for randomly placed quads over a
+#    few textures. Doesn't need a window or GL context.
+#
+#    Usage: ruby -Ilib bench/batch_bench.rb [frames] [quads] [seed]
+
+
+require 'gui/geom'
+require 'gui/color'
+require 'gui/driver'
+
+
+module BatchBench
+
+  TEXTURES = [:icons, :labels, :buttons, :images].freeze
+
+  module_function
+
+  def icon_rows(driver, quads, _rng)
+    (quads / 2).times do |index|
+      x = (index % 40) * 32.0
+      y = (index / 40) * 16.0
+      driver.draw_quad(:icons, GUI::Vec2[x, y], GUI::Vec2[12.0, 12.0])
+      driver.draw_quad(:labels, GUI::Vec2[x + 14.0, y], GUI::Vec2[16.0, 12.0])
+    end
+  end
+
+  def scattered(driver, quads, rng)
+    quads.times do
+      driver.draw_quad(
+        TEXTURES[rng.rand(TEXTURES.length)],
+        GUI::Vec2[rng.rand(1280), rng.rand(800)],
+        GUI::Vec2[4 + rng.rand(40), 4 + rng.rand(30)]
+        )
+    end
+  end
+
+  def run(frames, quads, seed)
+    driver = GUI::Driver.new(quads)
+    [:icon_rows, :scattered].each do |scene|
+      total = 0.0
+      before = after = 0
+      frames.times do |frame|
+        driver.clear
+        __send__(scene, driver, quads, Random.new(seed + frame))
+        before = driver.stage_count
+        start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        driver.batch_stages
+        total += Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+        after = driver.stage_count
+      end
+
+      puts "%-10s %d quads: %5d -> %5d stages, %8.3fms/frame" % [
+             scene, quads, before, after, total * 1000.0 / frames
+           ]
+    end
+  end
+
+end # BatchBench
+
+
+if $0 == __FILE__
+  frames = Integer(ARGV[0] || 50)
+  quads  = Integer(ARGV[1] || 4_000)
+  seed   = Integer(ARGV[2] || 1)
+  BatchBench.run(frames, quads, seed)
+end
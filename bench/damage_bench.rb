@@ -0,0 +1,101 @@
+#!/usr/bin/env ruby
+#  Copyright 2014 Noel Cower
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+#  -----------------------------------------------------------------------------
+#
+#  damage_bench.rb
+#    Measures how much of a window is redrawn when a few views change per
+#    frame, comparing the root view's DamageRegion against the single bounding
+#    rect used before damage regions. Doesn't need a window or GL context.
+#
+#    Usage: ruby -Ilib bench/damage_bench.rb [frames] [seed]
+
+
+require 'gui/view'
+
+
+module DamageBench
+
+  WIDTH   = 1280
+  HEIGHT  = 800
+  COLUMNS = 16
+  ROWS    = 20
+
+  module_function
+
+  # A window-sized root with a grid of cells, each holding a small widget.
+  def build_tree
+    root = GUI::View.new(GUI::Rect.new(0, 0, WIDTH, HEIGHT))
+    cell_width = WIDTH / COLUMNS
+    cell_height = HEIGHT / ROWS
+    widgets = []
+
+    ROWS.times do |row|
+      COLUMNS.times do |column|
+        cell = GUI::View.new(
+          GUI::Rect.new(column * cell_width, row * cell_height, cell_width, cell_height)
+          )
+        widget = GUI::View.new(GUI::Rect.new(4, 4, cell_width - 8, cell_height - 8))
+        cell.add_view(widget)
+        root.add_view(cell)
+        widgets << widget
+      end
+    end
+
+    [root, widgets]
+  end
+
+  def run(frames, seed)
+    rng = Random.new(seed)
+    root, widgets = build_tree
+    total_area = WIDTH * HEIGHT
+
+    [1, 2, 4, 16, 64].each do |changes|
+      region_area = 0.0
+      bounds_area = 0.0
+      rects = 0
+      start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+      frames.times do
+        root.instance_variable_set(:@invalidated, nil)
+        changes.times { widgets[rng.rand(widgets.length)].invalidate }
+
+        region = root.invalidated_region
+        bounds = region.bounds
+        region_area += region.area
+        bounds_area += bounds.width * bounds.height
+        rects += region.length
+      end
+
+      elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+      puts "%3d changes/frame: region %6.2f%% of window in %4.1f rects, " \
+           "bounding rect %6.2f%%, %6.2fus to invalidate" % [
+             changes,
+             100.0 * region_area / frames / total_area,
+             rects.fdiv(frames),
+             100.0 * bounds_area / frames / total_area,
+             elapsed * 1.0e6 / frames
+           ]
+    end
+  end
+
+end # DamageBench
+
+
+if $0 == __FILE__
+  frames = Integer(ARGV[0] || 1000)
+  seed   = Integer(ARGV[1] || 1)
+  DamageBench.run(frames, seed)
+end
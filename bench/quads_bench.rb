@@ -0,0 +1,78 @@
+#!/usr/bin/env ruby
+#  Copyright 2014 Noel Cower
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+#  -----------------------------------------------------------------------------
+#
+#  quads_bench.rb
+#    Compares building a frame's quads one draw_quad call at a time against a
+#    single draw_quads call. Only builds vertex and face data, so it doesn't
+#    need a window or GL context.
+#
+#    Usage: ruby -Ilib bench/quads_bench.rb [frames] [quads] [seed]
+
+
+require 'gui/geom'
+require 'gui/color'
+require 'gui/driver'
+
+
+module QuadsBench
+
+  module_function
+
+  def time(frames)
+    start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    frames.times { yield }
+    (Process.clock_gettime(Process::CLOCK_MONOTONIC) - start) * 1000.0 / frames
+  end
+
+  def run(frames, quads, seed)
+    rng = Random.new(seed)
+    positions = Snow::Vec2Array[quads]
+    sizes = Snow::Vec2Array[quads]
+    colors = Snow::Vec4Array[quads]
+    quads.times do |index|
+      positions[index] = GUI::Vec2[rng.rand(1280), rng.rand(800)]
+      sizes[index] = GUI::Vec2[8 + rng.rand(120), 8 + rng.rand(60)]
+      colors[index] = GUI::Color[rng.rand, rng.rand, rng.rand, 1.0]
+    end
+
+    driver = GUI::Driver.new(quads)
+    single = time(frames) do
+      driver.clear
+      quads.times do |index|
+        driver.draw_quad(:texture, positions[index], sizes[index], color: colors[index])
+      end
+    end
+
+    batched = time(frames) do
+      driver.clear
+      driver.draw_quads(:texture, positions, sizes, colors: colors)
+    end
+
+    puts "%d quads: draw_quad %8.3fms/frame, draw_quads %8.3fms/frame (%.1fx)" % [
+           quads, single, batched, single / batched
+         ]
+  end
+
+end # QuadsBench
+
+
+if $0 == __FILE__
+  frames = Integer(ARGV[0] || 50)
+  quads  = Integer(ARGV[1] || 10_000)
+  seed   = Integer(ARGV[2] || 1)
+  QuadsBench.run(frames, quads, seed)
+end
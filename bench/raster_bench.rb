@@ -0,0 +1,86 @@
+#!/usr/bin/env ruby
+#  Copyright 2014 Noel Cower
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+#  -----------------------------------------------------------------------------
+#
+#  raster_bench.rb
+#    Measures how long SoftwareDriver takes to draw a window's worth of quads
+#    -- opaque, translucent, and textured -- into its framebuffer. Doesn't need
+#    a window or GL context.
+#
+#    Usage: ruby -Ilib bench/raster_bench.rb [frames] [quads] [seed]
+
+
+require 'gui/geom'
+require 'gui/color'
+require 'gui/software_driver'
+
+
+module RasterBench
+
+  WIDTH  = 1280
+  HEIGHT = 800
+
+  module_function
+
+  def checkerboard(size)
+    pixels = String.new(encoding: Encoding::BINARY)
+    size.times do |y|
+      size.times do |x|
+        pixels << (((x / 4 + y / 4) % 2).zero? ? "\xff\xff\xff\xff" : "\x40\x40\x40\xff").b
+      end
+    end
+    GUI::Raster::Image.new(size, size, pixels)
+  end
+
+  def run(frames, quads, seed)
+    texture = checkerboard(64)
+    driver = GUI::SoftwareDriver.new(WIDTH, HEIGHT)
+    background = GUI::Color[0.2, 0.2, 0.2, 1.0]
+
+    { opaque: [nil, 1.0], translucent: [nil, 0.5], textured: [texture, 1.0] }.each do |name, (material, alpha)|
+      rng = Random.new(seed)
+      driver.clear
+      quads.times do
+        driver.draw_quad(
+          material,
+          GUI::Vec2[rng.rand(WIDTH), rng.rand(HEIGHT)],
+          GUI::Vec2[8 + rng.rand(120), 8 + rng.rand(60)],
+          color: GUI::Color[rng.rand, rng.rand, rng.rand, alpha]
+          )
+      end
+
+      start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      frames.times do
+        driver.fill(background)
+        driver.draw_stages
+      end
+      elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+
+      puts "%-12s %5d quads: %7.3fms/frame (SIMD: %s)" % [
+             name, quads, elapsed * 1000.0 / frames, GUI::Raster::SIMD || 'none'
+           ]
+    end
+  end
+
+end # RasterBench
+
+
+if $0 == __FILE__
+  frames = Integer(ARGV[0] || 100)
+  quads  = Integer(ARGV[1] || 2000)
+  seed   = Integer(ARGV[2] || 1)
+  RasterBench.run(frames, quads, seed)
+end
@@ -0,0 +1,244 @@
+#!/usr/bin/env ruby
+#  Copyright 2014 Noel Cower
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+#  -----------------------------------------------------------------------------
+#
+#  selector_bench.rb
+#    Benchmarks for the selector parser and matcher. Measures parse time and
+#    objects allocated per parse over a corpus of selectors, then times
+#    find_match and find_all over synthetic view trees of a few sizes and
+#    shapes.
+#
+#    Usage: ruby -Ilib bench/selector_bench.rb [options]
+#
+#      --sizes=N,N,...   View tree sizes (default: 1000,10000,100000,1000000)
+#      --corpus=FILE     Parse selectors from FILE, one per line, instead of
+#                        the built-in corpus
+#      --time=SECONDS    Minimum time spent on each measurement (default: 0.5)
+#      --parse-only      Skip the view tree benchmarks
+#
+#    The 1M-view trees take a while to build and a fair amount of memory, so
+#    pass smaller sizes for a quick run.
+
+
+require 'gui/selector_ext'
+require 'gui/selector/checks'
+require 'gui/view'
+
+
+module SelectorBench
+
+  class Panel  < GUI::View ; end
+  class Button < GUI::View ; end
+  class Label  < GUI::View ; end
+
+  CORPUS = [
+    'View',
+    '*',
+    '#ok',
+    'Panel Button',
+    'Panel > Button',
+    'Panel > Label #title',
+    '(Button|Label)',
+    '( Button |Label |Panel )[hidden]',
+    'Button[tag = ok]',
+    'Panel [frame.width > 100]',
+    'Panel [!frame.width >= 100.5] > Button[frame.height <= 2e2]',
+    'Window > Panel#content Panel > (Button|Label)[!hidden][tag != "cancel"]',
+    '*[subviews.length > 0] > *[class <- "Butt"] Label#caption',
+    'Panel#sidebar > Panel Panel > Panel Button[title = "a \\"quoted\\" title"]'
+  ].freeze
+
+  DEEP_DEPTH = 100
+
+  module_function
+
+  def now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  #
+  # Calls the block repeatedly for at least min_time seconds and returns the
+  # average time per call in seconds.
+  #
+  def measure(min_time)
+    count = 0
+    start = now
+    elapsed = 0.0
+    batch = 1
+    while elapsed < min_time
+      batch.times { yield }
+      count += batch
+      batch *= 2
+      elapsed = now - start
+    end
+    elapsed / count
+  end
+
+  def allocations_per_call(count)
+    GC.start
+    before = GC.stat(:total_allocated_objects)
+    count.times { yield }
+    (GC.stat(:total_allocated_objects) - before).fdiv(count)
+  end
+
+  def format_time(seconds)
+    if seconds < 1.0e-3
+      '%9.2fus' % (seconds * 1.0e6)
+    elsif seconds < 1.0
+      '%9.2fms' % (seconds * 1.0e3)
+    else
+      '%9.2fs ' % seconds
+    end
+  end
+
+  def bench_parse(corpus, min_time)
+    puts "Parse (#{GUI::SelectorParser::SCANNER} scanner)"
+
+    corpus.each do |source|
+      time = measure(min_time / corpus.length) { GUI::SelectorParser.parse(source) }
+      allocs = allocations_per_call(1000) { GUI::SelectorParser.parse(source) }
+      puts "  #{format_time(time)} #{'%7.1f' % allocs} objs  #{source}"
+    end
+
+    time = measure(min_time) { corpus.each { |source| GUI::SelectorParser.parse(source) } }
+    bytes = corpus.reduce(0) { |sum, source| sum + source.bytesize }
+    puts "  corpus: #{format_time(time / corpus.length)} per selector, " \
+         "#{'%.1f' % (bytes / time / 1.0e6)} MB/s"
+    puts
+  end
+
+  #
+  # Views are linked directly rather than through add_view, which invalidates
+  # caches up and down the tree on each call and makes building large trees
+  # quadratic.
+  #
+  def attach(parent, child)
+    child.instance_variable_set(:@superview, parent)
+    parent.subviews << child
+    child
+  end
+
+  def make_view(index)
+    view =
+      case index % 3
+      when 0 then Panel.new
+      when 1 then Button.new
+      else Label.new
+      end
+    view.frame.set(0, 0, index % 200, 20)
+    view.instance_variable_set(:@tag, :"v#{index % 97}")
+    view
+  end
+
+  #
+  # Wide/shallow: root > sqrt(N) children > the rest spread evenly as leaves.
+  #
+  def build_wide(size)
+    root = Panel.new
+    branches = Array.new(Math.sqrt(size).ceil) { |index| attach(root, make_view(index)) }
+    count = 1 + branches.length
+    while count < size
+      attach(branches[count % branches.length], make_view(count))
+      count += 1
+    end
+    root
+  end
+
+  #
+  # Deep/narrow: chains of DEEP_DEPTH views hanging off the root, each view
+  # with a single subview.
+  #
+  def build_deep(size)
+    root = Panel.new
+    parent = root
+    count = 1
+    while count < size
+      parent = root if (count - 1) % DEEP_DEPTH == 0
+      parent = attach(parent, make_view(count))
+      count += 1
+    end
+    root
+  end
+
+  def last_view(root)
+    view = root
+    view = view.subviews.last until view.subviews.empty?
+    view
+  end
+
+  def bench_trees(sizes, min_time)
+    sources = [
+      '#v3',
+      'Panel > Button',
+      'Panel Label#target',
+      'Panel Button[frame.width > 150]',
+      '*[hidden]'
+    ]
+
+    sizes.each do |size|
+      { 'wide' => :build_wide, 'deep' => :build_deep }.each do |shape, builder|
+        start = now
+        root = __send__(builder, size)
+        build_time = now - start
+
+        # Something for 'Panel Label#target' to find at the end of the tree.
+        target = attach(last_view(root), Label.new)
+        target.instance_variable_set(:@tag, :target)
+
+        start = now
+        root.__view_index__
+        index_time = now - start
+
+        puts "#{shape} tree, #{size} views " \
+             "(built in #{format_time(build_time).strip}, " \
+             "indexed in #{format_time(index_time).strip})"
+
+        sources.each do |source|
+          selector = GUI::Selector.build(source)
+          first = measure(min_time) { selector.find_match(root) }
+          all = measure(min_time) { selector.find_all(root) }
+          found = selector.find_all(root).length
+          puts "  find_match #{format_time(first)}  find_all #{format_time(all)}" \
+               "  #{'%8d' % found} found  #{source}"
+        end
+
+        puts
+      end
+    end
+  end
+
+end # SelectorBench
+
+
+if $0 == __FILE__
+  sizes = [1_000, 10_000, 100_000, 1_000_000]
+  corpus = SelectorBench::CORPUS
+  min_time = 0.5
+  parse_only = false
+
+  ARGV.each do |arg|
+    case arg
+    when /\A--sizes=(.+)\z/  then sizes = $1.split(',').map { |size| Integer(size) }
+    when /\A--corpus=(.+)\z/ then corpus = File.readlines($1, chomp: true).reject(&:empty?)
+    when /\A--time=(.+)\z/   then min_time = Float($1)
+    when '--parse-only'      then parse_only = true
+    else abort "Unrecognized option: #{arg}"
+    end
+  end
+
+  SelectorBench.bench_parse(corpus, min_time)
+  SelectorBench.bench_trees(sizes, min_time) unless parse_only
+end
@@ -0,0 +1,150 @@
+#!/usr/bin/env ruby
+#  Copyright 2014 Noel Cower
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+#  -----------------------------------------------------------------------------
+#
+#  selector_fuzz.rb
+#    Differential fuzzer for the selector parser. Generates selector strings,
+#    both well-formed and mangled, and checks that SelectorParser.parse agrees
+#    with the reference grammar in selector_grammar.rb -- including the error
+#    raised for invalid selectors.
+#
+#    Usage: ruby -Ilib bench/selector_fuzz.rb [iterations] [seed]
+#
+#    Exits with status 1 if any selector parses differently, printing each one.
+
+
+require 'gui/selector_ext'
+require 'gui/selector/checks'
+require_relative 'selector_grammar'
+
+
+module SelectorFuzz
+
+  NAMES     = %w[View Button Label panel x frame.width a.b.c _ é名 e5 +1].freeze
+  OPERATORS = %w[= != > >= < <= <-].freeze
+  # Characters that mean something to the parser, plus some that don't
+  NOISE     = %W[* # ( ) | [ ] ! = < > - " \\ . e E + 0 9 \s \t \n a é].freeze
+
+  def self.name(rng)
+    NAMES[rng.rand(NAMES.length)]
+  end
+
+  def self.operand(rng)
+    case rng.rand(6)
+    when 0 then rng.rand(1000).to_s
+    when 1 then "#{rng.rand(100)}.#{rng.rand(100)}"
+    when 2 then "#{rng.rand(10)}e#{%w[+ - ].sample(random: rng)}#{rng.rand(30)}"
+    when 3 then %("#{name(rng)}")
+    when 4 then %("a\\"b\\\\c #{name(rng)}")
+    else name(rng)
+    end
+  end
+
+  def self.space(rng)
+    [' ', '', '', "\t", '  '][rng.rand(5)]
+  end
+
+  def self.attribute(rng)
+    inverted = rng.rand(4) == 0 ? '!' : ''
+    if rng.rand(3) == 0
+      "[#{space(rng)}#{inverted}#{name(rng)}#{space(rng)}]"
+    else
+      op = OPERATORS[rng.rand(OPERATORS.length)]
+      "[#{inverted}#{space(rng)}#{name(rng)}#{space(rng)}#{op}" \
+        "#{space(rng)}#{operand(rng)}#{space(rng)}]"
+    end
+  end
+
+  def self.compound(rng)
+    out =
+      case rng.rand(4)
+      when 0 then '*'
+      when 1 then "(#{Array.new(rng.rand(1..3)) { name(rng) }.join(" |#{space(rng)}")})"
+      when 2 then ''
+      else name(rng).dup
+      end
+    out << "##{name(rng)}" if rng.rand(3) == 0 || out.empty?
+    rng.rand(3).times { out << attribute(rng) }
+    out
+  end
+
+  def self.selector(rng)
+    Array.new(rng.rand(1..4)) { compound(rng) }.map.with_index do |part, index|
+      index == 0 ? part : "#{space(rng)}#{rng.rand(3) == 0 ? '>' : ' '}#{space(rng)}#{part}"
+    end.join
+  end
+
+  # Inserts, deletes, or replaces a few characters of source.
+  def self.mangle(rng, source)
+    chars = source.chars
+    rng.rand(1..3).times do
+      index = chars.empty? ? 0 : rng.rand(chars.length + 1)
+      case rng.rand(3)
+      when 0 then chars.insert(index, NOISE[rng.rand(NOISE.length)])
+      when 1 then chars.delete_at(index)
+      else chars[index] = NOISE[rng.rand(NOISE.length)]
+      end
+    end
+    chars.join
+  end
+
+  def self.outcome
+    [:ok, yield]
+  rescue RuntimeError, SelectorGrammar::Error => ex
+    [:error, ex.message]
+  end
+
+  # Returns the reference and C parsers' outcomes for source.
+  def self.check(source)
+    [
+      outcome { SelectorGrammar.parse(source) },
+      outcome { SelectorGrammar.describe(GUI::SelectorParser.parse(source)) }
+    ]
+  end
+
+  def self.run(iterations, seed)
+    rng = Random.new(seed)
+    failures = 0
+    errors = 0
+
+    iterations.times do
+      source = selector(rng)
+      source = mangle(rng, source) if rng.rand(2) == 0
+
+      expected, actual = check(source)
+      errors += 1 if expected[0] == :error
+      # eql? so 1 and 1.0 aren't considered the same operand
+      next if actual.eql?(expected)
+
+      failures += 1
+      puts "MISMATCH #{source.inspect}"
+      puts "  expected #{expected.inspect}"
+      puts "  actual   #{actual.inspect}"
+    end
+
+    puts "#{iterations} selectors (#{errors} invalid), seed #{seed}: " \
+         "#{failures} mismatches"
+    failures
+  end
+
+end # SelectorFuzz
+
+
+if $0 == __FILE__
+  iterations = Integer(ARGV[0] || 100_000)
+  seed       = Integer(ARGV[1] || Random.new_seed % 1_000_000)
+  exit(SelectorFuzz.run(iterations, seed) == 0 ? 0 : 1)
+end
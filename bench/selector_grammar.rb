@@ -0,0 +1,317 @@
+#  Copyright 2014 Noel Cower
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+#  -----------------------------------------------------------------------------
+#
+#  selector_grammar.rb
+#    Reference implementation of the selector grammar, used by selector_fuzz.rb
+#    to check the C parser.
+
+
+module SelectorGrammar
+
+  #
+  # Selector grammar, as implemented by selector.c:
+  #
+  #   selector  := ws compound (ws compound)* ws
+  #   compound  := (class | '*')? tag? attr* ws '>'?
+  #   class     := name | '(' ws (name ws '|')* name? ws ')'
+  #   tag       := '#' name
+  #   attr      := '[' ws ('!' ws)? name ws (op ws operand ws)? ']'
+  #   op        := '=' | '!=' | '>' | '>=' | '<' | '<=' | '<-'
+  #   operand   := string | number | name
+  #   string    := '"' ([^"\\] | '\\' any)* '"'
+  #   number    := digit+ ('.' digit+)? ([eE] [+-]? digit+)?
+  #
+  # A name is a run of anything other than whitespace or one of !"#()*-<=>[]|
+  # and a compound with no class must start with '*', '#', or '['. The last
+  # compound can't be followed by a '>'.
+  #
+  # This is written for clarity rather than speed, and is only meant to be
+  # compared against the C parser.
+  #
+
+  Error = Class.new(StandardError)
+
+  NAME_RE   = /[^\t\n\r !"#()*\-<=>\[\]|]+/n
+  SPACE_RE  = /[\t\n\r ]*/n
+  NUMBER_RE = /\d+(?:\.(\d+)?)?(?:[eE][+-]?(\d+)?)?/n
+
+  OPERATORS = {
+    '!=' => :not_equal,
+    '='  => :equal,
+    '>=' => :greater_equal,
+    '>'  => :greater,
+    '<=' => :lesser_equal,
+    '<-' => :contains,
+    '<'  => :lesser
+  }.freeze
+
+  INVERSES = {
+    trueish:       :falseish,
+    falseish:      :trueish,
+    equal:         :not_equal,
+    not_equal:     :equal,
+    lesser:        :greater_equal,
+    greater:       :lesser_equal,
+    lesser_equal:  :greater,
+    greater_equal: :lesser
+  }.freeze
+
+  #
+  # Parses source and returns an Array of compounds, in the same form as
+  # SelectorGrammar.describe returns for a parsed Selector. Raises
+  # SelectorGrammar::Error with the C parser's message if source is invalid.
+  #
+  def self.parse(source)
+    Parser.new(source).parse
+  end
+
+  #
+  # Describes a Selector built by SelectorParser as an Array of compounds,
+  # each of which is [checks, direct]. Checks are one of
+  #
+  #   [:class, [names]]
+  #   [:tag, name]
+  #   [:attr, [key], operator, operand]
+  #
+  def self.describe(selector)
+    compounds = []
+    while selector
+      checks = selector.attributes.map do |check|
+        case check
+        when GUI::ViewClassCheck
+          [:class, check.instance_variable_get(:@classnames)]
+        when GUI::ViewTagCheck
+          [:tag, check.instance_variable_get(:@tagname)]
+        when GUI::ViewAttrCheck
+          [
+            :attr,
+            check.instance_variable_get(:@key),
+            check.instance_variable_get(:@operator),
+            check.instance_variable_get(:@operand)
+          ]
+        else
+          [:unknown, check.class]
+        end
+      end
+      compounds << [checks, !!selector.direct]
+      selector = selector.succ
+    end
+    compounds
+  end
+
+
+  class Parser
+
+    def initialize(source)
+      @encoding = source.encoding
+      @chars = source.b
+      @index = 0
+    end
+
+    def parse
+      compounds = []
+
+      compound = read_compound
+      fail! "Unable to parse selector string" unless compound
+      compounds << compound
+      skip_whitespace
+
+      while !eos? && (compound = read_compound)
+        compounds << compound
+        skip_whitespace
+      end
+
+      if eos? && compounds.last[1]
+        fail! "No selector following direct reference (>)"
+      end
+
+      fail! "Unable to completely parse selector string" unless eos?
+
+      compounds
+    end
+
+    private
+
+    def fail!(message)
+      raise Error, message
+    end
+
+    def eos?
+      @index >= @chars.bytesize
+    end
+
+    def peek
+      @chars[@index]
+    end
+
+    def accept(str)
+      if @chars[@index, str.bytesize] == str
+        @index += str.bytesize
+        str
+      end
+    end
+
+    def scan(re)
+      match = re.match(@chars, @index)
+      if match && match.begin(0) == @index && match.end(0) > @index
+        @index = match.end(0)
+        match
+      end
+    end
+
+    def skip_whitespace
+      scan(SPACE_RE)
+    end
+
+    def text(str)
+      str.dup.force_encoding(@encoding)
+    end
+
+    def read_name
+      match = scan(NAME_RE)
+      text(match[0]) if match
+    end
+
+    def read_compound
+      skip_whitespace
+
+      checks = []
+      globbed = accept('*') || peek == '#' || peek == '['
+
+      if !globbed
+        names = read_multi_class || ((name = read_name) && [name])
+        return nil unless names
+        checks << [:class, names.map(&:to_sym)]
+      end
+
+      if accept('#')
+        name = read_name
+        fail! "Expected tag name after #" unless name
+        checks << [:tag, name.to_sym]
+      end
+
+      while (check = read_attribute)
+        checks << check
+      end
+
+      skip_whitespace
+
+      [checks, !!accept('>')]
+    end
+
+    def read_multi_class
+      return nil unless accept('(')
+
+      names = []
+      skip_whitespace
+      while (name = read_name)
+        names << name
+        skip_whitespace
+        break unless accept('|')
+      end
+      skip_whitespace
+
+      fail! "Unclosed multi-tag selector" unless accept(')')
+      fail! "Cannot have an empty multi-tag selector" if names.empty?
+
+      names
+    end
+
+    def read_attribute
+      return nil unless accept('[')
+
+      skip_whitespace
+      inverted = accept('!')
+      skip_whitespace if inverted
+
+      name = read_name
+      fail! "Expected attribute name" unless name
+      skip_whitespace
+
+      if accept(']')
+        operator = :trueish
+        operand = nil
+      else
+        operator = read_operator
+        skip_whitespace
+        operand = read_string || read_number || read_name
+        fail! "Invalid operand to attribute check" if operand.nil?
+        skip_whitespace
+        fail! "No closing ] for attribute" unless accept(']')
+      end
+
+      if inverted
+        operator = INVERSES[operator]
+        fail! "Operator cannot be inverted" unless operator
+      end
+
+      key = name.split('.').reject(&:empty?).map!(&:to_sym)
+      [:attr, key, operator, operand]
+    end
+
+    def read_operator
+      OPERATORS.each do |mark, operator|
+        return operator if accept(mark)
+      end
+
+      if peek == '!'
+        fail! "Invalid operator -- expected ="
+      else
+        fail! "Invalid operator -- expected one of =, !=, <, <=, >, >=, <-"
+      end
+    end
+
+    def read_string
+      return nil unless accept('"')
+
+      start = @index
+      while !eos? && peek != '"'
+        @index += (peek == '\\') ? 2 : 1
+      end
+      @index = @chars.bytesize if @index > @chars.bytesize
+
+      fail! "No closing quote for string" unless accept('"')
+
+      text(@chars[start ... @index - 1].gsub(/\\(.)/mn, '\1'))
+    end
+
+    def read_number
+      match = scan(NUMBER_RE)
+      return nil unless match
+
+      number = match[0]
+      if number.include?('.') && match[1].nil?
+        fail! "Invalid number format: expected fractional value"
+      elsif number =~ /[eE]/ && match[2].nil?
+        fail! "Invalid number format: expected exponent"
+      end
+
+      if number =~ /[.eE]/
+        # Out of range exponents are infinite, as with strtod, without warning
+        verbose, $VERBOSE = $VERBOSE, nil
+        begin
+          Float(number)
+        ensure
+          $VERBOSE = verbose
+        end
+      else
+        Integer(number, 10)
+      end
+    end
+
+  end # Parser
+
+end # SelectorGrammar
@@ -19,45 +19,11 @@
 
 
 require 'mkmf'
+require_relative 'build_options'
 
 
-# Compile as C99
-$CFLAGS += " -std=c99 -march=native"
-
-OptKVPair = Struct.new(:key, :value)
-
-option_mappings = {
-  '-D'              => OptKVPair[:build_debug, true],
-  '--debug'         => OptKVPair[:build_debug, true],
-  '-ND'             => OptKVPair[:build_debug, false],
-  '--release'       => OptKVPair[:build_debug, false]
-}
-
-options = {
-  :build_debug => false
-}
-
-ARGV.each do |arg|
-  pair = option_mappings[arg]
-  if pair
-    options[pair.key] = pair.value
-  else
-    $stderr.puts "Unrecognized install option: #{arg}"
-  end
-end
-
-if options[:build_debug]
-  $CFLAGS += " -g -O0"
-  $stderr.puts "Building extension in debug mode"
-else
-  # mfpmath is ignored on clang, FYI
-  if `cc -v 2>&1`.include?('(clang-')
-    $CFLAGS += " -Ofast -O4 -flto -emit-llvm"
-  else
-    $CFLAGS += " -O3"
-  end
-  $CFLAGS += " -fno-strict-aliasing"
-  $stderr.puts "Building extension in release mode"
-end
+# Selector packs are memory-mapped where mmap is available and read into memory
+# otherwise.
+have_header('sys/mman.h')
 
 create_makefile('gui/selector_ext', 'gui_selectors/')
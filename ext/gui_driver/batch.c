@@ -0,0 +1,466 @@
+//  Copyright 2014 Noel Cower
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  ----------------------------------------------------------------------------
+//
+//  batch.c
+//    Quad reordering for Driver#batch_stages.
+//
+//    Quads are taken in draw order and each is moved back into the latest
+//    batch drawn with the same texture, so long as no quad in a batch after
+//    that one overlaps it -- quads that don't overlap can be drawn in any
+//    order without changing the result. Overlap is tested on the quads'
+//    bounding boxes, found through a coarse grid over their bounds: each cell
+//    lists the quads touching it and the latest batch among them, so a quad
+//    only has to be checked against quads near it in later batches.
+
+
+#include "ruby.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+
+/* Cells per side of the overlap grid */
+#define B_GRID_SIZE 64
+/* Quads per batch, keeping indices within 16 bits */
+#define B_MAX_QUADS (65536 / 4)
+/* Quads compared before assuming a quad is blocked */
+#define B_MAX_CHECKS 256
+/* Stage info entries: key, base vertex, vertices, base face, faces */
+#define B_STAGE_INFO 5
+
+
+/*=============================================================================
+|  Types                                                                      |
+=============================================================================*/
+
+typedef struct s_b_quad {
+  long  key;          /* texture key of the quad's stage */
+  long  vertex;       /* index of the quad's first vertex */
+  long  face;         /* index of the quad's first face */
+  long  local;        /* index of the quad's first vertex in its stage */
+  long  next;         /* next quad in the same batch, or -1 */
+  long  batch;        /* batch the quad was assigned */
+  float min_x, min_y;
+  float max_x, max_y;
+} b_quad_t;
+
+
+typedef struct s_b_batch {
+  long key;
+  long count;
+  long first;         /* first and last quads in the batch */
+  long last;
+} b_batch_t;
+
+
+/* Cells over the quads' bounds, each holding the latest batch of any quad
+   touching it and a list of those quads. */
+typedef struct s_b_grid {
+  long  batch[B_GRID_SIZE * B_GRID_SIZE];
+  long  head[B_GRID_SIZE * B_GRID_SIZE];
+  long *entry_quad;
+  long *entry_next;
+  long  entries;
+  long  capacity;
+} b_grid_t;
+
+
+/*=============================================================================
+|  Helpers                                                                    |
+=============================================================================*/
+
+/* Reads a quad's faces and bounds. Returns 0 if its faces don't index the
+   quad's four vertices, i.e., the stage isn't made of quads. */
+static
+int
+b_read_quad(
+  b_quad_t *quad, const uint8_t *vertices, const uint16_t *faces,
+  long stride, long position, long base_vertex, long base_face, long index
+  )
+{
+  const uint16_t *const indices = faces + (base_face + index * 2) * 3;
+  const long first = index * 4;
+  int corner;
+
+  for (corner = 0; corner < 6; ++corner) {
+    if (indices[corner] < first || indices[corner] > first + 3) {
+      return 0;
+    }
+  }
+
+  quad->vertex = base_vertex + first;
+  quad->local = first;
+  quad->face = base_face + index * 2;
+  quad->next = -1;
+  quad->min_x = quad->min_y = INFINITY;
+  quad->max_x = quad->max_y = -INFINITY;
+
+  for (corner = 0; corner < 4; ++corner) {
+    float xy[2];
+    memcpy(xy, vertices + (quad->vertex + corner) * stride + position, sizeof(xy));
+    if (xy[0] < quad->min_x) quad->min_x = xy[0];
+    if (xy[0] > quad->max_x) quad->max_x = xy[0];
+    if (xy[1] < quad->min_y) quad->min_y = xy[1];
+    if (xy[1] > quad->max_y) quad->max_y = xy[1];
+  }
+
+  return 1;
+}
+
+
+static
+long
+b_stage_info(VALUE stages, long stage, long field)
+{
+  return FIX2LONG(rb_ary_entry(stages, stage * B_STAGE_INFO + field));
+}
+
+
+/* Converts a coordinate to a cell index, clamped to the grid. */
+static
+long
+b_cell(float value, float origin, float scale)
+{
+  const float cell = (value - origin) * scale;
+  if (!(cell > 0.0f)) {
+    return 0;
+  } else if (cell >= (float)(B_GRID_SIZE - 1)) {
+    return B_GRID_SIZE - 1;
+  }
+  return (long)cell;
+}
+
+
+/*=============================================================================
+|  Reordering                                                                 |
+=============================================================================*/
+
+/* Whether two quads' bounds overlap. Bounds that only share an edge don't,
+   since no pixel center is inside both. */
+static
+int
+b_overlaps(const b_quad_t *left, const b_quad_t *right)
+{
+  return left->min_x < right->max_x && right->min_x < left->max_x &&
+         left->min_y < right->max_y && right->min_y < left->max_y;
+}
+
+
+/* Whether quad overlaps any quad in a batch after target among the quads
+   listed in the cells it covers. Gives up and answers yes after
+   B_MAX_CHECKS comparisons. */
+static
+int
+b_blocked(
+  const b_grid_t *grid, const b_quad_t *quads, const b_quad_t *quad,
+  long target, long left, long top, long right, long bottom
+  )
+{
+  long checks = 0;
+  long x, y;
+
+  for (y = top; y <= bottom; ++y) {
+    for (x = left; x <= right; ++x) {
+      const long cell = y * B_GRID_SIZE + x;
+      long entry;
+      if (grid->batch[cell] <= target) {
+        continue;
+      }
+      for (entry = grid->head[cell]; entry >= 0; entry = grid->entry_next[entry]) {
+        const b_quad_t *const other = quads + grid->entry_quad[entry];
+        if (other->batch <= target) {
+          continue;
+        } else if (++checks > B_MAX_CHECKS || b_overlaps(quad, other)) {
+          return 1;
+        }
+      }
+    }
+  }
+
+  return 0;
+}
+
+
+/* Assigns each quad a batch and returns the number of batches. */
+static
+long
+b_assign(b_quad_t *quads, long count, b_batch_t *batches, long *key_batches, b_grid_t *grid)
+{
+  float min_x = INFINITY, min_y = INFINITY, max_x = -INFINITY, max_y = -INFINITY;
+  float scale_x, scale_y;
+  long batch_count = 0;
+  long index;
+
+  for (index = 0; index < count; ++index) {
+    const b_quad_t *const quad = quads + index;
+    if (quad->min_x < min_x) min_x = quad->min_x;
+    if (quad->min_y < min_y) min_y = quad->min_y;
+    if (quad->max_x > max_x) max_x = quad->max_x;
+    if (quad->max_y > max_y) max_y = quad->max_y;
+  }
+  scale_x = max_x > min_x ? (float)B_GRID_SIZE / (max_x - min_x) : 0.0f;
+  scale_y = max_y > min_y ? (float)B_GRID_SIZE / (max_y - min_y) : 0.0f;
+
+  for (index = 0; index < B_GRID_SIZE * B_GRID_SIZE; ++index) {
+    grid->batch[index] = -1;
+    grid->head[index] = -1;
+  }
+  grid->entries = 0;
+
+  for (index = 0; index < count; ++index) {
+    b_quad_t *const quad = quads + index;
+    const long left = b_cell(quad->min_x, min_x, scale_x);
+    const long right = b_cell(quad->max_x, min_x, scale_x);
+    const long top = b_cell(quad->min_y, min_y, scale_y);
+    const long bottom = b_cell(quad->max_y, min_y, scale_y);
+    long target = key_batches[quad->key];
+    long barrier = -1;
+    long x, y;
+
+    for (y = top; y <= bottom; ++y) {
+      for (x = left; x <= right; ++x) {
+        const long cell = grid->batch[y * B_GRID_SIZE + x];
+        if (cell > barrier) barrier = cell;
+      }
+    }
+
+    /* The cells only say what might overlap, so check the quads in them
+       before giving up on the target */
+    if (target < 0 || batches[target].count >= B_MAX_QUADS ||
+        (target < barrier && b_blocked(grid, quads, quad, target, left, top, right, bottom))) {
+      target = batch_count++;
+      batches[target].key = quad->key;
+      batches[target].count = 0;
+      batches[target].first = index;
+      key_batches[quad->key] = target;
+    } else {
+      quads[batches[target].last].next = index;
+    }
+    batches[target].last = index;
+    batches[target].count += 1;
+    quad->batch = target;
+
+    for (y = top; y <= bottom; ++y) {
+      for (x = left; x <= right; ++x) {
+        const long cell = y * B_GRID_SIZE + x;
+        if (grid->entries == grid->capacity) {
+          grid->capacity *= 2;
+          REALLOC_N(grid->entry_quad, long, grid->capacity);
+          REALLOC_N(grid->entry_next, long, grid->capacity);
+        }
+        grid->entry_quad[grid->entries] = index;
+        grid->entry_next[grid->entries] = grid->head[cell];
+        grid->head[cell] = grid->entries++;
+        if (target > grid->batch[cell]) grid->batch[cell] = target;
+      }
+    }
+  }
+
+  return batch_count;
+}
+
+
+/* Writes the quads' vertices and faces in batch order. */
+static
+void
+b_write(
+  uint8_t *vertices_out, uint16_t *faces_out,
+  const uint8_t *vertices, const uint16_t *faces, long stride,
+  const b_quad_t *quads, const b_batch_t *batches, long batch_count
+  )
+{
+  long batch;
+
+  for (batch = 0; batch < batch_count; ++batch) {
+    long index = batches[batch].first;
+    long local = 0;
+    while (index >= 0) {
+      const b_quad_t *const quad = quads + index;
+      const uint16_t *const indices = faces + quad->face * 3;
+      int corner;
+
+      memcpy(vertices_out, vertices + quad->vertex * stride, (size_t)(4 * stride));
+      for (corner = 0; corner < 6; ++corner) {
+        faces_out[corner] = (uint16_t)(local + indices[corner] - quad->local);
+      }
+
+      vertices_out += 4 * stride;
+      faces_out += 6;
+      local += 4;
+      index = quad->next;
+    }
+  }
+}
+
+
+/*
+  call-seq:
+    Batches.reorder(vertices_address, faces_address, layout, stages, key_count) -> [key, quads, ...] or nil
+
+  Reorders the quads of the stages described by stages, a flat array of
+  [texture key, base vertex, vertices, base face, faces] per stage, so that
+  quads with the same key are drawn together wherever that doesn't change
+  how overlapping quads are drawn. Keys run from 0 to key_count - 1. layout is
+  [vertex stride, position offset] in bytes.
+
+  Returns the new stages as a flat array of [key, quad count] per stage, with
+  the vertices and faces rewritten to match, or nil if nothing was saved or
+  the stages aren't all quads, in which case nothing was changed.
+
+  Only meant to be called by Driver#batch_stages.
+*/
+static
+VALUE
+b_rb_reorder(
+  VALUE self, VALUE vertices_rb, VALUE faces_rb, VALUE layout_rb,
+  VALUE stages_rb, VALUE key_count_rb
+  )
+{
+  uint8_t *const vertices = (uint8_t *)NUM2SIZET(vertices_rb);
+  uint16_t *const faces = (uint16_t *)NUM2SIZET(faces_rb);
+  const long key_count = NUM2LONG(key_count_rb);
+  long stride, position, stage_count, quad_count, vertex_count, batch_count;
+  long stage, index;
+  b_quad_t *quads;
+  b_batch_t *batches;
+  long *key_batches;
+  b_grid_t *grid;
+  uint8_t *vertices_out;
+  uint16_t *faces_out;
+  VALUE result;
+  int quads_only = 1;
+
+  (void)self;
+
+  Check_Type(layout_rb, T_ARRAY);
+  Check_Type(stages_rb, T_ARRAY);
+  if (RARRAY_LEN(layout_rb) != 2 || RARRAY_LEN(stages_rb) % B_STAGE_INFO != 0) {
+    rb_raise(rb_eArgError, "Invalid batch layout or stages");
+  } else if (!vertices || !faces) {
+    rb_raise(rb_eArgError, "Invalid vertex or face address");
+  }
+
+  stride = NUM2LONG(rb_ary_entry(layout_rb, 0));
+  position = NUM2LONG(rb_ary_entry(layout_rb, 1));
+  stage_count = RARRAY_LEN(stages_rb) / B_STAGE_INFO;
+  if (stride <= 0 || position < 0 || position + 2 * (long)sizeof(float) > stride) {
+    rb_raise(rb_eArgError, "Invalid vertex layout");
+  }
+
+  /* Stages must be all quads, packed one after another from the start of
+     the arrays, as Driver lays them out */
+  quad_count = 0;
+  vertex_count = 0;
+  for (index = 0; index < RARRAY_LEN(stages_rb); ++index) {
+    if (!FIXNUM_P(rb_ary_entry(stages_rb, index))) {
+      rb_raise(rb_eTypeError, "Stage info must be Fixnums");
+    }
+  }
+  for (stage = 0; stage < stage_count; ++stage) {
+    const long key = b_stage_info(stages_rb, stage, 0);
+    const long stage_vertices = b_stage_info(stages_rb, stage, 2);
+    const long stage_faces = b_stage_info(stages_rb, stage, 4);
+    if (key < 0 || key >= key_count) {
+      rb_raise(rb_eArgError, "Invalid stage key: %ld", key);
+    } else if (stage_faces % 2 != 0 || stage_vertices != stage_faces * 2 ||
+               b_stage_info(stages_rb, stage, 1) != vertex_count ||
+               b_stage_info(stages_rb, stage, 3) != quad_count * 2) {
+      return Qnil;
+    }
+    quad_count += stage_faces / 2;
+    vertex_count += stage_vertices;
+  }
+
+  if (stage_count < 2 || key_count >= stage_count || quad_count == 0) {
+    return Qnil;
+  }
+
+  quads = ALLOC_N(b_quad_t, quad_count);
+  index = 0;
+  for (stage = 0; stage < stage_count && quads_only; ++stage) {
+    const long key = b_stage_info(stages_rb, stage, 0);
+    const long base_vertex = b_stage_info(stages_rb, stage, 1);
+    const long base_face = b_stage_info(stages_rb, stage, 3);
+    const long stage_quads = b_stage_info(stages_rb, stage, 4) / 2;
+    long quad;
+    for (quad = 0; quad < stage_quads; ++quad, ++index) {
+      if (!b_read_quad(quads + index, vertices, faces, stride, position, base_vertex, base_face, quad)) {
+        quads_only = 0;
+        break;
+      }
+      quads[index].key = key;
+    }
+  }
+
+  if (!quads_only) {
+    xfree(quads);
+    return Qnil;
+  }
+
+  batches = ALLOC_N(b_batch_t, quad_count);
+  key_batches = ALLOC_N(long, key_count);
+  grid = ALLOC(b_grid_t);
+  grid->capacity = quad_count * 4;
+  grid->entry_quad = ALLOC_N(long, grid->capacity);
+  grid->entry_next = ALLOC_N(long, grid->capacity);
+  for (index = 0; index < key_count; ++index) {
+    key_batches[index] = -1;
+  }
+
+  batch_count = b_assign(quads, quad_count, batches, key_batches, grid);
+  xfree(grid->entry_next);
+  xfree(grid->entry_quad);
+  xfree(grid);
+  xfree(key_batches);
+
+  if (batch_count >= stage_count) {
+    xfree(batches);
+    xfree(quads);
+    return Qnil;
+  }
+
+  vertices_out = ALLOC_N(uint8_t, (size_t)vertex_count * (size_t)stride);
+  faces_out = ALLOC_N(uint16_t, (size_t)quad_count * 6);
+  b_write(vertices_out, faces_out, vertices, faces, stride, quads, batches, batch_count);
+  memcpy(vertices, vertices_out, (size_t)(vertex_count * stride));
+  memcpy(faces, faces_out, (size_t)quad_count * 6 * sizeof(uint16_t));
+  xfree(faces_out);
+  xfree(vertices_out);
+
+  result = rb_ary_new_capa(batch_count * 2);
+  for (index = 0; index < batch_count; ++index) {
+    rb_ary_push(result, LONG2NUM(batches[index].key));
+    rb_ary_push(result, LONG2NUM(batches[index].count));
+  }
+
+  xfree(batches);
+  xfree(quads);
+  return result;
+}
+
+
+/*=============================================================================
+|  Init                                                                       |
+=============================================================================*/
+
+void
+s_init_batch(VALUE gui_module)
+{
+  VALUE batches_module = rb_define_module_under(gui_module, "Batches");
+
+  rb_define_singleton_method(batches_module, "reorder", b_rb_reorder, 5);
+}
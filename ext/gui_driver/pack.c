@@ -0,0 +1,260 @@
+//  Copyright 2014 Noel Cower
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  ----------------------------------------------------------------------------
+//
+//  pack.c
+//    Vertex packing for BufferedDriver's compact vertex formats.
+//
+//    Drivers build vertices as floats (Driver::VertexSpec). When a compact
+//    format is used, they're packed as they're uploaded: texcoords become
+//    unsigned normalized 16-bit integers, colors unsigned normalized bytes,
+//    and positions stay floats or become half floats or whole 16-bit
+//    integers. GL normalizes them back to floats for the shader.
+
+
+#include "ruby.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+
+/* How positions are stored */
+enum {
+  P_POSITION_FLOAT = 0,
+  P_POSITION_HALF  = 1,
+  P_POSITION_SHORT = 2
+};
+
+
+/*=============================================================================
+|  Types                                                                      |
+=============================================================================*/
+
+/* Byte offsets of a vertex's attributes. */
+typedef struct s_p_layout {
+  long stride;
+  long position;
+  long texcoord;
+  long color;
+} p_layout_t;
+
+
+/*=============================================================================
+|  Conversion                                                                 |
+=============================================================================*/
+
+/* Clamps value to [0, 1] and scales it to [0, max], rounding to nearest. */
+static
+uint32_t
+p_unorm(float value, float max)
+{
+  if (!(value > 0.0f)) {
+    return 0;
+  } else if (value >= 1.0f) {
+    return (uint32_t)max;
+  }
+  return (uint32_t)(value * max + 0.5f);
+}
+
+
+/* Converts value to a half float, rounding to nearest even. Values too
+   large for a half become infinities. */
+static
+uint16_t
+p_half(float value)
+{
+  uint32_t bits, sign, exponent, mantissa;
+  memcpy(&bits, &value, sizeof(bits));
+  sign = (bits >> 16) & 0x8000u;
+  exponent = (bits >> 23) & 0xFFu;
+  mantissa = bits & 0x7FFFFFu;
+
+  if (exponent == 0xFFu) {
+    /* Infinity or NaN, keeping NaNs NaNs */
+    return (uint16_t)(sign | 0x7C00u | (mantissa ? 0x200u : 0u));
+  } else if (exponent > 142) {
+    /* Larger than the largest half */
+    return (uint16_t)(sign | 0x7C00u);
+  } else if (exponent < 113) {
+    /* Subnormal half, or zero */
+    uint32_t shift, half, remainder, halfway;
+    if (exponent < 102) {
+      return (uint16_t)sign;
+    }
+    mantissa |= 0x800000u;
+    shift = 126 - exponent;
+    half = mantissa >> shift;
+    remainder = mantissa & ((1u << shift) - 1u);
+    halfway = 1u << (shift - 1);
+    if (remainder > halfway || (remainder == halfway && (half & 1u))) {
+      ++half;
+    }
+    return (uint16_t)(sign | half);
+  } else {
+    /* Normal half -- rounding may carry into the exponent, which is still
+       right, up to rounding to infinity */
+    uint32_t half = ((exponent - 112) << 10) | (mantissa >> 13);
+    const uint32_t remainder = mantissa & 0x1FFFu;
+    if (remainder > 0x1000u || (remainder == 0x1000u && (half & 1u))) {
+      ++half;
+    }
+    return (uint16_t)(sign | half);
+  }
+}
+
+
+/* Rounds value to the nearest 16-bit integer, saturating. */
+static
+int16_t
+p_short(float value)
+{
+  if (!(value > -32768.0f)) {
+    return value != value ? 0 : -32768;
+  } else if (value >= 32767.0f) {
+    return 32767;
+  }
+  return (int16_t)lrintf(value);
+}
+
+
+static
+void
+p_pack_vertices(
+  uint8_t *destination, const p_layout_t *to,
+  const uint8_t *source, const p_layout_t *from,
+  long count, int position_kind
+  )
+{
+  long vertex;
+
+  for (vertex = 0; vertex < count; ++vertex) {
+    const uint8_t *const in = source + vertex * from->stride;
+    uint8_t *const out = destination + vertex * to->stride;
+    float position[2], texcoord[2], color[4];
+    uint16_t packed_texcoord[2];
+    uint8_t packed_color[4];
+    int component;
+
+    memcpy(position, in + from->position, sizeof(position));
+    memcpy(texcoord, in + from->texcoord, sizeof(texcoord));
+    memcpy(color, in + from->color, sizeof(color));
+
+    switch (position_kind) {
+    case P_POSITION_HALF: {
+      const uint16_t half[2] = { p_half(position[0]), p_half(position[1]) };
+      memcpy(out + to->position, half, sizeof(half));
+      break;
+    }
+    case P_POSITION_SHORT: {
+      const int16_t whole[2] = { p_short(position[0]), p_short(position[1]) };
+      memcpy(out + to->position, whole, sizeof(whole));
+      break;
+    }
+    default:
+      memcpy(out + to->position, position, sizeof(position));
+      break;
+    }
+
+    packed_texcoord[0] = (uint16_t)p_unorm(texcoord[0], 65535.0f);
+    packed_texcoord[1] = (uint16_t)p_unorm(texcoord[1], 65535.0f);
+    memcpy(out + to->texcoord, packed_texcoord, sizeof(packed_texcoord));
+
+    for (component = 0; component < 4; ++component) {
+      packed_color[component] = (uint8_t)p_unorm(color[component], 255.0f);
+    }
+    memcpy(out + to->color, packed_color, sizeof(packed_color));
+  }
+}
+
+
+/*=============================================================================
+|  Methods                                                                    |
+=============================================================================*/
+
+static
+void
+p_read_layout(p_layout_t *layout, VALUE layout_rb)
+{
+  Check_Type(layout_rb, T_ARRAY);
+  if (RARRAY_LEN(layout_rb) != 4) {
+    rb_raise(rb_eArgError, "Invalid vertex layout");
+  }
+  layout->stride = NUM2LONG(rb_ary_entry(layout_rb, 0));
+  layout->position = NUM2LONG(rb_ary_entry(layout_rb, 1));
+  layout->texcoord = NUM2LONG(rb_ary_entry(layout_rb, 2));
+  layout->color = NUM2LONG(rb_ary_entry(layout_rb, 3));
+  if (layout->stride <= 0) {
+    rb_raise(rb_eArgError, "Invalid vertex stride: %ld", layout->stride);
+  }
+}
+
+
+/*
+  call-seq:
+    VertexPack.pack(destination_address, destination_layout, source_address,
+                    source_layout, count, position_kind) -> count
+
+  Packs count float vertices at source_address, laid out as source_layout,
+  into destination_address, laid out as destination_layout. Layouts are
+  [stride, position offset, texcoord offset, color offset] in bytes.
+  position_kind is 0 to keep positions as floats, 1 to store them as half
+  floats, or 2 to round them to 16-bit integers.
+
+  Only meant to be called by BufferedDriver, which sizes the destination.
+*/
+static
+VALUE
+p_rb_pack(
+  VALUE self, VALUE destination_rb, VALUE to_rb, VALUE source_rb,
+  VALUE from_rb, VALUE count_rb, VALUE position_kind_rb
+  )
+{
+  uint8_t *const destination = (uint8_t *)NUM2SIZET(destination_rb);
+  const uint8_t *const source = (const uint8_t *)NUM2SIZET(source_rb);
+  const long count = NUM2LONG(count_rb);
+  const int position_kind = NUM2INT(position_kind_rb);
+  p_layout_t to, from;
+
+  (void)self;
+
+  p_read_layout(&to, to_rb);
+  p_read_layout(&from, from_rb);
+
+  if (count <= 0) {
+    return INT2FIX(0);
+  } else if (!destination || !source) {
+    rb_raise(rb_eArgError, "Invalid vertex address");
+  } else if (position_kind < P_POSITION_FLOAT || position_kind > P_POSITION_SHORT) {
+    rb_raise(rb_eArgError, "Invalid position kind: %d", position_kind);
+  }
+
+  p_pack_vertices(destination, &to, source, &from, count, position_kind);
+
+  return LONG2NUM(count);
+}
+
+
+/*=============================================================================
+|  Init                                                                       |
+=============================================================================*/
+
+void
+s_init_pack(VALUE gui_module)
+{
+  VALUE pack_module = rb_define_module_under(gui_module, "VertexPack");
+
+  rb_define_singleton_method(pack_module, "pack", p_rb_pack, 6);
+}
@@ -0,0 +1,363 @@
+//  Copyright 2014 Noel Cower
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  ----------------------------------------------------------------------------
+//
+//  quads.c
+//    Batched quad emission for Driver#draw_quads.
+//
+//    Writes the vertices and faces of many quads straight into a Driver's
+//    vertex and face arrays, computing them exactly as Driver#draw_quad does:
+//    the quad's corners are offset by -(handle * size), rotated and scaled by
+//    the driver's transform, and added to position + origin, all in single
+//    precision and in the same order. With SSE2, a quad's four corners are
+//    transformed together.
+
+
+#include "ruby.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#define D_SSE2 1
+#include <emmintrin.h>
+#else
+#define D_SSE2 0
+#endif
+
+
+/*=============================================================================
+|  Types                                                                      |
+=============================================================================*/
+
+/* Byte offsets of a vertex's float attributes. */
+typedef struct s_d_layout {
+  long stride;
+  long position;
+  long texcoord;
+  long color;
+} d_layout_t;
+
+
+/* Where a batch's per-quad inputs come from. Each is an array of 2- or
+   4-component vectors of float or double components; uvs and colors may be
+   NULL to use the defaults for every quad. */
+typedef struct s_d_sources {
+  const uint8_t *positions;
+  const uint8_t *sizes;
+  const uint8_t *uvs;       /* min u, min v, max u, max v */
+  const uint8_t *colors;
+  long           component_size;
+} d_sources_t;
+
+
+/* Driver state shared by every quad in a batch. */
+typedef struct s_d_params {
+  float xx, xy;     /* transform applied to (1, 0) */
+  float yx, yy;     /* transform applied to (0, 1) */
+  float origin[2];
+  float handle[2];
+  float color[4];
+  double uv_offset[2];  /* texture region UV transform, applied in double */
+  double uv_scale[2];   /* precision as TextureRegion#remap_uv does */
+} d_params_t;
+
+
+/*=============================================================================
+|  Helpers                                                                    |
+=============================================================================*/
+
+static
+long
+d_ary_long(VALUE ary, long index)
+{
+  return NUM2LONG(rb_ary_entry(ary, index));
+}
+
+
+static
+float
+d_ary_float(VALUE ary, long index)
+{
+  return (float)NUM2DBL(rb_ary_entry(ary, index));
+}
+
+
+static
+double
+d_ary_double(VALUE ary, long index)
+{
+  return NUM2DBL(rb_ary_entry(ary, index));
+}
+
+
+static
+const uint8_t *
+d_ary_address(VALUE ary, long index)
+{
+  VALUE address = rb_ary_entry(ary, index);
+  if (NIL_P(address)) {
+    return NULL;
+  }
+  return (const uint8_t *)NUM2SIZET(address);
+}
+
+
+/* Reads count components of the index'th vector of a source array. */
+static
+void
+d_read(
+  float *out, const uint8_t *source, long index, long count, long component_size
+  )
+{
+  long component;
+  if (component_size == sizeof(float)) {
+    memcpy(out, source + index * count * sizeof(float), count * sizeof(float));
+  } else {
+    const uint8_t *const base = source + index * count * sizeof(double);
+    for (component = 0; component < count; ++component) {
+      double value;
+      memcpy(&value, base + component * sizeof(double), sizeof(value));
+      out[component] = (float)value;
+    }
+  }
+}
+
+
+/*=============================================================================
+|  Emission                                                                   |
+=============================================================================*/
+
+static
+void
+d_write_vertex(
+  uint8_t *vertex, const d_layout_t *layout,
+  float x, float y, float u, float v, const float color[4]
+  )
+{
+  const float position[2] = { x, y };
+  const float texcoord[2] = { u, v };
+  memcpy(vertex + layout->position, position, sizeof(position));
+  memcpy(vertex + layout->texcoord, texcoord, sizeof(texcoord));
+  memcpy(vertex + layout->color, color, 4 * sizeof(float));
+}
+
+
+static
+void
+d_emit_quads(
+  uint8_t *vertices, const d_layout_t *layout, uint16_t *faces,
+  long index_base, long count,
+  const d_sources_t *sources, long first_source, const d_params_t *params
+  )
+{
+  static const float default_uv[4] = { 0.0f, 0.0f, 1.0f, 1.0f };
+  long quad;
+
+#if D_SSE2
+  const __m128 xx = _mm_set1_ps(params->xx);
+  const __m128 xy = _mm_set1_ps(params->xy);
+  const __m128 yx = _mm_set1_ps(params->yx);
+  const __m128 yy = _mm_set1_ps(params->yy);
+#endif
+
+  for (quad = 0; quad < count; ++quad) {
+    const long source = first_source + quad;
+    float position[2], size[2], uv[4], color[4];
+    float left, top, right, bottom, pos_x, pos_y;
+    float corners_x[4], corners_y[4];
+    uint8_t *const vertex = vertices + quad * 4 * layout->stride;
+    uint16_t *const face = faces + quad * 6;
+    const uint16_t index = (uint16_t)(index_base + quad * 4);
+    int corner;
+
+    d_read(position, sources->positions, source, 2, sources->component_size);
+    d_read(size, sources->sizes, source, 2, sources->component_size);
+    if (sources->uvs) {
+      d_read(uv, sources->uvs, source, 4, sources->component_size);
+    } else {
+      memcpy(uv, default_uv, sizeof(uv));
+    }
+    if (sources->colors) {
+      d_read(color, sources->colors, source, 4, sources->component_size);
+    } else {
+      memcpy(color, params->color, sizeof(color));
+    }
+    uv[0] = (float)(params->uv_offset[0] + uv[0] * params->uv_scale[0]);
+    uv[1] = (float)(params->uv_offset[1] + uv[1] * params->uv_scale[1]);
+    uv[2] = (float)(params->uv_offset[0] + uv[2] * params->uv_scale[0]);
+    uv[3] = (float)(params->uv_offset[1] + uv[3] * params->uv_scale[1]);
+
+    /* top_left = -(handle * size), bottom_right = size + top_left */
+    left = -(params->handle[0] * size[0]);
+    top = -(params->handle[1] * size[1]);
+    right = size[0] + left;
+    bottom = size[1] + top;
+    pos_x = position[0] + params->origin[0];
+    pos_y = position[1] + params->origin[1];
+
+#if D_SSE2
+    {
+      const __m128 xs = _mm_setr_ps(left, right, right, left);
+      const __m128 ys = _mm_setr_ps(top, top, bottom, bottom);
+      const __m128 rotated_x = _mm_add_ps(_mm_mul_ps(xx, xs), _mm_mul_ps(yx, ys));
+      const __m128 rotated_y = _mm_add_ps(_mm_mul_ps(xy, xs), _mm_mul_ps(yy, ys));
+      _mm_storeu_ps(corners_x, _mm_add_ps(_mm_set1_ps(pos_x), rotated_x));
+      _mm_storeu_ps(corners_y, _mm_add_ps(_mm_set1_ps(pos_y), rotated_y));
+    }
+#else
+    {
+      const float xs[4] = { left, right, right, left };
+      const float ys[4] = { top, top, bottom, bottom };
+      for (corner = 0; corner < 4; ++corner) {
+        const float rotated_x = params->xx * xs[corner] + params->yx * ys[corner];
+        const float rotated_y = params->xy * xs[corner] + params->yy * ys[corner];
+        corners_x[corner] = pos_x + rotated_x;
+        corners_y[corner] = pos_y + rotated_y;
+      }
+    }
+#endif
+
+    /* v0 and v1 take the max v, v2 and v3 the min, as in draw_quad */
+    for (corner = 0; corner < 4; ++corner) {
+      d_write_vertex(
+        vertex + corner * layout->stride, layout,
+        corners_x[corner], corners_y[corner],
+        (corner == 0 || corner == 3) ? uv[0] : uv[2],
+        corner < 2 ? uv[3] : uv[1],
+        color
+        );
+    }
+
+    face[0] = index;
+    face[1] = index + 1;
+    face[2] = index + 2;
+    face[3] = index + 2;
+    face[4] = index + 3;
+    face[5] = index;
+  }
+}
+
+
+/*
+  call-seq:
+    Quads.emit(vertices_address, layout, faces_address, index_base, count,
+               sources, first_source, params) -> count
+
+  Writes count quads' vertices to vertices_address and their faces to
+  faces_address, which must have room for them. Face indices start at
+  index_base. layout is [stride, position offset, texcoord offset, color
+  offset] in bytes. sources is [positions address, sizes address, uvs
+  address or nil, colors address or nil, component size], and quads are read
+  from first_source onward. params is the driver's transform applied to
+  (1, 0) and (0, 1), then its origin, handle, and color, then the UV offset
+  and scale of the texture region drawn from -- 16 numbers.
+
+  Only meant to be called by Driver#draw_quads, which checks the addresses
+  and counts it passes.
+*/
+static
+VALUE
+d_rb_emit_quads(
+  VALUE self, VALUE vertices_rb, VALUE layout_rb, VALUE faces_rb,
+  VALUE index_base_rb, VALUE count_rb, VALUE sources_rb,
+  VALUE first_source_rb, VALUE params_rb
+  )
+{
+  uint8_t *const vertices = (uint8_t *)NUM2SIZET(vertices_rb);
+  uint16_t *const faces = (uint16_t *)NUM2SIZET(faces_rb);
+  const long index_base = NUM2LONG(index_base_rb);
+  const long count = NUM2LONG(count_rb);
+  const long first_source = NUM2LONG(first_source_rb);
+  d_layout_t layout;
+  d_sources_t sources;
+  d_params_t params;
+
+  (void)self;
+
+  Check_Type(layout_rb, T_ARRAY);
+  Check_Type(sources_rb, T_ARRAY);
+  Check_Type(params_rb, T_ARRAY);
+  if (RARRAY_LEN(layout_rb) != 4 || RARRAY_LEN(sources_rb) != 5 ||
+      RARRAY_LEN(params_rb) != 16) {
+    rb_raise(rb_eArgError, "Invalid quad layout, sources, or params");
+  }
+
+  layout.stride = d_ary_long(layout_rb, 0);
+  layout.position = d_ary_long(layout_rb, 1);
+  layout.texcoord = d_ary_long(layout_rb, 2);
+  layout.color = d_ary_long(layout_rb, 3);
+
+  sources.positions = d_ary_address(sources_rb, 0);
+  sources.sizes = d_ary_address(sources_rb, 1);
+  sources.uvs = d_ary_address(sources_rb, 2);
+  sources.colors = d_ary_address(sources_rb, 3);
+  sources.component_size = d_ary_long(sources_rb, 4);
+
+  params.xx = d_ary_float(params_rb, 0);
+  params.xy = d_ary_float(params_rb, 1);
+  params.yx = d_ary_float(params_rb, 2);
+  params.yy = d_ary_float(params_rb, 3);
+  params.origin[0] = d_ary_float(params_rb, 4);
+  params.origin[1] = d_ary_float(params_rb, 5);
+  params.handle[0] = d_ary_float(params_rb, 6);
+  params.handle[1] = d_ary_float(params_rb, 7);
+  params.color[0] = d_ary_float(params_rb, 8);
+  params.color[1] = d_ary_float(params_rb, 9);
+  params.color[2] = d_ary_float(params_rb, 10);
+  params.color[3] = d_ary_float(params_rb, 11);
+  params.uv_offset[0] = d_ary_double(params_rb, 12);
+  params.uv_offset[1] = d_ary_double(params_rb, 13);
+  params.uv_scale[0] = d_ary_double(params_rb, 14);
+  params.uv_scale[1] = d_ary_double(params_rb, 15);
+
+  if (count <= 0) {
+    return INT2FIX(0);
+  } else if (!vertices || !faces || !sources.positions || !sources.sizes) {
+    rb_raise(rb_eArgError, "Invalid vertex, face, or source address");
+  } else if (sources.component_size != sizeof(float) &&
+             sources.component_size != sizeof(double)) {
+    rb_raise(rb_eArgError, "Invalid component size: %ld", sources.component_size);
+  } else if (first_source < 0 || index_base < 0 || index_base + count * 4 > 65536) {
+    rb_raise(rb_eRangeError, "Quads don't fit in a stage");
+  }
+
+  d_emit_quads(vertices, &layout, faces, index_base, count, &sources, first_source, &params);
+
+  return LONG2NUM(count);
+}
+
+
+/*=============================================================================
+|  Init                                                                       |
+=============================================================================*/
+
+void s_init_stream(VALUE gui_module);
+void s_init_batch(VALUE gui_module);
+void s_init_pack(VALUE gui_module);
+
+
+void
+Init_driver_ext(void)
+{
+  VALUE gui_module = rb_define_module("GUI");
+  VALUE quads_module = rb_define_module_under(gui_module, "Quads");
+
+  rb_define_singleton_method(quads_module, "emit", d_rb_emit_quads, 8);
+
+  s_init_stream(gui_module);
+  s_init_batch(gui_module);
+  s_init_pack(gui_module);
+}
@@ -0,0 +1,163 @@
+//  Copyright 2014 Noel Cower
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  ----------------------------------------------------------------------------
+//
+//  stream.c
+//    Memory helpers for StreamingBuffer.
+//
+//    StreamingBuffer keeps a shadow copy of what each region of its GL buffer
+//    holds so it can upload only the bytes that changed since the region was
+//    last written. Finding that range is a pair of block-wise compares from
+//    either end, which is far cheaper than uploading what didn't change.
+
+
+#include "ruby.h"
+
+#include <stdint.h>
+#include <string.h>
+
+
+/* Bytes compared at a time before narrowing down to the differing byte */
+#define S_BLOCK_SIZE 64
+
+
+/*=============================================================================
+|  Helpers                                                                    |
+=============================================================================*/
+
+static
+long
+s_first_difference(const uint8_t *left, const uint8_t *right, long length)
+{
+  long offset = 0;
+  while (offset + S_BLOCK_SIZE <= length &&
+         memcmp(left + offset, right + offset, S_BLOCK_SIZE) == 0) {
+    offset += S_BLOCK_SIZE;
+  }
+  while (offset < length && left[offset] == right[offset]) {
+    ++offset;
+  }
+  return offset;
+}
+
+
+/* Returns one past the last differing byte at or after start. */
+static
+long
+s_last_difference(const uint8_t *left, const uint8_t *right, long start, long length)
+{
+  long end = length;
+  while (end - S_BLOCK_SIZE >= start &&
+         memcmp(left + end - S_BLOCK_SIZE, right + end - S_BLOCK_SIZE, S_BLOCK_SIZE) == 0) {
+    end -= S_BLOCK_SIZE;
+  }
+  while (end > start && left[end - 1] == right[end - 1]) {
+    --end;
+  }
+  return end;
+}
+
+
+/*=============================================================================
+|  Methods                                                                    |
+=============================================================================*/
+
+/*
+  call-seq:
+    StreamingBuffer.__update_shadow__(shadow, source_address, bytes) -> [offset, length] or nil
+
+  Compares the first bytes of memory at source_address against the shadow
+  String, copies whatever differs into shadow (growing it if bytes is longer),
+  and returns the offset and length of the single range covering every
+  difference, or nil if there were none.
+*/
+static
+VALUE
+s_rb_update_shadow(VALUE self, VALUE shadow_rb, VALUE source_rb, VALUE bytes_rb)
+{
+  const uint8_t *const source = (const uint8_t *)NUM2SIZET(source_rb);
+  const long bytes = NUM2LONG(bytes_rb);
+  long shadow_length, compared, first, last;
+  uint8_t *shadow;
+
+  (void)self;
+
+  StringValue(shadow_rb);
+  rb_str_modify(shadow_rb);
+  if (bytes <= 0) {
+    return Qnil;
+  } else if (!source) {
+    rb_raise(rb_eArgError, "Invalid source address");
+  }
+
+  shadow_length = RSTRING_LEN(shadow_rb);
+  if (shadow_length < bytes) {
+    rb_str_resize(shadow_rb, bytes);
+  }
+  shadow = (uint8_t *)RSTRING_PTR(shadow_rb);
+
+  /* Anything past the old end of the shadow is new */
+  compared = shadow_length < bytes ? shadow_length : bytes;
+  first = s_first_difference(shadow, source, compared);
+  if (first == compared && compared == bytes) {
+    return Qnil;
+  }
+  last = compared < bytes ? bytes : s_last_difference(shadow, source, first, compared);
+
+  memcpy(shadow + first, source + first, (size_t)(last - first));
+  return rb_assoc_new(LONG2NUM(first), LONG2NUM(last - first));
+}
+
+
+/*
+  call-seq:
+    StreamingBuffer.__copy__(destination_address, source_address, bytes) -> bytes
+
+  Copies bytes from source_address to destination_address, which is usually a
+  mapped buffer range.
+*/
+static
+VALUE
+s_rb_copy(VALUE self, VALUE destination_rb, VALUE source_rb, VALUE bytes_rb)
+{
+  uint8_t *const destination = (uint8_t *)NUM2SIZET(destination_rb);
+  const uint8_t *const source = (const uint8_t *)NUM2SIZET(source_rb);
+  const long bytes = NUM2LONG(bytes_rb);
+
+  (void)self;
+
+  if (bytes > 0) {
+    if (!destination || !source) {
+      rb_raise(rb_eArgError, "Invalid copy address");
+    }
+    memcpy(destination, source, (size_t)bytes);
+  }
+
+  return bytes_rb;
+}
+
+
+/*=============================================================================
+|  Init                                                                       |
+=============================================================================*/
+
+void
+s_init_stream(VALUE gui_module)
+{
+  VALUE stream_class = rb_define_class_under(gui_module, "StreamingBuffer", rb_cObject);
+
+  rb_define_singleton_method(stream_class, "__update_shadow__", s_rb_update_shadow, 3);
+  rb_define_singleton_method(stream_class, "__copy__", s_rb_copy, 3);
+}
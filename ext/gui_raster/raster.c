@@ -0,0 +1,845 @@
+//  Copyright 2014 Noel Cower
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  ----------------------------------------------------------------------------
+//
+//  raster.c
+//    CPU rasterizer for SoftwareDriver.
+//
+//    Draws a Driver's indexed triangles into an RGBA8 image the way the
+//    default shader and Window#__draw__ do on the GPU: vertex colors are
+//    interpolated and multiplied by a bilinearly filtered, edge-clamped
+//    texture sample, and the result is blended with SRC_ALPHA /
+//    ONE_MINUS_SRC_ALPHA on every channel. Pixel centers are at +0.5 and
+//    triangle edges follow the top-left fill rule, so quads sharing an edge
+//    don't overlap or leave gaps.
+//
+//    Triangles are drawn a row at a time: each row's span is found from the
+//    edge equations and then filled, four pixels per store for untextured,
+//    opaque, flat-colored spans and one pixel per SSE2 vector otherwise.
+//    Without SSE2 the same is done in scalar code.
+
+
+#include "ruby.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#define R_SSE2 1
+#include <emmintrin.h>
+#else
+#define R_SSE2 0
+#endif
+
+
+/*=============================================================================
+|  Types                                                                      |
+=============================================================================*/
+
+typedef struct s_r_image {
+  long     width;
+  long     height;
+  uint8_t *pixels;    /* RGBA8, rows top to bottom */
+} r_image_t;
+
+
+/* Byte offsets of a vertex's attributes, which are all floats. */
+typedef struct s_r_layout {
+  long stride;
+  long position;
+  long texcoord;
+  long color;
+} r_layout_t;
+
+
+typedef struct s_r_vertex {
+  float x, y;
+  float u, v;
+  float color[4];
+} r_vertex_t;
+
+
+typedef struct s_r_clip {
+  long left, top, right, bottom;
+} r_clip_t;
+
+
+static VALUE r_raster_module = Qnil;
+static VALUE r_image_class = Qnil;
+
+
+/*=============================================================================
+|  Image                                                                      |
+=============================================================================*/
+
+static
+void
+r_image_free(void *data)
+{
+  r_image_t *image = (r_image_t *)data;
+  xfree(image->pixels);
+  xfree(image);
+}
+
+
+static
+size_t
+r_image_memsize(const void *data)
+{
+  const r_image_t *image = (const r_image_t *)data;
+  return sizeof(*image) + (size_t)(image->width * image->height * 4);
+}
+
+
+static const rb_data_type_t r_image_type = {
+  "GUI::Raster::Image",
+  { NULL, r_image_free, r_image_memsize, },
+  NULL, NULL,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+
+static
+VALUE
+r_image_alloc(VALUE klass)
+{
+  r_image_t *image;
+  VALUE obj = TypedData_Make_Struct(klass, r_image_t, &r_image_type, image);
+  image->width = 0;
+  image->height = 0;
+  image->pixels = NULL;
+  return obj;
+}
+
+
+static
+r_image_t *
+r_get_image(VALUE obj)
+{
+  r_image_t *image;
+  TypedData_Get_Struct(obj, r_image_t, &r_image_type, image);
+  return image;
+}
+
+
+/*
+  call-seq:
+    Image.new(width, height, pixels = nil) -> image
+
+  Creates a width x height RGBA8 image, cleared to transparent black or
+  copied from the pixels String (width * height * 4 bytes, rows top to
+  bottom).
+*/
+static
+VALUE
+r_image_initialize(int argc, VALUE *argv, VALUE self)
+{
+  r_image_t *image = r_get_image(self);
+  VALUE width_rb, height_rb, pixels_rb;
+  long width, height;
+  size_t bytesize;
+
+  rb_scan_args(argc, argv, "21", &width_rb, &height_rb, &pixels_rb);
+  width = NUM2LONG(width_rb);
+  height = NUM2LONG(height_rb);
+
+  if (width < 0 || height < 0 || (height > 0 && width > (LONG_MAX / 4) / height)) {
+    rb_raise(rb_eArgError, "Invalid image size: %ldx%ld", width, height);
+  }
+
+  bytesize = (size_t)(width * height * 4);
+  if (!NIL_P(pixels_rb)) {
+    StringValue(pixels_rb);
+    if ((size_t)RSTRING_LEN(pixels_rb) != bytesize) {
+      rb_raise(rb_eArgError, "Expected %zu bytes of pixels, got %ld",
+        bytesize, RSTRING_LEN(pixels_rb));
+    }
+  }
+
+  xfree(image->pixels);
+  image->width = width;
+  image->height = height;
+  image->pixels = ZALLOC_N(uint8_t, bytesize > 0 ? bytesize : 1);
+
+  if (!NIL_P(pixels_rb)) {
+    memcpy(image->pixels, RSTRING_PTR(pixels_rb), bytesize);
+  }
+
+  return self;
+}
+
+
+static
+VALUE
+r_image_width(VALUE self)
+{
+  return LONG2NUM(r_get_image(self)->width);
+}
+
+
+static
+VALUE
+r_image_height(VALUE self)
+{
+  return LONG2NUM(r_get_image(self)->height);
+}
+
+
+/*
+  call-seq:
+    image.pixels -> String
+
+  Returns a copy of the image's RGBA8 pixels, rows top to bottom.
+*/
+static
+VALUE
+r_image_pixels(VALUE self)
+{
+  const r_image_t *image = r_get_image(self);
+  return rb_str_new((const char *)image->pixels, image->width * image->height * 4);
+}
+
+
+/*
+  call-seq:
+    image[x, y] -> Integer
+
+  Returns the pixel at x, y as 0xRRGGBBAA.
+*/
+static
+VALUE
+r_image_aref(VALUE self, VALUE x_rb, VALUE y_rb)
+{
+  const r_image_t *image = r_get_image(self);
+  const long x = NUM2LONG(x_rb);
+  const long y = NUM2LONG(y_rb);
+  const uint8_t *pixel;
+
+  if (x < 0 || y < 0 || x >= image->width || y >= image->height) {
+    rb_raise(rb_eIndexError, "Pixel %ld, %ld is outside of the image", x, y);
+  }
+
+  pixel = image->pixels + (y * image->width + x) * 4;
+  return UINT2NUM(
+    ((uint32_t)pixel[0] << 24) | ((uint32_t)pixel[1] << 16) |
+    ((uint32_t)pixel[2] << 8) | (uint32_t)pixel[3]
+    );
+}
+
+
+/*=============================================================================
+|  Conversions                                                                |
+=============================================================================*/
+
+static
+uint8_t
+r_unorm8(float value)
+{
+  if (!(value > 0.0f)) {
+    return 0;
+  } else if (value >= 1.0f) {
+    return 255;
+  }
+  return (uint8_t)(value * 255.0f + 0.5f);
+}
+
+
+static
+long
+r_clamp_long(long value, long low, long high)
+{
+  return value < low ? low : (value > high ? high : value);
+}
+
+
+/* Reads the clip rect from an Array of [x, y, width, height] in pixels,
+   clamped to the image. nil clips to the whole image. */
+static
+r_clip_t
+r_get_clip(VALUE clip_rb, const r_image_t *image)
+{
+  r_clip_t clip = { 0, 0, image->width, image->height };
+
+  if (!NIL_P(clip_rb)) {
+    long x, y, width, height;
+    Check_Type(clip_rb, T_ARRAY);
+    if (RARRAY_LEN(clip_rb) != 4) {
+      rb_raise(rb_eArgError, "Clip must be [x, y, width, height]");
+    }
+    x = NUM2LONG(rb_ary_entry(clip_rb, 0));
+    y = NUM2LONG(rb_ary_entry(clip_rb, 1));
+    width = NUM2LONG(rb_ary_entry(clip_rb, 2));
+    height = NUM2LONG(rb_ary_entry(clip_rb, 3));
+    clip.left = r_clamp_long(x, 0, image->width);
+    clip.top = r_clamp_long(y, 0, image->height);
+    clip.right = r_clamp_long(x + (width > 0 ? width : 0), clip.left, image->width);
+    clip.bottom = r_clamp_long(y + (height > 0 ? height : 0), clip.top, image->height);
+  }
+
+  return clip;
+}
+
+
+/*
+  call-seq:
+    image.clear(r, g, b, a, clip = nil) -> image
+
+  Sets every pixel inside clip ([x, y, width, height], defaulting to the
+  whole image) to the given color, whose components are 0..1.
+*/
+static
+VALUE
+r_image_clear(int argc, VALUE *argv, VALUE self)
+{
+  r_image_t *image = r_get_image(self);
+  VALUE r_rb, g_rb, b_rb, a_rb, clip_rb;
+  r_clip_t clip;
+  uint8_t color[4];
+  long row;
+
+  rb_scan_args(argc, argv, "41", &r_rb, &g_rb, &b_rb, &a_rb, &clip_rb);
+  clip = r_get_clip(clip_rb, image);
+  color[0] = r_unorm8((float)NUM2DBL(r_rb));
+  color[1] = r_unorm8((float)NUM2DBL(g_rb));
+  color[2] = r_unorm8((float)NUM2DBL(b_rb));
+  color[3] = r_unorm8((float)NUM2DBL(a_rb));
+
+  for (row = clip.top; row < clip.bottom; ++row) {
+    uint8_t *pixel = image->pixels + (row * image->width + clip.left) * 4;
+    uint8_t *const end = image->pixels + (row * image->width + clip.right) * 4;
+    for (; pixel < end; pixel += 4) {
+      memcpy(pixel, color, 4);
+    }
+  }
+
+  return self;
+}
+
+
+/*=============================================================================
+|  Shading                                                                    |
+=============================================================================*/
+
+/* floorf without the libm call -- texcoords are far inside long's range */
+static
+float
+r_floor(float value)
+{
+  const float truncated = (float)(long)value;
+  return truncated > value ? truncated - 1.0f : truncated;
+}
+
+
+#if !R_SSE2
+
+/* Bilinear, edge-clamped sample of texture at u, v, as 0..1 floats. Matches
+   GL_LINEAR with GL_CLAMP_TO_EDGE: texel centers are at +0.5 and row 0 is
+   at v = 0. */
+static
+void
+r_sample(const r_image_t *texture, float u, float v, float out[4])
+{
+  const float tx = u * (float)texture->width - 0.5f;
+  const float ty = v * (float)texture->height - 0.5f;
+  const float fx0 = r_floor(tx);
+  const float fy0 = r_floor(ty);
+  const float ax = tx - fx0;
+  const float ay = ty - fy0;
+  const long max_x = texture->width - 1;
+  const long max_y = texture->height - 1;
+  const long x0 = r_clamp_long((long)fx0, 0, max_x);
+  const long x1 = r_clamp_long((long)fx0 + 1, 0, max_x);
+  const long y0 = r_clamp_long((long)fy0, 0, max_y);
+  const long y1 = r_clamp_long((long)fy0 + 1, 0, max_y);
+  const uint8_t *const t00 = texture->pixels + (y0 * texture->width + x0) * 4;
+  const uint8_t *const t10 = texture->pixels + (y0 * texture->width + x1) * 4;
+  const uint8_t *const t01 = texture->pixels + (y1 * texture->width + x0) * 4;
+  const uint8_t *const t11 = texture->pixels + (y1 * texture->width + x1) * 4;
+  int channel;
+
+  for (channel = 0; channel < 4; ++channel) {
+    const float top = t00[channel] + (t10[channel] - t00[channel]) * ax;
+    const float bottom = t01[channel] + (t11[channel] - t01[channel]) * ax;
+    out[channel] = (top + (bottom - top) * ay) * (1.0f / 255.0f);
+  }
+}
+
+#endif
+
+
+#if R_SSE2
+
+static
+__m128
+r_load_pixel(const uint8_t *pixel)
+{
+  int32_t packed;
+  __m128i wide;
+  memcpy(&packed, pixel, 4);
+  wide = _mm_cvtsi32_si128(packed);
+  wide = _mm_unpacklo_epi8(wide, _mm_setzero_si128());
+  wide = _mm_unpacklo_epi16(wide, _mm_setzero_si128());
+  return _mm_mul_ps(_mm_cvtepi32_ps(wide), _mm_set1_ps(1.0f / 255.0f));
+}
+
+
+static
+void
+r_store_pixel(uint8_t *pixel, __m128 color)
+{
+  __m128i wide;
+  int32_t packed;
+  color = _mm_min_ps(_mm_max_ps(color, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+  wide = _mm_cvtps_epi32(_mm_mul_ps(color, _mm_set1_ps(255.0f)));
+  wide = _mm_packs_epi32(wide, wide);
+  wide = _mm_packus_epi16(wide, wide);
+  packed = _mm_cvtsi128_si32(wide);
+  memcpy(pixel, &packed, 4);
+}
+
+
+/* SSE2 version of r_sample, returning the texel as a vector. */
+static
+__m128
+r_sample_sse2(const r_image_t *texture, float u, float v)
+{
+  const float tx = u * (float)texture->width - 0.5f;
+  const float ty = v * (float)texture->height - 0.5f;
+  const float fx0 = r_floor(tx);
+  const float fy0 = r_floor(ty);
+  const long max_x = texture->width - 1;
+  const long max_y = texture->height - 1;
+  const long x0 = r_clamp_long((long)fx0, 0, max_x);
+  const long x1 = r_clamp_long((long)fx0 + 1, 0, max_x);
+  const long y0 = r_clamp_long((long)fy0, 0, max_y) * texture->width;
+  const long y1 = r_clamp_long((long)fy0 + 1, 0, max_y) * texture->width;
+  const __m128 ax = _mm_set1_ps(tx - fx0);
+  const __m128 ay = _mm_set1_ps(ty - fy0);
+  const __m128 t00 = r_load_pixel(texture->pixels + (y0 + x0) * 4);
+  const __m128 t10 = r_load_pixel(texture->pixels + (y0 + x1) * 4);
+  const __m128 t01 = r_load_pixel(texture->pixels + (y1 + x0) * 4);
+  const __m128 t11 = r_load_pixel(texture->pixels + (y1 + x1) * 4);
+  const __m128 top = _mm_add_ps(t00, _mm_mul_ps(_mm_sub_ps(t10, t00), ax));
+  const __m128 bottom = _mm_add_ps(t01, _mm_mul_ps(_mm_sub_ps(t11, t01), ax));
+  return _mm_add_ps(top, _mm_mul_ps(_mm_sub_ps(bottom, top), ay));
+}
+
+
+/* dst = src * src.a + dst * (1 - src.a) */
+static
+void
+r_blend_pixel(uint8_t *pixel, __m128 src)
+{
+  __m128 alpha;
+  src = _mm_min_ps(_mm_max_ps(src, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+  alpha = _mm_shuffle_ps(src, src, _MM_SHUFFLE(3, 3, 3, 3));
+  r_store_pixel(
+    pixel,
+    _mm_add_ps(
+      _mm_mul_ps(src, alpha),
+      _mm_mul_ps(r_load_pixel(pixel), _mm_sub_ps(_mm_set1_ps(1.0f), alpha))
+      )
+    );
+}
+
+#endif
+
+
+/* Fills count pixels with color. Used for opaque, untextured, flat spans,
+   where blending leaves just the source color. */
+static
+void
+r_fill_span(uint8_t *pixel, long count, const float color[4])
+{
+  uint8_t packed[4];
+  long index = 0;
+
+  packed[0] = r_unorm8(color[0]);
+  packed[1] = r_unorm8(color[1]);
+  packed[2] = r_unorm8(color[2]);
+  packed[3] = r_unorm8(color[3]);
+
+#if R_SSE2
+  {
+    int32_t word;
+    __m128i quad;
+    memcpy(&word, packed, 4);
+    quad = _mm_set1_epi32(word);
+    for (; index + 4 <= count; index += 4) {
+      _mm_storeu_si128((__m128i *)(pixel + index * 4), quad);
+    }
+  }
+#endif
+
+  for (; index < count; ++index) {
+    memcpy(pixel + index * 4, packed, 4);
+  }
+}
+
+
+/* Shades and blends count pixels, starting with the given interpolated
+   color and texcoords and stepping them by the per-pixel deltas. */
+static
+void
+r_shade_span(
+  uint8_t *pixel, long count, const r_image_t *texture,
+  const float color[4], const float color_dx[4],
+  float u, float v, float u_dx, float v_dx
+  )
+{
+  long index;
+
+#if R_SSE2
+  __m128 frag_color = _mm_loadu_ps(color);
+  const __m128 frag_color_dx = _mm_loadu_ps(color_dx);
+
+  for (index = 0; index < count; ++index, pixel += 4) {
+    __m128 src = frag_color;
+    if (texture) {
+      src = _mm_mul_ps(src, r_sample_sse2(texture, u, v));
+    }
+    r_blend_pixel(pixel, src);
+    frag_color = _mm_add_ps(frag_color, frag_color_dx);
+    u += u_dx;
+    v += v_dx;
+  }
+#else
+  float texel[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+  float frag_color[4];
+  memcpy(frag_color, color, sizeof(frag_color));
+
+  for (index = 0; index < count; ++index, pixel += 4) {
+    float src[4];
+    float alpha;
+    int channel;
+    if (texture) {
+      r_sample(texture, u, v, texel);
+    }
+    for (channel = 0; channel < 4; ++channel) {
+      const float value = frag_color[channel] * texel[channel];
+      src[channel] = value < 0.0f ? 0.0f : (value > 1.0f ? 1.0f : value);
+    }
+    alpha = src[3];
+    for (channel = 0; channel < 4; ++channel) {
+      pixel[channel] = r_unorm8(
+        src[channel] * alpha + pixel[channel] * (1.0f / 255.0f) * (1.0f - alpha)
+        );
+      frag_color[channel] += color_dx[channel];
+    }
+    u += u_dx;
+    v += v_dx;
+  }
+#endif
+}
+
+
+/*=============================================================================
+|  Triangles                                                                  |
+=============================================================================*/
+
+typedef struct s_r_edge {
+  double a, b, c;     /* E(x, y) = a * x + b * y + c, positive inside */
+  int    top_left;    /* whether pixels exactly on the edge are inside */
+} r_edge_t;
+
+
+static
+r_edge_t
+r_make_edge(const r_vertex_t *from, const r_vertex_t *to)
+{
+  r_edge_t edge;
+  edge.a = (double)from->y - to->y;
+  edge.b = (double)to->x - from->x;
+  edge.c = (double)from->x * to->y - (double)from->y * to->x;
+  /* With y down and counter-clockwise-on-screen winding made positive, a
+     top edge is horizontal and runs right to left; a left edge runs down. */
+  edge.top_left = (edge.a == 0.0 && edge.b < 0.0) || edge.a > 0.0;
+  return edge;
+}
+
+
+static
+int
+r_edge_inside(const r_edge_t *edge, double x, double y)
+{
+  const double value = edge->a * x + edge->b * y + edge->c;
+  return value > 0.0 || (value == 0.0 && edge->top_left);
+}
+
+
+static
+void
+r_draw_triangle(
+  r_image_t *target, const r_image_t *texture, const r_clip_t *clip,
+  const r_vertex_t *v0, const r_vertex_t *v1, const r_vertex_t *v2
+  )
+{
+  r_edge_t edges[3];
+  double area;
+  double min_x, max_x, min_y, max_y;
+  long left, right, top, bottom, row;
+  float color_dx[4], color_dy[4], color_0[4];
+  float u_dx, u_dy, u_0, v_dx, v_dy, v_0;
+  int channel;
+
+  area = ((double)v1->x - v0->x) * ((double)v2->y - v0->y) -
+         ((double)v2->x - v0->x) * ((double)v1->y - v0->y);
+  if (area == 0.0 || isnan(area)) {
+    return;
+  }
+
+  /* No culling -- wind every triangle the same way */
+  if (area < 0.0) {
+    const r_vertex_t *swap = v1;
+    v1 = v2;
+    v2 = swap;
+    area = -area;
+  }
+
+  /* edges[i] is opposite vertex i */
+  edges[0] = r_make_edge(v1, v2);
+  edges[1] = r_make_edge(v2, v0);
+  edges[2] = r_make_edge(v0, v1);
+
+  min_x = fmin(v0->x, fmin(v1->x, v2->x));
+  max_x = fmax(v0->x, fmax(v1->x, v2->x));
+  min_y = fmin(v0->y, fmin(v1->y, v2->y));
+  max_y = fmax(v0->y, fmax(v1->y, v2->y));
+
+  left = min_x <= (double)clip->left ? clip->left : (long)floor(min_x);
+  right = max_x >= (double)clip->right ? clip->right : (long)ceil(max_x);
+  top = min_y <= (double)clip->top ? clip->top : (long)floor(min_y);
+  bottom = max_y >= (double)clip->bottom ? clip->bottom : (long)ceil(max_y);
+  if (left >= right || top >= bottom) {
+    return;
+  }
+
+  /* Attributes are affine in screen space: attr(x, y) = attr_0 + x * dx +
+     y * dy, from the barycentric weights E_i / area. */
+  for (channel = 0; channel < 4; ++channel) {
+    const double c0 = v0->color[channel], c1 = v1->color[channel], c2 = v2->color[channel];
+    color_dx[channel] = (float)((edges[0].a * c0 + edges[1].a * c1 + edges[2].a * c2) / area);
+    color_dy[channel] = (float)((edges[0].b * c0 + edges[1].b * c1 + edges[2].b * c2) / area);
+    color_0[channel] = (float)((edges[0].c * c0 + edges[1].c * c1 + edges[2].c * c2) / area);
+  }
+  u_dx = (float)((edges[0].a * v0->u + edges[1].a * v1->u + edges[2].a * v2->u) / area);
+  u_dy = (float)((edges[0].b * v0->u + edges[1].b * v1->u + edges[2].b * v2->u) / area);
+  u_0 = (float)((edges[0].c * v0->u + edges[1].c * v1->u + edges[2].c * v2->u) / area);
+  v_dx = (float)((edges[0].a * v0->v + edges[1].a * v1->v + edges[2].a * v2->v) / area);
+  v_dy = (float)((edges[0].b * v0->v + edges[1].b * v1->v + edges[2].b * v2->v) / area);
+  v_0 = (float)((edges[0].c * v0->v + edges[1].c * v1->v + edges[2].c * v2->v) / area);
+
+  const int flat = color_dx[0] == 0.0f && color_dx[1] == 0.0f &&
+                   color_dx[2] == 0.0f && color_dx[3] == 0.0f &&
+                   color_dy[0] == 0.0f && color_dy[1] == 0.0f &&
+                   color_dy[2] == 0.0f && color_dy[3] == 0.0f;
+
+  for (row = top; row < bottom; ++row) {
+    const double cy = (double)row + 0.5;
+    long span_left = left;
+    long span_right = right;
+    int edge_index;
+
+    /* Narrow the row to where each edge is inside, solving E = 0 for x and
+       then nudging the bounds so the exact edge test decides the pixels
+       next to them. */
+    for (edge_index = 0; edge_index < 3 && span_left < span_right; ++edge_index) {
+      const r_edge_t *edge = &edges[edge_index];
+      const double row_value = edge->b * cy + edge->c;
+
+      if (edge->a == 0.0) {
+        if (!r_edge_inside(edge, 0.0, cy)) {
+          span_right = span_left;
+        }
+        continue;
+      }
+
+      double cross = -row_value / edge->a - 0.5;
+      if (cross < (double)span_left - 1.0) {
+        cross = (double)span_left - 1.0;
+      } else if (cross > (double)span_right + 1.0) {
+        cross = (double)span_right + 1.0;
+      }
+
+      if (edge->a > 0.0) {
+        long start = (long)ceil(cross);
+        if (start < span_left) start = span_left;
+        while (start > span_left && r_edge_inside(edge, (double)start - 0.5, cy)) --start;
+        while (start < span_right && !r_edge_inside(edge, (double)start + 0.5, cy)) ++start;
+        span_left = start;
+      } else {
+        long end = (long)floor(cross) + 1;
+        if (end > span_right) end = span_right;
+        while (end < span_right && r_edge_inside(edge, (double)end + 0.5, cy)) ++end;
+        while (end > span_left && !r_edge_inside(edge, (double)end - 0.5, cy)) --end;
+        span_right = end;
+      }
+    }
+
+    if (span_left >= span_right) {
+      continue;
+    }
+
+    {
+      uint8_t *const pixel = target->pixels + (row * target->width + span_left) * 4;
+      const long count = span_right - span_left;
+      const float cx = (float)span_left + 0.5f;
+      const float fy = (float)cy;
+      float color[4];
+
+      for (channel = 0; channel < 4; ++channel) {
+        color[channel] = color_0[channel] + color_dx[channel] * cx + color_dy[channel] * fy;
+      }
+
+      if (!texture && flat && color[3] >= 1.0f) {
+        r_fill_span(pixel, count, color);
+      } else {
+        r_shade_span(
+          pixel, count, texture, color, color_dx,
+          u_0 + u_dx * cx + u_dy * fy, v_0 + v_dx * cx + v_dy * fy,
+          u_dx, v_dx
+          );
+      }
+    }
+  }
+}
+
+
+static
+void
+r_read_vertex(
+  r_vertex_t *out, const uint8_t *vertices, long index, const r_layout_t *layout,
+  float scale
+  )
+{
+  const uint8_t *const base = vertices + index * layout->stride;
+  float position[2];
+  float texcoord[2];
+
+  memcpy(position, base + layout->position, sizeof(position));
+  memcpy(texcoord, base + layout->texcoord, sizeof(texcoord));
+  memcpy(out->color, base + layout->color, sizeof(out->color));
+
+  out->x = position[0] * scale;
+  out->y = position[1] * scale;
+  out->u = texcoord[0];
+  out->v = texcoord[1];
+}
+
+
+/*
+  call-seq:
+    Raster.draw_triangles(target, texture, vertices_address, vertex_count,
+                          layout, faces_address, first_face, face_count,
+                          base_vertex, scale, clip) -> target
+
+  Draws face_count triangles, starting at first_face, from the uint16
+  index triples at faces_address into the target Image. Indices are relative
+  to base_vertex and must be less than vertex_count. layout is
+  [stride, position offset, texcoord offset, color offset] in bytes, each
+  attribute being floats. Positions are multiplied by scale to get pixels.
+  texture is an Image or nil for solid color, and clip is [x, y, width,
+  height] in pixels or nil.
+
+  The addresses come from the Driver's vertex and face arrays, which must
+  stay alive for the duration of the call.
+*/
+static
+VALUE
+r_rb_draw_triangles(
+  VALUE self, VALUE target_rb, VALUE texture_rb,
+  VALUE vertices_address_rb, VALUE vertex_count_rb, VALUE layout_rb,
+  VALUE faces_address_rb, VALUE first_face_rb, VALUE face_count_rb,
+  VALUE base_vertex_rb, VALUE scale_rb, VALUE clip_rb
+  )
+{
+  r_image_t *const target = r_get_image(target_rb);
+  const r_image_t *texture = NIL_P(texture_rb) ? NULL : r_get_image(texture_rb);
+  const uint8_t *const vertices = (const uint8_t *)NUM2SIZET(vertices_address_rb);
+  const long vertex_count = NUM2LONG(vertex_count_rb);
+  const uint16_t *const faces = (const uint16_t *)NUM2SIZET(faces_address_rb);
+  const long first_face = NUM2LONG(first_face_rb);
+  const long face_count = NUM2LONG(face_count_rb);
+  const long base_vertex = NUM2LONG(base_vertex_rb);
+  const float scale = (float)NUM2DBL(scale_rb);
+  const r_clip_t clip = r_get_clip(clip_rb, target);
+  r_layout_t layout;
+  long face;
+
+  (void)self;
+
+  Check_Type(layout_rb, T_ARRAY);
+  if (RARRAY_LEN(layout_rb) != 4) {
+    rb_raise(rb_eArgError, "Layout must be [stride, position, texcoord, color]");
+  }
+  layout.stride = NUM2LONG(rb_ary_entry(layout_rb, 0));
+  layout.position = NUM2LONG(rb_ary_entry(layout_rb, 1));
+  layout.texcoord = NUM2LONG(rb_ary_entry(layout_rb, 2));
+  layout.color = NUM2LONG(rb_ary_entry(layout_rb, 3));
+
+  if (face_count <= 0 || clip.left >= clip.right || clip.top >= clip.bottom) {
+    return target_rb;
+  } else if (!vertices || !faces || first_face < 0 || base_vertex < 0) {
+    rb_raise(rb_eArgError, "Invalid vertex or face data");
+  } else if (texture && (texture->width == 0 || texture->height == 0)) {
+    texture = NULL;
+  }
+
+  for (face = first_face; face < first_face + face_count; ++face) {
+    const uint16_t *const indices = faces + face * 3;
+    r_vertex_t corners[3];
+    int corner;
+
+    for (corner = 0; corner < 3; ++corner) {
+      const long index = base_vertex + indices[corner];
+      if (index >= vertex_count) {
+        rb_raise(rb_eIndexError, "Face %ld refers to vertex %ld of %ld",
+          face, index, vertex_count);
+      }
+      r_read_vertex(&corners[corner], vertices, index, &layout, scale);
+    }
+
+    r_draw_triangle(target, texture, &clip, &corners[0], &corners[1], &corners[2]);
+  }
+
+  return target_rb;
+}
+
+
+/*=============================================================================
+|  Init                                                                       |
+=============================================================================*/
+
+void
+Init_raster_ext(void)
+{
+  VALUE gui_module = rb_define_module("GUI");
+
+  r_raster_module = rb_define_module_under(gui_module, "Raster");
+  r_image_class = rb_define_class_under(r_raster_module, "Image", rb_cObject);
+
+  rb_define_alloc_func(r_image_class, r_image_alloc);
+  rb_define_method(r_image_class, "initialize", r_image_initialize, -1);
+  rb_define_method(r_image_class, "width", r_image_width, 0);
+  rb_define_method(r_image_class, "height", r_image_height, 0);
+  rb_define_method(r_image_class, "pixels", r_image_pixels, 0);
+  rb_define_method(r_image_class, "[]", r_image_aref, 2);
+  rb_define_method(r_image_class, "clear", r_image_clear, -1);
+
+  rb_define_singleton_method(r_raster_module, "draw_triangles", r_rb_draw_triangles, 11);
+
+  rb_define_const(r_raster_module, "SIMD", R_SSE2 ? rb_str_new_cstr("sse2") : Qnil);
+}
@@ -0,0 +1,1438 @@
+//  Copyright 2014 Noel Cower
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  ----------------------------------------------------------------------------
+//
+//  match.c
+//    Native selector matching.
+//
+//    A selector chain is compiled into a flat program of compounds and ops,
+//    allocated as a single block. Class, tag, and attribute checks produced by
+//    the parser are evaluated directly in C -- view subviews, superviews, and
+//    tags are read straight from their ivars and class names come out of a
+//    cache -- so matching a view doesn't go through a Ruby call per check.
+//    Checks the compiler doesn't recognize (hand-written checks, subclasses of
+//    the built-in checks) are still supported and just get sent #call.
+
+
+#include "ruby.h"
+#include "selector.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+/*=============================================================================
+|  Types and values                                                           |
+=============================================================================*/
+
+typedef enum e_qop_kind
+{
+  Q_OP_CLASS,
+  Q_OP_TAG,
+  Q_OP_ATTR,
+  Q_OP_CALL
+} qop_kind_t;
+
+
+/* Number of class -> result pairs remembered by each class op */
+#define Q_CLASS_MEMO_SIZE 4
+
+
+typedef struct s_qop
+{
+  qop_kind_t kind;
+  qoperator_t operator;
+  int is_string;
+  long num_ids;
+  /* class names for Q_OP_CLASS, key path for Q_OP_ATTR */
+  ID *ids;
+  /* tag for Q_OP_TAG, operand for Q_OP_ATTR, check for Q_OP_CALL */
+  VALUE value;
+  /* operand as an ID for Q_OP_ATTR string operands compared to classes */
+  ID operand_id;
+  /* Recently tested classes and whether they passed */
+  VALUE memo_class[Q_CLASS_MEMO_SIZE];
+  int memo_result[Q_CLASS_MEMO_SIZE];
+  int memo_next;
+} qop_t;
+
+
+typedef struct s_qcompound
+{
+  int direct;
+  long first_op;
+  long num_ops;
+} qcompound_t;
+
+
+struct s_qprogram
+{
+  VALUE selector;
+  long num_compounds;
+  qcompound_t *compounds;
+  long num_ops;
+  qop_t *ops;
+  long num_ids;
+  ID *ids;
+  /*
+    Index of the op in the last compound used to look up candidate views in
+    a ViewIndex -- its tag op if it has one, else its class op -- or -1
+  */
+  long index_op;
+  /* Identity Hash reused by leaf-first searches, and whether one is */
+  VALUE visited;
+  int visited_in_use;
+};
+
+
+typedef struct s_qsearch
+{
+  qprogram_t *program;
+  /* Qnil when only the first match is wanted */
+  VALUE results;
+  VALUE first;
+} qsearch_t;
+
+
+static ID q_id_ivar_subviews   = 0;
+static ID q_id_ivar_superview  = 0;
+static ID q_id_ivar_tag        = 0;
+static ID q_id_ivar_attributes = 0;
+static ID q_id_ivar_succ       = 0;
+static ID q_id_ivar_direct     = 0;
+static ID q_id_ivar_classnames = 0;
+static ID q_id_ivar_tagname    = 0;
+static ID q_id_ivar_key        = 0;
+static ID q_id_ivar_operator   = 0;
+static ID q_id_ivar_operand    = 0;
+static ID q_id_ivar_specialized_for = 0;
+static ID q_id_call            = 0;
+static ID q_id_include         = 0;
+static ID q_id_subviews        = 0;
+static ID q_id_superview       = 0;
+static ID q_id_gt              = 0;
+static ID q_id_ge              = 0;
+static ID q_id_lt              = 0;
+static ID q_id_le              = 0;
+static ID q_id_leaf_views      = 0;
+static ID q_id_view_index      = 0;
+static ID q_id_views_with_tag  = 0;
+static ID q_id_classes         = 0;
+static ID q_id_compare_by_identity = 0;
+
+/* Class -> Symbol of the class's name with any module prefix removed */
+static VALUE q_class_name_cache = Qnil;
+
+
+static LAZY_CLASS_DEF_UNDER(
+  q_compiled_selector_class,
+  q_gui_module(),
+  CompiledSelector,
+  rb_cObject
+  );
+
+
+
+/*=============================================================================
+|  Prototypes                                                                 |
+=============================================================================*/
+
+static void q_program_mark(void *ptr);
+static void q_program_free(void *ptr);
+static size_t q_program_size(const void *ptr);
+static qprogram_t *q_get_program(VALUE self);
+static qoperator_t q_operator_for(VALUE operator_sym);
+static void q_compile_check(qop_t *op, VALUE check, ID **ids);
+static void q_compile(VALUE self, VALUE selector);
+static VALUE q_view_superview(VALUE view);
+static int q_class_op_matches(qop_t *op, VALUE klass);
+static int q_compare(qoperator_t operator, VALUE value, VALUE operand);
+static int q_class_operand_matches(const qop_t *op, VALUE klass);
+static int q_attr_op_matches(const qop_t *op, VALUE view);
+static int q_op_matches(qop_t *op, VALUE view);
+static int q_compound_matches(const qprogram_t *program, long index, VALUE view);
+static int q_match_upwards(const qprogram_t *program, long index, VALUE view, VALUE root);
+static int q_search_report(qsearch_t *search, VALUE view);
+static int q_search(qsearch_t *search, VALUE root, VALUE view, long depth);
+static void q_search_leaf_first(qsearch_t *search, VALUE root);
+static long q_view_depth_under(VALUE view, VALUE root);
+static int q_view_precedes(VALUE view, long depth, VALUE other, long other_depth);
+static int q_search_indexed(qsearch_t *search, VALUE root);
+
+
+
+/*=============================================================================
+|  Program allocation                                                         |
+=============================================================================*/
+
+static const rb_data_type_t q_program_type = {
+  "GUI::CompiledSelector",
+  { q_program_mark, q_program_free, q_program_size, },
+  NULL, NULL,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+
+static
+void
+q_program_mark(void *ptr)
+{
+  const qprogram_t *program = (const qprogram_t *)ptr;
+  long op_index;
+  int memo_index;
+
+  if (!program) {
+    return;
+  }
+
+  rb_gc_mark(program->selector);
+  rb_gc_mark(program->visited);
+
+  for (op_index = 0; op_index < program->num_ops; ++op_index) {
+    const qop_t *op = &program->ops[op_index];
+    rb_gc_mark(op->value);
+    for (memo_index = 0; memo_index < Q_CLASS_MEMO_SIZE; ++memo_index) {
+      rb_gc_mark(op->memo_class[memo_index]);
+    }
+  }
+}
+
+
+static
+void
+q_program_free(void *ptr)
+{
+  /* compounds, ops, and IDs all live in the program's allocation */
+  xfree(ptr);
+}
+
+
+static
+size_t
+q_program_size(const void *ptr)
+{
+  const qprogram_t *program = (const qprogram_t *)ptr;
+  return program
+    ? sizeof(*program) +
+      sizeof(qcompound_t) * program->num_compounds +
+      sizeof(qop_t) * program->num_ops +
+      sizeof(ID) * program->num_ids
+    : 0;
+}
+
+
+static
+qprogram_t *
+q_get_program(VALUE self)
+{
+  qprogram_t *program;
+  TypedData_Get_Struct(self, qprogram_t, &q_program_type, program);
+  if (!program) {
+    rb_raise(rb_eRuntimeError, "Uninitialized compiled selector");
+  }
+  return program;
+}
+
+
+
+/*=============================================================================
+|  Compilation                                                                |
+=============================================================================*/
+
+static
+qoperator_t
+q_operator_for(VALUE operator_sym)
+{
+  ID operator = SYMBOL_P(operator_sym) ? SYM2ID(operator_sym) : 0;
+
+  if (operator == q_id_trueish) return Q_OPER_TRUEISH;
+  if (operator == q_id_falseish) return Q_OPER_FALSEISH;
+  if (operator == q_id_equal) return Q_OPER_EQUAL;
+  if (operator == q_id_not_equal) return Q_OPER_NOT_EQUAL;
+  if (operator == q_id_greater) return Q_OPER_GREATER;
+  if (operator == q_id_greater_equal) return Q_OPER_GREATER_EQUAL;
+  if (operator == q_id_lesser) return Q_OPER_LESSER;
+  if (operator == q_id_lesser_equal) return Q_OPER_LESSER_EQUAL;
+  if (operator == q_id_contains) return Q_OPER_CONTAINS;
+
+  rb_raise(rb_eArgError, "Invalid operator for ViewAttrCheck: %"PRIsVALUE,
+           rb_inspect(operator_sym));
+  return Q_OPER_TRUEISH;
+}
+
+
+/*
+  Whether klass is ViewAttrCheck or one of the subclasses generated for it in
+  checks.rb. Other subclasses may override #call, so they're left alone.
+*/
+static
+int
+q_is_attr_check_class(VALUE klass)
+{
+  if (klass == q_view_attr_check()) {
+    return 1;
+  }
+
+  return rb_class_superclass(klass) == q_view_attr_check() &&
+         RTEST(rb_attr_get(klass, q_id_ivar_specialized_for));
+}
+
+
+/*
+  Counts the IDs a check will need. Only instances of the built-in
+  checks are compiled -- anything else becomes a Q_OP_CALL.
+*/
+static
+long
+q_check_id_count(VALUE check)
+{
+  VALUE klass = rb_obj_class(check);
+  VALUE ids = Qnil;
+
+  if (klass == q_view_class_check()) {
+    ids = rb_ivar_get(check, q_id_ivar_classnames);
+  } else if (q_is_attr_check_class(klass)) {
+    ids = rb_ivar_get(check, q_id_ivar_key);
+  }
+
+  return RB_TYPE_P(ids, T_ARRAY) ? RARRAY_LEN(ids) : 0;
+}
+
+
+static
+void
+q_compile_ids(VALUE names, ID *ids)
+{
+  long index;
+  for (index = 0; index < RARRAY_LEN(names); ++index) {
+    ids[index] = rb_to_id(rb_ary_entry(names, index));
+  }
+}
+
+
+static
+void
+q_compile_check(qop_t *op, VALUE check, ID **ids)
+{
+  VALUE klass = rb_obj_class(check);
+  VALUE names;
+  int memo_index;
+
+  memset(op, 0, sizeof(*op));
+  op->value = Qnil;
+  for (memo_index = 0; memo_index < Q_CLASS_MEMO_SIZE; ++memo_index) {
+    op->memo_class[memo_index] = Qnil;
+  }
+
+  if (klass == q_view_class_check() &&
+      RB_TYPE_P((names = rb_ivar_get(check, q_id_ivar_classnames)), T_ARRAY)) {
+    op->kind = Q_OP_CLASS;
+    op->num_ids = RARRAY_LEN(names);
+    op->ids = *ids;
+    q_compile_ids(names, op->ids);
+    *ids += op->num_ids;
+  } else if (klass == q_view_tag_check()) {
+    op->kind = Q_OP_TAG;
+    op->value = rb_ivar_get(check, q_id_ivar_tagname);
+  } else if (q_is_attr_check_class(klass) &&
+             RB_TYPE_P((names = rb_ivar_get(check, q_id_ivar_key)), T_ARRAY)) {
+    op->kind = Q_OP_ATTR;
+    op->operator = q_operator_for(rb_ivar_get(check, q_id_ivar_operator));
+    op->value = rb_ivar_get(check, q_id_ivar_operand);
+    op->is_string = RB_TYPE_P(op->value, T_STRING);
+    op->operand_id = op->is_string ? rb_intern_str(op->value) : 0;
+    op->num_ids = RARRAY_LEN(names);
+    op->ids = *ids;
+    q_compile_ids(names, op->ids);
+    *ids += op->num_ids;
+  } else {
+    op->kind = Q_OP_CALL;
+    op->value = check;
+  }
+}
+
+
+/*
+  Compiles the selector chain into self. The program is attached to self
+  before any checks are compiled so that it's freed by the GC if compiling a
+  check raises; num_ops only counts the ops compiled so far for marking.
+*/
+static
+void
+q_compile(VALUE self, VALUE selector)
+{
+  qprogram_t *program;
+  VALUE compound;
+  VALUE attributes;
+  long num_compounds = 0;
+  long num_ops = 0;
+  long num_ids = 0;
+  long compound_index;
+  long attr_index;
+  ID *ids;
+  char *block;
+
+  /* Size everything up first so the program is a single allocation */
+  for (compound = selector;
+       !NIL_P(compound);
+       compound = rb_ivar_get(compound, q_id_ivar_succ)) {
+    if (!rb_obj_is_kind_of(compound, q_selector_class())) {
+      rb_raise(rb_eTypeError, "Expected a GUI::Selector, got %"PRIsVALUE,
+               rb_obj_class(compound));
+    }
+
+    attributes = rb_ivar_get(compound, q_id_ivar_attributes);
+    Check_Type(attributes, T_ARRAY);
+
+    ++num_compounds;
+    num_ops += RARRAY_LEN(attributes);
+    for (attr_index = 0; attr_index < RARRAY_LEN(attributes); ++attr_index) {
+      num_ids += q_check_id_count(rb_ary_entry(attributes, attr_index));
+    }
+  }
+
+  block = ZALLOC_N(char,
+    sizeof(qprogram_t) +
+    sizeof(qcompound_t) * num_compounds +
+    sizeof(qop_t) * num_ops +
+    sizeof(ID) * num_ids);
+
+  program = (qprogram_t *)block;
+  program->selector      = selector;
+  program->num_compounds = num_compounds;
+  program->compounds     = (qcompound_t *)(block + sizeof(qprogram_t));
+  program->num_ops       = 0;
+  program->ops           = (qop_t *)(program->compounds + num_compounds);
+  program->num_ids       = num_ids;
+  program->ids           = (ID *)(program->ops + num_ops);
+  program->visited       = Qnil;
+
+  DATA_PTR(self) = program;
+
+  ids = program->ids;
+  compound_index = 0;
+  for (compound = selector;
+       !NIL_P(compound);
+       compound = rb_ivar_get(compound, q_id_ivar_succ), ++compound_index) {
+    qcompound_t *out = &program->compounds[compound_index];
+
+    attributes = rb_ivar_get(compound, q_id_ivar_attributes);
+
+    out->direct   = RTEST(rb_ivar_get(compound, q_id_ivar_direct));
+    out->first_op = program->num_ops;
+    out->num_ops  = RARRAY_LEN(attributes);
+
+    for (attr_index = 0; attr_index < out->num_ops; ++attr_index) {
+      q_compile_check(
+        &program->ops[program->num_ops],
+        rb_ary_entry(attributes, attr_index),
+        &ids
+        );
+      ++program->num_ops;
+    }
+  }
+
+  program->index_op = -1;
+  if (num_compounds > 0) {
+    const qcompound_t *last = &program->compounds[num_compounds - 1];
+    long op_index;
+
+    for (op_index = last->first_op;
+         op_index < last->first_op + last->num_ops;
+         ++op_index) {
+      const qop_kind_t kind = program->ops[op_index].kind;
+      if (kind == Q_OP_TAG ||
+          (kind == Q_OP_CLASS && program->index_op == -1)) {
+        program->index_op = op_index;
+      }
+    }
+  }
+}
+
+
+
+/*=============================================================================
+|  View access                                                                |
+=============================================================================*/
+
+ID
+q_class_short_name(VALUE klass)
+{
+  VALUE name_sym = rb_hash_lookup2(q_class_name_cache, klass, Qundef);
+
+  if (name_sym == Qundef) {
+    VALUE name = rb_class_name(klass);
+    const char *chars = RSTRING_PTR(name);
+    long length = RSTRING_LEN(name);
+    long start = length;
+
+    while (start > 1 && !(chars[start - 1] == ':' && chars[start - 2] == ':')) {
+      --start;
+    }
+    if (start <= 1) {
+      start = 0;
+    }
+
+    name_sym = ID2SYM(rb_intern2(chars + start, length - start));
+    rb_hash_aset(q_class_name_cache, klass, name_sym);
+  }
+
+  return SYM2ID(name_sym);
+}
+
+
+VALUE
+q_view_subviews(VALUE view)
+{
+  VALUE subviews = rb_ivar_get(view, q_id_ivar_subviews);
+  if (!RB_TYPE_P(subviews, T_ARRAY)) {
+    subviews = rb_check_array_type(rb_funcall2(view, q_id_subviews, 0, NULL));
+  }
+  return subviews;
+}
+
+
+static
+VALUE
+q_view_superview(VALUE view)
+{
+  if (rb_ivar_defined(view, q_id_ivar_superview)) {
+    return rb_ivar_get(view, q_id_ivar_superview);
+  }
+  return rb_funcall2(view, q_id_superview, 0, NULL);
+}
+
+
+
+/*=============================================================================
+|  Evaluation                                                                 |
+=============================================================================*/
+
+static
+int
+q_class_op_matches(qop_t *op, VALUE klass)
+{
+  VALUE ancestor;
+  int memo_index;
+  int result = 0;
+  long id_index;
+
+  for (memo_index = 0; memo_index < Q_CLASS_MEMO_SIZE; ++memo_index) {
+    if (op->memo_class[memo_index] == klass) {
+      return op->memo_result[memo_index];
+    }
+  }
+
+  for (ancestor = klass;
+       !result && !NIL_P(ancestor);
+       ancestor = rb_class_superclass(ancestor)) {
+    ID name = q_class_short_name(ancestor);
+    for (id_index = 0; id_index < op->num_ids; ++id_index) {
+      if (op->ids[id_index] == name) {
+        result = 1;
+        break;
+      }
+    }
+  }
+
+  memo_index = op->memo_next;
+  op->memo_class[memo_index] = klass;
+  op->memo_result[memo_index] = result;
+  op->memo_next = (memo_index + 1) % Q_CLASS_MEMO_SIZE;
+
+  return result;
+}
+
+
+static
+int
+q_compare(qoperator_t operator, VALUE value, VALUE operand)
+{
+  ID msg = 0;
+
+  if (FIXNUM_P(value) && FIXNUM_P(operand)) {
+    long lhs = FIX2LONG(value);
+    long rhs = FIX2LONG(operand);
+    switch (operator) {
+    case Q_OPER_GREATER:       return lhs >  rhs;
+    case Q_OPER_GREATER_EQUAL: return lhs >= rhs;
+    case Q_OPER_LESSER:        return lhs <  rhs;
+    case Q_OPER_LESSER_EQUAL:  return lhs <= rhs;
+    default: break;
+    }
+  } else if (RB_FLOAT_TYPE_P(value) && RB_FLOAT_TYPE_P(operand)) {
+    double lhs = RFLOAT_VALUE(value);
+    double rhs = RFLOAT_VALUE(operand);
+    switch (operator) {
+    case Q_OPER_GREATER:       return lhs >  rhs;
+    case Q_OPER_GREATER_EQUAL: return lhs >= rhs;
+    case Q_OPER_LESSER:        return lhs <  rhs;
+    case Q_OPER_LESSER_EQUAL:  return lhs <= rhs;
+    default: break;
+    }
+  }
+
+  switch (operator) {
+  case Q_OPER_GREATER:       msg = q_id_gt; break;
+  case Q_OPER_GREATER_EQUAL: msg = q_id_ge; break;
+  case Q_OPER_LESSER:        msg = q_id_lt; break;
+  case Q_OPER_LESSER_EQUAL:  msg = q_id_le; break;
+  default: return 0;
+  }
+
+  return RTEST(rb_funcall2(value, msg, 1, &operand));
+}
+
+
+/* Mirrors ViewAttrCheck#class_check */
+static
+int
+q_class_operand_matches(const qop_t *op, VALUE klass)
+{
+  VALUE ancestor;
+
+  switch (op->operator) {
+  case Q_OPER_TRUEISH:
+    return 1;
+
+  case Q_OPER_EQUAL:
+  case Q_OPER_NOT_EQUAL:
+    for (ancestor = klass; !NIL_P(ancestor); ancestor = rb_class_superclass(ancestor)) {
+      if (q_class_short_name(ancestor) == op->operand_id) {
+        return op->operator == Q_OPER_EQUAL;
+      }
+    }
+    return op->operator == Q_OPER_NOT_EQUAL;
+
+  default:
+    return 0;
+  }
+}
+
+
+/* Mirrors ViewAttrCheck#call */
+static
+int
+q_attr_op_matches(const qop_t *op, VALUE view)
+{
+  VALUE value = view;
+  VALUE operand = op->value;
+  long id_index;
+
+  for (id_index = 0; id_index < op->num_ids; ++id_index) {
+    value = rb_funcall2(value, op->ids[id_index], 0, NULL);
+  }
+
+  if (op->is_string && !RB_TYPE_P(value, T_STRING)) {
+    /* Symbols compare to the operand's ID without building a String */
+    if (SYMBOL_P(value) &&
+        (op->operator == Q_OPER_EQUAL || op->operator == Q_OPER_NOT_EQUAL)) {
+      return (SYM2ID(value) == op->operand_id) == (op->operator == Q_OPER_EQUAL);
+    } else if (RB_TYPE_P(value, T_CLASS)) {
+      return q_class_operand_matches(op, value);
+    } else if (RB_TYPE_P(value, T_MODULE)) {
+      value = rb_sym2str(ID2SYM(q_class_short_name(value)));
+    } else if (rb_obj_is_kind_of(value, rb_mEnumerable)) {
+      if (op->operator != Q_OPER_CONTAINS) {
+        return 0;
+      }
+    } else {
+      value = rb_obj_as_string(value);
+    }
+  }
+
+  switch (op->operator) {
+  case Q_OPER_TRUEISH:   return RTEST(value);
+  case Q_OPER_FALSEISH:  return !RTEST(value);
+  case Q_OPER_EQUAL:     return RTEST(rb_equal(value, operand));
+  case Q_OPER_NOT_EQUAL: return !RTEST(rb_equal(value, operand));
+
+  case Q_OPER_GREATER:
+  case Q_OPER_GREATER_EQUAL:
+  case Q_OPER_LESSER:
+  case Q_OPER_LESSER_EQUAL:
+    return q_compare(op->operator, value, operand);
+
+  case Q_OPER_CONTAINS:
+    return rb_respond_to(value, q_id_include) &&
+           RTEST(rb_funcall2(value, q_id_include, 1, &operand));
+
+  case Q_OPER_COUNT:
+  default:
+    return 0;
+  }
+}
+
+
+static
+int
+q_op_matches(qop_t *op, VALUE view)
+{
+  switch (op->kind) {
+  case Q_OP_CLASS:
+    return q_class_op_matches(op, rb_obj_class(view));
+
+  case Q_OP_TAG: {
+    VALUE tag = rb_ivar_get(view, q_id_ivar_tag);
+    return tag == op->value || RTEST(rb_equal(tag, op->value));
+  }
+
+  case Q_OP_ATTR:
+    return q_attr_op_matches(op, view);
+
+  case Q_OP_CALL:
+    return RTEST(rb_funcall2(op->value, q_id_call, 1, &view));
+  }
+
+  return 0;
+}
+
+
+static
+int
+q_compound_matches(const qprogram_t *program, long index, VALUE view)
+{
+  const qcompound_t *compound = &program->compounds[index];
+  qop_t *op = &program->ops[compound->first_op];
+  qop_t *const end = op + compound->num_ops;
+
+  for (; op < end; ++op) {
+    if (!q_op_matches(op, view)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+/*
+  Given a view that matched compound `index`, returns whether its superviews
+  satisfy the compounds before it. Superviews above root are not considered
+  (pass Qnil to allow any superview).
+*/
+static
+int
+q_match_upwards(const qprogram_t *program, long index, VALUE view, VALUE root)
+{
+  const qcompound_t *parent;
+  VALUE above;
+
+  if (index == 0) {
+    return 1;
+  } else if (view == root) {
+    return 0;
+  }
+
+  parent = &program->compounds[index - 1];
+
+  for (above = q_view_superview(view);
+       !NIL_P(above);
+       above = q_view_superview(above)) {
+    if (q_compound_matches(program, index - 1, above) &&
+        q_match_upwards(program, index - 1, above, root)) {
+      return 1;
+    }
+
+    if (parent->direct || above == root) {
+      break;
+    }
+  }
+
+  return 0;
+}
+
+
+/* Returns non-zero if the search should stop */
+static
+int
+q_search_report(qsearch_t *search, VALUE view)
+{
+  if (NIL_P(search->results)) {
+    search->first = view;
+    return 1;
+  }
+
+  rb_ary_push(search->results, view);
+  return 0;
+}
+
+
+/*
+  Top-down search: walks the tree under root depth-first, testing each view
+  against the last compound and then its superviews against the ones before
+  it, so matches are found in depth-first order. Views shallower than the
+  chain's length can't match and aren't tested.
+*/
+static
+int
+q_search(qsearch_t *search, VALUE root, VALUE view, long depth)
+{
+  const qprogram_t *program = search->program;
+  const long last = program->num_compounds - 1;
+  VALUE subviews;
+  long subview_index;
+
+  if (depth >= last &&
+      q_compound_matches(program, last, view) &&
+      q_match_upwards(program, last, view, root) &&
+      q_search_report(search, view)) {
+    return 1;
+  }
+
+  subviews = q_view_subviews(view);
+  for (subview_index = 0;
+       !NIL_P(subviews) && subview_index < RARRAY_LEN(subviews);
+       ++subview_index) {
+    if (q_search(search, root, rb_ary_entry(subviews, subview_index), depth + 1)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+
+/* Visited tables larger than this aren't kept around after a search */
+#define Q_VISITED_RETAIN_LIMIT 4096
+
+
+/* A leaf-first search in progress (see q_search_leaf_first) */
+typedef struct s_qleaf_walk
+{
+  qsearch_t *search;
+  VALUE root;
+  /* Identity Hash of views already tested */
+  VALUE visited;
+} qleaf_walk_t;
+
+
+static
+VALUE
+q_ident_hash_new(void)
+{
+  VALUE hash = rb_hash_new();
+  rb_funcall2(hash, q_id_compare_by_identity, 0, NULL);
+  return hash;
+}
+
+
+static
+VALUE
+q_leaf_walk(VALUE walk_ptr)
+{
+  const qleaf_walk_t *walk = (const qleaf_walk_t *)walk_ptr;
+  qsearch_t *const search = walk->search;
+  const qprogram_t *program = search->program;
+  const long last = program->num_compounds - 1;
+  const VALUE root = walk->root;
+  const VALUE visited = walk->visited;
+  VALUE leaves = rb_check_array_type(rb_funcall2(root, q_id_leaf_views, 0, NULL));
+  long leaf_index;
+
+  for (leaf_index = 0;
+       !NIL_P(leaves) && leaf_index < RARRAY_LEN(leaves);
+       ++leaf_index) {
+    VALUE leaf = rb_ary_entry(leaves, leaf_index);
+    VALUE view = rb_struct_aref(leaf, INT2FIX(0));
+    long depth = NUM2LONG(rb_struct_aref(leaf, INT2FIX(1)));
+
+    if (depth < last) {
+      break;
+    }
+
+    for (; depth >= last && !NIL_P(view); --depth) {
+      if (RTEST(rb_hash_lookup2(visited, view, Qfalse))) {
+        break;
+      }
+      rb_hash_aset(visited, view, Qtrue);
+
+      if (q_compound_matches(program, last, view) &&
+          q_match_upwards(program, last, view, root) &&
+          q_search_report(search, view)) {
+        return Qnil;
+      }
+
+      view = q_view_superview(view);
+    }
+  }
+
+  RB_GC_GUARD(leaves);
+  return Qnil;
+}
+
+
+/* Empties the program's visited table once a search is done with it */
+static
+VALUE
+q_leaf_walk_done(VALUE walk_ptr)
+{
+  const qleaf_walk_t *walk = (const qleaf_walk_t *)walk_ptr;
+  qprogram_t *const program = walk->search->program;
+
+  if (RHASH_SIZE(walk->visited) > Q_VISITED_RETAIN_LIMIT) {
+    program->visited = Qnil;
+  } else {
+    rb_hash_clear(walk->visited);
+  }
+  program->visited_in_use = 0;
+
+  return Qnil;
+}
+
+
+/*
+  Leaf-first search: starts at root's leaf views (deepest first) and walks up
+  their superviews, testing each view against the last compound and then its
+  superviews against the ones before it. Each view is tested at most once.
+
+  A chain of N compounds can only match a view at depth N - 1 or below, so
+  leaves shallower than that are skipped entirely -- and since leaf_views is
+  sorted by descending depth, the search stops at the first one -- and walks
+  up stop before reaching depth N - 2.
+
+  Visited views are tracked in an identity Hash kept on the program and
+  emptied after each search, so searches don't allocate one each. A search
+  started while another is using it (from Ruby code run by a check, or from
+  another thread) gets a Hash of its own.
+*/
+static
+void
+q_search_leaf_first(qsearch_t *search, VALUE root)
+{
+  qprogram_t *const program = search->program;
+  qleaf_walk_t walk;
+
+  walk.search = search;
+  walk.root = root;
+
+  if (program->visited_in_use) {
+    walk.visited = q_ident_hash_new();
+    q_leaf_walk((VALUE)&walk);
+    RB_GC_GUARD(walk.visited);
+    return;
+  }
+
+  if (NIL_P(program->visited)) {
+    program->visited = q_ident_hash_new();
+  }
+  walk.visited = program->visited;
+  program->visited_in_use = 1;
+
+  rb_ensure(q_leaf_walk, (VALUE)&walk, q_leaf_walk_done, (VALUE)&walk);
+}
+
+
+
+/*
+  Most candidates q_search_indexed will test. Each costs a walk up to the root
+  to put it in tree order, so the index only beats walking the tree when a
+  tag or class is rare -- past this, the tree is walked instead.
+*/
+#define Q_INDEX_MAX_CANDIDATES 8
+
+
+/* Collects candidate views from a ViewIndex for q_search_indexed */
+typedef struct s_qindex_gather
+{
+  qop_t *op;
+  long count;
+  VALUE candidates[Q_INDEX_MAX_CANDIDATES];
+} qindex_gather_t;
+
+
+static
+int
+q_gather_views(VALUE view, VALUE value, VALUE gather_ptr)
+{
+  qindex_gather_t *gather = (qindex_gather_t *)gather_ptr;
+  (void)value;
+  if (gather->count == Q_INDEX_MAX_CANDIDATES) {
+    /* Too many -- count past the limit so the caller can tell */
+    ++gather->count;
+    return ST_STOP;
+  }
+  gather->candidates[gather->count++] = view;
+  return ST_CONTINUE;
+}
+
+
+static
+int
+q_gather_class_views(VALUE klass, VALUE views, VALUE gather_ptr)
+{
+  qindex_gather_t *gather = (qindex_gather_t *)gather_ptr;
+  if (RB_TYPE_P(views, T_HASH) && q_class_op_matches(gather->op, klass)) {
+    rb_hash_foreach(views, q_gather_views, gather_ptr);
+  }
+  return gather->count > Q_INDEX_MAX_CANDIDATES ? ST_STOP : ST_CONTINUE;
+}
+
+
+/*
+  Returns the number of superviews above view, or -1 if root isn't view or
+  one of them.
+*/
+static
+long
+q_view_depth_under(VALUE view, VALUE root)
+{
+  long depth = 0;
+  int under_root = view == root;
+
+  for (view = q_view_superview(view); !NIL_P(view); view = q_view_superview(view)) {
+    under_root = under_root || view == root;
+    ++depth;
+  }
+
+  return under_root ? depth : -1;
+}
+
+
+/*
+  Whether view comes before other in depth-first order. Both must be in the
+  same tree, at the given depths. Only walks up to the views' closest common
+  superview.
+*/
+static
+int
+q_view_precedes(VALUE view, long depth, VALUE other, long other_depth)
+{
+  VALUE above;
+  VALUE subviews;
+  long subview_index;
+
+  if (view == other) {
+    return 0;
+  }
+
+  /* Bring both up to the same depth -- an ancestor always comes first */
+  for (; depth > other_depth; --depth) {
+    view = q_view_superview(view);
+    if (view == other) {
+      return 0;
+    }
+  }
+
+  for (; other_depth > depth; --other_depth) {
+    other = q_view_superview(other);
+    if (other == view) {
+      return 1;
+    }
+  }
+
+  /* Then up until they're siblings, whose order decides it */
+  for (;;) {
+    above = q_view_superview(view);
+    if (above == q_view_superview(other)) {
+      break;
+    }
+    view = above;
+    other = q_view_superview(other);
+  }
+
+  if (NIL_P(above)) {
+    return 0;
+  }
+
+  subviews = q_view_subviews(above);
+  if (NIL_P(subviews)) {
+    return 0;
+  }
+
+  for (subview_index = 0; subview_index < RARRAY_LEN(subviews); ++subview_index) {
+    VALUE subview = rb_ary_entry(subviews, subview_index);
+    if (subview == view) {
+      return 1;
+    } else if (subview == other) {
+      return 0;
+    }
+  }
+
+  return 0;
+}
+
+
+/*
+  Indexed search: when the last compound has a tag or class check and root's
+  tree has a ViewIndex, only the views the index has for that tag or class
+  are tested (against the last compound and then upward, as with leaf-first
+  search). Matches are put in depth-first order before they're reported, so
+  results are the same as a top-down search's.
+
+  Returns zero without reporting anything if the index can't be used, in which
+  case the caller should fall back to another search. The index isn't used if
+  it has more than Q_INDEX_MAX_CANDIDATES views for the tag or class.
+*/
+static
+int
+q_search_indexed(qsearch_t *search, VALUE root)
+{
+  const qprogram_t *program = search->program;
+  const long last = program->num_compounds - 1;
+  qindex_gather_t gather;
+  VALUE matches[Q_INDEX_MAX_CANDIDATES];
+  long depths[Q_INDEX_MAX_CANDIDATES];
+  long num_matches = 0;
+  long candidate_index;
+  VALUE index;
+  qop_t *op;
+
+  if (program->index_op < 0) {
+    return 0;
+  }
+
+  index = rb_check_funcall(root, q_id_view_index, 0, NULL);
+  if (index == Qundef || NIL_P(index)) {
+    return 0;
+  }
+
+  op = &program->ops[program->index_op];
+  gather.op = op;
+  gather.count = 0;
+
+  if (op->kind == Q_OP_TAG) {
+    VALUE views = rb_funcall2(index, q_id_views_with_tag, 1, &op->value);
+    if (RB_TYPE_P(views, T_HASH)) {
+      rb_hash_foreach(views, q_gather_views, (VALUE)&gather);
+    }
+  } else {
+    VALUE classes = rb_funcall2(index, q_id_classes, 0, NULL);
+    if (!RB_TYPE_P(classes, T_HASH)) {
+      return 0;
+    }
+    rb_hash_foreach(classes, q_gather_class_views, (VALUE)&gather);
+  }
+
+  if (gather.count > Q_INDEX_MAX_CANDIDATES) {
+    return 0;
+  }
+
+  for (candidate_index = 0; candidate_index < gather.count; ++candidate_index) {
+    VALUE view = gather.candidates[candidate_index];
+    const long depth = q_view_depth_under(view, root);
+    long insert_at;
+
+    if (depth < 0 ||
+        !q_compound_matches(program, last, view) ||
+        !q_match_upwards(program, last, view, root)) {
+      continue;
+    }
+
+    /* Insertion sort into tree order -- there are only ever a few */
+    insert_at = num_matches;
+    while (insert_at > 0 &&
+           q_view_precedes(view, depth, matches[insert_at - 1], depths[insert_at - 1])) {
+      matches[insert_at] = matches[insert_at - 1];
+      depths[insert_at] = depths[insert_at - 1];
+      --insert_at;
+    }
+    matches[insert_at] = view;
+    depths[insert_at] = depth;
+    ++num_matches;
+  }
+
+  for (candidate_index = 0; candidate_index < num_matches; ++candidate_index) {
+    if (q_search_report(search, matches[candidate_index])) {
+      break;
+    }
+  }
+
+  return 1;
+}
+
+
+
+/*=============================================================================
+|  Program access                                                             |
+=============================================================================*/
+
+const qprogram_t *
+q_compiled_program(VALUE compiled)
+{
+  return q_get_program(compiled);
+}
+
+
+int
+q_program_matches(const qprogram_t *program, VALUE view, VALUE root)
+{
+  const long last = program->num_compounds - 1;
+  return last >= 0 &&
+         q_compound_matches(program, last, view) &&
+         q_match_upwards(program, last, view, root);
+}
+
+
+qkey_kind_t
+q_program_key(const qprogram_t *program, VALUE *tag, const ID **names, long *num_names)
+{
+  const qop_t *op;
+
+  if (program->index_op < 0) {
+    return Q_KEY_UNIVERSAL;
+  }
+
+  op = &program->ops[program->index_op];
+  if (op->kind == Q_OP_TAG) {
+    *tag = op->value;
+    return Q_KEY_TAG;
+  }
+
+  *names = op->ids;
+  *num_names = op->num_ids;
+  return Q_KEY_CLASS;
+}
+
+
+
+/*=============================================================================
+|  Ruby methods                                                               |
+=============================================================================*/
+
+static
+VALUE
+q_rb_compiled_alloc(VALUE klass)
+{
+  return TypedData_Wrap_Struct(klass, &q_program_type, NULL);
+}
+
+
+/*
+  call-seq:
+    new(selector) -> compiled_selector
+
+  Compiles a Selector chain. The compiled form keeps a reference to the chain
+  but does not notice changes made to it afterward.
+*/
+static
+VALUE
+q_rb_compiled_initialize(VALUE self, VALUE selector)
+{
+  if (DATA_PTR(self)) {
+    rb_raise(rb_eRuntimeError, "Compiled selector already initialized");
+  }
+
+  q_compile(self, selector);
+
+  return self;
+}
+
+
+/*
+  call-seq:
+    selector -> Selector
+
+  Returns the selector chain this was compiled from.
+*/
+static
+VALUE
+q_rb_compiled_selector(VALUE self)
+{
+  return q_get_program(self)->selector;
+}
+
+
+/*
+  call-seq:
+    length -> Integer
+
+  Returns the number of compound selectors in the chain.
+*/
+static
+VALUE
+q_rb_compiled_length(VALUE self)
+{
+  return LONG2NUM(q_get_program(self)->num_compounds);
+}
+
+
+/*
+  call-seq:
+    match?(view, root = nil) -> true or false
+
+  Returns whether view is matched by the last selector in the chain with its
+  superviews matching the selectors before it. If root is given, no views
+  above it are considered.
+*/
+static
+VALUE
+q_rb_compiled_match(int argc, VALUE *argv, VALUE self)
+{
+  const qprogram_t *program = q_get_program(self);
+  VALUE view;
+  VALUE root;
+  long last;
+
+  rb_scan_args(argc, argv, "11", &view, &root);
+
+  last = program->num_compounds - 1;
+  return (last >= 0 &&
+          q_compound_matches(program, last, view) &&
+          q_match_upwards(program, last, view, root))
+         ? Qtrue
+         : Qfalse;
+}
+
+
+/*
+  call-seq:
+    find_first(view) -> view or nil
+
+  Returns the first view (depth-first, including view itself) matched by the
+  selector chain. Uses view's ViewIndex where possible (see q_search_indexed).
+*/
+static
+VALUE
+q_rb_compiled_find_first(VALUE self, VALUE view)
+{
+  qsearch_t search;
+
+  search.program = q_get_program(self);
+  search.results = Qnil;
+  search.first   = Qnil;
+
+  if (search.program->num_compounds > 0 &&
+      !q_search_indexed(&search, view)) {
+    q_search(&search, view, view, 0);
+  }
+
+  return search.first;
+}
+
+
+/*
+  call-seq:
+    find_all(view) -> Array
+
+  Returns all views (including view itself) matched by the selector chain,
+  in depth-first order. Uses view's ViewIndex where possible.
+*/
+static
+VALUE
+q_rb_compiled_find_all(VALUE self, VALUE view)
+{
+  qsearch_t search;
+
+  search.program = q_get_program(self);
+  search.results = rb_ary_new();
+  search.first   = Qnil;
+
+  if (search.program->num_compounds > 0 &&
+      !q_search_indexed(&search, view)) {
+    q_search(&search, view, view, 0);
+  }
+
+  return search.results;
+}
+
+
+/*
+  call-seq:
+    find_first_from_leaves(view) -> view or nil
+
+  Returns the first view under and including view matched by the selector
+  chain, searching from view's deepest leaf views upward. The view returned
+  may differ from find_first's when more than one view matches.
+*/
+static
+VALUE
+q_rb_compiled_find_first_from_leaves(VALUE self, VALUE view)
+{
+  qsearch_t search;
+
+  search.program = q_get_program(self);
+  search.results = Qnil;
+  search.first   = Qnil;
+
+  if (search.program->num_compounds > 0) {
+    q_search_leaf_first(&search, view);
+  }
+
+  return search.first;
+}
+
+
+/*
+  call-seq:
+    find_all_from_leaves(view) -> Array
+
+  Returns all views under and including view matched by the selector chain,
+  searching from view's deepest leaf views upward. Views are returned in the
+  order they're found, which is deepest-branch first.
+*/
+static
+VALUE
+q_rb_compiled_find_all_from_leaves(VALUE self, VALUE view)
+{
+  qsearch_t search;
+
+  search.program = q_get_program(self);
+  search.results = rb_ary_new();
+  search.first   = Qnil;
+
+  if (search.program->num_compounds > 0) {
+    q_search_leaf_first(&search, view);
+  }
+
+  return search.results;
+}
+
+
+void
+q_init_match(void)
+{
+  VALUE klass = q_compiled_selector_class();
+
+  q_id_ivar_subviews   = rb_intern("@subviews");
+  q_id_ivar_superview  = rb_intern("@superview");
+  q_id_ivar_tag        = rb_intern("@tag");
+  q_id_ivar_attributes = rb_intern("@attributes");
+  q_id_ivar_succ       = rb_intern("@succ");
+  q_id_ivar_direct     = rb_intern("@direct");
+  q_id_ivar_classnames = rb_intern("@classnames");
+  q_id_ivar_tagname    = rb_intern("@tagname");
+  q_id_ivar_key        = rb_intern("@key");
+  q_id_ivar_operator   = rb_intern("@operator");
+  q_id_ivar_operand    = rb_intern("@operand");
+  q_id_ivar_specialized_for = rb_intern("@__specialized_for__");
+  q_id_call            = rb_intern("call");
+  q_id_include         = rb_intern("include?");
+  q_id_subviews        = rb_intern("subviews");
+  q_id_superview       = rb_intern("superview");
+  q_id_gt              = rb_intern(">");
+  q_id_ge              = rb_intern(">=");
+  q_id_lt              = rb_intern("<");
+  q_id_le              = rb_intern("<=");
+  q_id_leaf_views      = rb_intern("leaf_views");
+  q_id_view_index      = rb_intern("__view_index__");
+  q_id_views_with_tag  = rb_intern("views_with_tag");
+  q_id_classes         = rb_intern("classes");
+  q_id_compare_by_identity = rb_intern("compare_by_identity");
+
+  q_class_name_cache = rb_hash_new();
+  rb_gc_register_mark_object(q_class_name_cache);
+
+  rb_define_alloc_func(klass, q_rb_compiled_alloc);
+  rb_define_method(klass, "initialize", q_rb_compiled_initialize, 1);
+  rb_define_method(klass, "selector", q_rb_compiled_selector, 0);
+  rb_define_method(klass, "length", q_rb_compiled_length, 0);
+  rb_define_method(klass, "match?", q_rb_compiled_match, -1);
+  rb_define_method(klass, "find_first", q_rb_compiled_find_first, 1);
+  rb_define_method(klass, "find_all", q_rb_compiled_find_all, 1);
+  rb_define_method(klass, "find_first_from_leaves", q_rb_compiled_find_first_from_leaves, 1);
+  rb_define_method(klass, "find_all_from_leaves", q_rb_compiled_find_all_from_leaves, 1);
+}
@@ -0,0 +1,1115 @@
+//  Copyright 2014 Noel Cower
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  ----------------------------------------------------------------------------
+//
+//  pack.c
+//    Precompiled selector packs.
+//
+//    A pack is a binary file holding the parsed ASTs of a list of selector
+//    strings. Opening one maps the file and checks its header -- nothing else
+//    is read until a selector is asked for, at which point its AST is checked
+//    and turned into a Selector chain the same way the parser would. Packs can
+//    be looked up by index or by source string (through a hash table stored in
+//    the file), so opening a pack costs the same no matter how many selectors
+//    it holds.
+//
+//    Layout (all integers are 32-bit in the byte order of the machine that
+//    wrote the pack; sections start on 8-byte boundaries):
+//
+//      header      qpack_header_t
+//      selectors   qpack_selector_t[num_selectors]
+//      compounds   qpack_compound_t[num_compounds]
+//      checks      qpack_check_t[num_checks]
+//      names       qpack_name_t[num_names]
+//      hash        uint32_t[hash_size] -- selector indices, Q_PACK_EMPTY if unused
+//      pool        UTF-8 source strings, which all names and operands point into
+//
+//    Compound, check, and name indices in a selector are relative to that
+//    selector's first compound, check, and name. Offsets are relative to the
+//    start of the pool.
+
+
+#include "selector.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+/*=============================================================================
+|  Types and values                                                           |
+=============================================================================*/
+
+#define Q_PACK_MAGIC      "GUISELPK"
+#define Q_PACK_VERSION    1
+#define Q_PACK_BYTE_ORDER 0x01020304u
+#define Q_PACK_EMPTY      UINT32_MAX
+#define Q_PACK_ALIGN      8
+
+
+typedef struct s_qpack_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+
+  uint32_t num_selectors;
+  uint32_t num_compounds;
+  uint32_t num_checks;
+  uint32_t num_names;
+  uint32_t hash_size;
+  uint32_t pool_size;
+
+  uint32_t selectors_offset;
+  uint32_t compounds_offset;
+  uint32_t checks_offset;
+  uint32_t names_offset;
+  uint32_t hash_offset;
+  uint32_t pool_offset;
+} qpack_header_t;
+
+
+typedef struct s_qpack_selector
+{
+  uint32_t source_offset;
+  uint32_t source_length;
+  uint32_t first_compound;
+  uint32_t num_compounds;
+  uint32_t first_check;
+  uint32_t num_checks;
+  uint32_t first_name;
+  uint32_t num_names;
+} qpack_selector_t;
+
+
+typedef struct s_qpack_compound
+{
+  uint32_t first_check;
+  uint32_t num_checks;
+  uint32_t direct;
+  uint32_t reserved;
+} qpack_compound_t;
+
+
+typedef struct s_qpack_check
+{
+  uint8_t kind;
+  uint8_t operator;
+  uint8_t operand_kind;
+  uint8_t escaped;
+  uint32_t name_offset;
+  uint32_t name_length;
+  uint32_t first_name;
+  uint32_t num_names;
+  uint32_t operand_offset;
+  uint32_t operand_length;
+} qpack_check_t;
+
+
+typedef struct s_qpack_name
+{
+  uint32_t offset;
+  uint32_t length;
+} qpack_name_t;
+
+
+typedef struct s_qpack
+{
+  const char *data;
+  size_t size;
+  int mapped;
+
+  const qpack_header_t *header;
+  const qpack_selector_t *selectors;
+  const qpack_compound_t *compounds;
+  const qpack_check_t *checks;
+  const qpack_name_t *names;
+  const uint32_t *hash;
+  const char *pool;
+
+  VALUE path;
+  /* Selectors built so far, by index */
+  VALUE selectors_cache;
+
+  /*
+    Number of selectors being built from the pack. Building calls into Ruby,
+    which may close the pack, so closing only unmaps it once this is zero --
+    until then, close_pending is set.
+  */
+  int busy;
+  int close_pending;
+} qpack_t;
+
+
+/* Arguments to q_rb_pack_build_body */
+typedef struct s_qpack_build
+{
+  qpack_t *pack;
+  long index;
+} qpack_build_t;
+
+
+/* Sections of a pack being written, each kept in a binary String */
+typedef struct s_qpack_writer
+{
+  VALUE selectors;
+  VALUE compounds;
+  VALUE checks;
+  VALUE names;
+  VALUE hashes;
+  VALUE pool;
+  uint32_t num_selectors;
+  uint32_t num_compounds;
+  uint32_t num_checks;
+  uint32_t num_names;
+} qpack_writer_t;
+
+
+static ID q_id_freeze = 0;
+
+
+static LAZY_CLASS_DEF_UNDER(
+  q_selector_pack_class,
+  q_gui_module(),
+  SelectorPack,
+  rb_cObject
+  );
+
+
+
+/*=============================================================================
+|  Prototypes                                                                 |
+=============================================================================*/
+
+static void q_pack_mark(void *ptr);
+static void q_pack_free(void *ptr);
+static size_t q_pack_size(const void *ptr);
+static void q_pack_unmap(qpack_t *pack);
+static qpack_t *q_get_pack(VALUE self);
+static VALUE q_pack_format_error(void);
+static uint32_t q_pack_hash(const char *chars, long length);
+static uint32_t q_pack_offset(VALUE section, const char *what);
+static void q_pack_cat_aligned(VALUE out, VALUE section);
+static VALUE q_pack_write_ast(const qast_t *ast, VALUE source, void *context);
+static int q_pack_section_ok(const qpack_t *pack, uint32_t offset, uint32_t count, size_t size);
+static int q_pack_slice_ok(const qpack_t *pack, uint32_t offset, uint32_t length);
+static int q_pack_text_ok(const qpack_t *pack, uint32_t offset, uint32_t length);
+static long q_pack_lookup(const qpack_t *pack, VALUE source);
+static VALUE q_pack_build(qpack_t *pack, long index);
+static VALUE q_rb_pack_build_body(VALUE build_ptr);
+static VALUE q_rb_pack_build_ensure(VALUE build_ptr);
+
+
+
+/*=============================================================================
+|  Pack allocation                                                            |
+=============================================================================*/
+
+static const rb_data_type_t q_pack_type = {
+  "GUI::SelectorPack",
+  { q_pack_mark, q_pack_free, q_pack_size, },
+  NULL, NULL,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+
+static
+void
+q_pack_mark(void *ptr)
+{
+  const qpack_t *pack = (const qpack_t *)ptr;
+  rb_gc_mark(pack->path);
+  rb_gc_mark(pack->selectors_cache);
+}
+
+
+static
+void
+q_pack_free(void *ptr)
+{
+  qpack_t *pack = (qpack_t *)ptr;
+  q_pack_unmap(pack);
+  xfree(pack);
+}
+
+
+static
+size_t
+q_pack_size(const void *ptr)
+{
+  const qpack_t *pack = (const qpack_t *)ptr;
+  /* Mapped packs are backed by the file, not the heap */
+  return sizeof(*pack) + (pack->mapped ? 0 : pack->size);
+}
+
+
+static
+void
+q_pack_unmap(qpack_t *pack)
+{
+  if (pack->data) {
+#ifdef HAVE_SYS_MMAN_H
+    if (pack->mapped) {
+      munmap((void *)pack->data, pack->size);
+    } else
+#endif
+    {
+      xfree((void *)pack->data);
+    }
+  }
+
+  pack->data   = NULL;
+  pack->size   = 0;
+  pack->mapped = 0;
+  pack->header = NULL;
+  pack->close_pending = 0;
+}
+
+
+static
+qpack_t *
+q_get_pack(VALUE self)
+{
+  qpack_t *pack;
+  TypedData_Get_Struct(self, qpack_t, &q_pack_type, pack);
+  if (!pack->header) {
+    rb_raise(rb_eIOError, "Selector pack is closed");
+  }
+  return pack;
+}
+
+
+static
+VALUE
+q_pack_format_error(void)
+{
+  return rb_const_get(q_selector_pack_class(), rb_intern("FormatError"));
+}
+
+
+/* FNV-1a */
+static
+uint32_t
+q_pack_hash(const char *chars, long length)
+{
+  uint32_t hash = 2166136261u;
+  long index;
+  for (index = 0; index < length; ++index) {
+    hash ^= (unsigned char)chars[index];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+
+
+/*=============================================================================
+|  Writing                                                                    |
+=============================================================================*/
+
+static
+uint32_t
+q_pack_offset(VALUE section, const char *what)
+{
+  const long length = RSTRING_LEN(section);
+  if ((unsigned long)length >= Q_PACK_EMPTY) {
+    rb_raise(rb_eArgError, "Too many %s for a selector pack", what);
+  }
+  return (uint32_t)length;
+}
+
+
+static
+void
+q_pack_cat_aligned(VALUE out, VALUE section)
+{
+  static const char padding[Q_PACK_ALIGN] = { 0 };
+  const long misalignment = RSTRING_LEN(out) % Q_PACK_ALIGN;
+
+  if (misalignment) {
+    rb_str_cat(out, padding, Q_PACK_ALIGN - misalignment);
+  }
+  rb_str_cat(out, RSTRING_PTR(section), RSTRING_LEN(section));
+}
+
+
+static
+VALUE
+q_pack_write_ast(const qast_t *ast, VALUE source, void *context)
+{
+  qpack_writer_t *writer = (qpack_writer_t *)context;
+  const char *const source_chars = RSTRING_PTR(source);
+  const uint32_t source_offset = q_pack_offset(writer->pool, "source characters");
+  qpack_selector_t selector;
+  uint32_t hash;
+  long index;
+
+#define Q_POOL_OFFSET(CHARS) (source_offset + (uint32_t)((CHARS) - source_chars))
+
+  rb_str_cat(writer->pool, source_chars, RSTRING_LEN(source));
+  q_pack_offset(writer->pool, "source characters");
+
+  selector.source_offset  = source_offset;
+  selector.source_length  = (uint32_t)RSTRING_LEN(source);
+  selector.first_compound = writer->num_compounds;
+  selector.num_compounds  = (uint32_t)ast->num_compounds;
+  selector.first_check    = writer->num_checks;
+  selector.num_checks     = (uint32_t)ast->num_checks;
+  selector.first_name     = writer->num_names;
+  selector.num_names      = (uint32_t)ast->num_names;
+
+  for (index = 0; index < ast->num_compounds; ++index) {
+    const qast_compound_t *compound = &ast->compounds[index];
+    qpack_compound_t out;
+
+    out.first_check = (uint32_t)compound->first_check;
+    out.num_checks  = (uint32_t)compound->num_checks;
+    out.direct      = compound->direct ? 1 : 0;
+    out.reserved    = 0;
+    rb_str_cat(writer->compounds, (const char *)&out, sizeof(out));
+  }
+
+  for (index = 0; index < ast->num_checks; ++index) {
+    const qast_check_t *check = &ast->checks[index];
+    qpack_check_t out;
+
+    memset(&out, 0, sizeof(out));
+    out.kind         = (uint8_t)check->kind;
+    out.first_name   = (uint32_t)check->first_name;
+    out.num_names    = (uint32_t)check->num_names;
+
+    /* The parser only fills in the fields each kind of check uses */
+    if (check->kind != Q_CHECK_CLASS) {
+      out.name_offset = Q_POOL_OFFSET(check->name.chars);
+      out.name_length = (uint32_t)check->name.length;
+    }
+
+    if (check->kind == Q_CHECK_ATTR) {
+      out.operator     = (uint8_t)check->operator;
+      out.operand_kind = (uint8_t)check->operand_kind;
+
+      if (check->operand_kind != Q_OPERAND_NONE) {
+        out.escaped        = check->escaped ? 1 : 0;
+        out.operand_offset = Q_POOL_OFFSET(check->operand.chars);
+        out.operand_length = (uint32_t)check->operand.length;
+      }
+    }
+
+    rb_str_cat(writer->checks, (const char *)&out, sizeof(out));
+  }
+
+  for (index = 0; index < ast->num_names; ++index) {
+    qpack_name_t out;
+    out.offset = Q_POOL_OFFSET(ast->names[index].chars);
+    out.length = (uint32_t)ast->names[index].length;
+    rb_str_cat(writer->names, (const char *)&out, sizeof(out));
+  }
+
+#undef Q_POOL_OFFSET
+
+  hash = q_pack_hash(source_chars, RSTRING_LEN(source));
+  rb_str_cat(writer->selectors, (const char *)&selector, sizeof(selector));
+  rb_str_cat(writer->hashes, (const char *)&hash, sizeof(hash));
+
+  writer->num_selectors += 1;
+  writer->num_compounds += selector.num_compounds;
+  writer->num_checks    += selector.num_checks;
+  writer->num_names     += selector.num_names;
+
+  return Qnil;
+}
+
+
+/*
+  call-seq:
+    compile(sources) -> String
+
+  Parses each selector string in sources and returns a binary String holding
+  a pack of them, in the same order. Sources are converted to UTF-8 first.
+  Raises if any source fails to parse.
+*/
+static
+VALUE
+q_rb_pack_compile(VALUE self, VALUE sources)
+{
+  qpack_writer_t writer;
+  qpack_header_t header;
+  VALUE hash_table;
+  VALUE out;
+  uint32_t *hashes;
+  uint32_t *table;
+  uint32_t hash_size;
+  uint32_t index;
+  long source_index;
+
+  (void)self;
+
+  sources = rb_Array(sources);
+
+  memset(&writer, 0, sizeof(writer));
+  writer.selectors = rb_str_buf_new(0);
+  writer.compounds = rb_str_buf_new(0);
+  writer.checks    = rb_str_buf_new(0);
+  writer.names     = rb_str_buf_new(0);
+  writer.hashes    = rb_str_buf_new(0);
+  writer.pool      = rb_str_buf_new(0);
+
+  for (source_index = 0; source_index < RARRAY_LEN(sources); ++source_index) {
+    VALUE source = rb_ary_entry(sources, source_index);
+    StringValue(source);
+    source = rb_str_conv_enc(source, rb_enc_get(source), rb_utf8_encoding());
+    q_parse_ast(source, q_pack_write_ast, &writer);
+  }
+
+  if (writer.num_selectors > (Q_PACK_EMPTY >> 2)) {
+    rb_raise(rb_eArgError, "Too many selectors for a selector pack");
+  }
+
+  /* Open addressing, at most half full */
+  hash_size = 0;
+  if (writer.num_selectors) {
+    hash_size = 1;
+    while (hash_size < writer.num_selectors * 2) {
+      hash_size <<= 1;
+    }
+  }
+
+  hash_table = rb_str_new(NULL, (long)hash_size * sizeof(uint32_t));
+  table = (uint32_t *)RSTRING_PTR(hash_table);
+  hashes = (uint32_t *)RSTRING_PTR(writer.hashes);
+  memset(table, 0xFF, (size_t)hash_size * sizeof(uint32_t));
+
+  for (index = 0; index < writer.num_selectors; ++index) {
+    const qpack_selector_t *selector =
+      &((const qpack_selector_t *)RSTRING_PTR(writer.selectors))[index];
+    const char *source = RSTRING_PTR(writer.pool) + selector->source_offset;
+    uint32_t slot = hashes[index] & (hash_size - 1);
+
+    for (;; slot = (slot + 1) & (hash_size - 1)) {
+      const uint32_t other_index = table[slot];
+      const qpack_selector_t *other;
+
+      if (other_index == Q_PACK_EMPTY) {
+        table[slot] = index;
+        break;
+      }
+
+      /* Duplicate sources resolve to the first of them */
+      other = &((const qpack_selector_t *)RSTRING_PTR(writer.selectors))[other_index];
+      if (other->source_length == selector->source_length &&
+          memcmp(RSTRING_PTR(writer.pool) + other->source_offset,
+                 source, selector->source_length) == 0) {
+        break;
+      }
+    }
+  }
+
+  out = rb_str_buf_new(sizeof(header));
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, Q_PACK_MAGIC, sizeof(header.magic));
+  header.version       = Q_PACK_VERSION;
+  header.byte_order    = Q_PACK_BYTE_ORDER;
+  header.num_selectors = writer.num_selectors;
+  header.num_compounds = writer.num_compounds;
+  header.num_checks    = writer.num_checks;
+  header.num_names     = writer.num_names;
+  header.hash_size     = hash_size;
+  header.pool_size     = (uint32_t)RSTRING_LEN(writer.pool);
+  rb_str_cat(out, (const char *)&header, sizeof(header));
+
+#define Q_WRITE_SECTION(FIELD, SECTION) do {                  \
+    q_pack_cat_aligned(out, (SECTION));                       \
+    header.FIELD = (uint32_t)(RSTRING_LEN(out) - RSTRING_LEN(SECTION)); \
+  } while (0)
+
+  Q_WRITE_SECTION(selectors_offset, writer.selectors);
+  Q_WRITE_SECTION(compounds_offset, writer.compounds);
+  Q_WRITE_SECTION(checks_offset, writer.checks);
+  Q_WRITE_SECTION(names_offset, writer.names);
+  Q_WRITE_SECTION(hash_offset, hash_table);
+  Q_WRITE_SECTION(pool_offset, writer.pool);
+
+#undef Q_WRITE_SECTION
+
+  q_pack_offset(out, "selectors");
+  memcpy(RSTRING_PTR(out), &header, sizeof(header));
+
+  RB_GC_GUARD(sources);
+  RB_GC_GUARD(hash_table);
+  RB_GC_GUARD(writer.selectors);
+  RB_GC_GUARD(writer.compounds);
+  RB_GC_GUARD(writer.checks);
+  RB_GC_GUARD(writer.names);
+  RB_GC_GUARD(writer.hashes);
+  RB_GC_GUARD(writer.pool);
+
+  return out;
+}
+
+
+
+/*=============================================================================
+|  Loading                                                                    |
+=============================================================================*/
+
+static
+int
+q_pack_section_ok(const qpack_t *pack, uint32_t offset, uint32_t count, size_t size)
+{
+  return offset % sizeof(uint32_t) == 0 &&
+         (uint64_t)offset + (uint64_t)count * size <= pack->size;
+}
+
+
+static
+int
+q_pack_slice_ok(const qpack_t *pack, uint32_t offset, uint32_t length)
+{
+  return (uint64_t)offset + length <= pack->header->pool_size;
+}
+
+
+/* Whether a slice of the pool is in bounds and valid UTF-8. Names are
+   interned, which raises an EncodingError for broken strings, so they're
+   checked before building anything from them. */
+static
+int
+q_pack_text_ok(const qpack_t *pack, uint32_t offset, uint32_t length)
+{
+  rb_encoding *const utf8 = rb_utf8_encoding();
+  const char *chars;
+  const char *end;
+
+  if (!q_pack_slice_ok(pack, offset, length)) {
+    return 0;
+  }
+
+  chars = pack->pool + offset;
+  end = chars + length;
+  while (chars < end) {
+    int char_length;
+
+    if ((unsigned char)*chars < 0x80) {
+      ++chars;
+      continue;
+    }
+
+    char_length = rb_enc_precise_mbclen(chars, end, utf8);
+    if (!MBCLEN_CHARFOUND_P(char_length)) {
+      return 0;
+    }
+    chars += MBCLEN_CHARFOUND_LEN(char_length);
+  }
+
+  return 1;
+}
+
+
+static
+VALUE
+q_rb_pack_alloc(VALUE klass)
+{
+  qpack_t *pack;
+  VALUE self = TypedData_Make_Struct(klass, qpack_t, &q_pack_type, pack);
+  pack->path = Qnil;
+  pack->selectors_cache = Qnil;
+  return self;
+}
+
+
+/*
+  call-seq:
+    new(path) -> selector_pack
+
+  Opens a selector pack written by SelectorPack.compile. The file is mapped
+  into memory where possible and only its header is read. Raises
+  SelectorPack::FormatError if the file isn't a pack this version can read.
+*/
+static
+VALUE
+q_rb_pack_initialize(VALUE self, VALUE path)
+{
+  qpack_t *pack;
+  const qpack_header_t *header;
+  const char *c_path;
+
+  TypedData_Get_Struct(self, qpack_t, &q_pack_type, pack);
+  if (pack->header || pack->busy) {
+    rb_raise(rb_eRuntimeError, "Selector pack already opened");
+  }
+
+  FilePathValue(path);
+  path = rb_str_new_frozen(path);
+  c_path = StringValueCStr(path);
+
+#ifdef HAVE_SYS_MMAN_H
+  {
+    struct stat info;
+    void *data;
+    int fd = open(c_path, O_RDONLY);
+
+    if (fd == -1) {
+      rb_sys_fail(c_path);
+    }
+
+    if (fstat(fd, &info) == -1) {
+      close(fd);
+      rb_sys_fail(c_path);
+    }
+
+    if ((size_t)info.st_size < sizeof(qpack_header_t)) {
+      close(fd);
+      rb_raise(q_pack_format_error(), "%s is too small to be a selector pack", c_path);
+    }
+
+    data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+      rb_sys_fail(c_path);
+    }
+
+    pack->data   = (const char *)data;
+    pack->size   = (size_t)info.st_size;
+    pack->mapped = 1;
+  }
+#else
+  {
+    VALUE contents = rb_funcall(rb_cFile, rb_intern("binread"), 1, path);
+    char *data;
+
+    if ((size_t)RSTRING_LEN(contents) < sizeof(qpack_header_t)) {
+      rb_raise(q_pack_format_error(), "%s is too small to be a selector pack", c_path);
+    }
+
+    data = ALLOC_N(char, RSTRING_LEN(contents));
+    memcpy(data, RSTRING_PTR(contents), RSTRING_LEN(contents));
+    pack->data   = data;
+    pack->size   = (size_t)RSTRING_LEN(contents);
+    pack->mapped = 0;
+  }
+#endif
+
+  header = (const qpack_header_t *)pack->data;
+
+  if (memcmp(header->magic, Q_PACK_MAGIC, sizeof(header->magic)) != 0) {
+    q_pack_unmap(pack);
+    rb_raise(q_pack_format_error(), "%s is not a selector pack", c_path);
+  } else if (header->byte_order != Q_PACK_BYTE_ORDER) {
+    q_pack_unmap(pack);
+    rb_raise(q_pack_format_error(), "%s was written with a different byte order", c_path);
+  } else if (header->version != Q_PACK_VERSION) {
+    const unsigned version = header->version;
+    q_pack_unmap(pack);
+    rb_raise(q_pack_format_error(),
+             "%s is a version %u selector pack (expected version %u)",
+             c_path, version, Q_PACK_VERSION);
+  }
+
+  pack->header = header;
+
+  if (!q_pack_section_ok(pack, header->selectors_offset, header->num_selectors, sizeof(qpack_selector_t)) ||
+      !q_pack_section_ok(pack, header->compounds_offset, header->num_compounds, sizeof(qpack_compound_t)) ||
+      !q_pack_section_ok(pack, header->checks_offset, header->num_checks, sizeof(qpack_check_t)) ||
+      !q_pack_section_ok(pack, header->names_offset, header->num_names, sizeof(qpack_name_t)) ||
+      !q_pack_section_ok(pack, header->hash_offset, header->hash_size, sizeof(uint32_t)) ||
+      !q_pack_section_ok(pack, header->pool_offset, header->pool_size, 1) ||
+      (header->hash_size & (header->hash_size - 1)) != 0 ||
+      (header->num_selectors && header->hash_size == 0)) {
+    q_pack_unmap(pack);
+    rb_raise(q_pack_format_error(), "%s is truncated or corrupt", c_path);
+  }
+
+  pack->selectors = (const qpack_selector_t *)(pack->data + header->selectors_offset);
+  pack->compounds = (const qpack_compound_t *)(pack->data + header->compounds_offset);
+  pack->checks    = (const qpack_check_t *)(pack->data + header->checks_offset);
+  pack->names     = (const qpack_name_t *)(pack->data + header->names_offset);
+  pack->hash      = (const uint32_t *)(pack->data + header->hash_offset);
+  pack->pool      = pack->data + header->pool_offset;
+
+  pack->path = path;
+  pack->selectors_cache = rb_hash_new();
+
+  return self;
+}
+
+
+/*
+  Returns the index of the selector whose source is source, or -1 if there
+  isn't one.
+*/
+static
+long
+q_pack_lookup(const qpack_t *pack, VALUE source)
+{
+  const uint32_t hash_size = pack->header->hash_size;
+  const char *chars;
+  long length;
+  uint32_t slot;
+  uint32_t probes;
+
+  source = rb_str_conv_enc(source, rb_enc_get(source), rb_utf8_encoding());
+  chars = RSTRING_PTR(source);
+  length = RSTRING_LEN(source);
+
+  if (hash_size == 0) {
+    return -1;
+  }
+
+  slot = q_pack_hash(chars, length) & (hash_size - 1);
+  for (probes = 0; probes < hash_size; ++probes, slot = (slot + 1) & (hash_size - 1)) {
+    const uint32_t index = pack->hash[slot];
+    const qpack_selector_t *selector;
+
+    if (index == Q_PACK_EMPTY) {
+      break;
+    } else if (index >= pack->header->num_selectors) {
+      rb_raise(q_pack_format_error(), "Selector pack hash table is corrupt");
+    }
+
+    selector = &pack->selectors[index];
+    if (selector->source_length == (uint32_t)length &&
+        q_pack_slice_ok(pack, selector->source_offset, selector->source_length) &&
+        memcmp(pack->pool + selector->source_offset, chars, length) == 0) {
+      return (long)index;
+    }
+  }
+
+  RB_GC_GUARD(source);
+  return -1;
+}
+
+
+/*
+  Checks the selector's AST against the bounds of the pack and builds its
+  Selector chain.
+*/
+static
+VALUE
+q_pack_build(qpack_t *pack, long index)
+{
+  const qpack_header_t *header = pack->header;
+  const qpack_selector_t *selector = &pack->selectors[index];
+  qast_t ast;
+  VALUE compounds_buf, checks_buf, names_buf;
+  VALUE result;
+  uint32_t item;
+
+#define Q_CORRUPT() \
+  rb_raise(q_pack_format_error(), "Selector %ld in pack is corrupt", index)
+
+  if ((uint64_t)selector->first_compound + selector->num_compounds > header->num_compounds ||
+      (uint64_t)selector->first_check + selector->num_checks > header->num_checks ||
+      (uint64_t)selector->first_name + selector->num_names > header->num_names ||
+      selector->num_compounds == 0) {
+    Q_CORRUPT();
+  }
+
+  ast.num_compounds = selector->num_compounds;
+  ast.num_checks    = selector->num_checks;
+  ast.num_names     = selector->num_names;
+  ast.compounds = ALLOCV_N(qast_compound_t, compounds_buf, ast.num_compounds);
+  ast.checks    = ALLOCV_N(qast_check_t, checks_buf, ast.num_checks + 1);
+  ast.names     = ALLOCV_N(qslice_t, names_buf, ast.num_names + 1);
+
+  for (item = 0; item < selector->num_compounds; ++item) {
+    const qpack_compound_t *in = &pack->compounds[selector->first_compound + item];
+    qast_compound_t *out = &ast.compounds[item];
+
+    if ((uint64_t)in->first_check + in->num_checks > selector->num_checks) {
+      Q_CORRUPT();
+    }
+
+    out->direct      = in->direct ? 1 : 0;
+    out->first_check = in->first_check;
+    out->num_checks  = in->num_checks;
+  }
+
+  for (item = 0; item < selector->num_checks; ++item) {
+    const qpack_check_t *in = &pack->checks[selector->first_check + item];
+    qast_check_t *out = &ast.checks[item];
+
+    if (in->kind > Q_CHECK_ATTR ||
+        in->operator >= Q_OPER_COUNT ||
+        in->operand_kind > Q_OPERAND_FLOAT ||
+        !q_pack_text_ok(pack, in->name_offset, in->name_length) ||
+        !q_pack_text_ok(pack, in->operand_offset, in->operand_length) ||
+        (uint64_t)in->first_name + in->num_names > selector->num_names) {
+      Q_CORRUPT();
+    }
+
+    out->kind           = (qcheck_kind_t)in->kind;
+    out->name.chars     = pack->pool + in->name_offset;
+    out->name.length    = in->name_length;
+    out->first_name     = in->first_name;
+    out->num_names      = in->num_names;
+    out->operator       = (qoperator_t)in->operator;
+    out->operand_kind   = (qoperand_kind_t)in->operand_kind;
+    out->escaped        = in->escaped ? 1 : 0;
+    out->operand.chars  = pack->pool + in->operand_offset;
+    out->operand.length = in->operand_length;
+  }
+
+  for (item = 0; item < selector->num_names; ++item) {
+    const qpack_name_t *in = &pack->names[selector->first_name + item];
+
+    if (!q_pack_text_ok(pack, in->offset, in->length)) {
+      Q_CORRUPT();
+    }
+
+    ast.names[item].chars  = pack->pool + in->offset;
+    ast.names[item].length = in->length;
+  }
+
+#undef Q_CORRUPT
+
+  result = q_build_selector(&ast, rb_utf8_encoding());
+
+  ALLOCV_END(compounds_buf);
+  ALLOCV_END(checks_buf);
+  ALLOCV_END(names_buf);
+
+  return result;
+}
+
+
+static
+VALUE
+q_rb_pack_build_body(VALUE build_ptr)
+{
+  const qpack_build_t *build = (const qpack_build_t *)build_ptr;
+  return q_pack_build(build->pack, build->index);
+}
+
+
+static
+VALUE
+q_rb_pack_build_ensure(VALUE build_ptr)
+{
+  qpack_t *pack = ((const qpack_build_t *)build_ptr)->pack;
+  if (--pack->busy == 0 && pack->close_pending) {
+    q_pack_unmap(pack);
+  }
+  return Qnil;
+}
+
+
+/*
+  call-seq:
+    [](index) -> Selector or nil
+    [](source) -> Selector or nil
+
+  Returns the frozen selector chain at index or with the given source string,
+  or nil if there's none. Each selector is built the first time it's asked for
+  and kept for later calls.
+*/
+static
+VALUE
+q_rb_pack_aref(VALUE self, VALUE key)
+{
+  qpack_t *pack = q_get_pack(self);
+  qpack_build_t build;
+  VALUE index_num;
+  VALUE selector;
+  long index;
+
+  if (RB_TYPE_P(key, T_STRING)) {
+    index = q_pack_lookup(pack, key);
+  } else {
+    index = NUM2LONG(key);
+    if (index < 0) {
+      index += (long)pack->header->num_selectors;
+    }
+  }
+
+  if (index < 0 || index >= (long)pack->header->num_selectors) {
+    return Qnil;
+  }
+
+  index_num = LONG2NUM(index);
+  selector = rb_hash_lookup2(pack->selectors_cache, index_num, Qundef);
+  if (selector != Qundef) {
+    return selector;
+  }
+
+  build.pack  = pack;
+  build.index = index;
+  ++pack->busy;
+  selector = rb_ensure(
+    q_rb_pack_build_body, (VALUE)&build,
+    q_rb_pack_build_ensure, (VALUE)&build
+    );
+  selector = rb_funcall(selector, q_id_freeze, 0);
+
+  /* Freezing runs Ruby code, so another thread may have built it already */
+  if (rb_hash_lookup2(pack->selectors_cache, index_num, Qundef) == Qundef) {
+    rb_hash_aset(pack->selectors_cache, index_num, selector);
+  }
+
+  return rb_hash_aref(pack->selectors_cache, index_num);
+}
+
+
+/*
+  call-seq:
+    index(source) -> Integer or nil
+
+  Returns the index of the selector with the given source string, or nil if
+  the pack doesn't have it. Doesn't build the selector.
+*/
+static
+VALUE
+q_rb_pack_index(VALUE self, VALUE source)
+{
+  long index;
+  StringValue(source);
+  index = q_pack_lookup(q_get_pack(self), source);
+  return index < 0 ? Qnil : LONG2NUM(index);
+}
+
+
+/*
+  call-seq:
+    source(index) -> String or nil
+
+  Returns the selector string the selector at index was compiled from.
+*/
+static
+VALUE
+q_rb_pack_source(VALUE self, VALUE index_num)
+{
+  qpack_t *pack = q_get_pack(self);
+  const qpack_selector_t *selector;
+  long index = NUM2LONG(index_num);
+
+  if (index < 0) {
+    index += (long)pack->header->num_selectors;
+  }
+
+  if (index < 0 || index >= (long)pack->header->num_selectors) {
+    return Qnil;
+  }
+
+  selector = &pack->selectors[index];
+  if (!q_pack_slice_ok(pack, selector->source_offset, selector->source_length)) {
+    rb_raise(q_pack_format_error(), "Selector %ld in pack is corrupt", index);
+  }
+
+  return rb_obj_freeze(rb_enc_str_new(
+    pack->pool + selector->source_offset,
+    selector->source_length,
+    rb_utf8_encoding()
+    ));
+}
+
+
+/*
+  call-seq:
+    length -> Integer
+
+  Returns the number of selectors in the pack.
+*/
+static
+VALUE
+q_rb_pack_length(VALUE self)
+{
+  return ULONG2NUM(q_get_pack(self)->header->num_selectors);
+}
+
+
+/*
+  call-seq:
+    path -> String
+
+  Returns the path the pack was opened from.
+*/
+static
+VALUE
+q_rb_pack_path(VALUE self)
+{
+  qpack_t *pack;
+  TypedData_Get_Struct(self, qpack_t, &q_pack_type, pack);
+  return pack->path;
+}
+
+
+/*
+  call-seq:
+    close -> nil
+
+  Unmaps the pack. Selectors already built from it remain usable. If a
+  selector is being built from the pack (close was called from Ruby code run
+  while building it), the pack is closed at once but only unmapped once the
+  build finishes.
+*/
+static
+VALUE
+q_rb_pack_close(VALUE self)
+{
+  qpack_t *pack;
+  TypedData_Get_Struct(self, qpack_t, &q_pack_type, pack);
+  if (pack->busy > 0) {
+    /* Closed to callers, but the build still reads the pool */
+    pack->header = NULL;
+    pack->close_pending = 1;
+  } else {
+    q_pack_unmap(pack);
+  }
+  return Qnil;
+}
+
+
+/*
+  call-seq:
+    closed? -> true or false
+*/
+static
+VALUE
+q_rb_pack_closed(VALUE self)
+{
+  qpack_t *pack;
+  TypedData_Get_Struct(self, qpack_t, &q_pack_type, pack);
+  return pack->header ? Qfalse : Qtrue;
+}
+
+
+void
+q_init_pack(void)
+{
+  VALUE klass = q_selector_pack_class();
+
+  q_id_freeze = rb_intern("freeze");
+
+  rb_define_const(klass, "VERSION", INT2FIX(Q_PACK_VERSION));
+
+  rb_define_alloc_func(klass, q_rb_pack_alloc);
+  rb_define_singleton_method(klass, "compile", q_rb_pack_compile, 1);
+  rb_define_method(klass, "initialize", q_rb_pack_initialize, 1);
+  rb_define_method(klass, "[]", q_rb_pack_aref, 1);
+  rb_define_method(klass, "index", q_rb_pack_index, 1);
+  rb_define_method(klass, "source", q_rb_pack_source, 1);
+  rb_define_method(klass, "length", q_rb_pack_length, 0);
+  rb_define_method(klass, "path", q_rb_pack_path, 0);
+  rb_define_method(klass, "close", q_rb_pack_close, 0);
+  rb_define_method(klass, "closed?", q_rb_pack_closed, 0);
+}
@@ -0,0 +1,285 @@
+//  Copyright 2014 Noel Cower
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  ----------------------------------------------------------------------------
+//
+//  scan.c
+//    Character classes and run scanners for the selector parser.
+//
+//    Single characters are classified through a 256-entry table. Names and
+//    quoted strings, which make up most of a selector, are scanned 16 bytes
+//    at a time with SSE2 or SSE4.2 when the CPU running the extension has
+//    them. Which scanner is used is decided once at load time, so the
+//    extension doesn't need to be built for the machine it runs on. Setting
+//    GUI_SELECTOR_SCAN to "scalar" or "sse2" before loading it caps the
+//    scanner used (mostly useful for benchmarking).
+
+
+#include "selector.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define Q_SCAN_X86 1
+#include <emmintrin.h>
+#include <nmmintrin.h>
+#else
+#define Q_SCAN_X86 0
+#endif
+
+
+/*=============================================================================
+|  Types and values                                                           |
+=============================================================================*/
+
+typedef const char *(*qscan_fn_t)(const char *chars, const char *end);
+
+
+#define Q_NB Q_CC_NAME_BOUND
+
+const unsigned char q_char_classes[256] = {
+  ['\t'] = Q_NB | Q_CC_SPACE,
+  ['\n'] = Q_NB | Q_CC_SPACE,
+  ['\r'] = Q_NB | Q_CC_SPACE,
+  [' ']  = Q_NB | Q_CC_SPACE,
+  ['!']  = Q_NB,
+  ['"']  = Q_NB | Q_CC_STRING_BOUND,
+  ['#']  = Q_NB,
+  ['(']  = Q_NB,
+  [')']  = Q_NB,
+  ['*']  = Q_NB,
+  ['+']  = Q_CC_SIGN,
+  ['-']  = Q_NB | Q_CC_SIGN,
+  ['<']  = Q_NB,
+  ['=']  = Q_NB,
+  ['>']  = Q_NB,
+  ['[']  = Q_NB,
+  ['\\'] = Q_CC_STRING_BOUND,
+  [']']  = Q_NB,
+  ['|']  = Q_NB,
+  ['0']  = Q_CC_DIGIT, ['1'] = Q_CC_DIGIT, ['2'] = Q_CC_DIGIT,
+  ['3']  = Q_CC_DIGIT, ['4'] = Q_CC_DIGIT, ['5'] = Q_CC_DIGIT,
+  ['6']  = Q_CC_DIGIT, ['7'] = Q_CC_DIGIT, ['8'] = Q_CC_DIGIT,
+  ['9']  = Q_CC_DIGIT,
+  ['e']  = Q_CC_EXPONENT,
+  ['E']  = Q_CC_EXPONENT
+};
+
+#undef Q_NB
+
+
+static const char *q_scan_name_scalar(const char *chars, const char *end);
+static const char *q_scan_string_scalar(const char *chars, const char *end);
+
+static qscan_fn_t q_scan_name_impl = q_scan_name_scalar;
+static qscan_fn_t q_scan_string_impl = q_scan_string_scalar;
+
+
+
+/*=============================================================================
+|  Scalar scanners                                                            |
+=============================================================================*/
+
+static
+const char *
+q_scan_name_scalar(const char *chars, const char *end)
+{
+  while (chars < end && !Q_CHAR_IS(*chars, Q_CC_NAME_BOUND)) {
+    ++chars;
+  }
+  return chars;
+}
+
+
+static
+const char *
+q_scan_string_scalar(const char *chars, const char *end)
+{
+  while (chars < end && !Q_CHAR_IS(*chars, Q_CC_STRING_BOUND)) {
+    ++chars;
+  }
+  return chars;
+}
+
+
+
+/*=============================================================================
+|  SSE2/SSE4.2 scanners                                                       |
+=============================================================================*/
+
+#if Q_SCAN_X86
+
+#define Q_EQ(CHUNK, CH) _mm_cmpeq_epi8((CHUNK), _mm_set1_epi8(CH))
+
+
+__attribute__((target("sse2")))
+static
+const char *
+q_scan_name_sse2(const char *chars, const char *end)
+{
+  for (; end - chars >= 16; chars += 16) {
+    const __m128i chunk = _mm_loadu_si128((const __m128i *)chars);
+    __m128i bounds;
+    int mask;
+
+    bounds = _mm_or_si128(Q_EQ(chunk, '\t'), Q_EQ(chunk, '\n'));
+    bounds = _mm_or_si128(bounds, Q_EQ(chunk, '\r'));
+    bounds = _mm_or_si128(bounds, Q_EQ(chunk, '-'));
+    bounds = _mm_or_si128(bounds, Q_EQ(chunk, '['));
+    bounds = _mm_or_si128(bounds, Q_EQ(chunk, ']'));
+    bounds = _mm_or_si128(bounds, Q_EQ(chunk, '|'));
+    /* ' ' through '#', '(' through '*', and '<' through '>' */
+    bounds = _mm_or_si128(bounds, _mm_and_si128(
+      _mm_cmpgt_epi8(chunk, _mm_set1_epi8(' ' - 1)),
+      _mm_cmplt_epi8(chunk, _mm_set1_epi8('#' + 1))
+      ));
+    bounds = _mm_or_si128(bounds, _mm_and_si128(
+      _mm_cmpgt_epi8(chunk, _mm_set1_epi8('(' - 1)),
+      _mm_cmplt_epi8(chunk, _mm_set1_epi8('*' + 1))
+      ));
+    bounds = _mm_or_si128(bounds, _mm_and_si128(
+      _mm_cmpgt_epi8(chunk, _mm_set1_epi8('<' - 1)),
+      _mm_cmplt_epi8(chunk, _mm_set1_epi8('>' + 1))
+      ));
+
+    mask = _mm_movemask_epi8(bounds);
+    if (mask) {
+      return chars + __builtin_ctz(mask);
+    }
+  }
+
+  return q_scan_name_scalar(chars, end);
+}
+
+
+__attribute__((target("sse2")))
+static
+const char *
+q_scan_string_sse2(const char *chars, const char *end)
+{
+  for (; end - chars >= 16; chars += 16) {
+    const __m128i chunk = _mm_loadu_si128((const __m128i *)chars);
+    const int mask = _mm_movemask_epi8(
+      _mm_or_si128(Q_EQ(chunk, '"'), Q_EQ(chunk, '\\'))
+      );
+
+    if (mask) {
+      return chars + __builtin_ctz(mask);
+    }
+  }
+
+  return q_scan_string_scalar(chars, end);
+}
+
+
+/*
+  pcmpestri only takes 16 bytes of needle, so name bounds are checked as
+  eight ranges and the last bound, '|', is compared separately.
+*/
+__attribute__((target("sse4.2")))
+static
+const char *
+q_scan_name_sse42(const char *chars, const char *end)
+{
+  const __m128i ranges = _mm_setr_epi8(
+    '\t', '\n',
+    '\r', '\r',
+    ' ',  '#',
+    '(',  '*',
+    '-',  '-',
+    '<',  '>',
+    '[',  '[',
+    ']',  ']'
+    );
+
+  for (; end - chars >= 16; chars += 16) {
+    const __m128i chunk = _mm_loadu_si128((const __m128i *)chars);
+    const __m128i in_range = _mm_cmpestrm(
+      ranges, 16, chunk, 16,
+      _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_UNIT_MASK
+      );
+    const int mask = _mm_movemask_epi8(_mm_or_si128(in_range, Q_EQ(chunk, '|')));
+
+    if (mask) {
+      return chars + __builtin_ctz(mask);
+    }
+  }
+
+  return q_scan_name_scalar(chars, end);
+}
+
+
+#undef Q_EQ
+
+#endif /* Q_SCAN_X86 */
+
+
+
+/*=============================================================================
+|  Dispatch                                                                   |
+=============================================================================*/
+
+const char *
+q_scan_name(const char *chars, const char *end)
+{
+  return q_scan_name_impl(chars, end);
+}
+
+
+const char *
+q_scan_string(const char *chars, const char *end)
+{
+  return q_scan_string_impl(chars, end);
+}
+
+
+const char *
+q_scan_impl_name(void)
+{
+  if (q_scan_name_impl == q_scan_name_scalar) {
+    return "scalar";
+  }
+#if Q_SCAN_X86
+  if (q_scan_name_impl == q_scan_name_sse42) {
+    return "sse4.2";
+  }
+#endif
+  return "sse2";
+}
+
+
+void
+q_init_scan(void)
+{
+#if Q_SCAN_X86
+  const char *forced = getenv("GUI_SELECTOR_SCAN");
+
+  __builtin_cpu_init();
+
+  if (forced && strcmp(forced, "scalar") == 0) {
+    return;
+  }
+
+  if (__builtin_cpu_supports("sse2")) {
+    q_scan_name_impl = q_scan_name_sse2;
+    q_scan_string_impl = q_scan_string_sse2;
+
+    if (__builtin_cpu_supports("sse4.2") &&
+        !(forced && strcmp(forced, "sse2") == 0)) {
+      q_scan_name_impl = q_scan_name_sse42;
+    }
+  }
+#endif
+}
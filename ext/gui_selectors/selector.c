@@ -30,202 +30,144 @@
 //    selector.
 //
 //    I decided this is sufficient.
+//
+//    bench/selector_bench.rb measures parse time and allocations for a corpus
+//    of selectors, and bench/selector_fuzz.rb checks the parser against a
+//    reference implementation of the grammar. Run both after changing this.
+
 
 
 #include "ruby.h"
+#include "ruby/encoding.h"
+#include "selector.h"
 
 #include <stdlib.h>
 #include <string.h>
-#include <stdbool.h>
-#include <assert.h>
 #include <stdio.h>
 
 
 /*=============================================================================
-|  Sean Barrett's stretchy buffer                                             |
+|  Types and values                                                           |
 =============================================================================*/
 
 /*
-  stretchy buffer
-  public domain, found at http://nothings.org/stb/stretchy_buffer.txt
-
-  Slightly modified from its original form to add an sbcapacity macro.
-
-  init: NULL
-  free: sbfree()
-  push_back: sbpush()
-  size: sbcount()
-  resize: sbresize()
+  Scratch memory for ASTs. Each thread keeps its own arena in a thread-local
+  variable (fiber-local, strictly, as with Thread#[]) and reuses it from one
+  parse to the next, and it's freed with the thread. If a thread's arena is
+  already in use (e.g., a parse was entered while building Ruby objects for
+  another), a temporary arena is allocated for that parse instead.
 */
-#define sbfree(a)     \
-  ((a) ? free(stb__sbraw(a)),0 : 0)
-#define sbpush(a,v)   \
-  (stb__sbmaybegrow(a,1), (a)[stb__sbn(a)++] = (v))
-#define sbcount(a)    \
-  ((a) ? stb__sbn(a) : 0)
-#define sbadd(a,n)    \
-  (stb__sbmaybegrow(a,n), stb__sbn(a)+=(n), &(a)[stb__sbn(a)-(n)])
-#define sblast(a)     \
-  ((a)[stb__sbn(a)-1])
-#define sbcapacity(a) \
-  ((a) ? stb__sbm(a) : 0)
-
-#include <stdlib.h>
-#define stb__sbraw(a) ((int *) (a) - 2)
-#define stb__sbm(a)   stb__sbraw(a)[0]
-#define stb__sbn(a)   stb__sbraw(a)[1]
-
-#define stb__sbneedgrow(a,n)  ((a)==0 || stb__sbn(a)+n >= stb__sbm(a))
-#define stb__sbmaybegrow(a,n) (stb__sbneedgrow(a,(n)) ? stb__sbgrow(a,n) : 0)
-#define stb__sbgrow(a,n)  stb__sbgrowf((void **) &(a), (n), sizeof(*(a)))
-
-static void stb__sbgrowf(void **arr, int increment, int itemsize)
+typedef struct s_qarena
 {
-   int m = *arr ? 2*stb__sbm(*arr)+increment : increment+1;
-   void *p = realloc(*arr ? stb__sbraw(*arr) : 0, itemsize * m + sizeof(int)*2);
-   assert(p);
-   if (p) {
-      if (!*arr) ((int *) p)[1] = 0;
-      *arr = (void *) ((int *) p + 2);
-      stb__sbm(*arr) = m;
-   }
-}
+  char *block;
+  size_t capacity;
+  int in_use;
+  /* Set for arenas allocated for a single parse */
+  int temporary;
+} qarena_t;
 
 
-
-/*=============================================================================
-|  Types and values                                                           |
-=============================================================================*/
-
 typedef struct s_qparser
 {
   const char *chars;
-  int length;
-  int index;
-  char *buffer;
+  long length;
+  long index;
+  /* Arrays are sized for the worst case, so they never need to grow */
+  qast_t ast;
+  /* Set to a static message when parsing fails */
+  const char *error;
 } qparser_t;
 
 
-typedef struct s_qchars {
-  int length;
-  const char *chars;
-} qchars_t;
-
-
-static qchars_t const Q_WHITESPACE         = { 4,  " \t\n\r" };
-static qchars_t const Q_ANY_TAG_MARK       = { 1,  "*" };
-static qchars_t const Q_CONTAINS_MARK      = { 1,  "-" };
-static qchars_t const Q_DECIMAL_MARK       = { 1,  "." };
-static qchars_t const Q_EQUAL_MARK         = { 1,  "=" };
-static qchars_t const Q_EXPONENT_MARK      = { 2,  "eE" };
-static qchars_t const Q_EXP_PLUSMINUS_MARK = { 2,  "+-" };
-static qchars_t const Q_GREATER_MARK       = { 1,  ">" };
-static qchars_t const Q_LESSER_MARK        = { 1,  "<" };
-static qchars_t const Q_NEGATION_MARK      = { 1,  "!" };
-static qchars_t const Q_MINUS_MARK         = { 1,  "-" };
-static qchars_t const Q_START_MULTI_TAG    = { 1,  "(" };
-static qchars_t const Q_END_MULTI_TAG      = { 1,  ")" };
-static qchars_t const Q_MULTI_TAG_SEP      = { 1,  "|" };
-static qchars_t const Q_START_ATTR         = { 1,  "[" };
-static qchars_t const Q_END_ATTR           = { 1,  "]" };
-static qchars_t const Q_TAG_MARKER         = { 1,  "#" };
-static qchars_t const Q_QUOTE              = { 1,  "\"" };
-static qchars_t const Q_ESCAPE             = { 1,  "\\" };
-static qchars_t const Q_QUOTE_OR_ESCAPE    = { 2,  "\"\\" };
-static qchars_t const Q_DIRECT_FOLLOW      = { 1,  ">" };
-static qchars_t const Q_DIGITS             = { 10, "0123456789" };
-static qchars_t const Q_OPERATOR_CHARS     = { 7,  "#!=<>*-" };
-static qchars_t const Q_NAME_BOUNDS        = { 17, " #\"|>([*!=<-])\n\t\r" };
+typedef struct s_qbuild
+{
+  qparser_t *parser;
+  qarena_t *arena;
+  VALUE source;
+  qast_fn_t fn;
+  void *context;
+} qbuild_t;
 
 
+/* Single-character marks (character sets are classes -- see scan.c) */
 enum {
-  Q_NO = 0,
-  Q_YES = 1,
-
-  /* as arguments to accept/read */
-  Q_DO_NOT_ADD_TO_BUFFER = Q_NO,
-  Q_ADD_TO_BUFFER = Q_YES,
-
-  /* as arguments to q_read_name */
-  Q_AS_STRING = Q_NO,
-  Q_AS_SYMBOL = Q_YES
+  Q_ANY_TAG_MARK    = '*',
+  Q_CONTAINS_MARK   = '-',
+  Q_DECIMAL_MARK    = '.',
+  Q_EQUAL_MARK      = '=',
+  Q_GREATER_MARK    = '>',
+  Q_LESSER_MARK     = '<',
+  Q_NEGATION_MARK   = '!',
+  Q_START_MULTI_TAG = '(',
+  Q_END_MULTI_TAG   = ')',
+  Q_MULTI_TAG_SEP   = '|',
+  Q_START_ATTR      = '[',
+  Q_END_ATTR        = ']',
+  Q_TAG_MARKER      = '#',
+  Q_QUOTE           = '"',
+  Q_ESCAPE          = '\\',
+  Q_DIRECT_FOLLOW   = '>'
 };
 
 
-typedef VALUE (qmaybefunc_t)(qparser_t *, void *);
+enum {
+  Q_NO = 0,
+  Q_YES = 1,
 
+  /* Results of q_read_* functions */
+  Q_ERROR = -1,
+  Q_NO_MATCH = 0,
+  Q_MATCH = 1
+};
 
-#define LAZY_CLASS_DEF_UNDER(FNAME, UNDER, CLASSNAME, SUPERCLASS)    \
-VALUE                                                                \
-FNAME ()                                                             \
-{                                                                    \
-  static VALUE klass = Qnil;                                         \
-  if (NIL_P(klass))                                                  \
-    klass = rb_define_class_under((UNDER), #CLASSNAME, SUPERCLASS);  \
-  return klass;                                                      \
-}
 
+/* Arenas larger than this aren't kept around after a parse */
+#define Q_ARENA_RETAIN_LIMIT (64 * 1024)
 
-#define LAZY_MODULE_DEF_UNDER(FNAME, UNDER, MODNAME)                 \
-VALUE                                                                \
-FNAME ()                                                             \
-{                                                                    \
-  static VALUE mod = Qnil;                                           \
-  if (NIL_P(mod))                                                    \
-    mod = rb_define_module_under((UNDER), #MODNAME);                 \
-  return mod;                                                        \
-}
+/* Numbers with more characters than this are converted through a String */
+#define Q_NUMBER_BUFFER_SIZE 64
 
 
-#define LAZY_MODULE_DEF(FNAME, MODNAME)                              \
-VALUE                                                                \
-FNAME ()                                                             \
-{                                                                    \
-  static VALUE mod = Qnil;                                           \
-  if (NIL_P(mod))                                                    \
-    mod = rb_define_module(#MODNAME);                                \
-  return mod;                                                        \
-}
+#define Q_FAIL(PARSER, MESSAGE) \
+  do { (PARSER)->error = (MESSAGE); return Q_ERROR; } while (0)
 
 
-#define LAZY_STATIC_ID(NAME, SYM)                                    \
-  static ID NAME = 0;                                                \
-  if (NAME == 0) NAME = rb_intern(SYM)
+static ID q_id_thread_arena = 0;
 
 
-static LAZY_MODULE_DEF(
+LAZY_MODULE_DEF(
   q_gui_module,
   GUI
   );
 
-static LAZY_MODULE_DEF_UNDER(
+LAZY_MODULE_DEF_UNDER(
   q_parser_module,
   q_gui_module(),
   SelectorParser
   );
 
-static LAZY_CLASS_DEF_UNDER(
+LAZY_CLASS_DEF_UNDER(
   q_selector_class,
   q_gui_module(),
   Selector,
   rb_cObject
   );
 
-static LAZY_CLASS_DEF_UNDER(
+LAZY_CLASS_DEF_UNDER(
   q_view_class_check,
   q_gui_module(),
   ViewClassCheck,
   rb_cObject
   );
 
-static LAZY_CLASS_DEF_UNDER(
+LAZY_CLASS_DEF_UNDER(
   q_view_tag_check,
   q_gui_module(),
   ViewTagCheck,
   rb_cObject
   );
 
-static LAZY_CLASS_DEF_UNDER(
+LAZY_CLASS_DEF_UNDER(
   q_view_attr_check,
   q_gui_module(),
   ViewAttrCheck,
@@ -234,155 +176,214 @@ static LAZY_CLASS_DEF_UNDER(
 
 
 /* Operator names */
-static ID q_id_equal = 0;
-static ID q_id_not_equal = 0;
-static ID q_id_greater = 0;
-static ID q_id_greater_equal = 0;
-static ID q_id_lesser = 0;
-static ID q_id_lesser_equal = 0;
-static ID q_id_contains = 0;
-static ID q_id_trueish = 0;
-static ID q_id_falseish = 0;
+ID q_id_equal = 0;
+ID q_id_not_equal = 0;
+ID q_id_greater = 0;
+ID q_id_greater_equal = 0;
+ID q_id_lesser = 0;
+ID q_id_lesser_equal = 0;
+ID q_id_contains = 0;
+ID q_id_trueish = 0;
+ID q_id_falseish = 0;
+
+/* Ivars set on built selectors and checks, in the order their initialize
+   methods set them (so built objects share a shape with Ruby-built ones) */
+static ID q_id_ivar_succ        = 0;
+static ID q_id_ivar_attributes  = 0;
+static ID q_id_ivar_direct      = 0;
+static ID q_id_ivar_classnames  = 0;
+static ID q_id_ivar_tagname     = 0;
+static ID q_id_ivar_key         = 0;
+static ID q_id_ivar_operator    = 0;
+static ID q_id_ivar_operand     = 0;
+static ID q_id_ivar_is_string   = 0;
+static ID q_id_ivar_operand_sym = 0;
+
+static ID q_id_specialized_class = 0;
+
+/* Specialized ViewAttrCheck subclasses by operator and whether the operand is
+   a String, looked up once from ViewAttrCheck.specialized_class */
+static VALUE q_attr_check_classes[Q_OPER_COUNT][2];
 
 
 
 /*=============================================================================
-|  Selector methods                                                           |
+|  Prototypes                                                                 |
 =============================================================================*/
 
-static
-int
-q_selector_is_direct(VALUE selector)
-{
-  LAZY_STATIC_ID(direct_id, "direct");
-  return RTEST(rb_funcall2(selector, direct_id, 0, NULL));
-}
+static void q_arena_free(void *ptr);
+static size_t q_arena_memsize(const void *ptr);
+static qarena_t *q_thread_arena(VALUE *holder_out);
+static char *q_arena_acquire(qarena_t **arena_out, VALUE *holder_out, size_t size);
+static void q_arena_release(qarena_t *arena);
+static void q_init_parser(qparser_t *parser, const char *chars, long length, char *block);
+static size_t q_arena_size_for(long length);
+static int q_eos(const qparser_t *parser);
+static int q_peek(const qparser_t *parser);
+static int q_read(qparser_t *parser);
+static int q_accept(qparser_t *parser, int ch);
+static int q_accept_class(qparser_t *parser, int char_class);
+static long q_accept_run(qparser_t *parser, int char_class);
+static void q_skip_whitespace(qparser_t *parser);
+static int q_read_name(qparser_t *parser, qslice_t *name);
+static int q_read_string(qparser_t *parser, qast_check_t *check);
+static int q_read_number(qparser_t *parser, qast_check_t *check);
+static int q_read_operator(qparser_t *parser, qoperator_t *operator);
+static int q_read_attribute(qparser_t *parser);
+static int q_read_multi_class_tag(qparser_t *parser);
+static int q_read_single_class_tag(qparser_t *parser);
+static int q_read_id_tag(qparser_t *parser);
+static int q_read_selector(qparser_t *parser);
+static int q_run_parser(qparser_t *parser);
+static VALUE q_build_name_symbol(qslice_t name, rb_encoding *enc);
+static VALUE q_build_operand(const qast_check_t *check, rb_encoding *enc);
+static VALUE q_build_check(const qast_t *ast, const qast_check_t *check, rb_encoding *enc);
+static VALUE q_rb_parse_selector(VALUE self, VALUE selector_rb_str);
 
 
-static
-VALUE
-q_selector_set_direct(VALUE selector, int direct)
-{
-  LAZY_STATIC_ID(direct_eq_id, "direct=");
-  VALUE is_direct = direct ? Qtrue : Qfalse;
-  return rb_funcall2(selector, direct_eq_id, 1, &is_direct);
-}
+
+/*=============================================================================
+|  Arena                                                                      |
+=============================================================================*/
+
+static const rb_data_type_t q_arena_type = {
+  "GUI::SelectorParser arena",
+  { NULL, q_arena_free, q_arena_memsize, },
+  NULL, NULL,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
 
 
 static
-VALUE
-q_selector_set_succ(VALUE selector, VALUE succ)
+void
+q_arena_free(void *ptr)
 {
-  LAZY_STATIC_ID(succ_eq_id, "succ=");
-  return rb_funcall2(selector, succ_eq_id, 1, &succ);
+  qarena_t *arena = (qarena_t *)ptr;
+  if (arena) {
+    free(arena->block);
+    xfree(arena);
+  }
 }
 
 
 static
-VALUE
-q_selector_succ(VALUE selector)
+size_t
+q_arena_memsize(const void *ptr)
 {
-  LAZY_STATIC_ID(succ_id, "succ");
-  return rb_funcall2(selector, succ_id, 0, NULL);
+  const qarena_t *arena = (const qarena_t *)ptr;
+  return arena ? sizeof(*arena) + arena->capacity : 0;
 }
 
 
+/*
+  Returns the current thread's arena, creating it if needed. The object
+  holding it is stored in holder_out, which the caller must keep alive while
+  using the arena.
+*/
 static
-VALUE
-q_selector_attributes(VALUE selector)
+qarena_t *
+q_thread_arena(VALUE *holder_out)
 {
-  LAZY_STATIC_ID(attributes_id, "attributes");
-  return rb_funcall2(selector, attributes_id, 0, NULL);
-}
+  const VALUE thread = rb_thread_current();
+  VALUE holder = rb_thread_local_aref(thread, q_id_thread_arena);
+  qarena_t *arena;
+
+  if (!rb_typeddata_is_kind_of(holder, &q_arena_type)) {
+    holder = TypedData_Make_Struct(rb_cObject, qarena_t, &q_arena_type, arena);
+    rb_thread_local_aset(thread, q_id_thread_arena, holder);
+  }
 
+  *holder_out = holder;
+  return (qarena_t *)RTYPEDDATA_DATA(holder);
+}
 
 
-/*=============================================================================
-|  Prototypes                                                                 |
-=============================================================================*/
+static
+char *
+q_arena_acquire(qarena_t **arena_out, VALUE *holder_out, size_t size)
+{
+  qarena_t *arena = q_thread_arena(holder_out);
 
-static const char *q_strnchr(const char *str, int length, int chr);
-static void q_set_buf_size(qparser_t *parser, int size);
-static void q_init_parser(qparser_t *parser, const char *chars, int length);
-static void q_destroy_parser(qparser_t *parser);
-static int q_eos(const qparser_t *parser);
-static int q_peek(const qparser_t *parser);
-static int q_read(qparser_t *parser, bool add_to_buffer);
-static void q_clear_buf(qparser_t *parser);
-static int q_accept(qparser_t *parser, qchars_t chars, int add_to_buffer);
-static int q_accept_run(qparser_t *parser, qchars_t chars, int add_to_buffer);
-static int q_accept_until(qparser_t *parser, qchars_t chars, int add_to_buffer);
-static void q_skip_whitespace(qparser_t *parser);
-static VALUE q_read_string(qparser_t *parser);
-static VALUE q_read_attribute(qparser_t *parser);
-static VALUE q_read_multi_class_tag(qparser_t *parser);
-static VALUE q_read_single_class_tag(qparser_t *parser);
-static VALUE q_read_selector(qparser_t *parser);
-static VALUE q_rb_parse_selector(VALUE self, VALUE selector_rb_str);
+  if (arena->in_use) {
+    arena = (qarena_t *)calloc(1, sizeof(*arena));
+    if (!arena) {
+      rb_memerror();
+    }
+    arena->temporary = Q_YES;
+  }
 
+  if (arena->capacity < size) {
+    char *block = (char *)realloc(arena->block, size);
+    if (!block) {
+      q_arena_release(arena);
+      rb_memerror();
+    }
+    arena->block = block;
+    arena->capacity = size;
+  }
 
+  arena->in_use = Q_YES;
+  *arena_out = arena;
+  return arena->block;
+}
 
-/*=============================================================================
-|  Implementations                                                            |
-=============================================================================*/
 
 static
-const char *
-q_strnchr(const char *str, int length, int chr)
+void
+q_arena_release(qarena_t *arena)
 {
-  if (chr != '\0') {
-    if (length > 1) {
-      const char *const end_of_str = str + length;
-      for (; str < end_of_str; ++str) {
-        if (*str == chr) return str;
-      }
-    } else if (length == 1) {
-      return *str == chr ? str : NULL;
+  if (arena->temporary) {
+    free(arena->block);
+    free(arena);
+  } else {
+    if (arena->capacity > Q_ARENA_RETAIN_LIMIT) {
+      free(arena->block);
+      arena->block = NULL;
+      arena->capacity = 0;
     }
+    arena->in_use = Q_NO;
   }
-  return NULL;
 }
 
 
+/*
+  Every compound, check, and name consumes at least one character of input,
+  so no AST needs more than length + 1 of each.
+*/
 static
-void
-q_set_buf_size(qparser_t *parser, int size)
+size_t
+q_arena_size_for(long length)
 {
-  int cap;
+  return (size_t)(length + 1) * (
+    sizeof(qast_compound_t) +
+    sizeof(qast_check_t) +
+    sizeof(qslice_t)
+    );
+}
 
-  if (!parser->buffer) {
-    return;
-  }
 
-  cap = sbcapacity(parser->buffer);
-  if (size > cap) {
-    stb__sbmaybegrow(parser->buffer, size - cap);
-  }
-
-  stb__sbn(parser->buffer) = size;
-}
 
+/*=============================================================================
+|  Lexing                                                                     |
+=============================================================================*/
 
 static
 void
-q_init_parser(qparser_t *parser, const char *chars, int length)
+q_init_parser(qparser_t *parser, const char *chars, long length, char *block)
 {
+  const long max_nodes = length + 1;
+
   parser->chars  = chars;
   parser->length = length;
   parser->index  = 0;
-  parser->buffer = NULL;
-}
-
-
-static
-void
-q_destroy_parser(qparser_t *parser)
-{
-  parser->chars = NULL;
-  parser->length = 0;
-  parser->index = 0;
-  sbfree(parser->buffer);
-  parser->buffer = NULL;
+  parser->error  = NULL;
+
+  parser->ast.num_compounds = 0;
+  parser->ast.compounds     = (qast_compound_t *)block;
+  parser->ast.num_checks    = 0;
+  parser->ast.checks        = (qast_check_t *)(parser->ast.compounds + max_nodes);
+  parser->ast.num_names     = 0;
+  parser->ast.names         = (qslice_t *)(parser->ast.checks + max_nodes);
 }
 
 
@@ -398,7 +399,7 @@ static
 int
 q_peek(const qparser_t *parser)
 {
-  int index = parser->index;
+  long index = parser->index;
   return (index < parser->length)
           ? parser->chars[index]
           : 0;
@@ -407,36 +408,24 @@ q_peek(const qparser_t *parser)
 
 static
 int
-q_read(qparser_t *parser, bool add_to_buffer)
+q_read(qparser_t *parser)
 {
   char const ch = q_peek(parser);
 
   if (ch) {
     ++parser->index;
-
-    if (add_to_buffer) {
-      sbpush(parser->buffer, ch);
-    }
   }
 
   return ch;
 }
 
 
-static
-void
-q_clear_buf(qparser_t *parser)
-{
-  q_set_buf_size(parser, 0);
-}
-
-
 static
 int
-q_accept(qparser_t *parser, qchars_t chars, int add_to_buffer)
+q_accept(qparser_t *parser, int ch)
 {
-  if (q_strnchr(chars.chars, chars.length, q_peek(parser))) {
-    return q_read(parser, add_to_buffer);
+  if (ch && q_peek(parser) == ch) {
+    return q_read(parser);
   }
   return 0;
 }
@@ -444,27 +433,24 @@ q_accept(qparser_t *parser, qchars_t chars, int add_to_buffer)
 
 static
 int
-q_accept_run(qparser_t *parser, qchars_t chars, int add_to_buffer)
+q_accept_class(qparser_t *parser, int char_class)
 {
-  int accepted = 0;
-  while (q_accept(parser, chars, add_to_buffer)) {
-    ++accepted;
+  if (!q_eos(parser) && Q_CHAR_IS(q_peek(parser), char_class)) {
+    return q_read(parser);
   }
-  return accepted;
+  return 0;
 }
 
 
 static
-int
-q_accept_until(qparser_t *parser, qchars_t chars, int add_to_buffer)
+long
+q_accept_run(qparser_t *parser, int char_class)
 {
-  int accepted = 0;
-  while (!q_eos(parser)
-         && !q_strnchr(chars.chars, chars.length, q_peek(parser))) {
-    q_read(parser, add_to_buffer);
-    ++accepted;
+  const long start = parser->index;
+  while (!q_eos(parser) && Q_CHAR_IS(parser->chars[parser->index], char_class)) {
+    ++parser->index;
   }
-  return accepted;
+  return parser->index - start;
 }
 
 
@@ -472,428 +458,711 @@ static
 void
 q_skip_whitespace(qparser_t *parser)
 {
-  for (;;) {
-    switch (q_peek(parser)) {
-    case ' ': case '\t': case '\r': case '\n':
-      q_read(parser, Q_DO_NOT_ADD_TO_BUFFER);
-      break;
-
-    default:
-      return;
-    }
-  }
+  q_accept_run(parser, Q_CC_SPACE);
 }
 
 
+
+/*=============================================================================
+|  Parsing                                                                    |
+=============================================================================*/
+
 static
-VALUE
-q_read_name(qparser_t *parser, int as_symbol)
+int
+q_read_name(qparser_t *parser, qslice_t *name)
 {
-  if (q_accept_until(parser, Q_NAME_BOUNDS, Q_ADD_TO_BUFFER)) {
-    VALUE name =
-      as_symbol
-      ? ID2SYM(rb_intern2(parser->buffer, sbcount(parser->buffer)))
-      : rb_str_new(parser->buffer, sbcount(parser->buffer));
-
-    q_clear_buf(parser);
-    return name;
+  const char *const start = parser->chars + parser->index;
+  const char *const stop = q_scan_name(start, parser->chars + parser->length);
+
+  if (stop != start) {
+    parser->index += stop - start;
+    name->chars = start;
+    name->length = stop - start;
+    return Q_MATCH;
   }
-  return Qnil;
+  return Q_NO_MATCH;
 }
 
 
 static
-VALUE
-q_read_string(qparser_t *parser)
+int
+q_read_string(qparser_t *parser, qast_check_t *check)
 {
   /*
     assumes the string doesn't depend on escaping anything other than a
     literal character
   */
-  if (q_accept(parser, Q_QUOTE, Q_DO_NOT_ADD_TO_BUFFER)) {
+  if (q_accept(parser, Q_QUOTE)) {
+    const long start = parser->index;
+
+    check->escaped = Q_NO;
+
     for (;;) {
-      q_accept_until(parser, Q_QUOTE_OR_ESCAPE, Q_ADD_TO_BUFFER);
+      const char *const run = parser->chars + parser->index;
+      parser->index += q_scan_string(run, parser->chars + parser->length) - run;
 
-      if (q_accept(parser, Q_ESCAPE, Q_DO_NOT_ADD_TO_BUFFER)) {
-        q_read(parser, Q_ADD_TO_BUFFER);
+      if (q_accept(parser, Q_ESCAPE)) {
+        check->escaped = Q_YES;
+        q_read(parser);
       } else {
         break;
       }
     }
 
-    if (q_accept(parser, Q_QUOTE, Q_DO_NOT_ADD_TO_BUFFER)) {
-      VALUE str = rb_str_new(parser->buffer, sbcount(parser->buffer));
-      q_clear_buf(parser);
-      return str;
+    check->operand.chars = parser->chars + start;
+    check->operand.length = parser->index - start;
+
+    if (q_accept(parser, Q_QUOTE)) {
+      check->operand_kind = Q_OPERAND_STRING;
+      return Q_MATCH;
     } else {
-      rb_raise(rb_eRuntimeError, "No closing quote for string");
+      Q_FAIL(parser, "No closing quote for string");
     }
   }
 
-  return Qnil;
+  return Q_NO_MATCH;
 }
 
 
 static
-VALUE
-q_read_number(qparser_t *parser)
+int
+q_read_number(qparser_t *parser, qast_check_t *check)
 {
-  VALUE result = Qnil;
+  const long start = parser->index;
 
-  if (q_accept_run(parser, Q_DIGITS, Q_ADD_TO_BUFFER)) {
+  if (q_accept_run(parser, Q_CC_DIGIT)) {
     int is_float = Q_NO;
 
-    if (q_accept(parser, Q_DECIMAL_MARK, Q_ADD_TO_BUFFER)) {
-      if (!q_accept_run(parser, Q_DIGITS, Q_ADD_TO_BUFFER)) {
-        rb_raise(
-          rb_eRuntimeError,
-          "Invalid number format: expected fractional value"
-          );
-        return Qnil;
+    if (q_accept(parser, Q_DECIMAL_MARK)) {
+      if (!q_accept_run(parser, Q_CC_DIGIT)) {
+        Q_FAIL(parser, "Invalid number format: expected fractional value");
       }
 
       is_float = Q_YES;
     }
 
-    if (q_accept(parser, Q_EXPONENT_MARK, Q_ADD_TO_BUFFER)) {
-      char plusminus = q_accept(parser, Q_EXP_PLUSMINUS_MARK, Q_ADD_TO_BUFFER);
+    if (q_accept_class(parser, Q_CC_EXPONENT)) {
+      q_accept_class(parser, Q_CC_SIGN);
 
-      if (!q_accept_run(parser, Q_DIGITS, Q_ADD_TO_BUFFER)) {
-        rb_raise(rb_eRuntimeError, "Invalid number format: expected exponent");
-        return Qnil;
+      if (!q_accept_run(parser, Q_CC_DIGIT)) {
+        Q_FAIL(parser, "Invalid number format: expected exponent");
       }
 
-      is_float = is_float || (plusminus == '-');
-    }
-
-    sbpush(parser->buffer, '\0');
-
-    if (is_float) {
-      result = DBL2NUM(strtod(parser->buffer, NULL));
-    } else {
-      #ifdef HAVE_LONG_LONG
-      result = LL2NUM(strtoll(parser->buffer, NULL, 10));
-      #else
-      result = LONG2NUM(strtol(parser->buffer, NULL, 10));
-      #endif
+      is_float = Q_YES;
     }
 
-    q_clear_buf(parser);
+    check->operand_kind = is_float ? Q_OPERAND_FLOAT : Q_OPERAND_INTEGER;
+    check->operand.chars = parser->chars + start;
+    check->operand.length = parser->index - start;
+    return Q_MATCH;
   }
 
-  return result;
+  return Q_NO_MATCH;
 }
 
 
 static
-ID
-q_read_operator(qparser_t *parser)
+int
+q_read_operator(qparser_t *parser, qoperator_t *operator)
 {
-  ID result = 0;
-
-  if (q_accept(parser, Q_NEGATION_MARK, Q_DO_NOT_ADD_TO_BUFFER)) {
-    if (!q_accept(parser, Q_EQUAL_MARK, Q_DO_NOT_ADD_TO_BUFFER)) {
-      rb_raise(rb_eRuntimeError, "Invalid operator -- expected =");
+  if (q_accept(parser, Q_NEGATION_MARK)) {
+    if (!q_accept(parser, Q_EQUAL_MARK)) {
+      Q_FAIL(parser, "Invalid operator -- expected =");
     }
-    result = q_id_not_equal;
-  } else if (q_accept(parser, Q_EQUAL_MARK, Q_DO_NOT_ADD_TO_BUFFER)) {
-    result = q_id_equal;
-  } else if(q_accept(parser, Q_GREATER_MARK, Q_DO_NOT_ADD_TO_BUFFER)) {
-    if (q_accept(parser, Q_EQUAL_MARK, Q_DO_NOT_ADD_TO_BUFFER)) {
-      result = q_id_greater_equal;
+    *operator = Q_OPER_NOT_EQUAL;
+  } else if (q_accept(parser, Q_EQUAL_MARK)) {
+    *operator = Q_OPER_EQUAL;
+  } else if(q_accept(parser, Q_GREATER_MARK)) {
+    if (q_accept(parser, Q_EQUAL_MARK)) {
+      *operator = Q_OPER_GREATER_EQUAL;
     } else {
-      result = q_id_greater;
+      *operator = Q_OPER_GREATER;
     }
-  } else if(q_accept(parser, Q_LESSER_MARK, Q_DO_NOT_ADD_TO_BUFFER)) {
-    if (q_accept(parser, Q_EQUAL_MARK, Q_DO_NOT_ADD_TO_BUFFER)) {
-      result = q_id_lesser_equal;
-    } else if (q_accept(parser, Q_CONTAINS_MARK, Q_DO_NOT_ADD_TO_BUFFER)) {
-      result = q_id_contains;
+  } else if(q_accept(parser, Q_LESSER_MARK)) {
+    if (q_accept(parser, Q_EQUAL_MARK)) {
+      *operator = Q_OPER_LESSER_EQUAL;
+    } else if (q_accept(parser, Q_CONTAINS_MARK)) {
+      *operator = Q_OPER_CONTAINS;
     } else {
-      result = q_id_lesser;
+      *operator = Q_OPER_LESSER;
     }
+  } else {
+    Q_FAIL(parser, "Invalid operator -- expected one of "
+                   "=, !=, <, <=, >, >=, <-");
   }
 
-  if (result == 0) {
-    rb_raise(rb_eRuntimeError, "Invalid operator -- expected one of "
-                               "=, !=, <, <=, >, >=, <-");
-    return Qnil;
-  }
-
-  return result;
+  return Q_MATCH;
 }
 
 
 static
-VALUE
+int
 q_read_attribute(qparser_t *parser)
 {
-  VALUE result = Qnil;
-
-  if (q_accept(parser, Q_START_ATTR, Q_DO_NOT_ADD_TO_BUFFER)) {
+  if (q_accept(parser, Q_START_ATTR)) {
+    qast_check_t *check = &parser->ast.checks[parser->ast.num_checks];
     int inverted = Q_NO;
-    VALUE key = Qnil;
-    ID operator = 0;
-    VALUE operand = Qnil;
+    int result;
+
+    check->kind         = Q_CHECK_ATTR;
+    check->first_name   = 0;
+    check->num_names    = 0;
+    check->operand_kind = Q_OPERAND_NONE;
+    check->escaped      = Q_NO;
 
     q_skip_whitespace(parser);
 
-    inverted = q_accept(parser, Q_NEGATION_MARK, Q_DO_NOT_ADD_TO_BUFFER);
+    inverted = q_accept(parser, Q_NEGATION_MARK);
     if (inverted) {
       q_skip_whitespace(parser);
     }
 
-    key = q_read_name(parser, Q_AS_STRING);
+    if (!q_read_name(parser, &check->name)) {
+      Q_FAIL(parser, "Expected attribute name");
+    }
+
     q_skip_whitespace(parser);
 
-    if (q_accept(parser, Q_END_ATTR, Q_DO_NOT_ADD_TO_BUFFER)) {
-      operator = q_id_trueish;
+    if (q_accept(parser, Q_END_ATTR)) {
+      check->operator = Q_OPER_TRUEISH;
       goto skip_operator_operand;
     }
 
-    operator = q_read_operator(parser);
-    if (operator == 0) {
-      rb_raise(rb_eRuntimeError, "Invalid operator returned");
+    if (q_read_operator(parser, &check->operator) == Q_ERROR) {
+      return Q_ERROR;
     }
 
     q_skip_whitespace(parser);
 
-    operand = q_read_string(parser);
-    if (!RTEST(operand)) {
-      operand = q_read_number(parser);
+    result = q_read_string(parser, check);
+    if (result == Q_NO_MATCH) {
+      result = q_read_number(parser, check);
 
-      if (!RTEST(operand)) {
-        operand = q_read_name(parser, Q_AS_STRING);
+      if (result == Q_NO_MATCH) {
+        result = q_read_name(parser, &check->operand);
+        check->operand_kind = Q_OPERAND_NAME;
       }
     }
 
-    if (NIL_P(operand)) {
-      rb_raise(rb_eRuntimeError, "Invalid operand to attribute check");
+    if (result == Q_ERROR) {
+      return Q_ERROR;
+    } else if (result == Q_NO_MATCH) {
+      Q_FAIL(parser, "Invalid operand to attribute check");
     }
 
     q_skip_whitespace(parser);
 
-    if (q_accept(parser, Q_END_ATTR, Q_DO_NOT_ADD_TO_BUFFER)) {
+    if (q_accept(parser, Q_END_ATTR)) {
       skip_operator_operand:
       if (inverted) {
-        if (operator == q_id_trueish) operator = q_id_falseish;
-        else if (operator == q_id_falseish) operator = q_id_trueish;
-        else if (operator == q_id_equal) operator = q_id_not_equal;
-        else if (operator == q_id_not_equal) operator = q_id_equal;
-        else if (operator == q_id_lesser) operator = q_id_greater_equal;
-        else if (operator == q_id_greater) operator = q_id_lesser_equal;
-        else if (operator == q_id_lesser_equal) operator = q_id_greater;
-        else if (operator == q_id_greater_equal) operator = q_id_lesser;
+        switch (check->operator) {
+        case Q_OPER_TRUEISH:       check->operator = Q_OPER_FALSEISH; break;
+        case Q_OPER_FALSEISH:      check->operator = Q_OPER_TRUEISH; break;
+        case Q_OPER_EQUAL:         check->operator = Q_OPER_NOT_EQUAL; break;
+        case Q_OPER_NOT_EQUAL:     check->operator = Q_OPER_EQUAL; break;
+        case Q_OPER_LESSER:        check->operator = Q_OPER_GREATER_EQUAL; break;
+        case Q_OPER_GREATER:       check->operator = Q_OPER_LESSER_EQUAL; break;
+        case Q_OPER_LESSER_EQUAL:  check->operator = Q_OPER_GREATER; break;
+        case Q_OPER_GREATER_EQUAL: check->operator = Q_OPER_LESSER; break;
+        default:
+          Q_FAIL(parser, "Operator cannot be inverted");
+        }
       }
 
-      VALUE args[3] = { key, ID2SYM(operator), operand };
-      result = rb_class_new_instance(3, args, q_view_attr_check());
+      ++parser->ast.num_checks;
+      return Q_MATCH;
     } else {
-      rb_raise(rb_eRuntimeError, "No closing ] for attribute");
+      Q_FAIL(parser, "No closing ] for attribute");
     }
   }
 
-  return result;
+  return Q_NO_MATCH;
 }
 
 
 static
-VALUE
+int
 q_read_multi_class_tag(qparser_t *parser)
 {
-  if (q_accept(parser, Q_START_MULTI_TAG, Q_DO_NOT_ADD_TO_BUFFER)) {
-    VALUE names = rb_ary_new();
-    VALUE name = Qnil;
+  if (q_accept(parser, Q_START_MULTI_TAG)) {
+    qast_t *ast = &parser->ast;
+    qast_check_t *check = &ast->checks[ast->num_checks];
+
+    check->kind         = Q_CHECK_CLASS;
+    check->first_name   = ast->num_names;
+    check->num_names    = 0;
+    check->operand_kind = Q_OPERAND_NONE;
 
     q_skip_whitespace(parser);
 
-    while (RTEST((name = q_read_name(parser, Q_AS_SYMBOL)))) {
-      rb_ary_push(names, name);
+    while (q_read_name(parser, &ast->names[ast->num_names])) {
+      ++ast->num_names;
+      ++check->num_names;
 
       q_skip_whitespace(parser);
 
-      if (!q_accept(parser, Q_MULTI_TAG_SEP, Q_DO_NOT_ADD_TO_BUFFER)) {
+      if (!q_accept(parser, Q_MULTI_TAG_SEP)) {
         break;
       }
     }
 
     q_skip_whitespace(parser);
 
-    if (q_accept(parser, Q_END_MULTI_TAG, Q_DO_NOT_ADD_TO_BUFFER)) {
-      if (RARRAY_LEN(names) == 0) {
-        rb_raise(rb_eRuntimeError, "Cannot have an empty multi-tag selector");
-        return Qnil;
+    if (q_accept(parser, Q_END_MULTI_TAG)) {
+      if (check->num_names == 0) {
+        Q_FAIL(parser, "Cannot have an empty multi-tag selector");
       }
 
-      return rb_class_new_instance(1, &names, q_view_class_check());
+      ++ast->num_checks;
+      return Q_MATCH;
     } else {
-      rb_raise(rb_eRuntimeError, "Unclosed multi-tag selector");
+      Q_FAIL(parser, "Unclosed multi-tag selector");
     }
   }
-  return Qnil;
+  return Q_NO_MATCH;
 }
 
 
 static
-VALUE
+int
 q_read_single_class_tag(qparser_t *parser)
 {
-  VALUE name = q_read_name(parser, Q_AS_SYMBOL);
-  if (RTEST(name)) {
-    return rb_class_new_instance(1, &name, q_view_class_check());
+  qast_t *ast = &parser->ast;
+
+  if (q_read_name(parser, &ast->names[ast->num_names])) {
+    qast_check_t *check = &ast->checks[ast->num_checks++];
+
+    check->kind         = Q_CHECK_CLASS;
+    check->first_name   = ast->num_names++;
+    check->num_names    = 1;
+    check->operand_kind = Q_OPERAND_NONE;
+
+    return Q_MATCH;
   }
-  return Qnil;
+  return Q_NO_MATCH;
 }
 
 
 static
-VALUE
+int
 q_read_id_tag(qparser_t *parser)
 {
-  if (q_accept(parser, Q_TAG_MARKER, Q_DO_NOT_ADD_TO_BUFFER)) {
-    VALUE name = q_read_name(parser, Q_AS_SYMBOL);
+  if (q_accept(parser, Q_TAG_MARKER)) {
+    qast_check_t *check = &parser->ast.checks[parser->ast.num_checks];
 
-    if (RTEST(name)) {
-      return rb_class_new_instance(1, &name, q_view_tag_check());
+    if (!q_read_name(parser, &check->name)) {
+      Q_FAIL(parser, "Expected tag name after #");
     }
+
+    check->kind         = Q_CHECK_TAG;
+    check->first_name   = 0;
+    check->num_names    = 0;
+    check->operand_kind = Q_OPERAND_NONE;
+
+    ++parser->ast.num_checks;
+    return Q_MATCH;
   }
 
-  return Qnil;
+  return Q_NO_MATCH;
 }
 
 
 static
-VALUE
+int
 q_read_selector(qparser_t *parser)
 {
-
-  VALUE selector = Qnil;
-  VALUE attributes_ary = Qnil;
-  VALUE type_check = Qnil;
+  qast_t *ast = &parser->ast;
+  qast_compound_t *compound = &ast->compounds[ast->num_compounds];
   int globbed = Q_NO;
+  int result;
 
   q_skip_whitespace(parser);
 
+  compound->first_check = ast->num_checks;
+
   globbed =
-    q_accept(parser, Q_ANY_TAG_MARK, Q_DO_NOT_ADD_TO_BUFFER) ||
-    q_peek(parser) == '#' ||
-    q_peek(parser) == '[';
+    q_accept(parser, Q_ANY_TAG_MARK) ||
+    q_peek(parser) == Q_TAG_MARKER ||
+    q_peek(parser) == Q_START_ATTR;
 
   if (!globbed) {
-    type_check = q_read_multi_class_tag(parser);
+    result = q_read_multi_class_tag(parser);
 
-    if (NIL_P(type_check)) {
-      type_check = q_read_single_class_tag(parser);
+    if (result == Q_NO_MATCH) {
+      result = q_read_single_class_tag(parser);
+    }
 
-      if (NIL_P(type_check)) {
-        return Qnil;
-      }
+    if (result != Q_MATCH) {
+      return result;
     }
   }
 
-  selector = rb_class_new_instance(0, NULL, q_selector_class());
-  attributes_ary = q_selector_attributes(selector);
+  if (q_read_id_tag(parser) == Q_ERROR) {
+    return Q_ERROR;
+  }
 
-  if (RTEST(type_check)) {
-    rb_ary_push(attributes_ary, type_check);
+  while ((result = q_read_attribute(parser)) == Q_MATCH) {
+    /* nop */
   }
 
-  type_check = q_read_id_tag(parser);
-  if (RTEST(type_check)) {
-    rb_ary_push(attributes_ary, type_check);
+  if (result == Q_ERROR) {
+    return Q_ERROR;
   }
 
-  while (RTEST((type_check = q_read_attribute(parser)))) {
-    rb_ary_push(attributes_ary, type_check);
+  q_skip_whitespace(parser);
+
+  compound->num_checks = ast->num_checks - compound->first_check;
+  compound->direct = q_accept(parser, Q_DIRECT_FOLLOW) ? Q_YES : Q_NO;
+  ++ast->num_compounds;
+
+  return Q_MATCH;
+}
+
+
+static
+int
+q_run_parser(qparser_t *parser)
+{
+  int result = q_read_selector(parser);
+
+  if (result == Q_ERROR) {
+    return Q_ERROR;
+  } else if (result == Q_NO_MATCH) {
+    Q_FAIL(parser, "Unable to parse selector string");
   }
 
   q_skip_whitespace(parser);
 
-  q_selector_set_direct(
-    selector,
-    q_accept(parser, Q_DIRECT_FOLLOW, Q_DO_NOT_ADD_TO_BUFFER)
-    );
+  while (!q_eos(parser) && (result = q_read_selector(parser)) == Q_MATCH) {
+    q_skip_whitespace(parser);
+  }
+
+  if (result == Q_ERROR) {
+    return Q_ERROR;
+  }
 
-  return selector;
+  if (q_eos(parser) &&
+      parser->ast.compounds[parser->ast.num_compounds - 1].direct) {
+    Q_FAIL(parser, "No selector following direct reference (>)");
+  }
+
+  if (!q_eos(parser)) {
+    Q_FAIL(parser, "Unable to completely parse selector string");
+  }
+
+  return Q_MATCH;
+}
+
+
+
+/*=============================================================================
+|  Building Ruby objects                                                      |
+=============================================================================*/
+
+ID
+q_operator_id(qoperator_t operator)
+{
+  switch (operator) {
+  case Q_OPER_TRUEISH:       return q_id_trueish;
+  case Q_OPER_FALSEISH:      return q_id_falseish;
+  case Q_OPER_EQUAL:         return q_id_equal;
+  case Q_OPER_NOT_EQUAL:     return q_id_not_equal;
+  case Q_OPER_GREATER:       return q_id_greater;
+  case Q_OPER_GREATER_EQUAL: return q_id_greater_equal;
+  case Q_OPER_LESSER:        return q_id_lesser;
+  case Q_OPER_LESSER_EQUAL:  return q_id_lesser_equal;
+  case Q_OPER_CONTAINS:      return q_id_contains;
+  default:                   break;
+  }
+
+  rb_raise(rb_eArgError, "Invalid selector operator: %d", (int)operator);
+  return 0;
 }
 
 
 static
 VALUE
-q_rb_ensure_destroy_parser(VALUE parser_data)
+q_build_name_symbol(qslice_t name, rb_encoding *enc)
 {
-  qparser_t *parser = (qparser_t *)DATA_PTR(parser_data);
-  q_destroy_parser(parser);
-  DATA_PTR(parser_data) = NULL;
-  return Qnil;
+  return ID2SYM(rb_intern3(name.chars, name.length, enc));
 }
 
 
 static
 VALUE
-q_rb_run_parser(VALUE parser_data)
+q_build_operand(const qast_check_t *check, rb_encoding *enc)
 {
-  qparser_t *parser = (qparser_t *)DATA_PTR(parser_data);
-  VALUE selector = Qnil;
-  VALUE succ = Qnil;
-  VALUE next_succ = Qnil;
+  const qslice_t operand = check->operand;
+  char number[Q_NUMBER_BUFFER_SIZE];
+
+  switch (check->operand_kind) {
+  case Q_OPERAND_STRING:
+    if (check->escaped) {
+      /* Drop the backslash in front of each escaped character */
+      VALUE str = rb_enc_str_new(NULL, 0, enc);
+      const char *run = operand.chars;
+      const char *const end = operand.chars + operand.length;
+      const char *ch;
+
+      for (ch = run; ch < end; ++ch) {
+        if (*ch == '\\') {
+          rb_str_cat(str, run, ch - run);
+          run = ++ch;
+        }
+      }
+      rb_str_cat(str, run, end - run);
+      return str;
+    }
+    /* fall through */
 
-  selector = q_read_selector(parser);
-  succ = selector;
+  case Q_OPERAND_NAME:
+    return rb_enc_str_new(operand.chars, operand.length, enc);
 
-  if (NIL_P(selector)) {
-    rb_raise(rb_eRuntimeError, "Unable to parse selector string");
+  case Q_OPERAND_INTEGER:
+    if (operand.length < Q_NUMBER_BUFFER_SIZE) {
+      memcpy(number, operand.chars, operand.length);
+      number[operand.length] = '\0';
+      return rb_cstr2inum(number, 10);
+    }
+    return rb_str2inum(rb_str_new(operand.chars, operand.length), 10);
+
+  case Q_OPERAND_FLOAT:
+    if (operand.length < Q_NUMBER_BUFFER_SIZE) {
+      memcpy(number, operand.chars, operand.length);
+      number[operand.length] = '\0';
+      return DBL2NUM(strtod(number, NULL));
+    }
+    return DBL2NUM(rb_str_to_dbl(rb_str_new(operand.chars, operand.length), Q_NO));
+
+  default:
     return Qnil;
   }
+}
 
-  q_skip_whitespace(parser);
 
-  while (!q_eos(parser) && RTEST(next_succ = q_read_selector(parser))) {
-    q_selector_set_succ(succ, next_succ);
-    succ = next_succ;
-    next_succ = Qnil;
-    q_skip_whitespace(parser);
+/*
+  Returns the ViewAttrCheck subclass to allocate for operator and operand. The
+  classes are constants, so they're cached here without being marked.
+*/
+static
+VALUE
+q_attr_check_class(qoperator_t operator, VALUE operand)
+{
+  const int is_string = RB_TYPE_P(operand, T_STRING);
+  VALUE klass = q_attr_check_classes[operator][is_string];
+
+  if (klass == Qfalse) {
+    klass = q_view_attr_check();
+    if (rb_respond_to(klass, q_id_specialized_class)) {
+      VALUE args[2] = { ID2SYM(q_operator_id(operator)), operand };
+      klass = rb_funcall2(klass, q_id_specialized_class, 2, args);
+      q_attr_check_classes[operator][is_string] = klass;
+    }
   }
 
-  if (q_eos(parser) && q_selector_is_direct(succ) && NIL_P(q_selector_succ(succ))) {
-    rb_raise(rb_eRuntimeError, "No selector following direct reference (>)");
-    return Qnil;
+  return klass;
+}
+
+
+/*
+  Checks are allocated without calling initialize, so the ivars set here have
+  to be kept in line with their initialize methods in checks.rb.
+*/
+static
+VALUE
+q_build_check(const qast_t *ast, const qast_check_t *check, rb_encoding *enc)
+{
+  VALUE result = Qnil;
+
+  switch (check->kind) {
+  case Q_CHECK_CLASS: {
+    VALUE names = rb_ary_new_capa(check->num_names);
+    long name_index;
+
+    for (name_index = 0; name_index < check->num_names; ++name_index) {
+      rb_ary_push(
+        names,
+        q_build_name_symbol(ast->names[check->first_name + name_index], enc)
+        );
+    }
+
+    result = rb_obj_alloc(q_view_class_check());
+    rb_ivar_set(result, q_id_ivar_classnames, names);
+    break;
   }
 
-  if (!q_eos(parser)) {
-    rb_raise(rb_eRuntimeError, "Unable to completely parse selector string");
-    return Qnil;
+  case Q_CHECK_TAG:
+    result = rb_obj_alloc(q_view_tag_check());
+    rb_ivar_set(result, q_id_ivar_tagname, q_build_name_symbol(check->name, enc));
+    break;
+
+  case Q_CHECK_ATTR: {
+    VALUE key = rb_ary_new();
+    VALUE operand = q_build_operand(check, enc);
+    int is_string = RB_TYPE_P(operand, T_STRING);
+    qslice_t part = { check->name.chars, 0 };
+    const char *const end = check->name.chars + check->name.length;
+    const char *ch;
+
+    /* Split the key path on . */
+    for (ch = check->name.chars; ch <= end; ++ch) {
+      if (ch == end || *ch == '.') {
+        part.length = ch - part.chars;
+        if (part.length > 0) {
+          rb_ary_push(key, q_build_name_symbol(part, enc));
+        }
+        part.chars = ch + 1;
+      }
+    }
+
+    result = rb_obj_alloc(q_attr_check_class(check->operator, operand));
+    rb_ivar_set(result, q_id_ivar_key, key);
+    rb_ivar_set(result, q_id_ivar_operator, ID2SYM(q_operator_id(check->operator)));
+    rb_ivar_set(result, q_id_ivar_operand, operand);
+    rb_ivar_set(result, q_id_ivar_is_string, is_string ? Qtrue : Qfalse);
+    rb_ivar_set(
+      result,
+      q_id_ivar_operand_sym,
+      is_string ? rb_str_intern(operand) : Qnil
+      );
+    break;
+  }
+  }
+
+  return result;
+}
+
+
+/*
+  Selectors are also allocated without calling initialize (see q_build_check).
+  The chain is built back to front so each selector's successor exists when
+  it's created.
+*/
+VALUE
+q_build_selector(const qast_t *ast, rb_encoding *enc)
+{
+  VALUE succ = Qnil;
+  long compound_index;
+  long check_index;
+
+  for (compound_index = ast->num_compounds - 1;
+       compound_index >= 0;
+       --compound_index) {
+    const qast_compound_t *compound = &ast->compounds[compound_index];
+    VALUE attributes = rb_ary_new_capa(compound->num_checks);
+    VALUE selector;
+
+    for (check_index = 0; check_index < compound->num_checks; ++check_index) {
+      rb_ary_push(
+        attributes,
+        q_build_check(ast, &ast->checks[compound->first_check + check_index], enc)
+        );
+    }
+
+    selector = rb_obj_alloc(q_selector_class());
+    rb_ivar_set(selector, q_id_ivar_succ, succ);
+    rb_ivar_set(selector, q_id_ivar_attributes, attributes);
+    rb_ivar_set(selector, q_id_ivar_direct, compound->direct ? Qtrue : Qfalse);
+    succ = selector;
   }
 
-  return selector;
+  return succ;
 }
 
 
 static
 VALUE
-q_rb_parse_selector(VALUE self, VALUE selector_rb_str)
+q_rb_build_body(VALUE build_ptr)
+{
+  qbuild_t *build = (qbuild_t *)build_ptr;
+  return build->fn(&build->parser->ast, build->source, build->context);
+}
+
+
+static
+VALUE
+q_rb_build_ensure(VALUE build_ptr)
+{
+  qbuild_t *build = (qbuild_t *)build_ptr;
+  q_arena_release(build->arena);
+  return Qnil;
+}
+
+
+VALUE
+q_parse_ast(VALUE source, qast_fn_t fn, void *context)
 {
-  /* selector_rb_str must be UTF8-encoded */
   qparser_t parser;
-  const char *sel_cstr = StringValuePtr(selector_rb_str);
-  VALUE wrapped_parser = Data_Wrap_Struct(rb_cData, NULL, NULL, &parser);
+  qbuild_t build;
+  qarena_t *arena = NULL;
+  VALUE arena_holder = Qnil;
+  long length;
+  char *block;
+  VALUE result;
+
+  StringValue(source);
+  /*
+    Building runs Ruby code, which could modify the caller's string out from
+    under the AST's slices -- a frozen copy shares its bytes and can't be
+  */
+  source = rb_str_new_frozen(source);
 
   /*
     don't use rb_str_length -- just want length in bytes, not necessary valid
     characters
   */
-  q_init_parser(&parser, sel_cstr, (int)RSTRING_LEN(selector_rb_str));
+  length = RSTRING_LEN(source);
+  block = q_arena_acquire(&arena, &arena_holder, q_arena_size_for(length));
+
+  q_init_parser(&parser, RSTRING_PTR(source), length, block);
 
-  return rb_ensure(
-    q_rb_run_parser, wrapped_parser,
-    q_rb_ensure_destroy_parser, wrapped_parser
+  if (q_run_parser(&parser) != Q_MATCH) {
+    const char *error = parser.error;
+    q_arena_release(arena);
+    rb_raise(rb_eRuntimeError, "%s", error);
+    return Qnil;
+  }
+
+  build.parser  = &parser;
+  build.arena   = arena;
+  build.source  = source;
+  build.fn      = fn;
+  build.context = context;
+
+  result = rb_ensure(
+    q_rb_build_body, (VALUE)&build,
+    q_rb_build_ensure, (VALUE)&build
     );
+
+  RB_GC_GUARD(source);
+  RB_GC_GUARD(arena_holder);
+  return result;
+}
+
+
+static
+VALUE
+q_build_parsed_selector(const qast_t *ast, VALUE source, void *context)
+{
+  (void)context;
+  return q_build_selector(ast, rb_enc_get(source));
+}
+
+
+static
+VALUE
+q_rb_parse_selector(VALUE self, VALUE selector_rb_str)
+{
+  (void)self;
+  return q_parse_ast(selector_rb_str, q_build_parsed_selector, NULL);
 }
 
 
 void
 Init_selector_ext()
 {
+  q_init_scan();
+
   /* init ext bindings */
   rb_define_singleton_method(q_parser_module(), "parse", q_rb_parse_selector, 1);
 
@@ -907,6 +1176,29 @@ Init_selector_ext()
   q_id_trueish       = rb_intern("trueish");
   q_id_falseish      = rb_intern("falseish");
 
+  q_id_ivar_succ        = rb_intern("@succ");
+  q_id_ivar_attributes  = rb_intern("@attributes");
+  q_id_ivar_direct      = rb_intern("@direct");
+  q_id_ivar_classnames  = rb_intern("@classnames");
+  q_id_ivar_tagname     = rb_intern("@tagname");
+  q_id_ivar_key         = rb_intern("@key");
+  q_id_ivar_operator    = rb_intern("@operator");
+  q_id_ivar_operand     = rb_intern("@operand");
+  q_id_ivar_is_string   = rb_intern("@is_string");
+  q_id_ivar_operand_sym = rb_intern("@operand_sym");
+
+  q_id_specialized_class = rb_intern("specialized_class");
+  q_id_thread_arena      = rb_intern("__gui_selector_arena__");
+
+  rb_define_const(
+    q_parser_module(), "SCANNER",
+    rb_obj_freeze(rb_str_new_cstr(q_scan_impl_name()))
+    );
+
+  q_init_match();
+  q_init_set();
+  q_init_pack();
+
   rb_require("gui/selector");
+  rb_require("gui/selector/pack");
 }
-
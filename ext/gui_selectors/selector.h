@@ -0,0 +1,295 @@
+//  Copyright 2014 Noel Cower
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  ----------------------------------------------------------------------------
+//
+//  selector.h
+//    Declarations shared between the parts of the selector extension.
+
+
+#ifndef __GUI_SELECTOR_H__
+#define __GUI_SELECTOR_H__
+
+
+#include "ruby.h"
+#include "ruby/encoding.h"
+
+
+/*=============================================================================
+|  Lazy class/module/ID definitions                                           |
+=============================================================================*/
+
+#define LAZY_CLASS_DEF_UNDER(FNAME, UNDER, CLASSNAME, SUPERCLASS)    \
+VALUE                                                                \
+FNAME ()                                                             \
+{                                                                    \
+  static VALUE klass = Qnil;                                         \
+  if (NIL_P(klass))                                                  \
+    klass = rb_define_class_under((UNDER), #CLASSNAME, SUPERCLASS);  \
+  return klass;                                                      \
+}
+
+
+#define LAZY_MODULE_DEF_UNDER(FNAME, UNDER, MODNAME)                 \
+VALUE                                                                \
+FNAME ()                                                             \
+{                                                                    \
+  static VALUE mod = Qnil;                                           \
+  if (NIL_P(mod))                                                    \
+    mod = rb_define_module_under((UNDER), #MODNAME);                 \
+  return mod;                                                        \
+}
+
+
+#define LAZY_MODULE_DEF(FNAME, MODNAME)                              \
+VALUE                                                                \
+FNAME ()                                                             \
+{                                                                    \
+  static VALUE mod = Qnil;                                           \
+  if (NIL_P(mod))                                                    \
+    mod = rb_define_module(#MODNAME);                                \
+  return mod;                                                        \
+}
+
+
+#define LAZY_STATIC_ID(NAME, SYM)                                    \
+  static ID NAME = 0;                                                \
+  if (NAME == 0) NAME = rb_intern(SYM)
+
+
+
+/*=============================================================================
+|  Selector AST (selector.c)                                                  |
+=============================================================================*/
+
+/*
+  The parser produces a flat AST in a single arena allocation. Names and
+  operands are slices of the parsed string rather than copies, and Ruby
+  objects are only created once the whole selector has been parsed.
+*/
+
+typedef enum e_qoperator
+{
+  Q_OPER_TRUEISH,
+  Q_OPER_FALSEISH,
+  Q_OPER_EQUAL,
+  Q_OPER_NOT_EQUAL,
+  Q_OPER_GREATER,
+  Q_OPER_GREATER_EQUAL,
+  Q_OPER_LESSER,
+  Q_OPER_LESSER_EQUAL,
+  Q_OPER_CONTAINS,
+
+  Q_OPER_COUNT
+} qoperator_t;
+
+
+typedef enum e_qcheck_kind
+{
+  Q_CHECK_CLASS,
+  Q_CHECK_TAG,
+  Q_CHECK_ATTR
+} qcheck_kind_t;
+
+
+typedef enum e_qoperand_kind
+{
+  Q_OPERAND_NONE,
+  /* Quoted string -- may contain backslash escapes if escaped is set */
+  Q_OPERAND_STRING,
+  /* Bare name, converted to a String */
+  Q_OPERAND_NAME,
+  Q_OPERAND_INTEGER,
+  Q_OPERAND_FLOAT
+} qoperand_kind_t;
+
+
+typedef struct s_qslice
+{
+  const char *chars;
+  long length;
+} qslice_t;
+
+
+typedef struct s_qast_check
+{
+  qcheck_kind_t kind;
+  /* Tag name for Q_CHECK_TAG, key path for Q_CHECK_ATTR */
+  qslice_t name;
+  /* Range of ast->names holding class names for Q_CHECK_CLASS */
+  long first_name;
+  long num_names;
+  qoperator_t operator;
+  qoperand_kind_t operand_kind;
+  int escaped;
+  qslice_t operand;
+} qast_check_t;
+
+
+typedef struct s_qast_compound
+{
+  int direct;
+  long first_check;
+  long num_checks;
+} qast_compound_t;
+
+
+typedef struct s_qast
+{
+  long num_compounds;
+  qast_compound_t *compounds;
+  long num_checks;
+  qast_check_t *checks;
+  long num_names;
+  qslice_t *names;
+} qast_t;
+
+
+/*
+  Returns the Selector chain for an AST. Strings and symbols are created with
+  the given encoding.
+*/
+VALUE q_build_selector(const qast_t *ast, rb_encoding *enc);
+
+/*
+  Parses source and passes its AST to fn, returning fn's result. The AST and
+  its slices are only valid until fn returns. fn is passed a frozen copy of
+  source, which the slices point into, so they're unaffected if source is
+  modified meanwhile. Raises a RuntimeError if source isn't a valid selector.
+*/
+typedef VALUE (*qast_fn_t)(const qast_t *ast, VALUE source, void *context);
+VALUE q_parse_ast(VALUE source, qast_fn_t fn, void *context);
+
+/* Returns the Symbol ID for an operator (e.g., :greater_equal) */
+ID q_operator_id(qoperator_t operator);
+
+
+
+/*=============================================================================
+|  Classes and modules (selector.c)                                           |
+=============================================================================*/
+
+VALUE q_gui_module(void);
+VALUE q_parser_module(void);
+VALUE q_selector_class(void);
+VALUE q_view_class_check(void);
+VALUE q_view_tag_check(void);
+VALUE q_view_attr_check(void);
+
+
+/* Operator names */
+extern ID q_id_equal;
+extern ID q_id_not_equal;
+extern ID q_id_greater;
+extern ID q_id_greater_equal;
+extern ID q_id_lesser;
+extern ID q_id_lesser_equal;
+extern ID q_id_contains;
+extern ID q_id_trueish;
+extern ID q_id_falseish;
+
+
+
+/*=============================================================================
+|  Character classes and scanning (scan.c)                                    |
+=============================================================================*/
+
+enum {
+  /* Characters that end a name */
+  Q_CC_NAME_BOUND   = 1 << 0,
+  /* Characters that end a run of plain characters in a quoted string */
+  Q_CC_STRING_BOUND = 1 << 1,
+  Q_CC_SPACE        = 1 << 2,
+  Q_CC_DIGIT        = 1 << 3,
+  Q_CC_EXPONENT     = 1 << 4,
+  Q_CC_SIGN         = 1 << 5
+};
+
+
+extern const unsigned char q_char_classes[256];
+
+#define Q_CHAR_IS(CH, CLASS) (q_char_classes[(unsigned char)(CH)] & (CLASS))
+
+
+/*
+  Return a pointer to the first character in [chars, end) that ends a name or
+  a plain run of a string, respectively, or end if there isn't one.
+*/
+const char *q_scan_name(const char *chars, const char *end);
+const char *q_scan_string(const char *chars, const char *end);
+
+/* Name of the scanner picked by q_init_scan ("scalar", "sse2", "sse4.2") */
+const char *q_scan_impl_name(void);
+
+void q_init_scan(void);
+
+
+
+/*=============================================================================
+|  Matching engine (match.c)                                                  |
+=============================================================================*/
+
+typedef struct s_qprogram qprogram_t;
+
+/* What a compiled selector's last compound can be looked up by */
+typedef enum e_qkey_kind
+{
+  Q_KEY_UNIVERSAL,
+  Q_KEY_TAG,
+  Q_KEY_CLASS
+} qkey_kind_t;
+
+
+/* Returns the program of a GUI::CompiledSelector, raising if it isn't one */
+const qprogram_t *q_compiled_program(VALUE compiled);
+
+/*
+  Returns whether view matches the program's last compound and its superviews
+  (up to root, or any if root is nil) match the rest.
+*/
+int q_program_matches(const qprogram_t *program, VALUE view, VALUE root);
+
+/*
+  Returns the key views matched by the program's last compound must have: a
+  tag (stored in *tag), one of a list of class names (stored in *names and
+  *num_names), or none.
+*/
+qkey_kind_t q_program_key(const qprogram_t *program, VALUE *tag, const ID **names, long *num_names);
+
+/* Returns the unqualified name of a class or module (e.g., :View) */
+ID q_class_short_name(VALUE klass);
+
+/* Returns a view's subviews Array, or nil */
+VALUE q_view_subviews(VALUE view);
+
+void q_init_match(void);
+
+
+
+/*=============================================================================
+|  Selector sets (set.c)                                                      |
+=============================================================================*/
+
+void q_init_set(void);
+
+
+
+/*=============================================================================
+|  Precompiled selector packs (pack.c)                                        |
+=============================================================================*/
+
+void q_init_pack(void);
+
+
+#endif /* end __GUI_SELECTOR_H__ include guard */
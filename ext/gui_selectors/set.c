@@ -0,0 +1,468 @@
+//  Copyright 2014 Noel Cower
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  ----------------------------------------------------------------------------
+//
+//  set.c
+//    Selector sets -- matching many selectors against a tree in one pass.
+//
+//    Each selector (a rule) is put in a bucket by the rightmost thing a view
+//    must have to match it: a tag, one of a set of class names, or nothing
+//    (universal rules). Walking the tree, each view is only tested against
+//    the rules in its tag's bucket, its classes' buckets, and the universal
+//    bucket. The rules for a class (its and its superclasses' buckets plus
+//    the universal ones) are worked out once per class and reused.
+
+
+#include "selector.h"
+
+
+/*=============================================================================
+|  Types and values                                                           |
+=============================================================================*/
+
+typedef struct s_qset
+{
+  /* Rules in the order they were added */
+  VALUE selectors;
+  VALUE compiled;
+  VALUE values;
+  /* tag -> Array of rule indices */
+  VALUE tag_rules;
+  /* class name Symbol -> Array of rule indices */
+  VALUE name_rules;
+  /* Array of rule indices */
+  VALUE universal_rules;
+  /* class -> sorted Array of rule indices, built on demand */
+  VALUE class_rules;
+} qset_t;
+
+
+typedef struct s_qset_walk
+{
+  qset_t *set;
+  VALUE root;
+} qset_walk_t;
+
+
+static ID q_id_build = 0;
+static ID q_id_compiled = 0;
+static ID q_id_tag = 0;
+
+
+static LAZY_CLASS_DEF_UNDER(
+  q_selector_set_class,
+  q_gui_module(),
+  SelectorSet,
+  rb_cObject
+  );
+
+
+
+/*=============================================================================
+|  Prototypes                                                                 |
+=============================================================================*/
+
+static void q_set_mark(void *ptr);
+static size_t q_set_size(const void *ptr);
+static qset_t *q_get_set(VALUE self);
+static void q_set_bucket_push(VALUE buckets, VALUE key, long rule);
+static VALUE q_set_rules_for_class(qset_t *set, VALUE klass);
+static void q_set_test(qset_walk_t *walk, VALUE view, long rule);
+static void q_set_visit(qset_walk_t *walk, VALUE view);
+
+
+
+/*=============================================================================
+|  Set allocation                                                             |
+=============================================================================*/
+
+static const rb_data_type_t q_set_type = {
+  "GUI::SelectorSet",
+  { q_set_mark, RUBY_TYPED_DEFAULT_FREE, q_set_size, },
+  NULL, NULL,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+
+static
+void
+q_set_mark(void *ptr)
+{
+  const qset_t *set = (const qset_t *)ptr;
+  rb_gc_mark(set->selectors);
+  rb_gc_mark(set->compiled);
+  rb_gc_mark(set->values);
+  rb_gc_mark(set->tag_rules);
+  rb_gc_mark(set->name_rules);
+  rb_gc_mark(set->universal_rules);
+  rb_gc_mark(set->class_rules);
+}
+
+
+static
+size_t
+q_set_size(const void *ptr)
+{
+  (void)ptr;
+  return sizeof(qset_t);
+}
+
+
+static
+qset_t *
+q_get_set(VALUE self)
+{
+  qset_t *set;
+  TypedData_Get_Struct(self, qset_t, &q_set_type, set);
+  return set;
+}
+
+
+static
+VALUE
+q_rb_set_alloc(VALUE klass)
+{
+  qset_t *set;
+  VALUE self = TypedData_Make_Struct(klass, qset_t, &q_set_type, set);
+
+  set->selectors       = rb_ary_new();
+  set->compiled        = rb_ary_new();
+  set->values          = rb_ary_new();
+  set->tag_rules       = rb_hash_new();
+  set->name_rules      = rb_hash_new();
+  set->universal_rules = rb_ary_new();
+  set->class_rules     = rb_hash_new();
+
+  rb_funcall2(set->class_rules, rb_intern("compare_by_identity"), 0, NULL);
+
+  return self;
+}
+
+
+
+/*=============================================================================
+|  Buckets                                                                    |
+=============================================================================*/
+
+static
+void
+q_set_bucket_push(VALUE buckets, VALUE key, long rule)
+{
+  VALUE bucket = rb_hash_lookup2(buckets, key, Qnil);
+  if (NIL_P(bucket)) {
+    bucket = rb_ary_new();
+    rb_hash_aset(buckets, key, bucket);
+  }
+  rb_ary_push(bucket, LONG2FIX(rule));
+}
+
+
+static
+int
+q_compare_rules(const void *left, const void *right)
+{
+  const long l = FIX2LONG(*(const VALUE *)left);
+  const long r = FIX2LONG(*(const VALUE *)right);
+  return (l > r) - (l < r);
+}
+
+
+/*
+  Returns the sorted rule indices for views of klass, other than those in
+  tag buckets: the buckets of its and its superclasses' names and the
+  universal bucket.
+*/
+static
+VALUE
+q_set_rules_for_class(qset_t *set, VALUE klass)
+{
+  VALUE rules = rb_hash_lookup2(set->class_rules, klass, Qnil);
+  VALUE ancestor;
+  VALUE sorted;
+  long index;
+
+  if (!NIL_P(rules)) {
+    return rules;
+  }
+
+  rules = rb_ary_dup(set->universal_rules);
+
+  for (ancestor = klass; !NIL_P(ancestor); ancestor = rb_class_superclass(ancestor)) {
+    VALUE bucket = rb_hash_lookup2(
+      set->name_rules, ID2SYM(q_class_short_name(ancestor)), Qnil
+      );
+    if (!NIL_P(bucket)) {
+      rb_ary_concat(rules, bucket);
+    }
+  }
+
+  /* A rule with more than one class name may be in several buckets */
+  RARRAY_PTR_USE(rules, rule_ptr,
+    qsort(rule_ptr, RARRAY_LEN(rules), sizeof(VALUE), q_compare_rules));
+  sorted = rb_ary_new_capa(RARRAY_LEN(rules));
+  for (index = 0; index < RARRAY_LEN(rules); ++index) {
+    VALUE rule = rb_ary_entry(rules, index);
+    if (index == 0 || rule != rb_ary_entry(rules, index - 1)) {
+      rb_ary_push(sorted, rule);
+    }
+  }
+
+  rb_obj_freeze(sorted);
+  rb_hash_aset(set->class_rules, klass, sorted);
+  return sorted;
+}
+
+
+
+/*=============================================================================
+|  Matching                                                                   |
+=============================================================================*/
+
+static
+void
+q_set_test(qset_walk_t *walk, VALUE view, long rule)
+{
+  const qprogram_t *program =
+    q_compiled_program(rb_ary_entry(walk->set->compiled, rule));
+
+  if (q_program_matches(program, view, walk->root)) {
+    rb_yield_values(3,
+      view,
+      rb_ary_entry(walk->set->selectors, rule),
+      rb_ary_entry(walk->set->values, rule)
+      );
+  }
+}
+
+
+/*
+  Tests view against its candidate rules in the order they were added (the
+  class and tag rule lists are both sorted, so they're merged), then visits
+  its subviews.
+
+  The block may change the tree, so the subviews visited are those view had
+  before its matches were yielded, not whatever its subviews array holds
+  partway through the walk.
+*/
+static
+void
+q_set_visit(qset_walk_t *walk, VALUE view)
+{
+  qset_t *set = walk->set;
+  VALUE class_rules = q_set_rules_for_class(set, rb_obj_class(view));
+  VALUE tag = rb_check_funcall(view, q_id_tag, 0, NULL);
+  VALUE tag_rules = Qnil;
+  VALUE subviews;
+  long class_index = 0;
+  long tag_index = 0;
+  long subview_index;
+
+  if (tag != Qundef && !NIL_P(tag)) {
+    tag_rules = rb_hash_lookup2(set->tag_rules, tag, Qnil);
+  }
+
+  subviews = q_view_subviews(view);
+  if (!NIL_P(subviews)) {
+    subviews = RARRAY_LEN(subviews) == 0 ? Qnil : rb_ary_dup(subviews);
+  }
+
+  for (;;) {
+    const long num_class = RARRAY_LEN(class_rules);
+    const long num_tag = NIL_P(tag_rules) ? 0 : RARRAY_LEN(tag_rules);
+    long next_class = class_index < num_class
+                      ? FIX2LONG(rb_ary_entry(class_rules, class_index)) : -1;
+    long next_tag = tag_index < num_tag
+                    ? FIX2LONG(rb_ary_entry(tag_rules, tag_index)) : -1;
+
+    if (next_class < 0 && next_tag < 0) {
+      break;
+    } else if (next_tag < 0 || (next_class >= 0 && next_class < next_tag)) {
+      ++class_index;
+      q_set_test(walk, view, next_class);
+    } else {
+      ++tag_index;
+      q_set_test(walk, view, next_tag);
+    }
+  }
+
+  for (subview_index = 0;
+       !NIL_P(subviews) && subview_index < RARRAY_LEN(subviews);
+       ++subview_index) {
+    q_set_visit(walk, rb_ary_entry(subviews, subview_index));
+  }
+
+  RB_GC_GUARD(class_rules);
+  RB_GC_GUARD(tag_rules);
+  RB_GC_GUARD(subviews);
+}
+
+
+
+/*=============================================================================
+|  Ruby methods                                                               |
+=============================================================================*/
+
+/*
+  call-seq:
+    add(selector, value = nil) -> self
+
+  Adds a rule to the set. selector may be a Selector or a selector string,
+  which is built with Selector.build. value is yielded along with the
+  selector by each_match when the rule matches a view.
+
+  Unfrozen selectors are compiled when added, so later changes to them aren't
+  seen by the set.
+*/
+static
+VALUE
+q_rb_set_add(int argc, VALUE *argv, VALUE self)
+{
+  qset_t *set = q_get_set(self);
+  VALUE selector;
+  VALUE value;
+  VALUE compiled;
+  VALUE tag = Qnil;
+  const ID *names = NULL;
+  long num_names = 0;
+  long rule;
+  long name_index;
+
+  rb_scan_args(argc, argv, "11", &selector, &value);
+  rb_check_frozen(self);
+
+  if (RB_TYPE_P(selector, T_STRING)) {
+    selector = rb_funcall2(q_selector_class(), q_id_build, 1, &selector);
+  } else if (!rb_obj_is_kind_of(selector, q_selector_class())) {
+    rb_raise(rb_eTypeError, "Expected a GUI::Selector or String, got %"PRIsVALUE,
+             rb_obj_class(selector));
+  }
+
+  compiled = rb_funcall2(selector, q_id_compiled, 0, NULL);
+  rule = RARRAY_LEN(set->selectors);
+
+  switch (q_program_key(q_compiled_program(compiled), &tag, &names, &num_names)) {
+  case Q_KEY_TAG:
+    q_set_bucket_push(set->tag_rules, tag, rule);
+    break;
+
+  case Q_KEY_CLASS:
+    for (name_index = 0; name_index < num_names; ++name_index) {
+      q_set_bucket_push(set->name_rules, ID2SYM(names[name_index]), rule);
+    }
+    break;
+
+  case Q_KEY_UNIVERSAL:
+    rb_ary_push(set->universal_rules, LONG2FIX(rule));
+    break;
+  }
+
+  rb_ary_push(set->selectors, selector);
+  rb_ary_push(set->compiled, compiled);
+  rb_ary_push(set->values, value);
+  rb_hash_clear(set->class_rules);
+
+  return self;
+}
+
+
+/*
+  call-seq:
+    set << selector -> self
+
+  Adds a rule with no value. See add.
+*/
+static
+VALUE
+q_rb_set_push(VALUE self, VALUE selector)
+{
+  return q_rb_set_add(1, &selector, self);
+}
+
+
+/*
+  call-seq:
+    length -> Integer
+
+  Returns the number of rules in the set.
+*/
+static
+VALUE
+q_rb_set_length(VALUE self)
+{
+  return LONG2NUM(RARRAY_LEN(q_get_set(self)->selectors));
+}
+
+
+/*
+  call-seq:
+    selectors -> Array
+
+  Returns the set's selectors in the order they were added.
+*/
+static
+VALUE
+q_rb_set_selectors(VALUE self)
+{
+  return rb_ary_dup(q_get_set(self)->selectors);
+}
+
+
+/*
+  call-seq:
+    each_match(root) { |view, selector, value| ... } -> self
+    each_match(root) -> Enumerator
+
+  Walks the tree under and including root once, depth-first, yielding each
+  view and rule that matches it. A view's matching rules are yielded in the
+  order the rules were added. As with Selector#find_all, no views above root
+  are used to match a rule.
+
+  Without a block, returns an Enumerator that walks the tree as it's
+  iterated, so taking only the first few matches (or breaking out of the
+  block) stops the walk early.
+*/
+static
+VALUE
+q_rb_set_each_match(VALUE self, VALUE root)
+{
+  qset_walk_t walk;
+
+  RETURN_ENUMERATOR(self, 1, &root);
+
+  walk.set  = q_get_set(self);
+  walk.root = root;
+
+  q_set_visit(&walk, root);
+
+  return self;
+}
+
+
+void
+q_init_set(void)
+{
+  VALUE klass = q_selector_set_class();
+
+  q_id_build    = rb_intern("build");
+  q_id_compiled = rb_intern("compiled");
+  q_id_tag      = rb_intern("tag");
+
+  rb_define_alloc_func(klass, q_rb_set_alloc);
+  rb_define_method(klass, "add", q_rb_set_add, -1);
+  rb_define_method(klass, "<<", q_rb_set_push, 1);
+  rb_define_method(klass, "length", q_rb_set_length, 0);
+  rb_define_method(klass, "selectors", q_rb_set_selectors, 0);
+  rb_define_method(klass, "each_match", q_rb_set_each_match, 1);
+}
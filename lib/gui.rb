@@ -28,6 +28,8 @@ require 'gui/geom'
 require 'gui/color'
 require 'gui/selector'
 require 'gui/selector/checks'
-# require 'gui/selector_ext'
+require 'gui/selector_ext'
+require 'gui/selector/pack'
 require 'gui/view'
+require 'gui/layout/stack_view'
 require 'gui/window'
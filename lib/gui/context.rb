@@ -21,6 +21,9 @@
 require 'glfw3'
 require 'opengl-core'
 require 'gui/gl/program'
+require 'gui/gl/texture_atlas'
+require 'gui/profiler'
+require 'gui/scheduler'
 
 
 module GUI
@@ -42,6 +45,9 @@ class Context
     }
   GLSL
 
+  # Attributes are read as floats whatever the driver's vertex format (see
+  # Driver::VERTEX_FORMATS) -- GL normalizes packed texcoords and colors and
+  # converts half float and short positions.
   DEFAULT_VERT_SHADER = <<-GLSL.freeze
     #version 150
 
@@ -88,19 +94,34 @@ class Context
       Glfw::Window.window_hint(Glfw::OPENGL_PROFILE, Glfw::OPENGL_CORE_PROFILE)
     end
 
-    def post(blocklike = nil, &block)
+    def post(blocklike = nil, priority: :normal, deadline: nil, &block)
       ctx = __active_context__
       raise "No active context to post block to" unless ctx
-      ctx.post(blocklike) if blocklike
-      ctx.post(block) if block
+      ctx.post(blocklike, priority: priority, deadline: deadline) if blocklike
+      ctx.post(block, priority: priority, deadline: deadline) if block
       self
     end
 
+    # Refresh rate of the primary monitor, or Scheduler::DEFAULT_REFRESH_RATE
+    # if it's unknown.
+    def __display_refresh_rate__
+      monitor = Glfw::Monitor.primary_monitor if Glfw::Monitor.respond_to?(:primary_monitor)
+      mode = monitor && monitor.video_mode
+      rate = mode && mode.refresh_rate
+      (rate && rate > 0) ? rate : Scheduler::DEFAULT_REFRESH_RATE
+    end
+
   end # singleton_class
 
 
   attr_accessor :windows
   attr_reader   :program
+  # Profiler recording each frame of run, disabled by default
+  attr_reader   :profiler
+  # Scheduler for posted work, paced to the display's refresh rate
+  attr_reader   :scheduler
+  # Atlas request_texture packs small images into
+  attr_reader   :atlas
 
 
   def initialize
@@ -111,7 +132,8 @@ class Context
     @textures     = {}
     @sequence     = 0
     @root_context = Glfw::Window.new(64, 64, '', nil, nil)
-    @blocks       = []
+    @profiler     = Profiler.new
+    @scheduler    = Scheduler.new(self.class.__display_refresh_rate__)
 
     Window.bind_context(@root_context) do
       @program = ProgramObject.new
@@ -124,6 +146,8 @@ class Context
       @program.bind_frag_data_location(FRAG_OUT0, :frag_color)
 
       @program.link
+
+      @atlas = TextureAtlas.new
     end
   end
 
@@ -152,26 +176,43 @@ class Context
     @root_context
   end
 
-  def post(blocklike = nil, &block)
+  #
+  # Posts work to run on a later frame of run -- see Scheduler for what
+  # priority and deadline (seconds from now) mean. Work responding to done?
+  # runs once a frame until it's done.
+  #
+  def post(blocklike = nil, priority: :normal, deadline: nil, &block)
     raise ArgumentError, "No block given" unless blocklike || block
-    @blocks << blocklike if blocklike
-    @blocks << block if block
+    @scheduler.post(blocklike, priority: priority, deadline: deadline) if blocklike
+    @scheduler.post(block, priority: priority, deadline: deadline) if block
     self
   end
 
-  def request_texture(name)
+  #
+  # Loads the image file at name, once, and returns its texture. Unless atlas
+  # is false, images small enough are packed into the context's TextureAtlas
+  # and a TextureRegion is returned instead, which can be drawn with like any
+  # texture -- quads drawn from regions of the same atlas page share a draw
+  # call.
+  #
+  def request_texture(name, atlas: true)
     interned = name.to_sym
     return @textures[interned] if @textures.include? interned
 
-    File.open(name, 'rb') do |io|
-      @textures[interned] = Texture.new(io)
+    Window.bind_context(@root_context) do
+      File.open(name, 'rb') do |io|
+        @textures[interned] = atlas ? @atlas.load_from_io(io) : Texture.load_from_io(io)
+      end
     end
+    @textures[interned]
   end
 
   def release_texture(name)
     name = name.to_sym unless name.kind_of? Symbol
     if @textures.include? name
-      @textures[name].release! { @texture.delete name }
+      Window.bind_context(@root_context) do
+        @textures[name].release { @textures.delete name }
+      end
     end
     self
   end
@@ -193,32 +234,39 @@ class Context
     end
   end
 
-  def run_blocks(seq)
-    seq.dup.each(&:call)
-    seq.reject! { |b| !b.respond_to?(:done?) || b.done? }
-  end
-
   def run(*args, **kvargs, &block)
     bind do
       this_sequence = @sequence
+      profiler = @profiler
+      scheduler = @scheduler
       while @sequence >= this_sequence && !@windows.empty?
-        run_blocks @blocks
+        frame_start = scheduler.now
+        profiler.begin_frame
+
+        profiler.measure(:run_blocks) { scheduler.run_frame }
 
-        if realtime?
-          Glfw.poll_events
+        # Only block on events when there's nothing to do until one arrives
+        paced = realtime? || scheduler.pending?
+        if paced
+          profiler.measure(:poll_events) { Glfw.poll_events }
         else
-          Glfw.wait_events
+          profiler.measure(:wait_events) { Glfw.wait_events }
         end
 
         @windows.each do |window|
-          window.dispatch_events
+          profiler.measure(:dispatch_events, window) { window.dispatch_events }
         end
 
-        block[*args, **kvargs] if block
+        profiler.measure(:run_block) { block[*args, **kvargs] } if block
 
         @windows.each do |window|
+          profiler.measure(:layout, window) { window.layout_if_needed }
           window.__swap_buffers__
         end
+
+        profiler.measure(:idle) { scheduler.finish_frame(frame_start) } if paced
+
+        profiler.end_frame
       end
     end
   end
@@ -0,0 +1,195 @@
+#  Copyright 2014 Noel Cower
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+#  -----------------------------------------------------------------------------
+#
+#  damage_region.rb
+#    Set of disjoint rects needing to be redrawn.
+
+
+require 'gui/geom'
+
+
+module GUI
+
+#
+# A damage region is a small set of disjoint rects covering the areas of a
+# view that need to be redrawn. Rects added to the region are merged with any
+# rects they overlap, and with rects close enough that merging them wastes
+# little area (see MERGE_WASTE). Once there are more than max_rects rects, the
+# two whose union wastes the least area are merged, so the region never grows
+# past max_rects rects no matter how many are added.
+#
+# Rects here are half-open: a rect covers [left, right) and [top, bottom), so
+# rects that only share an edge don't intersect.
+#
+class DamageRegion
+
+  include Enumerable
+
+  # Default maximum number of rects in a region
+  MAX_RECTS   = 8
+  # Non-overlapping rects are merged if the area of their union not covered
+  # by either is at most this fraction of the union's area
+  MERGE_WASTE = 0.25
+
+  attr_reader :max_rects
+
+  def initialize(max_rects = MAX_RECTS)
+    @max_rects = max_rects
+    @rects = []
+  end
+
+  #
+  # Adds a rect to the region. The rect isn't retained -- a copy of it (or a
+  # rect containing it) is added instead.
+  #
+  def add(rect)
+    add_rect(rect.x, rect.y, rect.width, rect.height)
+  end
+
+  alias_method :<<, :add
+
+  # Adds the rect at x, y with the given width and height to the region.
+  def add_rect(x, y, width, height)
+    return self unless width > 0 && height > 0
+
+    # Most invalidations repeat an area that's already damaged
+    right = x + width
+    bottom = y + height
+    contained = @rects.any? do |rect|
+      rect.left <= x && right <= rect.right && rect.top <= y && bottom <= rect.bottom
+    end
+    return self if contained
+
+    __add__(Rect.new(x, y, width, height))
+    while @rects.length > @max_rects
+      __merge_cheapest_pair__
+    end
+    self
+  end
+
+  # Whether the region intersects the rect at x, y with the given size.
+  def intersects?(x, y, width, height)
+    right = x + width
+    bottom = y + height
+    @rects.any? do |rect|
+      x < rect.right && rect.left < right && y < rect.bottom && rect.top < bottom
+    end
+  end
+
+  def each(&block)
+    return to_enum(:each) unless block
+    @rects.each(&block)
+    self
+  end
+
+  def length
+    @rects.length
+  end
+
+  alias_method :size, :length
+
+  def empty?
+    @rects.empty?
+  end
+
+  def clear
+    @rects.clear
+    self
+  end
+
+  # Total area covered by the region.
+  def area
+    @rects.reduce(0) { |sum, rect| sum + rect.width * rect.height }
+  end
+
+  # Returns the smallest rect containing the whole region, or nil if the
+  # region is empty.
+  def bounds(out = nil)
+    return nil if @rects.empty?
+    first = @rects.first
+    out = (out || Rect.new).set(first.x, first.y, first.width, first.height)
+    @rects.each { |rect| out.contains_both!(rect) }
+    out
+  end
+
+  def to_s
+    "(damage #{@rects.map(&:to_s).join(' ')})"
+  end
+
+  def __add__(rect)
+    # Merging can make rect overlap rects it didn't before, so keep going
+    # until it's disjoint from the rest
+    index = 0
+    while index < @rects.length
+      other = @rects[index]
+      if __contains__(other, rect)
+        return
+      elsif __overlaps__(other, rect) || __waste__(other, rect) <= MERGE_WASTE
+        rect.contains_both!(other)
+        @rects.delete_at(index)
+        index = 0
+      else
+        index += 1
+      end
+    end
+    @rects << rect
+  end
+  private :__add__
+
+  def __merge_cheapest_pair__
+    best_waste = nil
+    best_i = best_j = 0
+    @rects.each_with_index do |left, i|
+      (i + 1).upto(@rects.length - 1) do |j|
+        waste = __waste__(left, @rects[j])
+        if best_waste.nil? || waste < best_waste
+          best_waste, best_i, best_j = waste, i, j
+        end
+      end
+    end
+
+    right = @rects.delete_at(best_j)
+    left = @rects.delete_at(best_i)
+    __add__(left.contains_both!(right))
+  end
+  private :__merge_cheapest_pair__
+
+  def __contains__(outer, inner)
+    outer.left <= inner.left && inner.right <= outer.right &&
+    outer.top <= inner.top && inner.bottom <= outer.bottom
+  end
+  private :__contains__
+
+  def __overlaps__(a, b)
+    a.left < b.right && b.left < a.right && a.top < b.bottom && b.top < a.bottom
+  end
+  private :__overlaps__
+
+  # Fraction of the union of a and b (which don't overlap) covered by neither.
+  def __waste__(a, b)
+    left   = a.left < b.left ? a.left : b.left
+    top    = a.top < b.top ? a.top : b.top
+    right  = a.right > b.right ? a.right : b.right
+    bottom = a.bottom > b.bottom ? a.bottom : b.bottom
+    union  = (right - left) * (bottom - top)
+    return 0.0 if union <= 0
+    (union - a.width * a.height - b.width * b.height).fdiv(union)
+  end
+  private :__waste__
+
+end # DamageRegion
+
+end # GUI
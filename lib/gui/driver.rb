@@ -22,6 +22,9 @@ require 'opengl-core'
 require 'snow-data'
 require 'snow-math'
 require 'gui/gl'
+require 'gui/driver_ext'
+require 'gui/gl/streaming_buffer'
+require 'gui/texture_region'
 
 
 module GUI
@@ -42,14 +45,39 @@ class Driver
 
 
   Stage = Struct.new(
-    :texture,     # Texture
-    :vertices,    # BufferObject
-    :faces,       # BufferObject
+    :texture,     # Texture (never a TextureRegion)
+    :vertices,    # fixnum count
+    :faces,       # fixnum count
     :base_face,   # fixnum offset
     :base_vertex  # fixnum offset
     )
 
 
+  #
+  # Geometry recorded by record_geometry for reuse with replay_geometry. The
+  # block's vertices and faces are copies of what was drawn, split into one
+  # segment per stage it was drawn into.
+  #
+  GeometryBlock = Struct.new(
+    :driver,      # Driver that recorded the block
+    :state,       # Array of the driver's state when recorded (see STATE_LENGTH)
+    :end_state,   # Array of the state the drawing left, or nil if unchanged
+    :segments,    # Array of GeometrySegment
+    :vertices,    # VertexSpec::Array
+    :faces,       # FaceSpec::Array
+    :vertex_count,
+    :face_count
+    )
+
+
+  GeometrySegment = Struct.new(
+    :texture,     # Texture
+    :vertices,    # fixnum count
+    :faces,       # fixnum count
+    :index_base   # fixnum, the stage's vertex count the faces' indices start at
+    )
+
+
   VertexSpec = Snow::CStruct.struct do
     float    :position, 2
     float    :texcoord, 2
@@ -62,6 +90,45 @@ class Driver
   end
 
 
+  #
+  # Compact vertex layouts BufferedDriver can upload instead of VertexSpec.
+  # Vertices are always built as VertexSpecs and packed into one of these as
+  # they're uploaded (see VertexPack.pack). Texcoords are unsigned normalized
+  # shorts, so UVs are clamped to [0, 1], and colors unsigned normalized
+  # bytes. Positions are floats, half floats, or whole points.
+  #
+  PackedVertexSpec = Snow::CStruct.struct do
+    float    :position, 2
+    uint16_t :texcoord, 2
+    uint8_t  :color, 4
+  end
+
+
+  HalfVertexSpec = Snow::CStruct.struct do
+    uint16_t :position, 2
+    uint16_t :texcoord, 2
+    uint8_t  :color, 4
+  end
+
+
+  ShortVertexSpec = Snow::CStruct.struct do
+    int16_t  :position, 2
+    uint16_t :texcoord, 2
+    uint8_t  :color, 4
+  end
+
+
+  VertexFormat = Struct.new(
+    :name,          # Symbol
+    :spec,          # Snow::CStruct of one vertex
+    :layout,        # [stride, position, texcoord, and color offsets]
+    :position_type, # GL types of each attribute's components -- texcoords
+    :texcoord_type, # and colors of any type but GL_FLOAT are normalized
+    :color_type,
+    :position_kind  # how VertexPack.pack stores positions, nil if unpacked
+    )
+
+
   FLOAT_TYPE      = GL::GL_FLOAT
   VERTEX_STRIDE   = VertexSpec::SIZE
   POSITION_OFFSET = VertexSpec.offset_of(:position)
@@ -70,9 +137,34 @@ class Driver
   TEXCOORD_SIZE   = VertexSpec.length_of(:texcoord)
   COLOR_OFFSET    = VertexSpec.offset_of(:color)
   COLOR_SIZE      = VertexSpec.length_of(:color)
+  FACE_STRIDE     = FaceSpec::SIZE
+  # Number of floats in a GeometryBlock's state -- origin, scale, handle,
+  # rotation, and color
+  STATE_LENGTH    = 11
+  # Vertex layout and size of snow-math vector components, passed to
+  # Quads.emit by draw_quads
+  QUAD_LAYOUT     = [VERTEX_STRIDE, POSITION_OFFSET, TEXCOORD_OFFSET, COLOR_OFFSET].freeze
+  # Vertex layout passed to Batches.reorder by batch_stages
+  BATCH_LAYOUT    = [VERTEX_STRIDE, POSITION_OFFSET].freeze
+  COMPONENT_SIZE  = Snow::Vec4::SIZE / Snow::Vec4::LENGTH
+  # Formats by name: :float is VertexSpec as built, 32 bytes a vertex;
+  # :packed is 16, and :half and :short 12
+  VERTEX_FORMATS  = [
+    [:float,  VertexSpec,       GL::GL_FLOAT,      GL::GL_FLOAT,          GL::GL_FLOAT,         nil],
+    [:packed, PackedVertexSpec, GL::GL_FLOAT,      GL::GL_UNSIGNED_SHORT, GL::GL_UNSIGNED_BYTE, 0],
+    [:half,   HalfVertexSpec,   GL::GL_HALF_FLOAT, GL::GL_UNSIGNED_SHORT, GL::GL_UNSIGNED_BYTE, 1],
+    [:short,  ShortVertexSpec,  GL::GL_SHORT,      GL::GL_UNSIGNED_SHORT, GL::GL_UNSIGNED_BYTE, 2]
+  ].each_with_object({}) do |(name, spec, position, texcoord, color, kind), formats|
+    layout = [
+      spec::SIZE, spec.offset_of(:position), spec.offset_of(:texcoord), spec.offset_of(:color)
+    ].freeze
+    formats[name] = VertexFormat[name, spec, layout, position, texcoord, color, kind].freeze
+  end.freeze
 
   attr_accessor :request_uniform_cb
   attr_accessor :color
+  # Stages saved by the last batch_stages since the last clear
+  attr_reader   :stages_saved
 
   def initialize(capacity = 64, &request_uniform_cb)
     @position_attrib = 1
@@ -93,6 +185,12 @@ class Driver
     @state           = []
     @request_uniform_cb = request_uniform_cb
     @view_size       = Vec2[0.0, 0.0]
+    @quad_sources    = Array.new(5)
+    @quad_params     = Array.new(16)
+    @region_uvs      = Snow::Vec2Array[2]
+    @batch_keys      = {}.compare_by_identity
+    @batch_info      = []
+    @stages_saved    = 0
     ensure_capacity(capacity * 3, capacity)
   end
 
@@ -195,6 +293,7 @@ class Driver
 
   def clear
     @stages.clear
+    @stages_saved = 0
   end
 
   def transform
@@ -214,29 +313,32 @@ class Driver
     @transform
   end
 
+  # Builds a VAO reading vertices laid out as format, a VertexFormat.
   def build_vertex_array(
     vertex_buffer, index_buffer,
     position_attrib: 1,
     color_attrib: 2,
     texcoord_attrib: 3,
-    vertex_offset: 0
+    vertex_offset: 0,
+    format: VERTEX_FORMATS[:float]
     )
     VertexArrayObject.new.bind do |vao|
       vertex_buffer.bind GL::GL_ARRAY_BUFFER
       index_buffer.bind GL::GL_ELEMENT_ARRAY_BUFFER
 
-      position_offset = vertex_offset + POSITION_OFFSET
-      color_offset    = vertex_offset + COLOR_OFFSET
-      texcoord_offset = vertex_offset + TEXCOORD_OFFSET
+      stride, position_offset, texcoord_offset, color_offset = format.layout
+      position_offset += vertex_offset
+      color_offset    += vertex_offset
+      texcoord_offset += vertex_offset
 
       if position_attrib
         GL.glEnableVertexAttribArray(position_attrib)
         GL.glVertexAttribPointer(
           position_attrib,
           POSITION_SIZE,
-          FLOAT_TYPE,
+          format.position_type,
           GL::GL_FALSE,
-          VERTEX_STRIDE,
+          stride,
           position_offset
           )
       end
@@ -246,9 +348,9 @@ class Driver
         GL.glVertexAttribPointer(
           color_attrib,
           COLOR_SIZE,
-          FLOAT_TYPE,
-          GL::GL_FALSE,
-          VERTEX_STRIDE,
+          format.color_type,
+          format.color_type == FLOAT_TYPE ? GL::GL_FALSE : GL::GL_TRUE,
+          stride,
           color_offset
           )
       end
@@ -258,9 +360,9 @@ class Driver
         GL.glVertexAttribPointer(
           texcoord_attrib,
           TEXCOORD_SIZE,
-          FLOAT_TYPE,
-          GL::GL_FALSE,
-          VERTEX_STRIDE,
+          format.texcoord_type,
+          format.texcoord_type == FLOAT_TYPE ? GL::GL_FALSE : GL::GL_TRUE,
+          stride,
           texcoord_offset
           )
       end
@@ -276,7 +378,9 @@ class Driver
   #            the Driver will assume you have some way to guarantee this is
   #            drawn correctly. In general, never pass a nil material unless
   #            everything will have a nil material and all primitives share the
-  #            same drawing properties/state.
+  #            same drawing properties/state. If a TextureRegion, the quad is
+  #            drawn with the region's texture and its UVs are relative to the
+  #            region.
   # position - The position to draw the quad at. This is affected by both the
   #            Driver's origin and handle. Scale and rotation will not affect
   #            this, though a sufficiently off-center handle can cause a quad
@@ -311,10 +415,15 @@ class Driver
 
     uv_min ||= DEFAULT_UV_MIN
     uv_max ||= DEFAULT_UV_MAX
+    if texture.kind_of?(TextureRegion)
+      uv_min = texture.remap_uv(uv_min, @region_uvs[0])
+      uv_max = texture.remap_uv(uv_max, @region_uvs[1])
+      texture = texture.texture
+    end
     transform = self.transform
     stage = stage_for(texture)
     ensure_capacity(stage.base_vertex + stage.vertices + 4,
-                    stage.base_vertex + stage.vertices + 6)
+                    stage.base_face + stage.faces + 2)
 
     adjusted_pos = position.add(@origin, @temp_vectors[0])
     top_left     = @handle.multiply(size, @temp_vectors[1]).negate!
@@ -389,34 +498,359 @@ class Driver
     face.set_index(vertex_index    , 2)
 
     stage.vertices += 4
-    stage.faces += 6
+    stage.faces += 2
 
     self
   end
 
+  # Public: Draws count quads with the given texture, as though by calling
+  # draw_quad for each, but with their vertices and faces written natively in
+  # one go rather than a quad at a time.
+  #
+  # texture   - The texture to draw the quads with, as with draw_quad. UVs
+  #             are relative to it if it's a TextureRegion.
+  # positions - A Snow::Vec2Array of the quads' positions.
+  # sizes     - A Snow::Vec2Array of the quads' sizes.
+  # uvs       - A Snow::Vec4Array of the quads' UV rects as min u, min v, max
+  #             u, max v. Defaults to DEFAULT_UV_MIN to DEFAULT_UV_MAX for
+  #             every quad.
+  # colors    - A Snow::Vec4Array of the quads' colors. Defaults to the
+  #             Driver's color for every quad.
+  # count     - The number of quads to draw. Defaults to positions.length.
+  #
+  # Raises ArgumentError if any of the arrays are of the wrong type or have
+  # fewer than count elements.
+  # Returns self.
+  def draw_quads(texture, positions, sizes, uvs: nil, colors: nil, count: nil)
+    count ||= positions.length
+    unless positions.kind_of?(Snow::Vec2Array) && sizes.kind_of?(Snow::Vec2Array)
+      raise ArgumentError, "positions and sizes must be Vec2Arrays"
+    end
+    unless (uvs.nil? || uvs.kind_of?(Snow::Vec4Array)) &&
+           (colors.nil? || colors.kind_of?(Snow::Vec4Array))
+      raise ArgumentError, "uvs and colors must be Vec4Arrays"
+    end
+    if positions.length < count || sizes.length < count ||
+       (uvs && uvs.length < count) || (colors && colors.length < count)
+      raise ArgumentError, "Fewer positions, sizes, UVs, or colors than quads"
+    end
+    return self if count <= 0
+
+    sources = @quad_sources
+    sources[0] = positions.address
+    sources[1] = sizes.address
+    sources[2] = uvs && uvs.address
+    sources[3] = colors && colors.address
+    sources[4] = COMPONENT_SIZE
+    params = __quad_params__(texture)
+    texture = texture.texture if texture.kind_of?(TextureRegion)
+
+    drawn = 0
+    while drawn < count
+      stage = stage_for(texture)
+      batch = (MAX_VERTICES_PER_STAGE - stage.vertices) / 4
+      batch = count - drawn if batch > count - drawn
+      ensure_capacity(stage.base_vertex + stage.vertices + batch * 4,
+                      stage.base_face + stage.faces + batch * 2)
+
+      Quads.emit(
+        @vertices.address + (stage.base_vertex + stage.vertices) * VERTEX_STRIDE,
+        QUAD_LAYOUT,
+        @faces.address + (stage.base_face + stage.faces) * FACE_STRIDE,
+        stage.vertices, batch,
+        sources, drawn,
+        params
+        )
+
+      stage.vertices += batch * 4
+      stage.faces += batch * 2
+      drawn += batch
+    end
+
+    self
+  end
+
+  # The transform's columns, origin, handle, color, and texture's UV offset
+  # and scale for Quads.emit.
+  def __quad_params__(texture)
+    params = @quad_params
+    transform = self.transform
+    axis = transform.rotate_vec3(@temp_vectors[0].set(1.0, 0.0, 0.0), @temp_vectors[1])
+    params[0] = axis[0]
+    params[1] = axis[1]
+    axis = transform.rotate_vec3(@temp_vectors[0].set(0.0, 1.0, 0.0), @temp_vectors[1])
+    params[2] = axis[0]
+    params[3] = axis[1]
+    params[4] = @origin[0]
+    params[5] = @origin[1]
+    params[6] = @handle[0]
+    params[7] = @handle[1]
+    params[8] = @color[0]
+    params[9] = @color[1]
+    params[10] = @color[2]
+    params[11] = @color[3]
+    if texture.kind_of?(TextureRegion)
+      params[12], params[13], params[14], params[15] = texture.uv_transform
+    else
+      params[12] = params[13] = 0.0
+      params[14] = params[15] = 1.0
+    end
+    params
+  end
+  private :__quad_params__
+
+  #
+  # Records the geometry drawn by the block into a GeometryBlock, reusing
+  # block's storage if given, and returns it. The geometry is drawn as usual;
+  # the block can be passed to replay_geometry on later frames to draw the
+  # same geometry again without regenerating it, so long as the driver's
+  # state is the same as it was before the block ran. Replaying also leaves
+  # the driver in whatever state the block left it in.
+  #
+  def record_geometry(block = nil)
+    first_stage = @stages.length
+    current = @stages.last
+    prior_vertices = current ? current.vertices : 0
+    prior_faces = current ? current.faces : 0
+    start_vertex = current ? current.base_vertex + prior_vertices : 0
+    start_face = current ? current.base_face + prior_faces : 0
+
+    # Replays compare against the state the geometry was drawn from, not the
+    # state the block left the driver in
+    block ||= GeometryBlock.new(nil, Array.new(STATE_LENGTH), nil, [])
+    block.driver = self
+    __store_state__(block.state)
+
+    yield self
+
+    if __same_state__(block.state)
+      block.end_state = nil
+    else
+      block.end_state = __store_state__(block.end_state || Array.new(STATE_LENGTH))
+    end
+
+    segments = block.segments.clear
+    index = current ? first_stage - 1 : first_stage
+    while index < @stages.length
+      stage = @stages[index]
+      if stage.equal?(current)
+        vertices = stage.vertices - prior_vertices
+        faces = stage.faces - prior_faces
+        base = prior_vertices
+      else
+        vertices = stage.vertices
+        faces = stage.faces
+        base = 0
+      end
+      segments << GeometrySegment[stage.texture, vertices, faces, base] if faces > 0
+      index += 1
+    end
+
+    last = @stages.last
+    vertex_count = last ? last.base_vertex + last.vertices - start_vertex : 0
+    face_count = last ? last.base_face + last.faces - start_face : 0
+    block.vertices = self.class.ensure_capacity_of_array(
+      block.vertices, vertex_count < 1 ? 1 : vertex_count, VertexSpec::Array
+      )
+    block.faces = self.class.ensure_capacity_of_array(
+      block.faces, face_count < 1 ? 1 : face_count, FaceSpec::Array
+      )
+    block.vertices.copy!(@vertices, 0, start_vertex * VERTEX_STRIDE, vertex_count * VERTEX_STRIDE)
+    block.faces.copy!(@faces, 0, start_face * FACE_STRIDE, face_count * FACE_STRIDE)
+    block.vertex_count = vertex_count
+    block.face_count = face_count
+
+    block
+  end
+
+  #
+  # Draws the geometry recorded in block by copying it into the driver's
+  # stages. Returns false, drawing nothing, if block is nil, was recorded by
+  # another driver, or was recorded with different driver state (origin,
+  # scale, rotation, handle, or color) -- in which case it has to be recorded
+  # again. Returns true otherwise.
+  #
+  def replay_geometry(block)
+    return false unless block && block.driver.equal?(self) && __same_state__(block.state)
+
+    vertex = 0
+    face = 0
+    block.segments.each do |segment|
+      stage = stage_for(segment.texture, vertices_needed: segment.vertices)
+      ensure_capacity(stage.base_vertex + stage.vertices + segment.vertices,
+                      stage.base_face + stage.faces + segment.faces)
+
+      # Indices are relative to the stage, so shift them if the segment lands
+      # somewhere else in it than last time -- usually it doesn't
+      if stage.vertices != segment.index_base
+        __rebase_faces__(block.faces, face, segment.faces, stage.vertices - segment.index_base)
+        segment.index_base = stage.vertices
+      end
+
+      @vertices.copy!(
+        block.vertices,
+        (stage.base_vertex + stage.vertices) * VERTEX_STRIDE,
+        vertex * VERTEX_STRIDE,
+        segment.vertices * VERTEX_STRIDE
+        )
+      @faces.copy!(
+        block.faces,
+        (stage.base_face + stage.faces) * FACE_STRIDE,
+        face * FACE_STRIDE,
+        segment.faces * FACE_STRIDE
+        )
+
+      stage.vertices += segment.vertices
+      stage.faces += segment.faces
+      vertex += segment.vertices
+      face += segment.faces
+    end
+
+    __load_state__(block.end_state) if block.end_state
+
+    true
+  end
+
+  def __rebase_faces__(faces, first, count, delta)
+    index = first
+    last = first + count
+    while index < last
+      face = faces[index]
+      face.set_index(face.index(0) + delta, 0)
+      face.set_index(face.index(1) + delta, 1)
+      face.set_index(face.index(2) + delta, 2)
+      index += 1
+    end
+  end
+  private :__rebase_faces__
+
+  def __store_state__(out)
+    out[0]  = @origin[0]
+    out[1]  = @origin[1]
+    out[2]  = @scale[0]
+    out[3]  = @scale[1]
+    out[4]  = @handle[0]
+    out[5]  = @handle[1]
+    out[6]  = @rotation
+    out[7]  = @color[0]
+    out[8]  = @color[1]
+    out[9]  = @color[2]
+    out[10] = @color[3]
+    out
+  end
+  private :__store_state__
+
+  def __same_state__(state)
+    state[0] == @origin[0] && state[1] == @origin[1] &&
+    state[2] == @scale[0] && state[3] == @scale[1] &&
+    state[4] == @handle[0] && state[5] == @handle[1] &&
+    state[6] == @rotation &&
+    state[7] == @color[0] && state[8] == @color[1] &&
+    state[9] == @color[2] && state[10] == @color[3]
+  end
+  private :__same_state__
+
+  def __load_state__(state)
+    @origin[0] = state[0]
+    @origin[1] = state[1]
+    if state[2] != @scale[0] || state[3] != @scale[1] || state[6] != @rotation
+      @scale[0] = state[2]
+      @scale[1] = state[3]
+      @rotation = state[6]
+      @transform_dirty = true
+    end
+    @handle[0] = state[4]
+    @handle[1] = state[5]
+    @color = Color[state[7], state[8], state[9], state[10]]
+  end
+  private :__load_state__
+
+  #
+  # Reorders the quads drawn since the last clear so that quads drawn with
+  # the same texture share a stage wherever moving them doesn't change the
+  # result: a quad is only drawn earlier than it was if it doesn't overlap
+  # anything it moves ahead of, so overlapping quads keep their painter's
+  # order. Overlap is judged on the quads' bounding boxes on a coarse grid,
+  # so some quads that could be merged aren't. Stages still hold no more
+  # than MAX_VERTICES_PER_STAGE vertices.
+  #
+  # Does nothing if the stages mix nil and non-nil textures, since a nil
+  # texture draws with whatever was bound before it, or if they hold
+  # anything other than quads. Returns the number of stages saved.
+  #
+  def batch_stages
+    keys = @batch_keys.clear
+    info = @batch_info.clear
+    @stages.each do |stage|
+      key = (keys[stage.texture] ||= keys.length)
+      info.push(key, stage.base_vertex, stage.vertices, stage.base_face, stage.faces)
+    end
+    return 0 if keys.length >= @stages.length || (keys.include?(nil) && keys.length > 1)
+
+    batches = Batches.reorder(@vertices.address, @faces.address, BATCH_LAYOUT, info, keys.length)
+    return 0 unless batches
+
+    textures = keys.invert
+    saved = @stages.length - batches.length / 2
+    @stages.pop(saved)
+    base_vertex = 0
+    base_face = 0
+    @stages.each_with_index do |stage, index|
+      quads = batches[index * 2 + 1]
+      stage.texture = textures[batches[index * 2]]
+      stage.vertices = quads * 4
+      stage.faces = quads * 2
+      stage.base_vertex = base_vertex
+      stage.base_face = base_face
+      base_vertex += stage.vertices
+      base_face += stage.faces
+    end
+
+    @stages_saved += saved
+    saved
+  end
+
+  # Number of quads drawn since the last clear.
+  def quad_count
+    @stages.reduce(0) { |sum, stage| sum + stage.faces } / 2
+  end
+
+  def stage_count
+    @stages.length
+  end
+
+  # Number of draw calls draw_stages makes -- one per non-empty stage.
+  def draw_call_count
+    @stages.count { |stage| stage.faces > 0 }
+  end
+
   def vertex_data_size
     stage = @stages.last
-    ((stage && (stage.base_vertex + stage.vertices)) || 0) * VertexSpec::SIZE
+    ((stage && (stage.base_vertex + stage.vertices)) || 0) * VERTEX_STRIDE
   end
 
   def index_data_size
     stage = @stages.last
-    ((stage && (stage.base_face + stage.faces * 3)) || 0) / 6 * VertexSpec::SIZE
+    ((stage && (stage.base_face + stage.faces)) || 0) * FACE_STRIDE
   end
 
+  # Uploads the vertices and faces. vertices and vertices_size may be given
+  # to upload other vertex data, such as packed vertices, in their place.
   def flush_data_to(
     vertex_buffer: nil,
     vertices_offset: 0,
     index_buffer: nil,
-    indices_offset: 0
+    indices_offset: 0,
+    vertices: @vertices,
+    vertices_size: vertex_data_size()
     )
 
     vertex_buffer.bind(GL::GL_ARRAY_BUFFER) do
       GL.glBufferSubData(
         GL::GL_ARRAY_BUFFER,
         vertices_offset,
-        vertex_data_size(),
-        @vertices.address)
+        vertices_size,
+        vertices.address)
     end
 
     index_buffer.bind(GL::GL_ELEMENT_ARRAY_BUFFER) do
@@ -428,8 +862,10 @@ class Driver
     end
   end
 
-  # Takes a request_uniform_cb method so the texture unit can be set
-  def draw_stages(vao, indices_offset: 0)
+  # Takes a request_uniform_cb method so the texture unit can be set.
+  # indices_offset is the byte offset of the faces in the VAO's index buffer
+  # and base_vertex the index of the first vertex in its vertex buffer.
+  def draw_stages(vao, indices_offset: 0, base_vertex: 0)
     raise "Invalid VAO" unless vao && vao.name != 0
 
     GL.glActiveTexture(GL::GL_TEXTURE0)
@@ -440,7 +876,7 @@ class Driver
 
           texture = stage.texture
 
-          offset = indices_offset + stage.base_face * 2
+          offset = indices_offset + stage.base_face * FACE_STRIDE
 
           if texture
             texture.bind(GL::GL_TEXTURE_2D)
@@ -455,7 +891,7 @@ class Driver
             stage.faces * 3,
             GL::GL_UNSIGNED_SHORT,
             offset,
-            stage.base_vertex
+            base_vertex + stage.base_vertex
             )
         end
       end
@@ -478,7 +914,7 @@ class Driver
       base_face  = current_stage.base_face + current_stage.faces
     end
 
-    new_stage = Stage.new(texture, 0, 0, base_vertex, base_face)
+    new_stage = Stage.new(texture, 0, 0, base_face, base_vertex)
     @stages << new_stage
     new_stage
   end
@@ -493,20 +929,43 @@ class BufferedDriver < Driver
   private :ensure_capacity
   private :build_vertex_array
 
+  #
+  # With streaming set, vertex and face data are uploaded through a pair of
+  # StreamingBuffers, a ring of per-frame regions written without waiting on
+  # the GPU, instead of being rewritten in place with glBufferSubData each
+  # frame. With batching set, batch_stages is run on what was drawn before
+  # it's uploaded. vertex_format names one of VERTEX_FORMATS to upload
+  # vertices as -- any but :float packs them first, which costs a little CPU
+  # time for a half or less of the bandwidth. Must be created with a GL
+  # context current.
+  #
   def initialize(
     capacity = 64,
     position_attrib: 1,
     color_attrib: 2,
     texcoord_attrib: 3,
+    streaming: false,
+    batching: false,
+    vertex_format: :float,
     &request_uniform_cb
     )
     super(capacity, &request_uniform_cb)
 
-    vbo = BufferObject.new
-    ibo = BufferObject.new
+    @vertex_format = VERTEX_FORMATS[vertex_format]
+    raise ArgumentError, "Invalid vertex format: #{vertex_format.inspect}" unless @vertex_format
 
-    vbo.target = GL::GL_ARRAY_BUFFER
-    ibo.target = GL::GL_ELEMENT_ARRAY_BUFFER
+    if streaming
+      @vertex_stream = StreamingBuffer.new(GL::GL_ARRAY_BUFFER, alignment: @vertex_format.layout[0])
+      @index_stream  = StreamingBuffer.new(GL::GL_ELEMENT_ARRAY_BUFFER)
+      vbo = @vertex_stream.buffer
+      ibo = @index_stream.buffer
+    else
+      @vertex_stream = @index_stream = nil
+      vbo = BufferObject.new
+      ibo = BufferObject.new
+      vbo.target = GL::GL_ARRAY_BUFFER
+      ibo.target = GL::GL_ELEMENT_ARRAY_BUFFER
+    end
 
     ObjectSpace.define_finalizer(self) { destroy }
 
@@ -514,17 +973,41 @@ class BufferedDriver < Driver
     @index_buffer           = ibo
     @vertex_buffer_capacity = 0
     @index_buffer_capacity  = 0
+    @vertex_offset          = 0
+    @index_offset           = 0
     @vao                    = nil
     @position_attrib        = position_attrib
     @color_attrib           = color_attrib
     @texcoord_attrib        = texcoord_attrib
     @refresh_needed         = false
+    @batching               = batching
+    @packed_vertices        = nil
 
   end
 
+  # The VertexFormat vertices are uploaded as.
+  attr_reader :vertex_format
+
+  # Whether batch_stages is run before each upload.
+  attr_accessor :batching
+
+  def streaming?
+    !@vertex_stream.nil?
+  end
+
+  # The StreamingBuffers used when streaming, for their upload statistics.
+  attr_reader :vertex_stream
+  attr_reader :index_stream
+
   def destroy
-    @vertex_buffer.release { @vertex_buffer = nil }
-    @index_buffer.release { @index_buffer = nil }
+    if @vertex_stream
+      @vertex_stream.destroy
+      @index_stream.destroy
+      @vertex_stream = @index_stream = @vertex_buffer = @index_buffer = nil
+    else
+      @vertex_buffer.release { @vertex_buffer = nil } if @vertex_buffer
+      @index_buffer.release { @index_buffer = nil } if @index_buffer
+    end
     @vao.release { @vao = nil } if @vao
   end
 
@@ -551,6 +1034,16 @@ class BufferedDriver < Driver
     super
   end
 
+  def draw_quads(texture, positions, sizes, uvs: nil, colors: nil, count: nil)
+    @refresh_needed = true
+    super
+  end
+
+  def replay_geometry(block)
+    @refresh_needed = true
+    super
+  end
+
   def ensure_buffer_capacity(vertices_capacity: nil, indices_capacity: nil)
     if vertices_capacity
       @vertex_buffer_capacity = self.class.ensure_buffer_object_capacity(
@@ -569,30 +1062,80 @@ class BufferedDriver < Driver
     end
   end
 
+  #
+  # Uploads the stages' data if anything was drawn since the last upload and
+  # draws them. Window calls this once per damaged rect, so the data is only
+  # uploaded by the first call of a frame.
+  #
   def draw_stages
     if @refresh_needed
-      ensure_buffer_capacity(
-        vertices_capacity: self.vertex_data_size,
-        indices_capacity: self.index_data_size
-        )
+      batch_stages if @batching
 
-      flush_data_to(
-        vertex_buffer: @vertex_buffer,
-        index_buffer: @index_buffer
-        )
+      vertices = @vertices
+      vertices_size = self.vertex_data_size
+      if @vertex_format.position_kind
+        vertices = __pack_vertices__(vertices_size / VERTEX_STRIDE)
+        vertices_size = vertices_size / VERTEX_STRIDE * @vertex_format.layout[0]
+      end
+
+      if @vertex_stream
+        @vertex_offset = @vertex_stream.upload(vertices, vertices_size)
+        @index_offset = @index_stream.upload(@faces, self.index_data_size)
+      else
+        ensure_buffer_capacity(
+          vertices_capacity: vertices_size,
+          indices_capacity: self.index_data_size
+          )
+
+        flush_data_to(
+          vertex_buffer: @vertex_buffer,
+          index_buffer: @index_buffer,
+          vertices: vertices,
+          vertices_size: vertices_size
+          )
+      end
 
       if @vao.nil?
         @vao = build_vertex_array(
           @vertex_buffer, @index_buffer,
           position_attrib: @position_attrib,
           color_attrib:    @color_attrib,
-          texcoord_attrib: @texcoord_attrib
+          texcoord_attrib: @texcoord_attrib,
+          format:          @vertex_format
           )
       end
+      @refresh_needed = false
     end
 
-    super(@vao) unless @stages.empty?
+    return if @stages.empty?
+
+    super(
+      @vao,
+      indices_offset: @index_offset,
+      base_vertex: @vertex_offset / @vertex_format.layout[0]
+      )
+
+    if @vertex_stream
+      @vertex_stream.fence
+      @index_stream.fence
+    end
+  end
+
+  # Packs the first count vertices into @packed_vertices as the vertex
+  # format and returns them.
+  def __pack_vertices__(count)
+    format = @vertex_format
+    @packed_vertices = self.class.ensure_capacity_of_array(
+      @packed_vertices, count < 1 ? 1 : count, format.spec::Array
+      )
+    VertexPack.pack(
+      @packed_vertices.address, format.layout,
+      @vertices.address, QUAD_LAYOUT,
+      count, format.position_kind
+      )
+    @packed_vertices
   end
+  private :__pack_vertices__
 
 end # BufferedDriver
 
@@ -15,31 +15,76 @@
 #  -----------------------------------------------------------------------------
 #
 #  event.rb
-#    Basic event class
+#    Basic event class and typed, pooled events for window input
+
+
+require 'gui/geom'
 
 
 module GUI
 
 class EventCancellationError < StandardError ; end
 
+#
+# Generic event, with its payload in a frozen info Hash whose keys can be
+# read as methods (e.g., event.frame for info[:frame]).
+#
+# Events posted for window input are instances of the typed subclasses below
+# instead, which have real accessors and are pooled: Window acquires them from
+# their class's pool, and EventDispatch#dispatch_events releases them back to
+# it once they've been dispatched, so steady input doesn't allocate events.
+# Handlers that need to keep a pooled event past its dispatch must call
+# retain! on it.
+#
 class Event
 
   __Target__ = Struct.new(:p)
 
+  # Maximum number of released events kept in each class's pool
+  POOL_LIMIT = 32
+
   attr_reader   :sender
   attr_reader   :kind
   attr_reader   :info
   attr_accessor :target
 
-  class << self ; alias_method :[], :new ; end
+  class << self
+
+    alias_method :[], :new
+
+    # Released events of this class, ready to be reused.
+    def __pool__
+      @pool ||= []
+    end
+
+    #
+    # Takes an event from the class's pool, or allocates one if the pool is
+    # empty, and marks it as pooled so it's released after dispatch.
+    #
+    def __acquire__
+      event = __pool__.pop || new
+      event.__pooled__ = true
+      event
+    end
+
+    private :__acquire__
+
+  end
 
   def initialize(sender, kind, **info)
+    __reset__(sender, kind, info[:target])
+    @info = info.freeze
+    @pooled = false
+  end
+
+  def __reset__(sender, kind, target)
     @sender = sender
     @kind = kind
-    @info = info.freeze
+    @target = target
+    @original_target = target
     @cancelled = false
     @propagating = true
-    @target = info[:target]
+    self
   end
 
   def method_missing(meth, *args)
@@ -51,7 +96,7 @@ class Event
   end
 
   def original_target
-    info[:target]
+    @original_target
   end
 
   def cancellable?
@@ -80,15 +125,133 @@ class Event
     self
   end
 
+  # Whether the event will be returned to its class's pool once dispatched.
+  def pooled?
+    @pooled
+  end
+
+  def __pooled__=(pooled)
+    @pooled = pooled
+  end
+
+  # Keeps a pooled event from being reused after it's dispatched.
+  def retain!
+    @pooled = false
+    self
+  end
+
+  #
+  # Returns a pooled event to its class's pool, dropping its references to
+  # views. Does nothing if the event isn't pooled.
+  #
+  def release
+    return self unless @pooled
+    @pooled = false
+    @sender = @target = @original_target = nil
+    pool = self.class.__pool__
+    pool << self if pool.length < POOL_LIMIT
+    self
+  end
+
   def to_s
     "(event (sender #{sender}) (kind #{kind})#{
-      ' ' unless @info.empty?
+      ' ' unless info.empty?
       }#{
-      @info.map { |k,v| "(#{k} #{v})"}.join ' '
+      info.map { |k,v| "(#{k} #{v})"}.join ' '
       })"
   end
 
 end # Event
 
-end # GUI
 
+#
+# A mouse button was pressed or released over target, the topmost view under
+# the cursor. The position is in the window's coordinates.
+#
+class MouseButtonEvent < Event
+
+  attr_reader :button
+  attr_reader :action
+  attr_reader :modifiers
+  attr_reader :position # Vec2
+
+  def self.acquire(sender, target, button, action, modifiers, x, y)
+    __acquire__.__set__(sender, target, button, action, modifiers, x, y)
+  end
+
+  def initialize(sender = nil, target = nil, button = 0, action = 0, modifiers = 0, x = 0, y = 0)
+    @position = Vec2[0, 0]
+    @pooled = false
+    __set__(sender, target, button, action, modifiers, x, y)
+  end
+
+  def __set__(sender, target, button, action, modifiers, x, y)
+    __reset__(sender, :mouse_button, target)
+    @button = button
+    @action = action
+    @modifiers = modifiers
+    @position.x = x
+    @position.y = y
+    self
+  end
+
+  def info
+    { target: @original_target, action: @action, button: @button,
+      modifiers: @modifiers, position: @position }
+  end
+
+end # MouseButtonEvent
+
+
+#
+# The window was resized or moved. frame is a copy of the window's frame at
+# the time.
+#
+class ResizeEvent < Event
+
+  attr_reader :frame # Rect
+
+  def self.acquire(sender, target, frame)
+    __acquire__.__set__(sender, target, frame)
+  end
+
+  def initialize(sender = nil, target = nil, frame = nil)
+    @frame = Rect.new
+    @pooled = false
+    __set__(sender, target, frame)
+  end
+
+  def __set__(sender, target, frame)
+    __reset__(sender, :resized, target)
+    @frame.set(frame.x, frame.y, frame.width, frame.height) if frame
+    self
+  end
+
+  def info
+    { target: @original_target, frame: @frame }
+  end
+
+end # ResizeEvent
+
+
+#
+# The window's close button was clicked.
+#
+class CloseEvent < Event
+
+  def self.acquire(sender, target)
+    __acquire__.__reset__(sender, :close_button, target)
+  end
+
+  def initialize(sender = nil, target = nil)
+    @pooled = false
+    __reset__(sender, :close_button, target)
+  end
+
+  def info
+    { target: @original_target }
+  end
+
+end # CloseEvent
+
+end # GUI
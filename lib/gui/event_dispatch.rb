@@ -18,14 +18,38 @@
 #    Event dispatch module
 
 
-require 'set'
 require 'gui/event'
 
 
 module GUI
 
+#
+# Queues events posted to its includer and dispatches them once per frame.
+# Each event goes to the view its kind is redirected to (see
+# redirect_events), then its target, then every leaf view, each followed by
+# its superviews, until one of them stops its propagation. No view receives
+# the same event twice.
+#
+# The routes events take up the tree are cached until a view is added to or
+# removed from the tree (see ViewIndex#version), and consecutive events of
+# some kinds are merged as they're posted (see coalesce_events), so a flood
+# of window resizes only costs one dispatch per frame.
+#
 module EventDispatch
 
+  #
+  # Default coalescing policies by event kind:
+  #
+  # :latest   - A posted event replaces the last event in the queue if it's of
+  #             the same kind, sender, and target.
+  # :earliest - A posted event is dropped if the last event in the queue is of
+  #             the same kind, sender, and target.
+  #
+  COALESCING = {
+    resized:      :latest,
+    close_button: :earliest
+  }.freeze
+
   def dispatch_event_upwards(event, target, visited, &provider)
     raise ArgumentError, "No target-provider block given" unless block_given?
     return unless event.propagating? && target
@@ -45,21 +69,73 @@ module EventDispatch
     self
   end
 
+  #
+  # Sets the coalescing policy for events of the given kind to :latest or
+  # :earliest (see COALESCING), or turns coalescing off for the kind if
+  # policy is nil.
+  #
+  def coalesce_events(kind, policy)
+    unless policy.nil? || policy == :latest || policy == :earliest
+      raise ArgumentError, "Invalid coalescing policy: #{policy.inspect}"
+    end
+
+    policies = (@event_coalescing ||= COALESCING.dup)
+    if policy.nil?
+      policies.delete(kind)
+    else
+      policies[kind] = policy
+    end
+
+    self
+  end
+
+  def event_coalescing_policy(kind)
+    (@event_coalescing || COALESCING)[kind]
+  end
+
+  #
+  # Queues the event for the next dispatch_events, merging it with the last
+  # queued event according to the event kind's coalescing policy. Events
+  # posted during dispatch aren't coalesced. Pooled events dropped by
+  # coalescing are released immediately.
+  #
   def post_event(event)
-    (@events ||= []) << event
+    events = (@events ||= [])
+    last = events.last
+
+    if last && !@dispatching_events &&
+       last.kind == event.kind &&
+       last.sender.equal?(event.sender) &&
+       last.target.equal?(event.target)
+      case event_coalescing_policy(event.kind)
+      when :latest
+        events[-1] = event
+        last.release
+        return self
+      when :earliest
+        event.release
+        return self
+      end
+    end
+
+    events << event
     self
   end
 
+  #
+  # Sends event to target unless it's already been visited -- visited is an
+  # identity Hash whose keys are the targets the event has been sent to.
+  #
   def dispatch_event_to_target(target, event, visited)
     return unless event.propagating? &&
                   target &&
-                  !visited.include?(target.__id__)
+                  !visited.include?(target)
 
     if target.respond_to?(:handle_event)
       target.handle_event(event)
     end
 
-    visited << target.__id__
+    visited[target] = true
 
     self
   end
@@ -74,7 +150,7 @@ module EventDispatch
       dispatch_event_to_target(target, event, visited)
       last_target = target
       target = yield
-    end while !once && event.propagating? && target.__id__ != last_target.__id__
+    end while !once && event.propagating? && !target.equal?(last_target)
 
     dispatch_event_upwards(event, target, visited) do |above|
       above && above.respond_to?(parent_msg) && above.__send__(parent_msg)
@@ -84,43 +160,139 @@ module EventDispatch
   end
 
   def dispatch_events(parent_msg = nil)
-    return self unless @events
+    events = @events
+    return self if events.nil? || events.empty?
     parent_msg ||= :superview
 
-    visited = Set.new
+    visited = (@dispatch_visited ||= {}.compare_by_identity)
     redirects = (@event_redirects ||= {})
 
-    @events.each do |event|
-      kind = event.kind
-      visited.clear
+    @dispatching_events = true
+    begin
+      events.each do |event|
+        kind = event.kind
+        visited.clear
 
-      if redirects.include?(kind)
-        dispatch_event_with_target(event, visited, parent_msg: parent_msg) do
-          redirects[kind]
+        if redirects.include?(kind)
+          __dispatch_along_route__(event, visited, parent_msg) { redirects[kind] }
+          next unless event.propagating?
         end
 
+        __dispatch_along_route__(event, visited, parent_msg) { event.target }
         next unless event.propagating?
-      end
 
-      dispatch_event_with_target(event, visited, parent_msg: parent_msg) do
-        event.target
+        # If the event is still propagating, send it to all the leaf views and
+        # their superviews next. Handlers may have changed the tree.
+        __validate_dispatch_routes__(parent_msg)
+        route = __broadcast_route__(parent_msg)
+        index = 0
+        while index < route.length && event.propagating?
+          dispatch_event_to_target(route[index], event, visited)
+          index += 1
+        end
       end
 
-      next unless event.propagating?
+      # Pooled events are reused for the next ones posted
+      events.each(&:release).clear
+    ensure
+      @dispatching_events = false
+      visited.clear
+    end
 
-      # If the event is still propagating, send it to all the leaf views and
-      # their superviews next.
+    self
+  end
+
+  #
+  # Sends event to the target provided by the block until the block provides
+  # the same target twice (handlers may retarget the event), then up the last
+  # target's cached route.
+  #
+  def __dispatch_along_route__(event, visited, parent_msg)
+    last_target = nil
+    target = yield
+
+    begin
+      dispatch_event_to_target(target, event, visited)
+      last_target = target
+      target = yield
+    end while event.propagating? && !target.equal?(last_target)
+
+    return unless target
+    __validate_dispatch_routes__(parent_msg)
+    route = __dispatch_route__(target, parent_msg)
+    index = 1
+    while index < route.length && event.propagating?
+      dispatch_event_to_target(route[index], event, visited)
+      index += 1
+    end
+  end
+  private :__dispatch_along_route__
+
+  #
+  # Drops cached routes if the tree has changed since they were built. Without
+  # a view index to tell, routes are only kept for a single dispatch.
+  #
+  def __validate_dispatch_routes__(parent_msg)
+    index = respond_to?(:__view_index__) ? __view_index__ : nil
+    version = index && index.version
+
+    unless index &&
+           index.equal?(@dispatch_routes_index) &&
+           version == @dispatch_routes_version &&
+           parent_msg == @dispatch_routes_parent_msg
+      (@dispatch_routes ||= {}.compare_by_identity).clear
+      @broadcast_route = nil
+      @dispatch_routes_index = index
+      @dispatch_routes_version = version
+      @dispatch_routes_parent_msg = parent_msg
+    end
+  end
+  private :__validate_dispatch_routes__
+
+  #
+  # Returns target followed by its superviews, as given by parent_msg. Routes
+  # are only cached for targets in the dispatcher's own tree, since changes to
+  # other trees don't show up in its index.
+  #
+  def __dispatch_route__(target, parent_msg)
+    route = @dispatch_routes[target]
+    return route if route
+
+    route = [target]
+    above = target
+    while above.respond_to?(parent_msg) &&
+          (above = above.__send__(parent_msg)) &&
+          !above.equal?(route.last)
+      route << above
+    end
+
+    if @dispatch_routes_index && route.last.equal?(@dispatch_routes_index.root)
+      @dispatch_routes[target] = route.freeze
+    end
+    route
+  end
+  private :__dispatch_route__
+
+  #
+  # Returns the leaf views, deepest first, each followed by those of its
+  # superviews not already in the route.
+  #
+  def __broadcast_route__(parent_msg)
+    @broadcast_route ||= begin
+      seen = {}.compare_by_identity
+      route = []
       leaf_views.each do |leaf|
         view = leaf.view
-        dispatch_event_with_target(event, visited, once: true, parent_msg: parent_msg) do
-          view
+        while view && !seen.include?(view)
+          seen[view] = true
+          route << view
+          view = view.respond_to?(parent_msg) && view.__send__(parent_msg)
         end
-        break unless event.propagating?
       end
-    end.clear
-
-    self
+      route.freeze
+    end
   end
+  private :__broadcast_route__
 
 end # EventDispatch
 
@@ -161,7 +161,7 @@ class BufferObject < GLObject
 
   def destroy
     if self.name != 0
-      GL.glDeleteTextures(1, self.address)
+      GL.glDeleteBuffers(1, self.address)
       self.name = 0
     end
   end
@@ -0,0 +1,222 @@
+#  Copyright 2014 Noel Cower
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+#  -----------------------------------------------------------------------------
+#
+#  streaming_buffer.rb
+#    Buffer object streamed to a frame at a time without stalling on the GPU.
+
+
+require 'opengl-core'
+require 'gui/gl'
+require 'gui/driver_ext'
+
+
+module GUI
+
+#
+# A buffer object split into a ring of REGIONS regions, each written on its
+# own frame, so the region being written is never one the GPU may still be
+# reading from an earlier frame. In :map mode (the default), each upload goes
+# to the next region through glMapBufferRange with GL_MAP_UNSYNCHRONIZED_BIT,
+# and a fence placed after the region's draws is checked before the region is
+# reused. If the GPU is still behind by the whole ring, the buffer is orphaned
+# rather than waited on.
+#
+# Only the bytes that changed since a region was last written are uploaded:
+# a shadow copy of each region is kept and compared against the new data
+# (see StreamingBuffer.__update_shadow__), which for a UI that mostly redraws
+# the same geometry is usually a small range or nothing at all.
+#
+# In :orphan mode the buffer is a single region, orphaned with glBufferData
+# and refilled with glBufferSubData on every upload. This needs nothing past
+# GL 1.5 and is what :map mode falls back to. The mode defaults to the value
+# of the GUI_BUFFER_STREAMING environment variable, "map" or "orphan", which
+# is handy for comparing the two under a software GL like Mesa's llvmpipe.
+#
+class StreamingBuffer
+
+  # Number of frames a buffer's regions span
+  REGIONS = 3
+  MODES   = [:map, :orphan].freeze
+
+  MAP_ACCESS = GL::GL_MAP_WRITE_BIT |
+               GL::GL_MAP_INVALIDATE_RANGE_BIT |
+               GL::GL_MAP_UNSYNCHRONIZED_BIT
+
+  def self.default_mode
+    mode = ENV['GUI_BUFFER_STREAMING']
+    (mode && MODES.include?(mode.to_sym)) ? mode.to_sym : :map
+  end
+
+  attr_reader :buffer
+  attr_reader :target
+  attr_reader :mode
+  # Size in bytes of each region
+  attr_reader :region_size
+  # Bytes uploaded by the last upload and in total, and the number of times
+  # the buffer was orphaned because the GPU was behind
+  attr_reader :uploaded_bytes
+  attr_reader :total_uploaded_bytes
+  attr_reader :orphan_count
+
+  #
+  # Creates a streaming buffer for target (e.g., GL_ARRAY_BUFFER) whose
+  # regions are always a multiple of alignment bytes, so region offsets are
+  # too. Must be called with a GL context current.
+  #
+  def initialize(target, alignment: 4, mode: self.class.default_mode)
+    raise ArgumentError, "Invalid streaming mode: #{mode.inspect}" unless MODES.include?(mode)
+
+    @buffer               = BufferObject.new
+    @buffer.target        = target
+    @target               = target
+    @alignment            = alignment
+    @mode                 = mode
+    @region_count         = mode == :map ? REGIONS : 1
+    @region_size          = 0
+    @region               = 0
+    @fences               = Array.new(@region_count)
+    @shadows              = Array.new(@region_count) { String.new(encoding: Encoding::BINARY) }
+    @uploaded_bytes       = 0
+    @total_uploaded_bytes = 0
+    @orphan_count         = 0
+  end
+
+  # Byte offset of the region last uploaded to.
+  def offset
+    @region * @region_size
+  end
+
+  #
+  # Uploads bytes bytes from source (anything with an address, such as a
+  # Snow::Memory) to the next region and returns the region's byte offset.
+  #
+  def upload(source, bytes)
+    @buffer.bind(@target) do
+      __reserve__(bytes)
+      @region = (@region + 1) % @region_count
+
+      if @mode == :orphan
+        __orphan__
+        __sub_data__(source.address, 0, bytes)
+        @uploaded_bytes = bytes
+      else
+        __wait_for_region__
+        range = self.class.__update_shadow__(@shadows[@region], source.address, bytes)
+        if range.nil?
+          @uploaded_bytes = 0
+        elsif __map_range__(source.address, range[0], range[1])
+          @uploaded_bytes = range[1]
+        else
+          # Couldn't map, or the mapping's contents were lost
+          __sub_data__(source.address, 0, bytes)
+          @uploaded_bytes = bytes
+        end
+      end
+    end
+
+    @total_uploaded_bytes += @uploaded_bytes
+    offset
+  end
+
+  #
+  # Marks the current region as in use by the draws issued since it was
+  # uploaded. Call after every batch of draws reading from the region.
+  #
+  def fence
+    return self unless @mode == :map
+    previous = @fences[@region]
+    GL.glDeleteSync(previous) if previous
+    @fences[@region] = GL.glFenceSync(GL::GL_SYNC_GPU_COMMANDS_COMPLETE, 0)
+    self
+  end
+
+  def destroy
+    __delete_fences__
+    @buffer.release { @buffer = nil } if @buffer
+  end
+
+  # Grows the regions to hold at least bytes bytes, reallocating the buffer.
+  def __reserve__(bytes)
+    return if bytes <= @region_size
+
+    size = @region_size * 2
+    size = bytes if size < bytes
+    size = ((size + @alignment - 1) / @alignment) * @alignment
+    @region_size = size
+    GL.glBufferData(@target, size * @region_count, 0, GL::GL_STREAM_DRAW)
+    __invalidate__
+  end
+  private :__reserve__
+
+  # Gives the buffer new storage, leaving the old to whatever's drawing with
+  # it, so nothing written to it can stall.
+  def __orphan__
+    GL.glBufferData(@target, @region_size * @region_count, 0, GL::GL_STREAM_DRAW)
+    __invalidate__
+  end
+  private :__orphan__
+
+  # Orphans the buffer if the GPU hasn't finished with the current region.
+  def __wait_for_region__
+    fence = @fences[@region]
+    return unless fence
+
+    status = GL.glClientWaitSync(fence, 0, 0)
+    if status == GL::GL_TIMEOUT_EXPIRED || status == GL::GL_WAIT_FAILED
+      @orphan_count += 1
+      __orphan__
+    else
+      GL.glDeleteSync(fence)
+      @fences[@region] = nil
+    end
+  end
+  private :__wait_for_region__
+
+  # Drops the shadows and fences, after which every region is rewritten whole.
+  def __invalidate__
+    __delete_fences__
+    @shadows.each(&:clear)
+  end
+  private :__invalidate__
+
+  def __delete_fences__
+    @fences.each_with_index do |fence, index|
+      next unless fence
+      GL.glDeleteSync(fence)
+      @fences[index] = nil
+    end
+  end
+  private :__delete_fences__
+
+  # Copies length bytes from address + start to the current region through a
+  # mapping. Returns whether it succeeded.
+  def __map_range__(address, start, length)
+    mapped = GL.glMapBufferRange(@target, offset + start, length, MAP_ACCESS)
+    mapped = mapped ? mapped.to_i : 0
+    return false if mapped == 0
+    self.class.__copy__(mapped, address + start, length)
+    GL.glUnmapBuffer(@target) == GL::GL_TRUE
+  end
+  private :__map_range__
+
+  def __sub_data__(address, start, length)
+    GL.glBufferSubData(@target, offset + start, length, address + start)
+  end
+  private :__sub_data__
+
+end # StreamingBuffer
+
+end # GUI
@@ -0,0 +1,204 @@
+#  Copyright 2014 Noel Cower
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+#  -----------------------------------------------------------------------------
+#
+#  texture_atlas.rb
+#    Packs small images into shared texture pages.
+
+
+require 'stb-image'
+require 'opengl-core'
+require 'gui/gl'
+require 'gui/gl/texture'
+require 'gui/skyline_packer'
+require 'gui/texture_region'
+
+
+module GUI
+
+#
+# Packs images into square RGBA pages of page_size texels and hands out a
+# TextureRegion for each, so the many small images a UI draws with end up in
+# a few textures and Driver can batch them into a few stages.
+#
+# Each image is surrounded by padding texels copied from its edges, so linear
+# filtering at a region's edges never samples a neighbour. Images wider or
+# taller than max_region aren't worth a page's space and get a Texture of
+# their own instead. A page whose regions have all been released is emptied
+# and reused.
+#
+# Must be used with a GL context current.
+#
+class TextureAtlas
+
+  DEFAULT_PAGE_SIZE = 1024
+  DEFAULT_PADDING   = 2
+  BYTES_PER_TEXEL   = 4
+
+  Page = Struct.new(
+    :texture,     # Texture
+    :packer,      # SkylinePacker
+    :regions      # fixnum, live regions in the page
+    )
+
+  attr_reader :page_size
+  attr_reader :padding
+  attr_reader :max_region
+  attr_reader :pages
+
+  def initialize(
+    page_size: DEFAULT_PAGE_SIZE,
+    padding: DEFAULT_PADDING,
+    max_region: nil
+    )
+    limit = GLObject.new
+    GL.glGetIntegerv(GL::GL_MAX_TEXTURE_SIZE, limit.address)
+    page_size = limit.name if limit.name > 0 && page_size > limit.name
+
+    @page_size  = page_size
+    @padding    = padding
+    @max_region = max_region || page_size / 4
+    @pages      = []
+  end
+
+  #
+  # Loads an image from io, converted to RGBA, and returns a TextureRegion for
+  # it -- or a Texture, if it's larger than max_region.
+  #
+  def load_from_io(io)
+    STBI.load_image(io, STBI::COMPONENTS_RGB_ALPHA) do |data, width, height, _components|
+      add(data, width, height) || __standalone_texture__(data, width, height)
+    end
+  end
+
+  #
+  # Packs width by height RGBA8 pixels (a String, rows top to bottom) and
+  # returns their TextureRegion, or nil if they're larger than max_region.
+  #
+  def add(pixels, width, height)
+    raise ArgumentError, "Invalid image size: #{width}x#{height}" unless width > 0 && height > 0
+    return nil if width > @max_region || height > @max_region
+
+    padded_width = width + @padding * 2
+    padded_height = height + @padding * 2
+    page = nil
+    corner = nil
+    @pages.each do |candidate|
+      corner = candidate.packer.pack(padded_width, padded_height)
+      if corner
+        page = candidate
+        break
+      end
+    end
+
+    unless page
+      page = __new_page__
+      corner = page.packer.pack(padded_width, padded_height)
+      return nil unless corner
+    end
+
+    page.texture.bind(GL::GL_TEXTURE_2D) do
+      GL.glTexSubImage2D(
+        GL::GL_TEXTURE_2D, 0,
+        corner[0], corner[1], padded_width, padded_height,
+        GL::GL_RGBA, GL::GL_UNSIGNED_BYTE,
+        __extrude__(pixels, width, height)
+        )
+    end
+
+    page.regions += 1
+    TextureRegion.new(
+      page.texture,
+      corner[0] + @padding, corner[1] + @padding, width, height,
+      @page_size, @page_size,
+      owner: self
+      )
+  end
+
+  # Number of regions handed out and not yet released.
+  def region_count
+    @pages.reduce(0) { |sum, page| sum + page.regions }
+  end
+
+  def destroy
+    @pages.each { |page| page.texture.release }
+    @pages.clear
+  end
+
+  # Called by TextureRegion#release once a region is no longer used.
+  def __release_region__(region)
+    page = @pages.find { |candidate| candidate.texture.equal?(region.texture) }
+    return unless page
+    page.regions -= 1
+    page.packer.reset if page.regions == 0
+  end
+
+  def __new_page__
+    texture = Texture.new
+    texture.bind(GL::GL_TEXTURE_2D) do
+      GL.glTexParameteri(GL::GL_TEXTURE_2D, GL::GL_TEXTURE_WRAP_S, GL::GL_CLAMP_TO_EDGE)
+      GL.glTexParameteri(GL::GL_TEXTURE_2D, GL::GL_TEXTURE_WRAP_T, GL::GL_CLAMP_TO_EDGE)
+      GL.glTexParameteri(GL::GL_TEXTURE_2D, GL::GL_TEXTURE_MIN_FILTER, GL::GL_LINEAR)
+      GL.glTexParameteri(GL::GL_TEXTURE_2D, GL::GL_TEXTURE_MAG_FILTER, GL::GL_LINEAR)
+      GL.glTexImage2D(
+        GL::GL_TEXTURE_2D, 0, GL::GL_RGBA8, @page_size, @page_size, 0,
+        GL::GL_RGBA, GL::GL_UNSIGNED_BYTE, 0
+        )
+    end
+
+    page = Page[texture, SkylinePacker.new(@page_size, @page_size), 0]
+    @pages << page
+    page
+  end
+  private :__new_page__
+
+  # Copies pixels into a buffer padding texels larger on each side, filling
+  # the border with the image's edge texels.
+  def __extrude__(pixels, width, height)
+    return pixels if @padding == 0
+
+    pixels = pixels.b unless pixels.encoding == Encoding::BINARY
+    row_bytes = width * BYTES_PER_TEXEL
+    padded_width = width + @padding * 2
+    rows = Array.new(height) do |y|
+      row = pixels.byteslice(y * row_bytes, row_bytes)
+      row.byteslice(0, BYTES_PER_TEXEL) * @padding << row <<
+        row.byteslice(row_bytes - BYTES_PER_TEXEL, BYTES_PER_TEXEL) * @padding
+    end
+
+    out = String.new(
+      capacity: padded_width * (height + @padding * 2) * BYTES_PER_TEXEL,
+      encoding: Encoding::BINARY
+      )
+    @padding.times { out << rows.first }
+    rows.each { |row| out << row }
+    @padding.times { out << rows.last }
+    out
+  end
+  private :__extrude__
+
+  def __standalone_texture__(pixels, width, height)
+    Texture.new.bind(GL::GL_TEXTURE_2D) do |texture|
+      Texture.__load_texture_data__(
+        GL::GL_TEXTURE_2D, pixels, width, height, STBI::COMPONENTS_RGB_ALPHA
+        )
+      texture
+    end
+  end
+  private :__standalone_texture__
+
+end # TextureAtlas
+
+end # GUI
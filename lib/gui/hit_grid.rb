@@ -0,0 +1,204 @@
+#  Copyright 2014 Noel Cower
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+#  -----------------------------------------------------------------------------
+#
+#  hit_grid.rb
+#    Uniform grid of a view's subview frames for hit testing.
+
+
+module GUI
+
+#
+# Buckets a view's subviews into a uniform grid over the view's bounds by
+# their frames, so hit testing a point only has to look at the subviews in
+# the point's cell rather than all of them. Views with more than MIN_VIEWS
+# subviews get one automatically (see View#uses_hit_grid).
+#
+# Cells are sized close to the average subview. Each cell holds the subviews
+# overlapping it in the order they appear in subviews, so the last one in a
+# cell is the topmost. The grid is kept up to date by View as subviews are
+# added and removed and their frames are assigned, and is rebuilt if the
+# view's size changes. Changes made to a subview's frame in place (e.g.,
+# frame.origin.x = 4) aren't seen -- assign the frame to move it in the grid.
+#
+class HitGrid
+
+  # Views with more subviews than this use a HitGrid for hit testing
+  MIN_VIEWS = 32
+  # Upper bound on the grid's total cells per subview
+  MAX_CELLS_PER_VIEW = 4
+
+  # The view whose subviews are in the grid.
+  attr_reader :view
+
+  def initialize(view)
+    @view = view
+    rebuild
+  end
+
+  # Rebuilds the grid for the view's current size and subviews.
+  def rebuild
+    size     = @view.frame.size
+    subviews = @view.subviews
+    @width   = size.x
+    @height  = size.y
+
+    @columns, @rows = __dimensions__(subviews)
+    @cell_width     = (@width > 0) ? @width.fdiv(@columns) : 1.0
+    @cell_height    = (@height > 0) ? @height.fdiv(@rows) : 1.0
+    @cells          = Array.new(@columns * @rows) { [] }
+    # Subview => [first column, first row, last column, last row]
+    @ranges         = {}.compare_by_identity
+    # Subview => position used to keep cells in subview order
+    @order          = {}.compare_by_identity
+    @next_order     = 0
+
+    subviews.each { |subview| add(subview) }
+    self
+  end
+
+  # Whether the view has been resized since the grid was built.
+  def stale?
+    size = @view.frame.size
+    size.x != @width || size.y != @height
+  end
+
+  # Adds a subview, which must be the view's last subview, to the grid.
+  def add(subview)
+    @order[subview] = (@next_order += 1)
+    __insert__(subview)
+    self
+  end
+
+  # Removes a subview from the grid.
+  def remove(subview)
+    __erase__(subview)
+    @order.delete(subview)
+    self
+  end
+
+  # Moves a subview to the cells its frame now overlaps.
+  def move(subview)
+    return self unless @order.include?(subview)
+    __erase__(subview)
+    __insert__(subview)
+    self
+  end
+
+  #
+  # Hit tests the subviews in the cell containing x, y (in the view's
+  # coordinates), topmost first. See View#__hit_test__.
+  #
+  def hit_test(x, y, out)
+    cell = @cells[__row__(y) * @columns + __column__(x)]
+    index = cell.length - 1
+    while index >= 0
+      subview = cell[index]
+      origin = subview.frame.origin
+      subview.__hit_test__(x - origin.x, y - origin.y, out)
+      index -= 1
+    end
+    out
+  end
+
+  #
+  # Picks cell dimensions close to the average subview size, so a subview
+  # usually overlaps only a few cells (a vertical list gets a single column,
+  # for example), with no more than MAX_CELLS_PER_VIEW cells per subview in
+  # total.
+  #
+  def __dimensions__(subviews)
+    count = subviews.length
+    return [1, 1] if count == 0
+
+    total_width = 0.0
+    total_height = 0.0
+    subviews.each do |subview|
+      size = subview.frame.size
+      total_width += size.x.abs
+      total_height += size.y.abs
+    end
+
+    columns = __divisions__(@width, total_width / count, count)
+    rows = __divisions__(@height, total_height / count, count)
+    limit = count * MAX_CELLS_PER_VIEW
+    if columns * rows > limit
+      scale = Math.sqrt(limit.fdiv(columns * rows))
+      columns = [(columns * scale).floor, 1].max
+      rows = [(rows * scale).floor, 1].max
+    end
+    [columns, rows]
+  end
+  private :__dimensions__
+
+  def __divisions__(extent, average, limit)
+    return 1 if extent <= 0 || average <= 0
+    divisions = (extent / average).ceil
+    divisions < 1 ? 1 : (divisions > limit ? limit : divisions)
+  end
+  private :__divisions__
+
+  def __column__(x)
+    column = (x / @cell_width).floor
+    column < 0 ? 0 : (column >= @columns ? @columns - 1 : column)
+  end
+  private :__column__
+
+  def __row__(y)
+    row = (y / @cell_height).floor
+    row < 0 ? 0 : (row >= @rows ? @rows - 1 : row)
+  end
+  private :__row__
+
+  def __insert__(subview)
+    frame = subview.frame
+    left, right = frame.left, frame.right
+    top, bottom = frame.top, frame.bottom
+    left, right = right, left if right < left
+    top, bottom = bottom, top if bottom < top
+
+    range = [__column__(left), __row__(top), __column__(right), __row__(bottom)]
+    @ranges[subview] = range
+    order = @order[subview]
+
+    range[1].upto(range[3]) do |row|
+      range[0].upto(range[2]) do |column|
+        cell = @cells[row * @columns + column]
+        if cell.empty? || @order[cell.last] < order
+          cell << subview
+        else
+          index = cell.bsearch_index { |other| @order[other] > order }
+          cell.insert(index || cell.length, subview)
+        end
+      end
+    end
+  end
+  private :__insert__
+
+  def __erase__(subview)
+    range = @ranges.delete(subview)
+    return unless range
+
+    range[1].upto(range[3]) do |row|
+      range[0].upto(range[2]) do |column|
+        @cells[row * @columns + column].delete(subview)
+      end
+    end
+  end
+  private :__erase__
+
+end # HitGrid
+
+end # GUI
@@ -0,0 +1,210 @@
+#  Copyright 2014 Noel Cower
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+#  -----------------------------------------------------------------------------
+#
+#  stack_view.rb
+#    View that lays its subviews out in a row or column.
+
+
+require 'gui/view'
+
+
+module GUI
+
+#
+# Lays its visible subviews out one after another along its axis, either
+# :vertical (top to bottom) or :horizontal (left to right), separated by
+# spacing and inset from its bounds by padding.
+#
+# Each subview gets its measured size (see View#measure) along the axis. Any
+# space left over -- or missing, if the subviews don't fit -- is shared
+# between the subviews with a non-zero flex, in proportion to it, though no
+# subview is shrunk below zero. Across the axis, subviews are placed according
+# to alignment: :start, :center, :end, or :fill to stretch them to the stack's
+# width (or height).
+#
+# A stack measures itself by its subviews, so it lays itself out again
+# whenever one of them requests layout, and its superview is told in turn.
+#
+class StackView < View
+
+  AXES       = [:vertical, :horizontal].freeze
+  ALIGNMENTS = [:start, :center, :end, :fill].freeze
+
+  attr_reader :axis
+  attr_reader :spacing
+  attr_reader :padding
+  attr_reader :alignment
+
+  def initialize(frame = nil, axis: :vertical, spacing: 0, padding: 0, alignment: :fill)
+    @axis      = __check_axis__(axis)
+    @spacing   = spacing
+    @padding   = padding
+    @alignment = __check_alignment__(alignment)
+    super(frame)
+  end
+
+  def axis=(new_axis)
+    @axis = __check_axis__(new_axis)
+    request_layout
+    new_axis
+  end
+
+  def spacing=(new_spacing)
+    @spacing = new_spacing
+    request_layout
+    new_spacing
+  end
+
+  def padding=(new_padding)
+    @padding = new_padding
+    request_layout
+    new_padding
+  end
+
+  def alignment=(new_alignment)
+    @alignment = __check_alignment__(new_alignment)
+    request_layout
+    new_alignment
+  end
+
+  def vertical?
+    @axis == :vertical
+  end
+
+  def __subview_needs_layout__(subview)
+    @subtree_needs_layout = true
+    request_layout
+  end
+
+  def size_that_fits(available_width, available_height)
+    vertical = vertical?
+    inset = @padding * 2
+    cross_available = (vertical ? available_width : available_height) - inset
+
+    main = 0
+    cross = 0
+    count = 0
+    @subviews.each do |subview|
+      next if subview.hidden
+
+      size = __subview_size__(subview, vertical, cross_available)
+      main += vertical ? size.y : size.x
+      subview_cross = vertical ? size.x : size.y
+      cross = subview_cross if subview_cross > cross
+      count += 1
+    end
+    main += @spacing * (count - 1) if count > 1
+
+    vertical ? Vec2[cross + inset, main + inset] : Vec2[main + inset, cross + inset]
+  end
+
+  def perform_layout
+    vertical = vertical?
+    size = @frame.size
+    main_extent = (vertical ? size.y : size.x) - @padding * 2
+    cross_extent = (vertical ? size.x : size.y) - @padding * 2
+
+    visible = @subviews.reject(&:hidden)
+    return if visible.empty?
+
+    # Measure, then share out whatever space is left along the axis
+    mains = visible.map do |subview|
+      measured = __subview_size__(subview, vertical, cross_extent)
+      vertical ? measured.y : measured.x
+    end
+    free = main_extent - @spacing * (visible.length - 1) - mains.reduce(0, :+)
+    total_flex = visible.reduce(0) { |sum, subview| sum + subview.flex }
+    if free != 0 && total_flex > 0
+      visible.each_with_index do |subview, index|
+        next unless subview.flex > 0
+        main = mains[index] + free * subview.flex.fdiv(total_flex)
+        mains[index] = main < 0 ? 0 : main
+      end
+    end
+
+    offset = @padding
+    visible.each_with_index do |subview, index|
+      main = mains[index]
+      cross = __subview_cross__(subview, vertical, cross_extent)
+      cross_offset = @padding + __cross_offset__(cross, cross_extent)
+
+      if vertical
+        __place_subview__(subview, cross_offset, offset, cross, main)
+      else
+        __place_subview__(subview, offset, cross_offset, main, cross)
+      end
+      offset += main + @spacing
+    end
+  end
+
+  #
+  # Sets subview's frame if it differs from the given one. Compared after
+  # building the new Rect, since its components may be stored at a lower
+  # precision than they were computed at.
+  #
+  def __place_subview__(subview, x, y, width, height)
+    frame = subview.frame
+    new_frame = Rect.new(x, y, width, height)
+    return if frame.x == new_frame.x && frame.y == new_frame.y &&
+              frame.width == new_frame.width && frame.height == new_frame.height
+    invalidate(frame)
+    subview.frame = new_frame
+    invalidate(new_frame)
+  end
+  private :__place_subview__
+
+  def __subview_size__(subview, vertical, cross_available)
+    if vertical
+      subview.measure(cross_available, Float::INFINITY)
+    else
+      subview.measure(Float::INFINITY, cross_available)
+    end
+  end
+  private :__subview_size__
+
+  def __subview_cross__(subview, vertical, cross_extent)
+    return (cross_extent < 0 ? 0 : cross_extent) if @alignment == :fill
+    size = __subview_size__(subview, vertical, cross_extent)
+    vertical ? size.x : size.y
+  end
+  private :__subview_cross__
+
+  def __cross_offset__(cross, cross_extent)
+    case @alignment
+    when :center then (cross_extent - cross) / 2.0
+    when :end    then cross_extent - cross
+    else 0
+    end
+  end
+  private :__cross_offset__
+
+  def __check_axis__(axis)
+    raise ArgumentError, "Invalid stack axis: #{axis.inspect}" unless AXES.include?(axis)
+    axis
+  end
+  private :__check_axis__
+
+  def __check_alignment__(alignment)
+    unless ALIGNMENTS.include?(alignment)
+      raise ArgumentError, "Invalid stack alignment: #{alignment.inspect}"
+    end
+    alignment
+  end
+  private :__check_alignment__
+
+end # StackView
+
+end # GUI
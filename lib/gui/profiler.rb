@@ -0,0 +1,285 @@
+#  Copyright 2014 Noel Cower
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+#  -----------------------------------------------------------------------------
+#
+#  profiler.rb
+#    Per-frame timings of Context#run, exportable as a Chrome trace.
+
+
+require 'json'
+
+
+module GUI
+
+#
+# Records how long each phase of a frame takes, per window, along with counts
+# of what was drawn. Every Context has one (see Context#profiler), disabled
+# until enabled is set, at which point Context#run and Window record into it.
+# While disabled, measure only yields.
+#
+# The last capacity frames are kept in a ring buffer of Frames, which are
+# reused rather than allocated, and can be read back with each_frame or
+# written out with write_chrome_trace for chrome://tracing or Perfetto.
+#
+class Profiler
+
+  # Default number of frames kept
+  CAPACITY = 240
+
+  #
+  # A single frame's spans and counters. Spans are stored in parallel arrays
+  # in the order they finished, so nested spans come before their parents.
+  # Times are in seconds since the profiler was created.
+  #
+  class Frame
+
+    attr_reader :number
+    attr_reader :start
+    attr_reader :duration
+    # Quads drawn, draw stages built, stages saved by batching, and draw
+    # calls made
+    attr_accessor :quads
+    attr_accessor :stages
+    attr_accessor :stages_saved
+    attr_accessor :draw_calls
+
+    def initialize
+      @names     = []
+      @windows   = []
+      @starts    = []
+      @durations = []
+      __reset__(0, 0.0)
+    end
+
+    def __reset__(number, start)
+      @number       = number
+      @start        = start
+      @duration     = 0.0
+      @quads        = 0
+      @stages       = 0
+      @stages_saved = 0
+      @draw_calls   = 0
+      @names.clear
+      @windows.clear
+      @starts.clear
+      @durations.clear
+      self
+    end
+
+    def __finish__(time)
+      @duration = time - @start
+      self
+    end
+
+    def __add_span__(name, window, start, duration)
+      @names << name
+      @windows << window
+      @starts << start
+      @durations << duration
+    end
+
+    def span_count
+      @names.length
+    end
+
+    #
+    # Yields the name, window (nil for phases not specific to a window),
+    # start, and duration of each span in the frame.
+    #
+    def each_span
+      return to_enum(:each_span) unless block_given?
+      @names.each_index do |index|
+        yield @names[index], @windows[index], @starts[index], @durations[index]
+      end
+      self
+    end
+
+    # Returns the total time spent in spans with the given name and window.
+    def time_in(name, window = nil)
+      total = 0.0
+      @names.each_index do |index|
+        next unless @names[index] == name
+        next unless window.nil? || @windows[index].equal?(window)
+        total += @durations[index]
+      end
+      total
+    end
+
+  end # Frame
+
+
+  attr_reader   :capacity
+  # Whether frames are being recorded
+  attr_accessor :enabled
+  alias_method  :enabled?, :enabled
+
+  def initialize(capacity = CAPACITY, enabled: false)
+    @capacity = capacity
+    @enabled  = enabled
+    @frames   = Array.new(capacity) { Frame.new }
+    @count    = 0
+    @current  = nil
+    @epoch    = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  # Seconds since the profiler was created.
+  def now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC) - @epoch
+  end
+
+  # Starts recording a frame, overwriting the oldest once the buffer is full.
+  def begin_frame
+    return self unless @enabled
+    @current = @frames[@count % @capacity].__reset__(@count, now)
+    @count += 1
+    self
+  end
+
+  def end_frame
+    if @current
+      @current.__finish__(now)
+      @current = nil
+    end
+    self
+  end
+
+  # The frame being recorded, or nil.
+  def current_frame
+    @current
+  end
+
+  #
+  # Yields and records how long the block took as a span named name in the
+  # current frame. Returns the block's result.
+  #
+  def measure(name, window = nil)
+    frame = @current
+    return yield unless frame
+
+    start = now
+    begin
+      yield
+    ensure
+      frame.__add_span__(name, window, start, now - start)
+    end
+  end
+
+  #
+  # Adds the given counts to the current frame's counters, if there is one.
+  #
+  def count(quads: 0, stages: 0, stages_saved: 0, draw_calls: 0)
+    frame = @current
+    return self unless frame
+    frame.quads += quads
+    frame.stages += stages
+    frame.stages_saved += stages_saved
+    frame.draw_calls += draw_calls
+    self
+  end
+
+  # Number of complete frames held, at most capacity.
+  def length
+    finished = @current ? @count - 1 : @count
+    finished < @capacity ? finished : @capacity
+  end
+
+  alias_method :size, :length
+
+  # Yields each complete frame held, oldest first.
+  def each_frame
+    return to_enum(:each_frame) unless block_given?
+    finished = @current ? @count - 1 : @count
+    (finished - length).upto(finished - 1) do |number|
+      yield @frames[number % @capacity]
+    end
+    self
+  end
+
+  # Returns the most recent complete frame, or nil.
+  def last_frame
+    finished = @current ? @count - 1 : @count
+    finished > 0 ? @frames[(finished - 1) % @capacity] : nil
+  end
+
+  # Drops all recorded frames.
+  def clear
+    @count = 0
+    @current = nil
+    self
+  end
+
+  #
+  # Returns the recorded frames as a Chrome trace-event Hash. Each frame is a
+  # complete event on thread 0 with its phases nested under it, on thread 0
+  # for phases common to all windows and on a thread per window otherwise.
+  # Counters are emitted as counter events.
+  #
+  def to_chrome_trace
+    events = []
+    threads = { nil => 0 }.compare_by_identity
+
+    each_frame do |frame|
+      events << {
+        name: 'frame', cat: 'frame', ph: 'X', pid: 1, tid: 0,
+        ts: __micros__(frame.start), dur: __micros__(frame.duration),
+        args: { number: frame.number }
+      }
+
+      frame.each_span do |name, window, start, duration|
+        tid = (threads[window] ||= threads.length)
+        events << {
+          name: name.to_s, cat: 'phase', ph: 'X', pid: 1, tid: tid,
+          ts: __micros__(start), dur: __micros__(duration)
+        }
+      end
+
+      events << {
+        name: 'draw', cat: 'counters', ph: 'C', pid: 1, tid: 0,
+        ts: __micros__(frame.start),
+        args: {
+          quads: frame.quads, stages: frame.stages,
+          stages_saved: frame.stages_saved, draw_calls: frame.draw_calls
+        }
+      }
+    end
+
+    threads.each do |window, tid|
+      label = window.nil? ? 'context' : __window_label__(window, tid)
+      events << { name: 'thread_name', ph: 'M', pid: 1, tid: tid, args: { name: label } }
+    end
+
+    { traceEvents: events, displayTimeUnit: 'ms' }
+  end
+
+  # Writes the recorded frames to path as Chrome trace-event JSON.
+  def write_chrome_trace(path)
+    File.write(path, JSON.generate(to_chrome_trace))
+    path
+  end
+
+  def __micros__(seconds)
+    (seconds * 1.0e6).round(3)
+  end
+  private :__micros__
+
+  def __window_label__(window, tid)
+    title = window.respond_to?(:title) ? window.title : nil
+    (title.nil? || title.empty?) ? "window #{tid}" : "window #{tid} (#{title})"
+  end
+  private :__window_label__
+
+end # Profiler
+
+end # GUI
@@ -0,0 +1,204 @@
+#  Copyright 2014 Noel Cower
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+#  -----------------------------------------------------------------------------
+#
+#  scheduler.rb
+#    Runs work posted to a Context within each frame's time budget.
+
+
+module GUI
+
+#
+# Queues work posted to a Context (see Context#post) and decides how much of
+# it runs each frame. Work is anything responding to call. As before the
+# scheduler existed, anything that also responds to done? is run again each
+# frame until done? returns true, which is how long jobs are split into steps.
+#
+# Work is posted at one of three priorities:
+#
+# - :high runs every frame, all of it, whatever it costs.
+# - :normal runs in deadline order until the frame's budget (frame_budget) is
+#   spent. Work without a deadline runs after work with one, oldest first.
+# - :idle runs only in the time left over between drawing a frame and the
+#   next one being due, when Context#run would otherwise sleep.
+#
+# A deadline is a number of seconds after posting by which the work should
+# run. Work whose deadline has passed runs regardless of the budget, even at
+# :idle priority. For repeating work, the deadline applies to each step.
+#
+# Each piece of work runs at most once per frame, so a repeating job gets one
+# step per frame however cheap its steps are.
+#
+class Scheduler
+
+  PRIORITIES           = [:high, :normal, :idle].freeze
+  # Refresh rate assumed when the display's can't be determined
+  DEFAULT_REFRESH_RATE = 60.0
+  # Default fraction of a frame that :normal work may take
+  BUDGET_FRACTION      = 0.25
+  # Leftover time below which Context#run doesn't bother sleeping
+  MIN_SLEEP            = 0.001
+
+  Task = Struct.new(
+    :callable,  # Object responding to call
+    :priority,  # Symbol, one of PRIORITIES
+    :latency,   # seconds from being queued to its deadline, or nil
+    :deadline,  # absolute time it should run by, or Float::INFINITY
+    :sequence   # fixnum, orders tasks with the same deadline
+    )
+
+  # Frames per second Context#run paces itself to
+  attr_reader   :refresh_rate
+  attr_reader   :frame_interval
+  # Seconds per frame :normal work may take, or nil for BUDGET_FRACTION of
+  # the frame interval
+  attr_writer   :frame_budget
+
+  def initialize(refresh_rate = DEFAULT_REFRESH_RATE)
+    @queues       = { high: [], normal: [], idle: [] }
+    @requeue      = []
+    @sequence     = 0
+    @frame_budget = nil
+    self.refresh_rate = refresh_rate
+  end
+
+  def refresh_rate=(rate)
+    raise ArgumentError, "Invalid refresh rate: #{rate.inspect}" unless rate > 0
+    @refresh_rate = rate.to_f
+    @frame_interval = 1.0 / @refresh_rate
+  end
+
+  def frame_budget
+    @frame_budget || @frame_interval * BUDGET_FRACTION
+  end
+
+  def now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  #
+  # Queues callable at the given priority, to run within deadline seconds if
+  # given. Returns the queued Task.
+  #
+  def post(callable, priority: :normal, deadline: nil)
+    queue = @queues[priority]
+    raise ArgumentError, "Invalid priority: #{priority.inspect}" unless queue
+    task = Task.new(callable, priority, deadline, deadline ? now + deadline : Float::INFINITY, 0)
+    __enqueue__(queue, task)
+    task
+  end
+
+  # Whether any work is queued.
+  def pending?
+    busy? || !@queues[:idle].empty?
+  end
+
+  # Whether work that isn't :idle is queued.
+  def busy?
+    !@queues[:high].empty? || !@queues[:normal].empty? ||
+      (!@requeue.empty? && @requeue.any? { |task| task.priority != :idle })
+  end
+
+  def length
+    @queues[:high].length + @queues[:normal].length + @queues[:idle].length +
+      @requeue.length
+  end
+
+  alias_method :size, :length
+
+  #
+  # Runs this frame's share of work: all :high work queued before the frame
+  # started, then :normal work until the budget is spent, then any overdue
+  # :idle work.
+  #
+  def run_frame
+    start = now
+    __requeue__(start)
+    __run_count__(@queues[:high], @queues[:high].length)
+    __run_until__(@queues[:normal], start + frame_budget)
+    __run_until__(@queues[:idle], start)
+    self
+  end
+
+  #
+  # Runs :idle work until the next frame is due (frame_interval after
+  # frame_start), then sleeps out whatever time is left so frames are paced
+  # to the refresh rate.
+  #
+  def finish_frame(frame_start)
+    next_frame = frame_start + @frame_interval
+    __run_until__(@queues[:idle], next_frame)
+
+    remaining = next_frame - now
+    sleep(remaining) if remaining >= MIN_SLEEP
+    self
+  end
+
+  # Inserts task into queue, ordered by deadline and then by posting order.
+  def __enqueue__(queue, task)
+    task.sequence = (@sequence += 1)
+    last = queue.last
+    if last.nil? || last.deadline <= task.deadline
+      queue << task
+    else
+      index = queue.bsearch_index { |other| other.deadline > task.deadline }
+      queue.insert(index, task)
+    end
+  end
+  private :__enqueue__
+
+  def __run_count__(queue, count)
+    while count > 0 && (task = queue.shift)
+      __run_task__(task)
+      count -= 1
+    end
+  end
+  private :__run_count__
+
+  # Runs tasks until end_time, after which only overdue tasks run.
+  def __run_until__(queue, end_time)
+    while (task = queue.first)
+      time = now
+      break if time >= end_time && task.deadline > time
+      queue.shift
+      __run_task__(task)
+    end
+  end
+  private :__run_until__
+
+  def __run_task__(task)
+    callable = task.callable
+    callable.call
+    if callable.respond_to?(:done?) && !callable.done?
+      @requeue << task
+    end
+  end
+  private :__run_task__
+
+  # Queues the repeating tasks run last frame again. They're held back until
+  # the next frame starts so each runs once per frame.
+  def __requeue__(time)
+    return if @requeue.empty?
+    @requeue.each do |task|
+      task.deadline = task.latency ? time + task.latency : Float::INFINITY
+      __enqueue__(@queues[task.priority], task)
+    end
+    @requeue.clear
+  end
+  private :__requeue__
+
+end # Scheduler
+
+end # GUI
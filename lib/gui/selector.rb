@@ -18,17 +18,150 @@
 #    Selector chain class.
 
 
+require 'thread'
+
+
 module GUI
 
+class SelectorError < StandardError ; end
+
 class Selector
 
+  # Default number of selector strings retained by Selector.build.
+  DEFAULT_CACHE_CAPACITY = 256
+
+  @__cache__           = {}
+  @__cache_lock__      = Mutex.new
+  @__cache_capacity__  = DEFAULT_CACHE_CAPACITY
+  @__cache_hits__      = 0
+  @__cache_misses__    = 0
+  @__cache_evictions__ = 0
+  @__packs__           = []
+
   class << self
     def view_matches_attr(view, name, value)
       view.respond_to?(name) && view.__send__(name) == value
     end
 
+    #
+    # Returns a frozen selector chain for the given selector string. Chains are
+    # interned in a bounded LRU cache keyed by the selector string, so repeated
+    # lookups of the same selector don't reparse it or allocate new selectors.
+    # Because the chains are frozen, they can be shared between views and
+    # threads.
+    #
+    # Selectors not in the cache are taken from packs added with add_pack, if
+    # any of them has one with the same source, and are parsed otherwise.
+    #
+    # Raises whatever SelectorParser.parse raises if the string is invalid.
+    # Invalid selectors are not cached.
+    #
     def build(selector_str)
+      key = selector_str.to_s
+
+      @__cache_lock__.synchronize do
+        cache = @__cache__
+
+        # Hashes retain insertion order, so deleting and reinserting a hit
+        # moves it to the most-recently-used end.
+        selector = cache.delete(key)
+        if selector
+          @__cache_hits__ += 1
+        else
+          @__cache_misses__ += 1
+          selector = __pack_selector__(key) || SelectorParser.parse(key).freeze
+
+          while cache.length >= @__cache_capacity__
+            cache.shift
+            @__cache_evictions__ += 1
+          end
+        end
+
+        cache[key] = selector
+      end
+    end
+
+    # The maximum number of selectors retained by build.
+    def cache_capacity
+      @__cache_capacity__
+    end
+
+    # Sets the maximum number of selectors retained by build. If the cache
+    # holds more than the new capacity, the least-recently-used selectors are
+    # evicted immediately. Must be at least 1.
+    def cache_capacity=(capacity)
+      capacity = Integer(capacity)
+      raise ArgumentError, "Selector cache capacity must be >= 1" if capacity < 1
+
+      @__cache_lock__.synchronize do
+        @__cache_capacity__ = capacity
+        while @__cache__.length > capacity
+          @__cache__.shift
+          @__cache_evictions__ += 1
+        end
+      end
+
+      capacity
+    end
+
+    # Returns a Hash of the cache's :hits, :misses, :evictions, :size, and
+    # :capacity.
+    def cache_stats
+      @__cache_lock__.synchronize do
+        {
+          hits:      @__cache_hits__,
+          misses:    @__cache_misses__,
+          evictions: @__cache_evictions__,
+          size:      @__cache__.length,
+          capacity:  @__cache_capacity__
+        }
+      end
+    end
 
+    # Adds a SelectorPack for build to take selectors from. Packs are searched
+    # in the order they're added.
+    def add_pack(pack)
+      @__cache_lock__.synchronize { @__packs__ << pack unless @__packs__.include?(pack) }
+      self
+    end
+
+    # Removes a pack added with add_pack. Selectors already taken from it stay
+    # in the cache.
+    def remove_pack(pack)
+      @__cache_lock__.synchronize { @__packs__.delete(pack) }
+      self
+    end
+
+    # Returns the packs build takes selectors from.
+    def packs
+      @__cache_lock__.synchronize { @__packs__.dup }
+    end
+
+    # Returns the selector for key from the first pack that has it. Only called
+    # with the cache lock held.
+    def __pack_selector__(key)
+      @__packs__.each do |pack|
+        next if pack.closed?
+        selector = pack[key]
+        return selector if selector
+      end
+      nil
+    end
+    private :__pack_selector__
+
+    # Empties the cache. If reset_stats is true, the hit/miss/eviction counters
+    # are also reset to zero.
+    def clear_cache(reset_stats: false)
+      @__cache_lock__.synchronize do
+        @__cache__.clear
+        if reset_stats
+          @__cache_hits__      = 0
+          @__cache_misses__    = 0
+          @__cache_evictions__ = 0
+        end
+      end
+
+      self
     end
   end # singleton_class
 
@@ -45,20 +178,63 @@ class Selector
     @direct = false
   end
 
-  # Whether this selector matches a view.
+  # Freezes the selector along with its attribute checks and the rest of its
+  # chain. A frozen selector keeps its compiled form, since it can no longer
+  # change.
+  def freeze
+    return self if frozen?
+    @attributes.each(&:freeze)
+    @attributes.freeze
+    @succ.freeze if @succ
+    @compiled = CompiledSelector.new(self)
+    super
+  end
+
+  # Returns the CompiledSelector for this chain. Unfrozen selectors are
+  # recompiled on each call, since their checks may have changed.
+  def compiled
+    @compiled || CompiledSelector.new(self)
+  end
+
+  # Whether this selector matches a view. Only tests this selector's own
+  # attributes, not the rest of the chain.
   def matches?(view)
     attributes.empty? || attributes.all? { |sel_attr| sel_attr[view] }
   end
 
-  def find_match(view)
-    # TODO: Grab leaves and test selectors in reverse order
-    further = direct ? nil : self
-    if matches?(view)
-      return view unless @succ
-      further = @succ
+  # Whether view is matched by the last selector in the chain and its
+  # superviews (up to root, if given) are matched by the ones before it.
+  def match?(view, root = nil)
+    compiled.match?(view, root)
+  end
+
+  # Returns the first view under and including view (in depth-first order)
+  # that the chain matches, or nil if there's none. A selector followed by >
+  # (direct) only matches its successor against immediate subviews.
+  #
+  # If the last selector in the chain checks a tag or class, only the views
+  # with that tag or class in the tree's ViewIndex are tested. Otherwise, the
+  # tree is walked depth-first. If leaf_first is true, the search instead
+  # starts from view's leaf views and works upward, skipping branches too
+  # shallow to hold a match, and the view returned may differ if more than one
+  # view matches.
+  def find_match(view, leaf_first: false)
+    if leaf_first
+      compiled.find_first_from_leaves(view)
+    else
+      compiled.find_first(view)
     end
+  end
 
-    view.subviews.detect { |subview| further.find_match(subview) }
+  # Returns all views under and including view that the chain matches, in
+  # depth-first order. See find_match for leaf_first, in which case views are
+  # returned in the order they're found.
+  def find_all(view, leaf_first: false)
+    if leaf_first
+      compiled.find_all_from_leaves(view)
+    else
+      compiled.find_all(view)
+    end
   end
 
 end # Selector
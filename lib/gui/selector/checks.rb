@@ -29,12 +29,13 @@ module GUI
 # attribute checks don't have to depend on reducing something by sending
 # messages over and over.
 #
-# In practice, however, selectors are just slow in all my tests right now and I
-# need to rewrite them to test starting with leaf views anyway (this should
-# result in more specific matches and avoid recursive tests since it's then
-# possible to iterate down through parents and cut off if a minimum depth isn't
-# met [i.e., a selector with N views to match requires at least depth N, but
-# can match views across depths greater than N if it has indirect matches]).
+# The built-in checks are normally evaluated natively by CompiledSelector,
+# which only sends #call to checks it doesn't recognize. Selectors can also be
+# tested starting with leaf views (see Selector#find_match), iterating up
+# through superviews and cutting off branches that don't meet the minimum depth
+# (i.e., a selector with N views to match requires at least depth N - 1 below
+# the view searched, but can match views across greater depths if it has
+# indirect matches).
 #
 
 
@@ -45,7 +46,7 @@ class ViewTagCheck
   end
 
   def call(view)
-    view.tag == tagname
+    view.tag == @tagname
   end
 
   alias_method :[], :call
@@ -86,20 +87,74 @@ class ViewAttrCheck
   SCO_MARKER          = '::'
   KEYPATH_SEPARATOR   = '.'
 
-  class << self
-    attr_accessor :__module_name_cache__
+  # Ruby operators for the comparison operators, used to generate the
+  # specialized checks below.
+  COMPARISONS = {
+    equal:         '==',
+    not_equal:     '!=',
+    greater:       '>',
+    greater_equal: '>=',
+    lesser:        '<',
+    lesser_equal:  '<='
+  }.freeze
+
+  @__module_name_cache__ = {}.compare_by_identity
+  @__specialized__       = {}
 
+  class << self
     def extract_class_name(klass)
-      (__module_name_cache__ ||= {})[klass] ||= begin
-        # Cache classname symbols because string ops are slow
-        name = klass.name
-        sco_index = klass.rindex(SCO_MARKER)
-        if sco_index
-          klass.slice!(0 .. sco_index + 1)
-        end
+      # Cache classname symbols because string ops are slow
+      cache = ViewAttrCheck.instance_variable_get(:@__module_name_cache__)
+      cache[klass] ||= begin
+        name = klass.name || klass.to_s
+        sco_index = name.rindex(SCO_MARKER)
+        name = name[(sco_index + SCO_MARKER.length) .. -1] if sco_index
         name.to_sym
       end
     end
+
+    #
+    # Returns a check for the given key, operator, and operand. Checks are
+    # instances of a subclass of ViewAttrCheck specialized for the operator
+    # and whether the operand is a String, so they don't have to decide how to
+    # compare values each time they're called. The parser builds its checks
+    # the same way.
+    #
+    def build(key, operator, operand)
+      specialized_class(operator, operand).new(key, operator, operand)
+    end
+
+    # Returns the specialized subclass for operator and operand, or
+    # ViewAttrCheck itself if there isn't one.
+    def specialized_class(operator, operand)
+      ViewAttrCheck.instance_variable_get(:@__specialized__)[
+        [operator, operand.kind_of?(String)]
+      ] || ViewAttrCheck
+    end
+
+    # Whether this class is one of the generated specializations.
+    def specialized?
+      !!@__specialized_for__
+    end
+
+    # Defines a specialized subclass named name whose call method compares
+    # the resolved value using body (a string of Ruby code in which `value` is
+    # the resolved value).
+    def __specialize__(name, operator, is_string, body)
+      klass = Class.new(ViewAttrCheck)
+      klass.instance_variable_set(:@__specialized_for__, [operator, is_string].freeze)
+      klass.class_eval <<-EOS, __FILE__, __LINE__ + 1
+        def call(view)
+          value = __resolve__(view)
+          #{body}
+        end
+
+        alias_method :[], :call
+      EOS
+      const_set(name, klass)
+      @__specialized__[[operator, is_string]] = klass
+    end
+    private :__specialize__
   end # singleton_class
 
   def initialize(key, operator, operand)
@@ -107,6 +162,20 @@ class ViewAttrCheck
     @operator = operator
     @operand = operand
     @is_string = @operand.kind_of?(String)
+    # Cache Symbol for operand so I'm not converting it for every class check
+    # (and so the check can be frozen).
+    @operand_sym = @is_string ? @operand.to_sym : nil
+  end
+
+  # Returns the value at the check's key path for view.
+  def __resolve__(view)
+    key = @key
+    case key.length
+    when 1 then view.__send__(key[0])
+    when 2 then view.__send__(key[0]).__send__(key[1])
+    when 3 then view.__send__(key[0]).__send__(key[1]).__send__(key[2])
+    else key.reduce(view) { |value, msg| value.__send__(msg) }
+    end
   end
 
   # NOTE: Deprecate and remove class checks for ViewAttrCheck? Might be a good
@@ -114,23 +183,22 @@ class ViewAttrCheck
   # like [content_view.class = Something]. Probably just going to remove this,
   # though.
   def class_check(klass)
-    # Cache Symbol for operand so I'm not converting it every time.
-    name = (@operand_sym ||= @operand.to_sym)
+    name = @operand_sym
 
-    while klass
-      case @operator
-      when :equal
-        return true if self.class.extract_class_name(klass) == name
-      when :not_equal
-        return true unless self.class.extract_class_name(klass) == name
-      when :trueish # Necessarily true for classes.
-        true
-      else # Otherwise no test passes.
-        false
+    case @operator
+    when :equal, :not_equal
+      while klass
+        if self.class.extract_class_name(klass) == name
+          return @operator == :equal
+        end
+        klass = klass.superclass
       end
-      klass = klass.superclass
+      @operator == :not_equal
+    when :trueish # Necessarily true for classes.
+      true
+    else # Otherwise no test passes.
+      false
     end
-    false
   end
 
   def call(view)
@@ -140,7 +208,7 @@ class ViewAttrCheck
       view_value =
         case view_value
         when Class then return class_check(view_value) # return early
-        when Module then extract_class_name(view_value)
+        when Module then self.class.extract_class_name(view_value).to_s
         when Enumerable then
           # There is a case here where doing something like
           # `included_modules <- X` will fail because the values contained by
@@ -154,7 +222,7 @@ class ViewAttrCheck
         end
     end
 
-    case operator
+    case @operator
     when :trueish       then !!view_value
     when :falseish      then !view_value
     when :equal         then view_value == @operand
@@ -166,12 +234,62 @@ class ViewAttrCheck
     when :contains
       view_value.respond_to?(:include?) && view_value.include?(@operand)
     else
-      raise SelectorError, "Invalid operator for ViewAttrCheck: #{operator}"
+      raise SelectorError, "Invalid operator for ViewAttrCheck: #{@operator}"
     end
   end
 
   alias_method :[], :call
 
+
+  #
+  # Specialized checks. Each operator gets one for non-String operands, which
+  # just compare the resolved value, and one for String operands, which
+  # convert the value the same way ViewAttrCheck#call does. Symbols are
+  # compared to a String operand's Symbol instead of converting them.
+  #
+
+  __specialize__ :Trueish,  :trueish,  false, '!!value'
+  __specialize__ :Falseish, :falseish, false, '!value'
+
+  COMPARISONS.each do |operator, ruby_op|
+    name = operator.to_s.split('_').map!(&:capitalize).join
+
+    __specialize__ name.to_sym, operator, false, "value #{ruby_op} @operand"
+
+    symbol_case =
+      case operator
+      when :equal     then 'when Symbol then value.equal?(@operand_sym)'
+      when :not_equal then 'when Symbol then !value.equal?(@operand_sym)'
+      else ''
+      end
+
+    __specialize__ :"String#{name}", operator, true, <<-EOS
+      case value
+      when String then value #{ruby_op} @operand
+      #{symbol_case}
+      when Class then class_check(value)
+      when Module then self.class.extract_class_name(value).to_s #{ruby_op} @operand
+      when Enumerable then false
+      else value.to_s #{ruby_op} @operand
+      end
+    EOS
+  end
+
+  __specialize__ :Contains, :contains, false, <<-EOS
+    value.respond_to?(:include?) && value.include?(@operand)
+  EOS
+
+  __specialize__ :StringContains, :contains, true, <<-EOS
+    case value
+    when String, Enumerable then value.include?(@operand)
+    when Class then false
+    when Module then self.class.extract_class_name(value).to_s.include?(@operand)
+    else
+      value = value.to_s
+      value.include?(@operand)
+    end
+  EOS
+
 end # ViewAttrCheck
 
 end # GUI
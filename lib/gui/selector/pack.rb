@@ -0,0 +1,87 @@
+#  Copyright 2014 Noel Cower
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+#  -----------------------------------------------------------------------------
+#
+#  selector/pack.rb
+#    Ruby half of precompiled selector packs (see ext/gui_selectors/pack.c).
+
+
+require 'gui/selector'
+
+
+module GUI
+
+#
+# A file of precompiled selectors. Packs are written ahead of time with
+# SelectorPack.write and opened with SelectorPack.new, which maps the file
+# without reading any selectors from it. Selectors are built the first time
+# they're asked for, by index or by source string.
+#
+# A pack can be handed to Selector.add_pack so that Selector.build takes
+# selectors from it instead of parsing them.
+#
+class SelectorPack
+
+  include Enumerable
+
+  # Raised when opening a file that isn't a readable selector pack.
+  class FormatError < SelectorError ; end
+
+  class << self
+    # Compiles the selector strings in sources and writes them to path as a
+    # pack. Returns path.
+    def write(path, sources)
+      File.binwrite(path, compile(sources))
+      path
+    end
+
+    # Opens the pack at path. If given a block, yields the pack and closes it
+    # once the block returns, returning the block's result.
+    def open(path)
+      pack = new(path)
+      return pack unless block_given?
+
+      begin
+        yield pack
+      ensure
+        pack.close
+      end
+    end
+  end # singleton_class
+
+  alias_method :size, :length
+
+  # Whether the pack has a selector compiled from source.
+  def include?(source)
+    !index(source.to_s).nil?
+  end
+
+  # Yields each selector in the pack, building any that haven't been built.
+  def each
+    return to_enum(:each) { length } unless block_given?
+    length.times { |index| yield self[index] }
+    self
+  end
+
+  # Yields the source string of each selector in the pack without building it.
+  def each_source
+    return to_enum(:each_source) { length } unless block_given?
+    length.times { |index| yield source(index) }
+    self
+  end
+
+end # SelectorPack
+
+end # GUI
@@ -0,0 +1,148 @@
+#  Copyright 2014 Noel Cower
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+#  -----------------------------------------------------------------------------
+#
+#  skyline_packer.rb
+#    Bottom-left skyline rectangle packer.
+
+
+module GUI
+
+#
+# Packs rectangles into a fixed-size area, placing each as low as it fits
+# along the skyline formed by the top edges of those placed before it. Space
+# under the skyline is never reused, so the packer is best fed rectangles as
+# they come and reset once everything in it has been freed.
+#
+# Coordinates grow from the top-left corner, as texture rows do.
+#
+class SkylinePacker
+
+  # A span of the skyline: x, the height packed up to (y), and its width
+  Segment = Struct.new(:x, :y, :width)
+
+  attr_reader :width
+  attr_reader :height
+  # Area of the rectangles packed since the last reset
+  attr_reader :used_area
+
+  def initialize(width, height)
+    raise ArgumentError, "Invalid packer size: #{width}x#{height}" unless width > 0 && height > 0
+    @width = width
+    @height = height
+    reset
+  end
+
+  def reset
+    @skyline = [Segment[0, 0, @width]]
+    @used_area = 0
+    self
+  end
+
+  # Fraction of the area packed.
+  def occupancy
+    @used_area.to_f / (@width * @height)
+  end
+
+  #
+  # Finds room for a width by height rectangle and returns its top-left
+  # corner as [x, y], or nil if it doesn't fit. Of the spots along the
+  # skyline, the one leaving the lowest top edge wins, then the narrowest.
+  #
+  def pack(width, height)
+    return nil if width <= 0 || height <= 0 || width > @width || height > @height
+
+    best_index = nil
+    best_bottom = best_width = best_y = nil
+
+    @skyline.each_index do |index|
+      y = __fit__(index, width, height)
+      next unless y
+      bottom = y + height
+      segment_width = @skyline[index].width
+      if best_index.nil? || bottom < best_bottom ||
+         (bottom == best_bottom && segment_width < best_width)
+        best_index = index
+        best_bottom = bottom
+        best_width = segment_width
+        best_y = y
+      end
+    end
+
+    return nil unless best_index
+
+    x = @skyline[best_index].x
+    __place__(best_index, x, best_y + height, width)
+    @used_area += width * height
+    [x, best_y]
+  end
+
+  # Returns the y a rectangle would sit at if its left edge were at the
+  # skyline segment at index, or nil if it doesn't fit there.
+  def __fit__(index, width, height)
+    x = @skyline[index].x
+    return nil if x + width > @width
+
+    y = 0
+    remaining = width
+    while remaining > 0
+      segment = @skyline[index]
+      y = segment.y if segment.y > y
+      return nil if y + height > @height
+      remaining -= segment.width
+      index += 1
+    end
+    y
+  end
+  private :__fit__
+
+  # Raises the skyline to top over [x, x + width), starting at index.
+  def __place__(index, x, top, width)
+    @skyline.insert(index, Segment[x, top, width])
+    right = x + width
+
+    # Trim or drop the segments now covered by the new one
+    following = index + 1
+    while following < @skyline.length
+      segment = @skyline[following]
+      break if segment.x >= right
+      shrink = right - segment.x
+      if shrink >= segment.width
+        @skyline.delete_at(following)
+      else
+        segment.x += shrink
+        segment.width -= shrink
+        break
+      end
+    end
+
+    # Merge neighbours at the same height
+    index = 0
+    while index < @skyline.length - 1
+      current = @skyline[index]
+      following = @skyline[index + 1]
+      if current.y == following.y
+        current.width += following.width
+        @skyline.delete_at(index + 1)
+      else
+        index += 1
+      end
+    end
+  end
+  private :__place__
+
+end # SkylinePacker
+
+end # GUI
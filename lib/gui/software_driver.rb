@@ -0,0 +1,190 @@
+#  Copyright 2014 Noel Cower
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+#  -----------------------------------------------------------------------------
+#
+#  software_driver.rb
+#    Driver that draws into an in-memory framebuffer without a GL context.
+
+
+require 'zlib'
+require 'gui/driver'
+require 'gui/damage_region'
+require 'gui/raster_ext'
+
+
+module GUI
+
+#
+# A Driver whose stages are drawn on the CPU into an RGBA8 framebuffer (a
+# Raster::Image) rather than through GL, so views can be drawn without a
+# window or GPU -- for thumbnails, snapshot tests, or benchmarking on CI.
+#
+# Quads are built exactly as they are for BufferedDriver, and draw_stages
+# shades them the way Window#__draw__ does: vertex colors times a bilinear
+# texture sample, blended with SRC_ALPHA / ONE_MINUS_SRC_ALPHA. Textures must
+# be Raster::Images (or respond to raster_image with one); stages with a nil
+# texture are drawn in their vertex colors alone.
+#
+# Positions are in points with the origin at the framebuffer's top-left, as
+# with a Window, and pixel_scale is the number of pixels per point.
+#
+class SoftwareDriver < Driver
+
+  # Vertex layout passed to Raster.draw_triangles
+  RASTER_LAYOUT = [
+    VERTEX_STRIDE, POSITION_OFFSET, TEXCOORD_OFFSET, COLOR_OFFSET
+  ].freeze
+
+  attr_reader :framebuffer
+  attr_reader :pixel_scale
+
+  def initialize(width, height, pixel_scale: 1.0, capacity: 64)
+    super(capacity)
+    @pixel_scale = pixel_scale
+    @framebuffer = nil
+    @clip        = [0, 0, 0, 0]
+    resize(width, height)
+  end
+
+  #
+  # Replaces the framebuffer with one width x height points in size, cleared
+  # to transparent black.
+  #
+  def resize(width, height)
+    @framebuffer = Raster::Image.new(
+      (width * @pixel_scale).ceil,
+      (height * @pixel_scale).ceil
+      )
+    self
+  end
+
+  # Framebuffer width in pixels.
+  def width
+    @framebuffer.width
+  end
+
+  # Framebuffer height in pixels.
+  def height
+    @framebuffer.height
+  end
+
+  #
+  # Sets the framebuffer's pixels inside rect (in points, defaulting to the
+  # whole framebuffer) to color. Like glClear, this ignores blending.
+  #
+  def fill(color, rect = nil)
+    @framebuffer.clear(color[0], color[1], color[2], color[3], __clip_for__(rect))
+    self
+  end
+
+  #
+  # Draws all stages into the framebuffer, clipped to rect (in points) if
+  # given, as a scissor rect would.
+  #
+  def draw_stages(rect = nil)
+    return self if @stages.empty?
+
+    clip = __clip_for__(rect)
+    vertex_count = vertex_data_size / VERTEX_STRIDE
+    vertices = @vertices.address
+    faces = @faces.address
+
+    @stages.each do |stage|
+      next unless stage.faces > 0
+      Raster.draw_triangles(
+        @framebuffer, __raster_texture__(stage.texture),
+        vertices, vertex_count, RASTER_LAYOUT,
+        faces, stage.base_face, stage.faces, stage.base_vertex,
+        @pixel_scale, clip
+        )
+    end
+
+    self
+  end
+
+  #
+  # Draws view and its subviews into the framebuffer the way a Window draws
+  # its damaged area: each rect in damage (defaulting to the view's bounds) is
+  # filled with background, if given, and then drawn. Returns the
+  # framebuffer.
+  #
+  def render(view, background: nil, damage: nil)
+    damage ||= DamageRegion.new << view.bounds
+    clear
+    view.__draw__(self, damage)
+    damage.each do |rect|
+      fill(background, rect) if background
+      draw_stages(rect)
+    end
+    @framebuffer
+  end
+
+  # Returns the framebuffer encoded as an RGBA PNG.
+  def to_png
+    width = @framebuffer.width
+    height = @framebuffer.height
+    pixels = @framebuffer.pixels
+    stride = width * 4
+
+    # Every scanline is prefixed with filter type 0 (none)
+    scanlines = String.new(capacity: (stride + 1) * height, encoding: Encoding::BINARY)
+    height.times do |row|
+      scanlines << "\0" << pixels.byteslice(row * stride, stride)
+    end
+
+    "\x89PNG\r\n\x1a\n".b <<
+      __png_chunk__('IHDR', [width, height, 8, 6, 0, 0, 0].pack('NNCCCCC')) <<
+      __png_chunk__('IDAT', Zlib::Deflate.deflate(scanlines)) <<
+      __png_chunk__('IEND', ''.b)
+  end
+
+  def write_png(path)
+    File.binwrite(path, to_png)
+    path
+  end
+
+  def __png_chunk__(type, data)
+    body = type.b << data
+    [data.bytesize].pack('N') << body << [Zlib.crc32(body)].pack('N')
+  end
+  private :__png_chunk__
+
+  # Returns rect, in points, as a pixel clip rect for Raster, or nil.
+  def __clip_for__(rect)
+    return nil unless rect
+    scale = @pixel_scale
+    left = (rect.x * scale).floor
+    top = (rect.y * scale).floor
+    @clip[0] = left
+    @clip[1] = top
+    @clip[2] = ((rect.x + rect.width) * scale).ceil - left
+    @clip[3] = ((rect.y + rect.height) * scale).ceil - top
+    @clip
+  end
+  private :__clip_for__
+
+  def __raster_texture__(texture)
+    case
+    when texture.nil? || texture.kind_of?(Raster::Image) then texture
+    when texture.respond_to?(:raster_image) then texture.raster_image
+    else
+      raise ArgumentError, "SoftwareDriver can't sample a #{texture.class}"
+    end
+  end
+  private :__raster_texture__
+
+end # SoftwareDriver
+
+end # GUI
@@ -0,0 +1,98 @@
+#  Copyright 2014 Noel Cower
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+#  -----------------------------------------------------------------------------
+#
+#  texture_region.rb
+#    A rectangle of a larger texture standing in for a texture of its own.
+
+
+module GUI
+
+#
+# A width by height rectangle of texture at (x, y) in texels, usually an image
+# packed into a TextureAtlas page. Drivers accept a region anywhere they
+# accept a texture: UVs passed with it are relative to the region and are
+# remapped into the containing texture, which is what's drawn with, so quads
+# drawn from different regions of one texture share a stage.
+#
+# Regions are retained and released like GLObjects. Releasing the last
+# reference hands the region back to its owner (see TextureAtlas), if any.
+#
+class TextureRegion
+
+  attr_reader :texture
+  attr_reader :x
+  attr_reader :y
+  attr_reader :width
+  attr_reader :height
+  attr_reader :owner
+
+  def initialize(texture, x, y, width, height, texture_width, texture_height, owner: nil)
+    @texture  = texture
+    @x        = x
+    @y        = y
+    @width    = width
+    @height   = height
+    @owner    = owner
+    @u_offset = x.to_f / texture_width
+    @v_offset = y.to_f / texture_height
+    @u_scale  = width.to_f / texture_width
+    @v_scale  = height.to_f / texture_height
+    @refs     = 1
+  end
+
+  # UV rect of the region in its texture as [min u, min v, max u, max v].
+  def uv_rect
+    [@u_offset, @v_offset, @u_offset + @u_scale, @v_offset + @v_scale]
+  end
+
+  # UV offset and scale from region to texture UVs as [u offset, v offset,
+  # u scale, v scale].
+  def uv_transform
+    [@u_offset, @v_offset, @u_scale, @v_scale]
+  end
+
+  # Stores uv, a region UV, remapped into the texture in out and returns out.
+  def remap_uv(uv, out)
+    out[0] = @u_offset + uv[0] * @u_scale
+    out[1] = @v_offset + uv[1] * @v_scale
+    out
+  end
+
+  def retain
+    @refs += 1
+    if block_given?
+      begin
+        yield self
+      ensure
+        release
+      end
+    end
+  end
+
+  def release
+    @refs -= 1
+    if @refs == 0
+      yield self if block_given?
+      @owner.__release_region__(self) if @owner
+      @owner = nil
+    elsif @refs < 0
+      raise "Region with retain count of zero released"
+    end
+  end
+
+end # TextureRegion
+
+end # GUI
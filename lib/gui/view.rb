@@ -19,6 +19,9 @@
 
 
 require 'gui/geom'
+require 'gui/view_index'
+require 'gui/hit_grid'
+require 'gui/damage_region'
 
 
 module GUI
@@ -26,32 +29,51 @@ module GUI
 class View
 
   ViewDepth = Struct.new(:view, :depth)
-  ViewDepth::SORT_PROC = -> (l, r) { -(l.depth <=> r.depth) }
 
   # View tag (default: nil)
-  attr_accessor :tag
+  attr_reader   :tag
 
   # Subviews held by the view. Should not be modified directly. Instead, to
   # add a subview, use add_view.
   attr_reader   :subviews
 
   # Rectangular portion
-  attr_accessor :frame # Rect
+  attr_reader   :frame # Rect
 
-  attr_accessor :hidden
+  attr_reader   :hidden
+
+  # Share of a layout container's free space given to the view (see
+  # StackView). 0 means the view keeps its measured size.
+  attr_reader   :flex
+
+  # Size the view measures as by default (see size_that_fits). Initially the
+  # size of the frame the view was created with.
+  attr_reader   :preferred_size
 
   def initialize(frame = nil)
-    @leaf_cache     = nil
     @needs_layout   = false
+    @subtree_needs_layout = false
+    @measure_cache  = nil
+    @flex           = 0
+    @geometry       = nil
+    @geometry_dirty = true
     @invalidated    = nil
     @subviews       = []
     @attributes     = []
     @superview      = nil
     @tag            = nil
     @frame          = frame || Rect.new
+    @preferred_size = Vec2[@frame.size.x, @frame.size.y]
     @window_cache   = nil
     @rootview_cache = nil
     @hidden         = false
+    @view_index     = nil
+    @hit_grid       = nil
+    @uses_hit_grid  = nil
+    @leaf_cache     = nil
+    @leaf_cache_version = nil
+    # Incremented whenever a view is added to or removed from the subtree
+    @subtree_version = 0
 
     invalidate
     request_layout
@@ -66,7 +88,6 @@ class View
   end
 
   def invalidate_caches
-    __invalidate_leaf_caches__
     __invalidate_ascendant_view_caches__
     self
   end
@@ -76,28 +97,104 @@ class View
   end
 
   def post_event(event)
-    window.post_event
+    window.post_event(event)
   end
 
   def scale_factor
     window.scale_factor
   end
 
+  #
+  # Returns the views under and including self whose bounds contain point
+  # (relative to self), topmost first -- i.e., in the reverse of the order
+  # they're drawn in. The results are appended to out if given, in which case
+  # nothing is allocated.
+  #
   def views_containing_point(point, out: nil)
-    out ||= []
+    __hit_test__(point.x, point.y, out || [])
+  end
 
-    if bounds.include?(point)
-      out.unshift self
+  #
+  # Appends the views under and including self containing x, y (relative to
+  # self) to out, topmost first. Subviews are tested last to first, through
+  # the view's HitGrid if it uses one, and self is appended after them.
+  #
+  def __hit_test__(x, y, out)
+    size = @frame.size
+    return out unless 0 <= x && x <= size.x && 0 <= y && y <= size.y
 
-      converted_point = Vec2.new
-      @subviews.each do |view|
-        point.copy(converted_point)
-        converted_point.add!(view.frame.origin)
-        view.views_containing_point(converted_point, out: out)
+    grid = __hit_grid__
+    if grid
+      grid.hit_test(x, y, out)
+    else
+      index = @subviews.length - 1
+      while index >= 0
+        subview = @subviews[index]
+        origin = subview.frame.origin
+        subview.__hit_test__(x - origin.x, y - origin.y, out)
+        index -= 1
       end
     end
 
-    out
+    out << self
+  end
+
+  #
+  # Whether hit testing goes through a HitGrid of this view's subviews. If nil
+  # (the default), a grid is used once the view has more than
+  # HitGrid::MIN_VIEWS subviews.
+  #
+  attr_reader :uses_hit_grid
+
+  def uses_hit_grid=(value)
+    @uses_hit_grid = value
+    @hit_grid = nil
+  end
+
+  # Returns the view's HitGrid, building or rebuilding it as needed, or nil if
+  # the view doesn't use one.
+  def __hit_grid__
+    grid = @hit_grid
+    if grid
+      grid.rebuild if grid.stale?
+      grid
+    elsif @uses_hit_grid || (@uses_hit_grid.nil? &&
+                             @subviews.length > HitGrid::MIN_VIEWS)
+      @hit_grid = HitGrid.new(self)
+    end
+  end
+
+  # Returns the view's HitGrid if it's been built, otherwise nil.
+  def __built_hit_grid__
+    @hit_grid
+  end
+
+  #
+  # Sets the view's frame, moving it in its superview's HitGrid. If the size
+  # changes, the view's subviews are laid out again on the next layout pass.
+  #
+  def frame=(new_frame)
+    old_size = @frame.size
+    resized = old_size.x != new_frame.size.x || old_size.y != new_frame.size.y
+    @frame = new_frame
+    grid = @superview && @superview.__built_hit_grid__
+    grid.move(self) if grid
+    if resized
+      @geometry_dirty = true
+      __resized__
+    end
+    new_frame
+  end
+
+  def hidden=(is_hidden)
+    if !@hidden != !is_hidden
+      @hidden = is_hidden
+      if @superview
+        @superview.invalidate(@frame)
+        @superview.__subview_needs_layout__(self)
+      end
+    end
+    is_hidden
   end
 
   def convert_to_root(point, out = nil)
@@ -165,14 +262,26 @@ class View
     @superview
   end
 
+  # Sets the view's tag, updating the view tree's tag index.
+  def tag=(new_tag)
+    old_tag = @tag
+    @tag = new_tag
+    index = root_view.__built_view_index__
+    index.retag(self, old_tag, new_tag) if index && !old_tag.equal?(new_tag)
+    new_tag
+  end
+
   # Sets the containing superview of the view. This invalidates and requests
   # layout on the previous superview, if any.
   def superview=(new_superview)
-    self.__invalidate_leaf_caches__
-
     old_superview = @superview
     if !old_superview.nil?
+      old_index = root_view.__built_view_index__
+      old_index.remove_tree(self) if old_index
+      old_grid = old_superview.__built_hit_grid__
+      old_grid.remove(self) if old_grid
       old_superview.subviews.delete(self)
+      old_superview.__subtree_changed__
       old_superview.invalidate(@frame)
       old_superview.request_layout
     end
@@ -180,49 +289,91 @@ class View
     @superview = new_superview
     if !new_superview.nil?
       new_superview.subviews << self
-      new_superview.__invalidate_leaf_caches__
+      new_superview.__subtree_changed__
+      new_grid = new_superview.__built_hit_grid__
+      new_grid.add(self) if new_grid
       new_superview.invalidate(@frame)
       new_superview.request_layout
+      # The view may have requested layout before it had a superview to tell
+      new_superview.__subview_needs_layout__(self) if subtree_needs_layout?
     end
 
     __invalidate_ascendant_view_caches__
 
+    # Subtrees are only indexed by their root view
+    @view_index = nil
+    if !new_superview.nil?
+      new_index = root_view.__built_view_index__
+      new_index.add_tree(self) if new_index
+    end
+
     new_superview
   end
 
-  def __invalidate_leaf_caches__
-    @leaf_cache = nil
-    each_superview(&:__invalidate_leaf_caches__)
+  # Returns the ViewIndex for the tree this view is in, building it if
+  # needed. The index is held by the tree's root view.
+  def __view_index__
+    root = root_view
+    root.__built_view_index__ || root.__build_view_index__
   end
 
-  # If cache is true, the results will be cached leaf views relative to this
-  # view, but only if the output and depth arguments are nil.
-  def leaf_views(__out: nil, __depth: nil, cache: true)
-    return @leaf_cache if @leaf_cache && cache && !__out && !__depth
+  # Returns this view's index if it's a root view with an index, otherwise nil.
+  def __built_view_index__
+    @view_index
+  end
 
-    __out   ||= []
-    __depth ||= 0
+  def __build_view_index__
+    @view_index = ViewIndex.new(self)
+  end
 
-    if @subviews.empty?
-      __out << ViewDepth[self, __depth]
-    else
-      @subviews.each do |view|
-        view.leaf_views(__out: __out, __depth: __depth + 1, cache: false)
-      end
+  #
+  # Returns an Array of ViewDepth for each leaf view under and including self,
+  # sorted by descending depth relative to self. The Array must not be
+  # modified.
+  #
+  # For a root view, this is the tree's leaf index (see ViewIndex#leaf_views),
+  # which is kept up to date as views are added and removed. For any other
+  # view, the subtree is walked and its leaves are bucketed by depth, and the
+  # result is kept until a view is added to or removed from the subtree.
+  #
+  def leaf_views
+    return __view_index__.leaf_views if @superview.nil?
+
+    if @leaf_cache.nil? || @leaf_cache_version != @subtree_version
+      buckets = []
+      __collect_leaves__(buckets, 0)
+      @leaf_cache = buckets.reverse_each.with_object([]) do |bucket, out|
+        out.concat(bucket) if bucket
+      end.freeze
+      @leaf_cache_version = @subtree_version
     end
 
-    __out.uniq!
-    __out.sort!(&ViewDepth::SORT_PROC)
+    @leaf_cache
+  end
+
+  # Bumps the subtree version of the view and each of its superviews.
+  def __subtree_changed__
+    view = self
+    view = view.__bump_subtree_version__ while view
+  end
 
-    @leaf_cache = __out if cache
+  # Bumps the view's subtree version and returns its superview.
+  def __bump_subtree_version__
+    @subtree_version += 1
+    @superview
+  end
 
-    __out
+  def __collect_leaves__(buckets, depth)
+    if @subviews.empty?
+      (buckets[depth] ||= []) << ViewDepth[self, depth]
+    else
+      @subviews.each { |view| view.__collect_leaves__(buckets, depth + 1) }
+    end
   end
 
   def add_view(view)
     raise ArgumentError, "View already has a superview" if view.superview
     view.superview = self
-    __invalidate_leaf_caches__
     self
   end
 
@@ -234,47 +385,189 @@ class View
     self.superview = nil
   end
 
+  # Returns the view's DamageRegion, or nil if it hasn't been invalidated since
+  # it was last drawn.
   def invalidated_region
     @invalidated
   end
 
+  #
+  # Marks region (a Rect relative to the view, defaulting to its bounds) as
+  # needing to be redrawn. The region is clipped to the view's bounds and
+  # added to the view's DamageRegion, and then to its superviews' regions, so
+  # the root view's region covers everything that changed in the tree. The
+  # view's cached geometry (see __draw__) is dropped, but its superviews' isn't.
+  #
   def invalidate(region = nil)
-    if @invalidated
-      @invalidated.contains_both!(region || @frame)
+    @geometry_dirty = true
+    size = @frame.size
+    if region
+      left   = region.left < 0 ? 0 : region.left
+      top    = region.top < 0 ? 0 : region.top
+      right  = region.right > size.x ? size.x : region.right
+      bottom = region.bottom > size.y ? size.y : region.bottom
     else
-      @invalidated = (region || @frame.with_origin(0, 0)).dup
-    end.intersection!(bounds)
+      left, top, right, bottom = 0, 0, size.x, size.y
+    end
+
+    view = self
+    while view && right > left && bottom > top
+      view.__damage_region__.add_rect(left, top, right - left, bottom - top)
+
+      origin = view.frame.origin
+      view = view.superview
+      if view
+        size = view.frame.size
+        left   += origin.x
+        right  += origin.x
+        top    += origin.y
+        bottom += origin.y
+        left   = 0 if left < 0
+        top    = 0 if top < 0
+        right  = size.x if right > size.x
+        bottom = size.y if bottom > size.y
+      end
+    end
 
     self
   end
 
+  # Returns the view's DamageRegion, creating it if needed.
+  def __damage_region__
+    @invalidated ||= DamageRegion.new
+  end
+
   #
-  # Invalidates layout on self and all subviews thereof. Any subview will have
-  # its perform_layout method called in turn.
+  # Marks the view as needing layout because its content changed, dropping
+  # its cached measurement. Superviews are told through
+  # __subview_needs_layout__, so the next layout pass reaches the view, and
+  # layout containers lay themselves out again since the view's size may have
+  # changed. Nothing below the view is touched.
   #
   def request_layout
-    if !@needs_layout
-      @needs_layout = true
-      subviews.each(&:request_layout)
-    end
+    return self if @needs_layout && @measure_cache.nil? &&
+                   (@superview.nil? || @superview.__subviews_need_layout__)
+    @needs_layout = true
+    @measure_cache = nil
+    @superview.__subview_needs_layout__(self) if @superview
+    self
   end
 
   def needs_layout?
     @needs_layout
   end
 
+  # Whether the view or any view under it needs layout.
+  def subtree_needs_layout?
+    @needs_layout || @subtree_needs_layout
+  end
+
+  # Whether the next layout pass will visit the view's subviews.
+  def __subviews_need_layout__
+    @subtree_needs_layout
+  end
+
   #
-  # For view subclasses or views with extended layout features, this should
-  # layout its subviews (ideally within the bounds of self, but this isn't
-  # required). By default, all it does is call its subviews' perform_layout
-  # functions.
+  # Called when a subview requests layout. Drops the view's cached
+  # measurement, since it may depend on its subviews, and marks its subtree as
+  # needing layout. Layout containers also request layout for themselves.
+  #
+  def __subview_needs_layout__(subview)
+    return if @subtree_needs_layout && @measure_cache.nil?
+    @subtree_needs_layout = true
+    @measure_cache = nil
+    @superview.__subview_needs_layout__(self) if @superview
+  end
+
+  #
+  # Called when the view's size changes. Its subviews need to be laid out
+  # again, but its superview's layout and its own measurement are unaffected
+  # (a container resizing its subviews shouldn't have to measure them again).
+  #
+  def __resized__
+    @needs_layout = true
+    view = @superview
+    while view && !view.__subtree_marked__
+      view = view.superview
+    end
+  end
+
+  # Marks the view's subtree as needing layout and returns whether it already
+  # was.
+  def __subtree_marked__
+    marked = @subtree_needs_layout
+    @subtree_needs_layout = true
+    marked
+  end
+
   #
-  # Implementations should either call their superclass's perform_layout to
-  # initiate layout of subviews or do so themselves.
+  # Lays out the view if it needs it, and then whichever of its subviews need
+  # it. Subtrees that don't need layout are skipped entirely. Called on each
+  # window before it's drawn.
+  #
+  def layout_if_needed
+    if @needs_layout
+      @needs_layout = false
+      perform_layout
+    end
+
+    if @subtree_needs_layout
+      @subtree_needs_layout = false
+      @subviews.each do |subview|
+        subview.layout_if_needed if subview.subtree_needs_layout?
+      end
+    end
+
+    self
+  end
+
+  #
+  # For view subclasses or views with extended layout features, this should
+  # set the frames of the view's subviews (ideally within the bounds of self,
+  # but this isn't required). It's only called when the view needs layout --
+  # see layout_if_needed -- and subviews whose sizes change are laid out
+  # afterward, so implementations don't need to recurse. By default, views
+  # leave their subviews where they are.
   #
   def perform_layout
-    @needs_layout = false
-    @subviews.each(&:perform_layout)
+  end
+
+  #
+  # Returns the view's preferred size as a Vec2, given the space available to
+  # it (either of which may be Float::INFINITY). Results are cached until the
+  # view requests layout -- override size_that_fits, not this.
+  #
+  def measure(available_width = Float::INFINITY, available_height = Float::INFINITY)
+    cache = @measure_cache
+    if cache && cache[0] == available_width && cache[1] == available_height
+      return cache[2]
+    end
+
+    size = size_that_fits(available_width, available_height)
+    @measure_cache = [available_width, available_height, size]
+    size
+  end
+
+  #
+  # Computes the view's preferred size for measure. By default, this is the
+  # view's preferred_size, or zero if it's nil. It shouldn't depend on the
+  # view's frame, since layout containers set that from the result.
+  #
+  def size_that_fits(available_width, available_height)
+    size = @preferred_size
+    size ? Vec2[size.x, size.y] : Vec2[0, 0]
+  end
+
+  def preferred_size=(size)
+    @preferred_size = size && Vec2[size.x, size.y]
+    request_layout
+    size
+  end
+
+  def flex=(value)
+    @flex = value
+    request_layout
+    value
   end
 
   def hide
@@ -285,18 +578,48 @@ class View
     self.hidden = false
   end
 
+  # Returns the first view under and including self (in depth-first order)
+  # with the given tag, or nil if there's none. Views are found through the
+  # tree's tag index, so a unique tag doesn't walk the tree. If several views
+  # share the tag, the tree is walked instead, since the walk stops at the
+  # first of them and is cheaper than putting them in tree order.
   def view_with_tag(tag)
-    if @tag == tag
-      self
-    else
-      @subviews.detect { |subview| subview.view_with_tag(tag) }
+    return self if @tag == tag
+    return __scan_for_tag__(tag) if tag.nil?
+
+    tagged = __view_index__.views_with_tag(tag)
+    return nil unless tagged
+    return __scan_for_tag__(tag) if tagged.length > 1
+
+    view = tagged.first[0]
+    view if @superview.nil? || view.__descendant_of__?(self)
+  end
+
+  # Whether view is one of this view's superviews.
+  def __descendant_of__?(view)
+    above = @superview
+    while above
+      return true if above.equal?(view)
+      above = above.superview
     end
+    false
   end
 
-  def view_with_selector(selector)
+  def __scan_for_tag__(tag)
+    return self if @tag == tag
+    @subviews.each do |subview|
+      found = subview.__scan_for_tag__(tag)
+      return found if found
+    end
     nil
   end
 
+  # Returns the first view under and including self matched by the selector.
+  # See Selector#find_match for leaf_first.
+  def view_with_selector(selector, leaf_first: false)
+    selector.find_match(self, leaf_first: leaf_first)
+  end
+
   #
   # Drawing routine for a view, given a graphics driver.
   #
@@ -313,26 +636,48 @@ class View
   # def draw(driver)
   # end
 
-  def draw_subviews(driver)
-    region = @invalidated
-    return unless region
+  #
+  # Draws the subviews that intersect damage, a DamageRegion defaulting to the
+  # view's own. x and y are the view's position in the region's coordinates,
+  # for when the region belongs to one of the view's superviews.
+  #
+  def draw_subviews(driver, damage = @invalidated, x = 0, y = 0)
+    return unless damage
     @subviews.each do |subview|
-      return unless region.intersects?(subview.frame)
+      next if subview.hidden
+
+      frame = subview.frame
+      subview_x = x + frame.x
+      subview_y = y + frame.y
+      next unless damage.intersects?(subview_x, subview_y, frame.width, frame.height)
 
       driver.push_state do
-        driver.origin += subview.frame.origin
-        subview.__draw__(driver)
+        driver.origin += frame.origin
+        subview.__draw__(driver, damage, subview_x, subview_y)
       end
     end
   end
 
-  def __draw__(driver)
-    return unless @invalidated && !@hidden
+  #
+  # Draws the view and those of its subviews intersecting damage (see
+  # draw_subviews) and clears the view's own damage. Without a damage region,
+  # nothing is drawn unless the view has been invalidated.
+  #
+  # The geometry emitted by the view's draw method is kept and replayed on
+  # later frames instead of calling draw again, until the view is invalidated
+  # or resized, or it's drawn with a different driver state (e.g., because it
+  # or one of its superviews moved). Views whose drawing depends on anything
+  # else must invalidate themselves when it changes.
+  #
+  def __draw__(driver, damage = nil, x = 0, y = 0)
+    damage ||= @invalidated
+    return unless damage && !@hidden
 
-    if respond_to? :draw
-      draw(driver)
+    if respond_to?(:draw) && (@geometry_dirty || !driver.replay_geometry(@geometry))
+      @geometry = driver.record_geometry(@geometry) { draw(driver) }
+      @geometry_dirty = false
     end
-    draw_subviews(driver)
+    draw_subviews(driver, damage, x, y)
 
     @invalidated = nil
   end
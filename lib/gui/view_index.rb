@@ -0,0 +1,228 @@
+#  Copyright 2014 Noel Cower
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+#  -----------------------------------------------------------------------------
+#
+#  view_index.rb
+#    Tag, class, and leaf indexes for a view tree.
+
+
+module GUI
+
+#
+# Indexes every view in a tree by tag and by class, and the tree's leaf views
+# by depth. An index is only ever held by the root view of a tree (see
+# View#__view_index__), is built the first time it's needed, and is kept up to
+# date by View as views are added, removed, and retagged.
+#
+# Views are kept in identity hashes (used as ordered sets), so adding and
+# removing a view is O(1) per view. Lookups return views in no particular
+# order -- use sort_in_tree_order! if order matters.
+#
+# The class index also holds each view's depth below the root, which is what
+# the leaf index is bucketed by. Leaves are added to and removed from their
+# depth's bucket as views are attached and detached, so leaf_views only has to
+# concatenate the buckets, deepest first, and never sorts.
+#
+class ViewIndex
+
+  # The root view of the indexed tree.
+  attr_reader :root
+  # Number of views in the tree.
+  attr_reader :size
+  # Incremented whenever a view is added to or removed from the tree, so
+  # anything derived from the tree's shape can tell when it's stale.
+  attr_reader :version
+
+  def initialize(root)
+    @root       = root
+    @by_tag     = {}
+    @by_class   = {}.compare_by_identity
+    # Leaf views by depth -- each bucket maps a leaf to its View::ViewDepth
+    @leaves     = []
+    # Cached result of leaf_views, dropped whenever a leaf is added or removed
+    @leaf_views = nil
+    @size       = 0
+    @version    = 0
+    add_tree(root)
+  end
+
+  #
+  # Adds view and all of its subviews to the index. view's superview, if any,
+  # must already be indexed and already have view as a subview.
+  #
+  def add_tree(view)
+    above = view.superview
+    depth = above && !view.equal?(@root) && depth_of(above)
+    if depth
+      __remove_leaf__(above, depth)
+      __add_tree__(view, depth + 1)
+    else
+      __add_tree__(view, 0)
+    end
+    self
+  end
+
+  #
+  # Removes view and all of its subviews from the index. If view is its
+  # superview's only subview (or has already been removed from its subviews),
+  # the superview becomes a leaf.
+  #
+  def remove_tree(view)
+    __remove_tree__(view)
+
+    above = view.superview
+    depth = above && !view.equal?(@root) && depth_of(above)
+    if depth && above.subviews.all? { |subview| subview.equal?(view) }
+      __add_leaf__(above, depth)
+    end
+    self
+  end
+
+  #
+  # Adds view alone to the index at the given depth. Prefer add_tree, which
+  # also keeps the leaf index up to date for view's superview.
+  #
+  def add_view(view, depth = 0)
+    tag = view.tag
+    (@by_tag[tag] ||= {}.compare_by_identity)[view] = true unless tag.nil?
+    (@by_class[view.class] ||= {}.compare_by_identity)[view] = depth
+    __add_leaf__(view, depth) if view.subviews.empty?
+    @size += 1
+    @version += 1
+    self
+  end
+
+  def remove_view(view)
+    depth = depth_of(view)
+    __remove_leaf__(view, depth) if depth
+    __remove_from__(@by_class, view.class, view)
+    __remove_from__(@by_tag, view.tag, view) unless view.tag.nil?
+    @size -= 1
+    @version += 1
+    self
+  end
+
+  # Returns view's depth below the root, or nil if it isn't indexed.
+  def depth_of(view)
+    views = @by_class[view.class]
+    views && views[view]
+  end
+
+  #
+  # Returns an Array of View::ViewDepth for each leaf view in the tree, sorted
+  # by descending depth. The Array is shared until the tree's leaves change
+  # and must not be modified.
+  #
+  def leaf_views
+    @leaf_views ||= begin
+      out = []
+      @leaves.reverse_each { |bucket| out.concat(bucket.values) if bucket }
+      out.freeze
+    end
+  end
+
+  # Moves view from old_tag's views to new_tag's.
+  def retag(view, old_tag, new_tag)
+    __remove_from__(@by_tag, old_tag, view) unless old_tag.nil?
+    (@by_tag[new_tag] ||= {}.compare_by_identity)[view] = true unless new_tag.nil?
+    self
+  end
+
+  # Returns a Hash whose keys are the views tagged tag, or nil if there are
+  # none. The Hash must not be modified.
+  def views_with_tag(tag)
+    @by_tag[tag]
+  end
+
+  # Returns a Hash of classes to Hashes whose keys are the views that are
+  # instances of that class (and not a subclass of it). Must not be modified.
+  def classes
+    @by_class
+  end
+
+  # Returns an Array of all views whose class or one of its superclasses is
+  # klass.
+  def views_of_class(klass)
+    @by_class.each_with_object([]) do |(view_class, views), out|
+      out.concat(views.keys) if view_class <= klass
+    end
+  end
+
+  #
+  # Sorts views, all of which must be in the indexed tree, into the order a
+  # depth-first walk of the tree would visit them. Returns views.
+  #
+  def sort_in_tree_order!(views)
+    return views if views.length < 2
+
+    # Each parent's subview positions are only looked up once
+    positions = {}.compare_by_identity
+    views.sort_by! do |view|
+      path = []
+      while (above = view.superview)
+        subview_positions = positions[above] ||= begin
+          subviews = above.subviews
+          subviews.each_index.with_object({}.compare_by_identity) do |index, out|
+            out[subviews[index]] = index
+          end
+        end
+        path << subview_positions[view]
+        view = above
+      end
+      path.reverse!
+    end
+  end
+
+  def __add_tree__(view, depth)
+    add_view(view, depth)
+    view.subviews.each { |subview| __add_tree__(subview, depth + 1) }
+  end
+  private :__add_tree__
+
+  def __remove_tree__(view)
+    remove_view(view)
+    view.subviews.each { |subview| __remove_tree__(subview) }
+  end
+  private :__remove_tree__
+
+  def __add_leaf__(view, depth)
+    bucket = (@leaves[depth] ||= {}.compare_by_identity)
+    unless bucket.include?(view)
+      bucket[view] = View::ViewDepth[view, depth]
+      @leaf_views = nil
+    end
+  end
+  private :__add_leaf__
+
+  def __remove_leaf__(view, depth)
+    bucket = @leaves[depth]
+    if bucket && bucket.delete(view)
+      @leaf_views = nil
+      @leaves.pop while !@leaves.empty? && (@leaves.last.nil? || @leaves.last.empty?)
+    end
+  end
+  private :__remove_leaf__
+
+  def __remove_from__(index, key, view)
+    views = index[key]
+    return unless views
+    views.delete(view)
+    index.delete(key) if views.empty?
+  end
+  private :__remove_from__
+
+end # ViewIndex
+
+end # GUI
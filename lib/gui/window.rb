@@ -60,19 +60,37 @@ class Window < View
 
   attr_accessor :background
   attr_reader   :context
+  # Number of rects and total area (in points) redrawn by the last draw
+  attr_reader   :redrawn_rects
+  attr_reader   :redrawn_area
 
-  def initialize(frame, title, context = nil)
+  #
+  # vertex_format is the format the window's driver uploads vertices in (see
+  # Driver::VERTEX_FORMATS). Packed formats are smaller but clamp texcoords to
+  # [0, 1], so they're only worth opting into if no view draws with UVs
+  # outside that range.
+  #
+  def initialize(frame, title, context = nil, vertex_format: :float)
     context ||= Context.__active_context__
 
     @title = title
     @background = Color.dark_grey
     @in_update = []
     @context = context
+    # Reused for hit testing so clicks don't allocate a results Array or point
+    @hit_views = []
+    @cursor_pos = Vec2[0.0, 0.0]
+    @redrawn_rects = 0
+    @redrawn_area = 0
 
     super(frame)
 
     self.class.bind_context(__window__) do
-      @driver = BufferedDriver.new
+      @driver = BufferedDriver.new(
+        streaming: true,
+        batching: true,
+        vertex_format: vertex_format
+        )
     end
   end
 
@@ -114,8 +132,9 @@ class Window < View
         unless @in_update.include? :frame
           @frame.size.x = x
           @frame.size.y = y
+          __resized__
           invalidate(bounds)
-          post_event Event[self, :resized, target: self, frame: @frame.dup]
+          post_event ResizeEvent.acquire(self, self, @frame)
         end
       end
 
@@ -127,7 +146,7 @@ class Window < View
         unless @in_update.include? :frame
           @frame.origin.x = x
           @frame.origin.y = y
-          post_event Event[self, :resized, target: self, frame: @frame.dup]
+          post_event ResizeEvent.acquire(self, self, @frame)
         end
       end
 
@@ -136,19 +155,15 @@ class Window < View
       end
 
       window.set_close_callback do |w|
-        post_event Event[self, :close_button, target: self]
+        post_event CloseEvent.acquire(self, self)
       end
 
       window.mouse_button_callback = -> (wnd, button, action, mods) do
-        pos = Vec2[*wnd.cursor_pos]
-        target = self.views_containing_point(pos).first || self
-        post_event Event[self, :mouse_button,
-          target: target,
-          action: action,
-          button: button,
-          modifiers: mods,
-          position: pos
-        ]
+        x, y = wnd.cursor_pos
+        @cursor_pos.x = x
+        @cursor_pos.y = y
+        target = views_containing_point(@cursor_pos, out: @hit_views.clear).first || self
+        post_event MouseButtonEvent.acquire(self, target, button, action, mods, x, y)
       end
 
       @context.windows << self
@@ -209,7 +224,7 @@ class Window < View
       # Note: post this since otherwise destroying the window here will do
       # Bad Things(r) if #close is called from a callback (which it is). Be
       # very careful about that.
-      @context.post { prev_window.destroy }
+      @context.post(priority: :high) { prev_window.destroy }
       @context.windows.delete(self)
     end
   end
@@ -250,31 +265,55 @@ class Window < View
 
       end # program.use
 
-      window.swap_buffers
+      @context.profiler.measure(:swap_buffers, self) { window.swap_buffers }
     end # bind_context(window)
   end
 
+  #
+  # Draws everything intersecting the window's damage region. The geometry
+  # for those views is built once, then for each rect in the region the
+  # scissor is set to the rect, it's cleared, and the geometry is drawn, so
+  # only the damaged pixels are touched.
+  #
   def __draw__(driver)
     region = @invalidated
     if !self.hidden && region && !region.empty?
       GL.glEnable(GL::GL_BLEND)
       GL.glBlendFunc(GL::GL_SRC_ALPHA, GL::GL_ONE_MINUS_SRC_ALPHA)
       GL.glEnable(GL::GL_SCISSOR_TEST)
-      GL.glScissor(
-        region.x * scale_factor,
-        (@frame.height - region.bottom) * scale_factor,
-        region.width * scale_factor,
-        region.height * scale_factor
-        )
-
       GL.glClearColor(*@background)
-      GL.glClear(GL::GL_COLOR_BUFFER_BIT)
 
-      driver.clear
+      profiler = @context.profiler
+      profiler.measure(:draw, self) do
+        driver.clear
+        super driver
+      end
+
+      scale = scale_factor
+      profiler.measure(:draw_stages, self) do
+        region.each do |rect|
+          GL.glScissor(
+            rect.x * scale,
+            (@frame.height - rect.bottom) * scale,
+            rect.width * scale,
+            rect.height * scale
+            )
+          GL.glClear(GL::GL_COLOR_BUFFER_BIT)
+          driver.draw_stages
+        end
+      end
 
-      super driver
+      if profiler.current_frame
+        profiler.count(
+          quads:        driver.quad_count,
+          stages:       driver.stage_count,
+          stages_saved: driver.stages_saved,
+          draw_calls:   driver.draw_call_count * region.length
+          )
+      end
 
-      driver.draw_stages
+      @redrawn_rects = region.length
+      @redrawn_area = region.area
 
       GL.glDisable(GL::GL_SCISSOR_TEST)
     end # !region.empty?
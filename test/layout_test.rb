@@ -0,0 +1,108 @@
+#!/usr/bin/env ruby
+#  Copyright 2014 Noel Cower
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+#  -----------------------------------------------------------------------------
+#
+#  layout_test.rb
+#    Checks that layout reaches views through StackViews, both when a tree
+#    is first built and when a view's preferred size changes afterward.
+#    Doesn't need a window or GL context.
+#
+#    Usage: ruby -Ilib test/layout_test.rb
+
+
+require 'minitest/autorun'
+require 'gui/view'
+require 'gui/layout/stack_view'
+
+
+class LayoutTest < Minitest::Test
+
+  # Counts calls to perform_layout.
+  class CountingStackView < GUI::StackView
+    attr_reader :layouts
+
+    def perform_layout
+      @layouts = (@layouts || 0) + 1
+      super
+    end
+  end
+
+  # root > outer > inner > leaf, with the stacks filling the root's width.
+  def build_tree
+    @root = GUI::View.new(GUI::Rect.new(0, 0, 400, 300))
+    @outer = CountingStackView.new(GUI::Rect.new(0, 0, 400, 300))
+    @inner = CountingStackView.new
+    @leaf = GUI::View.new(GUI::Rect.new(0, 0, 10, 10))
+
+    @root.add_view(@outer)
+    @outer.add_view(@inner)
+    @inner.add_view(@leaf)
+  end
+
+  def assert_size(width, height, view)
+    size = view.frame.size
+    assert_equal [width, height], [size.x, size.y]
+  end
+
+  def test_attached_views_are_laid_out
+    build_tree
+    @root.layout_if_needed
+
+    assert_equal 1, @outer.layouts
+    assert_equal 1, @inner.layouts
+    assert_size 400, 10, @inner
+    assert_size 400, 10, @leaf
+    refute @root.subtree_needs_layout?
+  end
+
+  def test_views_are_attached_before_their_subviews
+    @root = GUI::View.new(GUI::Rect.new(0, 0, 400, 300))
+    @outer = CountingStackView.new(GUI::Rect.new(0, 0, 400, 300))
+    @inner = CountingStackView.new
+    @leaf = GUI::View.new(GUI::Rect.new(0, 0, 10, 10))
+
+    @inner.add_view(@leaf)
+    @outer.add_view(@inner)
+    @root.add_view(@outer)
+    @root.layout_if_needed
+
+    assert_size 400, 10, @leaf
+  end
+
+  def test_preferred_size_change_is_laid_out
+    build_tree
+    @root.layout_if_needed
+
+    @leaf.preferred_size = GUI::Vec2[20, 30]
+    assert @root.subtree_needs_layout?
+    @root.layout_if_needed
+
+    assert_equal 2, @outer.layouts
+    assert_equal 2, @inner.layouts
+    assert_size 400, 30, @inner
+    assert_size 400, 30, @leaf
+  end
+
+  def test_clean_tree_is_not_laid_out_again
+    build_tree
+    @root.layout_if_needed
+    @root.layout_if_needed
+
+    assert_equal 1, @outer.layouts
+    assert_equal 1, @inner.layouts
+  end
+
+end # LayoutTest
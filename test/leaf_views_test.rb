@@ -0,0 +1,86 @@
+#!/usr/bin/env ruby
+#  Copyright 2014 Noel Cower
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+#  -----------------------------------------------------------------------------
+#
+#  leaf_views_test.rb
+#    Checks that a subview's leaf views are kept until its own subtree
+#    changes. Doesn't need a window or GL context.
+#
+#    Usage: ruby -Ilib test/leaf_views_test.rb
+
+
+require 'minitest/autorun'
+require 'gui/view'
+
+
+class LeafViewsTest < Minitest::Test
+
+  # root > (left > (a, b), right > c)
+  def setup
+    @root = GUI::View.new
+    @left = GUI::View.new
+    @right = GUI::View.new
+    @a = GUI::View.new
+    @b = GUI::View.new
+    @c = GUI::View.new
+
+    @root.add_view(@left)
+    @root.add_view(@right)
+    @left.add_view(@a)
+    @left.add_view(@b)
+    @right.add_view(@c)
+  end
+
+  def leaves_of(view)
+    view.leaf_views.map { |leaf| [leaf.view, leaf.depth] }
+  end
+
+  def test_subview_leaves
+    assert_equal [[@a, 1], [@b, 1]], leaves_of(@left)
+    assert_same @left.leaf_views, @left.leaf_views
+  end
+
+  def test_sibling_mutation_keeps_cache
+    leaves = @left.leaf_views
+
+    @right.add_view(GUI::View.new)
+    @c.add_view(GUI::View.new)
+    @c.superview = nil
+
+    assert_same leaves, @left.leaf_views
+  end
+
+  def test_own_mutation_drops_cache
+    leaves = @left.leaf_views
+
+    d = GUI::View.new
+    @b.add_view(d)
+    refute_same leaves, @left.leaf_views
+    assert_equal [[d, 2], [@a, 1]], leaves_of(@left)
+
+    d.superview = nil
+    assert_equal [[@a, 1], [@b, 1]], leaves_of(@left)
+  end
+
+  def test_moved_subtree_keeps_relative_depths
+    @left.leaf_views
+    @left.superview = nil
+    @c.add_view(@left)
+    assert_equal [[@a, 1], [@b, 1]], leaves_of(@left)
+    assert_equal [[@a, 4], [@b, 4]], leaves_of(@root)
+  end
+
+end # LeafViewsTest
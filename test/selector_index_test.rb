@@ -0,0 +1,134 @@
+#!/usr/bin/env ruby
+#  Copyright 2014 Noel Cower
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+#  -----------------------------------------------------------------------------
+#
+#  selector_index_test.rb
+#    Checks that searching through a tree's ViewIndex finds the same views as
+#    walking the tree, and is never much slower than the walk when many views
+#    share a tag. Expects the extension to have been built.
+#
+#    Usage: ruby -Ilib test/selector_index_test.rb
+
+
+require 'minitest/autorun'
+require 'gui/selector_ext'
+require 'gui/selector/checks'
+require 'gui/view'
+
+
+class SelectorIndexTest < Minitest::Test
+
+  class Row   < GUI::View ; end
+  class Label < GUI::View ; end
+
+  # How much slower than walking the tree an indexed search may be before
+  # it's considered a regression. Generous, since this is timing-based.
+  SLOWDOWN_ALLOWED = 3.0
+
+  # Views are linked directly, as in bench/selector_bench.rb, since add_view
+  # makes building large trees slow.
+  def attach(parent, child)
+    child.instance_variable_set(:@superview, parent)
+    parent.subviews << child
+    child
+  end
+
+  def tagged(view, tag)
+    view.instance_variable_set(:@tag, tag)
+    view
+  end
+
+  # A list of rows, each a Row holding a Label tagged :label and four views.
+  def build_list(rows)
+    root = GUI::View.new
+    rows.times do
+      row = attach(root, Row.new)
+      attach(row, tagged(Label.new, :label))
+      4.times { attach(row, GUI::View.new) }
+    end
+    root
+  end
+
+  # Chains of depth views hanging off the root, every 97th view tagged :v3.
+  def build_deep(size, depth)
+    root = GUI::View.new
+    parent = root
+    (1...size).each do |count|
+      parent = root if (count - 1) % depth == 0
+      parent = attach(parent, tagged(GUI::View.new, :"v#{count % 97}"))
+    end
+    root
+  end
+
+  def best_time(iterations = 20)
+    Array.new(5) do
+      start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      iterations.times { yield }
+      Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+    end.min
+  end
+
+  # Times find_match and find_all with and without root's index, checking
+  # they find the same views.
+  def assert_index_not_slower(root, source)
+    selector = GUI::Selector.build(source)
+    root.__view_index__
+
+    indexed_first = selector.find_match(root)
+    indexed_all = selector.find_all(root)
+    indexed_times = [
+      best_time { selector.find_match(root) },
+      best_time { selector.find_all(root) }
+    ]
+
+    def root.__view_index__
+      nil
+    end
+
+    assert_same selector.find_match(root), indexed_first
+    assert_equal selector.find_all(root).map(&:object_id), indexed_all.map(&:object_id)
+    walk_times = [
+      best_time { selector.find_match(root) },
+      best_time { selector.find_all(root) }
+    ]
+
+    %w[find_match find_all].each_with_index do |name, which|
+      assert_operator indexed_times[which], :<=, walk_times[which] * SLOWDOWN_ALLOWED,
+        "#{name} #{source} is slower with the index"
+    end
+  end
+
+  def test_shared_tag_in_list
+    assert_index_not_slower(build_list(1000), '#label')
+  end
+
+  def test_shared_class_in_list
+    assert_index_not_slower(build_list(1000), 'Row > Label')
+  end
+
+  def test_shared_tag_in_deep_tree
+    assert_index_not_slower(build_deep(10_000, 100), '#v3')
+  end
+
+  def test_unique_tag_is_found
+    root = build_list(100)
+    target = attach(root.subviews[50], tagged(Label.new, :target))
+    root.__view_index__
+    assert_same target, GUI::Selector.build('Row > Label#target').find_match(root)
+    assert_equal [target], GUI::Selector.build('#target').find_all(root)
+  end
+
+end # SelectorIndexTest